@@ -0,0 +1,993 @@
+/*
+ * libvacaps - compiled VAAPI capability queries
+ * Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <va/va.h>
+
+#include "vacaps.h"
+
+#define VACAPS_PROFILES     64
+#define VACAPS_ENTRYPOINTS  32
+#define VACAPS_RT_FORMATS   32
+#define VACAPS_FOURCCS      64
+// Open-addressed, so kept at most half full.
+#define VACAPS_FOURCC_SLOTS 128
+
+struct vacaps_surface {
+    bool     valid;
+    uint64_t pixel_formats;
+    int      min_width,  max_width;
+    int      min_height, max_height;
+};
+
+struct vacaps_config {
+    uint32_t rt_formats;
+    struct vacaps_surface surface[VACAPS_RT_FORMATS];
+};
+
+struct VACapsDevice {
+    uint32_t entrypoints[VACAPS_PROFILES];
+    struct vacaps_config *config[VACAPS_PROFILES][VACAPS_ENTRYPOINTS];
+
+    int      nb_fourccs;
+    uint32_t fourccs[VACAPS_FOURCCS];
+    // Index + 1 of the fourcc hashing to each slot, 0 if empty.
+    uint8_t  fourcc_slots[VACAPS_FOURCC_SLOTS];
+    // Pixel formats left out because the table was full.
+    int      nb_dropped_fourccs;
+};
+
+static unsigned int vacaps_fourcc_slot(uint32_t fourcc)
+{
+    return (fourcc * UINT32_C(0x9e3779b1)) >> 25;
+}
+
+int vacaps_fourcc_index(const VACapsDevice *device, uint32_t fourcc)
+{
+    unsigned int slot = vacaps_fourcc_slot(fourcc);
+    while (device->fourcc_slots[slot]) {
+        int index = device->fourcc_slots[slot] - 1;
+        if (device->fourccs[index] == fourcc)
+            return index;
+        slot = (slot + 1) % VACAPS_FOURCC_SLOTS;
+    }
+    return -1;
+}
+
+static int vacaps_intern_fourcc(VACapsDevice *device, uint32_t fourcc)
+{
+    unsigned int slot;
+    int index = vacaps_fourcc_index(device, fourcc);
+    if (index >= 0)
+        return index;
+    if (device->nb_fourccs >= VACAPS_FOURCCS) {
+        ++device->nb_dropped_fourccs;
+        return -1;
+    }
+
+    index = device->nb_fourccs++;
+    device->fourccs[index] = fourcc;
+
+    slot = vacaps_fourcc_slot(fourcc);
+    while (device->fourcc_slots[slot])
+        slot = (slot + 1) % VACAPS_FOURCC_SLOTS;
+    device->fourcc_slots[slot] = index + 1;
+    return index;
+}
+
+static void vacaps_probe_surfaces(VADisplay display, VACapsDevice *device,
+                                  VAProfile profile, VAEntrypoint entrypoint,
+                                  struct vacaps_config *cc)
+{
+    int bit;
+    for (bit = 0; bit < VACAPS_RT_FORMATS; bit++) {
+        unsigned int rt_format = 1u << bit;
+        if (!(cc->rt_formats & rt_format))
+            continue;
+
+        VAConfigAttrib attr_rt_format = {
+            .type  = VAConfigAttribRTFormat,
+            .value = rt_format,
+        };
+
+        VAConfigID config;
+        VAStatus vas = vaCreateConfig(display, profile, entrypoint,
+                                      &attr_rt_format, 1, &config);
+        if (vas != VA_STATUS_SUCCESS)
+            continue;
+
+        unsigned int attr_count = 0;
+        vas = vaQuerySurfaceAttributes(display, config, 0, &attr_count);
+        if (vas == VA_STATUS_SUCCESS) {
+            VASurfaceAttrib *attr_list = calloc(attr_count,
+                                                sizeof(*attr_list));
+            vas = vaQuerySurfaceAttributes(display, config,
+                                           attr_list, &attr_count);
+            if (vas == VA_STATUS_SUCCESS) {
+                struct vacaps_surface *cs = &cc->surface[bit];
+                int i, index;
+
+                *cs = (struct vacaps_surface) {
+                    .valid      = true,
+                    .max_width  = INT32_MAX,
+                    .max_height = INT32_MAX,
+                };
+                for (i = 0; i < attr_count; i++) {
+                    int value = attr_list[i].value.value.i;
+                    switch (attr_list[i].type) {
+                    case VASurfaceAttribPixelFormat:
+                        index = vacaps_intern_fourcc(device, value);
+                        if (index >= 0)
+                            cs->pixel_formats |= UINT64_C(1) << index;
+                        break;
+                    case VASurfaceAttribMinWidth:
+                        cs->min_width = value;
+                        break;
+                    case VASurfaceAttribMaxWidth:
+                        cs->max_width = value;
+                        break;
+                    case VASurfaceAttribMinHeight:
+                        cs->min_height = value;
+                        break;
+                    case VASurfaceAttribMaxHeight:
+                        cs->max_height = value;
+                        break;
+                    default:
+                        break;
+                    }
+                }
+            }
+            free(attr_list);
+        }
+
+        vaDestroyConfig(display, config);
+    }
+}
+
+VACapsDevice *vacaps_device_create(VADisplay display)
+{
+    VACapsDevice *device = calloc(1, sizeof(*device));
+    if (!device)
+        return NULL;
+
+    int profile_count = vaMaxNumProfiles(display);
+    VAProfile *profile_list = calloc(profile_count, sizeof(*profile_list));
+    int entrypoint_count = vaMaxNumEntrypoints(display);
+    VAEntrypoint *entrypoint_list = calloc(entrypoint_count,
+                                           sizeof(*entrypoint_list));
+
+    VAStatus vas = vaQueryConfigProfiles(display,
+                                         profile_list, &profile_count);
+    if (vas != VA_STATUS_SUCCESS) {
+        free(entrypoint_list);
+        free(profile_list);
+        free(device);
+        return NULL;
+    }
+
+    int i, j;
+    for (i = 0; i < profile_count; i++) {
+        // VAProfileNone is -1, so everything is shifted up by one.
+        unsigned int pi = profile_list[i] + 1;
+        if (pi >= VACAPS_PROFILES)
+            continue;
+
+        int count = entrypoint_count;
+        vas = vaQueryConfigEntrypoints(display, profile_list[i],
+                                       entrypoint_list, &count);
+        if (vas != VA_STATUS_SUCCESS)
+            continue;
+
+        for (j = 0; j < count; j++) {
+            VAEntrypoint entrypoint = entrypoint_list[j];
+            if (entrypoint < 0 || entrypoint >= VACAPS_ENTRYPOINTS)
+                continue;
+
+            VAConfigAttrib attr = { .type = VAConfigAttribRTFormat };
+            vas = vaGetConfigAttributes(display, profile_list[i],
+                                        entrypoint, &attr, 1);
+            if (vas != VA_STATUS_SUCCESS ||
+                attr.value == VA_ATTRIB_NOT_SUPPORTED)
+                attr.value = 0;
+
+            struct vacaps_config *cc = calloc(1, sizeof(*cc));
+            if (!cc)
+                continue;
+            cc->rt_formats = attr.value;
+            vacaps_probe_surfaces(display, device, profile_list[i],
+                                  entrypoint, cc);
+
+            device->entrypoints[pi] |= 1u << entrypoint;
+            device->config[pi][entrypoint] = cc;
+        }
+    }
+
+    free(entrypoint_list);
+    free(profile_list);
+    return device;
+}
+
+void vacaps_device_destroy(VACapsDevice *device)
+{
+    int i, j;
+
+    if (!device)
+        return;
+    for (i = 0; i < VACAPS_PROFILES; i++) {
+        for (j = 0; j < VACAPS_ENTRYPOINTS; j++)
+            free(device->config[i][j]);
+    }
+    free(device);
+}
+
+static const struct vacaps_config *vacaps_config(const VACapsDevice *device,
+                                                 VAProfile profile,
+                                                 VAEntrypoint entrypoint)
+{
+    unsigned int pi = profile + 1;
+    if (pi >= VACAPS_PROFILES ||
+        (unsigned int)entrypoint >= VACAPS_ENTRYPOINTS)
+        return NULL;
+    return device->config[pi][entrypoint];
+}
+
+static const struct vacaps_surface *vacaps_surface(const VACapsDevice *device,
+                                                   VAProfile profile,
+                                                   VAEntrypoint entrypoint,
+                                                   unsigned int rt_format)
+{
+    const struct vacaps_config *cc =
+        vacaps_config(device, profile, entrypoint);
+    const struct vacaps_surface *cs;
+
+    if (!cc || !(cc->rt_formats & rt_format) ||
+        (rt_format & (rt_format - 1)))
+        return NULL;
+    cs = &cc->surface[__builtin_ctz(rt_format)];
+    return cs->valid ? cs : NULL;
+}
+
+uint32_t vacaps_entrypoints(const VACapsDevice *device, VAProfile profile)
+{
+    unsigned int pi = profile + 1;
+    return pi < VACAPS_PROFILES ? device->entrypoints[pi] : 0;
+}
+
+int vacaps_supports(const VACapsDevice *device,
+                    VAProfile profile, VAEntrypoint entrypoint)
+{
+    return vacaps_config(device, profile, entrypoint) != NULL;
+}
+
+unsigned int vacaps_rt_formats(const VACapsDevice *device,
+                               VAProfile profile, VAEntrypoint entrypoint)
+{
+    const struct vacaps_config *cc =
+        vacaps_config(device, profile, entrypoint);
+    return cc ? cc->rt_formats : 0;
+}
+
+uint64_t vacaps_pixel_formats(const VACapsDevice *device,
+                              VAProfile profile, VAEntrypoint entrypoint,
+                              unsigned int rt_format)
+{
+    const struct vacaps_surface *cs =
+        vacaps_surface(device, profile, entrypoint, rt_format);
+    return cs ? cs->pixel_formats : 0;
+}
+
+int vacaps_supports_pixel_format(const VACapsDevice *device,
+                                 VAProfile profile, VAEntrypoint entrypoint,
+                                 unsigned int rt_format, uint32_t fourcc)
+{
+    int index = vacaps_fourcc_index(device, fourcc);
+    return index >= 0 &&
+        (vacaps_pixel_formats(device, profile, entrypoint, rt_format) &
+         UINT64_C(1) << index);
+}
+
+int vacaps_size_range(const VACapsDevice *device,
+                      VAProfile profile, VAEntrypoint entrypoint,
+                      unsigned int rt_format, VACapsSizeRange *range)
+{
+    const struct vacaps_surface *cs =
+        vacaps_surface(device, profile, entrypoint, rt_format);
+    if (!cs)
+        return -1;
+
+    *range = (VACapsSizeRange) {
+        .min_width  = cs->min_width,
+        .max_width  = cs->max_width,
+        .min_height = cs->min_height,
+        .max_height = cs->max_height,
+    };
+    return 0;
+}
+
+int vacaps_nb_fourccs(const VACapsDevice *device)
+{
+    return device->nb_fourccs;
+}
+
+uint32_t vacaps_fourcc(const VACapsDevice *device, int index)
+{
+    if (index < 0 || index >= device->nb_fourccs)
+        return 0;
+    return device->fourccs[index];
+}
+
+int vacaps_nb_dropped_fourccs(const VACapsDevice *device)
+{
+    return device->nb_dropped_fourccs;
+}
+
+/*
+ * Devices built by hand, for example from stored dumps or to model
+ * devices which are not present.
+ */
+
+VACapsDevice *vacaps_device_alloc(void)
+{
+    return calloc(1, sizeof(VACapsDevice));
+}
+
+static struct vacaps_config *vacaps_config_add(VACapsDevice *device,
+                                               VAProfile profile,
+                                               VAEntrypoint entrypoint)
+{
+    unsigned int pi = profile + 1;
+    struct vacaps_config *cc;
+
+    if (pi >= VACAPS_PROFILES ||
+        (unsigned int)entrypoint >= VACAPS_ENTRYPOINTS)
+        return NULL;
+
+    cc = device->config[pi][entrypoint];
+    if (!cc) {
+        cc = calloc(1, sizeof(*cc));
+        if (!cc)
+            return NULL;
+        device->config[pi][entrypoint] = cc;
+        device->entrypoints[pi] |= 1u << entrypoint;
+    }
+    return cc;
+}
+
+int vacaps_device_add_config(VACapsDevice *device, VAProfile profile,
+                             VAEntrypoint entrypoint, unsigned int rt_formats)
+{
+    struct vacaps_config *cc = vacaps_config_add(device, profile, entrypoint);
+    if (!cc)
+        return -1;
+    cc->rt_formats |= rt_formats;
+    return 0;
+}
+
+int vacaps_device_add_surface(VACapsDevice *device, VAProfile profile,
+                              VAEntrypoint entrypoint, unsigned int rt_format,
+                              const uint32_t *fourccs, int nb_fourccs,
+                              const VACapsSizeRange *range)
+{
+    struct vacaps_config *cc;
+    struct vacaps_surface *cs;
+    int i, index, err = 0;
+
+    if (!rt_format || (rt_format & (rt_format - 1)))
+        return -1;
+    cc = vacaps_config_add(device, profile, entrypoint);
+    if (!cc)
+        return -1;
+    cc->rt_formats |= rt_format;
+
+    cs = &cc->surface[__builtin_ctz(rt_format)];
+    if (!cs->valid) {
+        *cs = (struct vacaps_surface) {
+            .valid      = true,
+            .max_width  = INT32_MAX,
+            .max_height = INT32_MAX,
+        };
+    }
+    for (i = 0; i < nb_fourccs; i++) {
+        index = vacaps_intern_fourcc(device, fourccs[i]);
+        if (index < 0)
+            err = -1;
+        else
+            cs->pixel_formats |= UINT64_C(1) << index;
+    }
+    if (range) {
+        cs->min_width  = range->min_width;
+        cs->max_width  = range->max_width;
+        cs->min_height = range->min_height;
+        cs->max_height = range->max_height;
+    }
+    return err;
+}
+
+/*
+ * Matching one job against many devices.
+ *
+ * Everything is laid out by capability rather than by device.  Each
+ * profile/entrypoint/rt_format triple supported by any device has a row of
+ * bits, one per device, as does each pixel format of such a triple; the
+ * surface size limits of a triple are rows of integers, one per device.
+ * A job is then a few ANDs of rows (per rt_format it may use, ORed
+ * together) and one vectorised range comparison, whatever the number of
+ * devices.
+ */
+
+#define VACAPS_TRIPLES (VACAPS_PROFILES * VACAPS_ENTRYPOINTS * VACAPS_RT_FORMATS)
+
+struct vacaps_kernel {
+    const char *name;
+    void (*and_rows)(uint64_t *dst, const uint64_t *src, int words);
+    void (*or_rows)(uint64_t *dst, const uint64_t *src, int words);
+    // Clears the bits of devices whose range excludes the size; a
+    // dimension is only checked if its flag is set.
+    void (*size_rows)(uint64_t *dst, const int32_t *const limits[4],
+                      int width, int height,
+                      bool check_width, bool check_height, int words);
+};
+
+struct VACapsMatcher {
+    int nb_devices;
+    // Words in each bit row, a multiple of four so that rows can be
+    // processed 256 bits at a time.
+    int words;
+
+    // Row + 1 for each (profile + 1, entrypoint, rt_format bit), 0 if no
+    // device supports it.
+    uint32_t *triple_rows;
+    // rt_formats of any device for each (profile + 1, entrypoint).
+    uint32_t rt_formats[VACAPS_PROFILES][VACAPS_ENTRYPOINTS];
+
+    int       nb_triples;
+    uint64_t *triple_bits;
+    // min_width, max_width, min_height, max_height for each triple.
+    int32_t  *limits[4];
+
+    // Open-addressed from (triple << 32 | fourcc) to pixel format row.
+    int       fourcc_slots_size;
+    uint64_t *fourcc_keys;
+    int      *fourcc_slot_rows;
+    int       nb_fourcc_rows;
+    uint64_t *fourcc_bits;
+
+    const struct vacaps_kernel *kernel;
+};
+
+static void scalar_and_rows(uint64_t *dst, const uint64_t *src, int words)
+{
+    int i;
+    for (i = 0; i < words; i++)
+        dst[i] &= src[i];
+}
+
+static void scalar_or_rows(uint64_t *dst, const uint64_t *src, int words)
+{
+    int i;
+    for (i = 0; i < words; i++)
+        dst[i] |= src[i];
+}
+
+static void scalar_size_rows(uint64_t *dst, const int32_t *const limits[4],
+                             int width, int height,
+                             bool check_width, bool check_height, int words)
+{
+    int i, j;
+    for (i = 0; i < words; i++) {
+        uint64_t fail = 0;
+        if (!dst[i])
+            continue;
+        for (j = 0; j < 64; j++) {
+            int d = 64 * i + j;
+            bool bad =
+                (check_width  && (width  < limits[0][d] ||
+                                  width  > limits[1][d])) ||
+                (check_height && (height < limits[2][d] ||
+                                  height > limits[3][d]));
+            fail |= (uint64_t)bad << j;
+        }
+        dst[i] &= ~fail;
+    }
+}
+
+static const struct vacaps_kernel vacaps_scalar_kernel = {
+    .name      = "scalar",
+    .and_rows  = &scalar_and_rows,
+    .or_rows   = &scalar_or_rows,
+    .size_rows = &scalar_size_rows,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void sse2_and_rows(uint64_t *dst, const uint64_t *src, int words)
+{
+    int i;
+    for (i = 0; i < words; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(a, b));
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_or_rows(uint64_t *dst, const uint64_t *src, int words)
+{
+    int i;
+    for (i = 0; i < words; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(a, b));
+    }
+}
+
+// Mask of the lanes where value is outside [min, max].
+__attribute__((target("sse2")))
+static inline __m128i sse2_outside(__m128i value, const int32_t *min,
+                                   const int32_t *max)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i*)min);
+    __m128i hi = _mm_loadu_si128((const __m128i*)max);
+    return _mm_or_si128(_mm_cmpgt_epi32(lo, value),
+                        _mm_cmpgt_epi32(value, hi));
+}
+
+__attribute__((target("sse2")))
+static void sse2_size_rows(uint64_t *dst, const int32_t *const limits[4],
+                           int width, int height,
+                           bool check_width, bool check_height, int words)
+{
+    __m128i w = _mm_set1_epi32(width), h = _mm_set1_epi32(height);
+    int i, j;
+    for (i = 0; i < words; i++) {
+        uint64_t fail = 0;
+        if (!dst[i])
+            continue;
+        for (j = 0; j < 64; j += 4) {
+            int d = 64 * i + j;
+            __m128i bad = _mm_setzero_si128();
+            if (check_width)
+                bad = _mm_or_si128(bad, sse2_outside(w, limits[0] + d,
+                                                     limits[1] + d));
+            if (check_height)
+                bad = _mm_or_si128(bad, sse2_outside(h, limits[2] + d,
+                                                     limits[3] + d));
+            fail |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(bad)) << j;
+        }
+        dst[i] &= ~fail;
+    }
+}
+
+static const struct vacaps_kernel vacaps_sse2_kernel = {
+    .name      = "sse2",
+    .and_rows  = &sse2_and_rows,
+    .or_rows   = &sse2_or_rows,
+    .size_rows = &sse2_size_rows,
+};
+
+__attribute__((target("avx2")))
+static void avx2_and_rows(uint64_t *dst, const uint64_t *src, int words)
+{
+    int i;
+    for (i = 0; i < words; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_and_si256(a, b));
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_or_rows(uint64_t *dst, const uint64_t *src, int words)
+{
+    int i;
+    for (i = 0; i < words; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(a, b));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_outside(__m256i value, const int32_t *min,
+                                   const int32_t *max)
+{
+    __m256i lo = _mm256_loadu_si256((const __m256i*)min);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)max);
+    return _mm256_or_si256(_mm256_cmpgt_epi32(lo, value),
+                           _mm256_cmpgt_epi32(value, hi));
+}
+
+__attribute__((target("avx2")))
+static void avx2_size_rows(uint64_t *dst, const int32_t *const limits[4],
+                           int width, int height,
+                           bool check_width, bool check_height, int words)
+{
+    __m256i w = _mm256_set1_epi32(width), h = _mm256_set1_epi32(height);
+    int i, j;
+    for (i = 0; i < words; i++) {
+        uint64_t fail = 0;
+        if (!dst[i])
+            continue;
+        for (j = 0; j < 64; j += 8) {
+            int d = 64 * i + j;
+            __m256i bad = _mm256_setzero_si256();
+            if (check_width)
+                bad = _mm256_or_si256(bad, avx2_outside(w, limits[0] + d,
+                                                        limits[1] + d));
+            if (check_height)
+                bad = _mm256_or_si256(bad, avx2_outside(h, limits[2] + d,
+                                                        limits[3] + d));
+            fail |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(bad))
+                    << j;
+        }
+        dst[i] &= ~fail;
+    }
+}
+
+static const struct vacaps_kernel vacaps_avx2_kernel = {
+    .name      = "avx2",
+    .and_rows  = &avx2_and_rows,
+    .or_rows   = &avx2_or_rows,
+    .size_rows = &avx2_size_rows,
+};
+
+#endif
+
+static const struct vacaps_kernel *vacaps_best_kernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &vacaps_avx2_kernel;
+    if (__builtin_cpu_supports("sse2"))
+        return &vacaps_sse2_kernel;
+#endif
+    return &vacaps_scalar_kernel;
+}
+
+static unsigned int vacaps_triple(unsigned int pi, unsigned int entrypoint,
+                                  unsigned int bit)
+{
+    return (pi * VACAPS_ENTRYPOINTS + entrypoint) * VACAPS_RT_FORMATS + bit;
+}
+
+static unsigned int vacaps_fourcc_row_slot(const VACapsMatcher *matcher,
+                                           uint64_t key)
+{
+    unsigned int mask = matcher->fourcc_slots_size - 1;
+    unsigned int slot = (key * UINT64_C(0x9e3779b97f4a7c15)) >> 40 & mask;
+    while (matcher->fourcc_slot_rows[slot] &&
+           matcher->fourcc_keys[slot] != key)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+static int vacaps_matcher_fourcc_row(VACapsMatcher *matcher, uint64_t key)
+{
+    unsigned int slot;
+    int i;
+
+    if (2 * (matcher->nb_fourcc_rows + 1) > matcher->fourcc_slots_size) {
+        int old_size = matcher->fourcc_slots_size;
+        int new_size = old_size ? 2 * old_size : 256;
+        uint64_t *old_keys = matcher->fourcc_keys;
+        int *old_rows = matcher->fourcc_slot_rows;
+        uint64_t *keys = calloc(new_size, sizeof(*keys));
+        int *rows = calloc(new_size, sizeof(*rows));
+
+        if (!keys || !rows) {
+            free(keys);
+            free(rows);
+            return -1;
+        }
+        matcher->fourcc_slots_size = new_size;
+        matcher->fourcc_keys       = keys;
+        matcher->fourcc_slot_rows  = rows;
+        for (i = 0; i < old_size; i++) {
+            if (!old_rows[i])
+                continue;
+            slot = vacaps_fourcc_row_slot(matcher, old_keys[i]);
+            matcher->fourcc_keys[slot]      = old_keys[i];
+            matcher->fourcc_slot_rows[slot] = old_rows[i];
+        }
+        free(old_keys);
+        free(old_rows);
+    }
+
+    slot = vacaps_fourcc_row_slot(matcher, key);
+    if (!matcher->fourcc_slot_rows[slot]) {
+        int row = matcher->nb_fourcc_rows;
+        uint64_t *bits = realloc(matcher->fourcc_bits,
+                                 (row + 1) * matcher->words *
+                                 sizeof(uint64_t));
+        if (!bits)
+            return -1;
+        matcher->fourcc_bits = bits;
+        memset(bits + row * matcher->words, 0,
+               matcher->words * sizeof(uint64_t));
+        matcher->fourcc_keys[slot]      = key;
+        matcher->fourcc_slot_rows[slot] = row + 1;
+        ++matcher->nb_fourcc_rows;
+    }
+    return matcher->fourcc_slot_rows[slot] - 1;
+}
+
+static int vacaps_matcher_triple_row(VACapsMatcher *matcher,
+                                     unsigned int triple)
+{
+    int padded = 64 * matcher->words, row, i, j;
+    uint64_t *bits;
+
+    if (matcher->triple_rows[triple])
+        return matcher->triple_rows[triple] - 1;
+
+    row  = matcher->nb_triples;
+    bits = realloc(matcher->triple_bits,
+                   (row + 1) * matcher->words * sizeof(uint64_t));
+    if (!bits)
+        return -1;
+    matcher->triple_bits = bits;
+    memset(bits + row * matcher->words, 0,
+           matcher->words * sizeof(uint64_t));
+
+    // Devices without the triple, or without surface limits for it,
+    // match no size.
+    for (i = 0; i < 4; i++) {
+        int32_t *limits = realloc(matcher->limits[i],
+                                  (row + 1) * padded * sizeof(int32_t));
+        if (!limits)
+            return -1;
+        matcher->limits[i] = limits;
+        for (j = 0; j < padded; j++)
+            limits[row * padded + j] = i % 2 ? INT32_MIN : INT32_MAX;
+    }
+
+    matcher->triple_rows[triple] = row + 1;
+    ++matcher->nb_triples;
+    return row;
+}
+
+VACapsMatcher *vacaps_matcher_create(const VACapsDevice *const *devices,
+                                     int nb_devices)
+{
+    VACapsMatcher *matcher = calloc(1, sizeof(*matcher));
+    unsigned int pi, entrypoint, bit;
+    int d, i, padded;
+
+    if (!matcher)
+        return NULL;
+    matcher->nb_devices  = nb_devices;
+    matcher->words       = (nb_devices + 255) / 256 * 4;
+    matcher->kernel      = vacaps_best_kernel();
+    matcher->triple_rows = calloc(VACAPS_TRIPLES,
+                                  sizeof(*matcher->triple_rows));
+    if (!matcher->triple_rows)
+        goto fail;
+    padded = 64 * matcher->words;
+
+    for (d = 0; d < nb_devices; d++) {
+        const VACapsDevice *device = devices[d];
+        uint64_t device_bit = UINT64_C(1) << d % 64;
+        int word = d / 64;
+
+        for (pi = 0; pi < VACAPS_PROFILES; pi++) {
+            for (entrypoint = 0; entrypoint < VACAPS_ENTRYPOINTS;
+                 entrypoint++) {
+                const struct vacaps_config *cc =
+                    device->config[pi][entrypoint];
+                if (!cc)
+                    continue;
+                matcher->rt_formats[pi][entrypoint] |= cc->rt_formats;
+
+                for (bit = 0; bit < VACAPS_RT_FORMATS; bit++) {
+                    const struct vacaps_surface *cs = &cc->surface[bit];
+                    int row;
+                    if (!(cc->rt_formats & 1u << bit))
+                        continue;
+
+                    row = vacaps_matcher_triple_row(matcher,
+                        vacaps_triple(pi, entrypoint, bit));
+                    if (row < 0)
+                        goto fail;
+                    matcher->triple_bits[row * matcher->words + word] |=
+                        device_bit;
+                    if (!cs->valid)
+                        continue;
+
+                    matcher->limits[0][row * padded + d] = cs->min_width;
+                    matcher->limits[1][row * padded + d] = cs->max_width;
+                    matcher->limits[2][row * padded + d] = cs->min_height;
+                    matcher->limits[3][row * padded + d] = cs->max_height;
+
+                    for (i = 0; i < device->nb_fourccs; i++) {
+                        uint64_t key;
+                        int frow;
+                        if (!(cs->pixel_formats & UINT64_C(1) << i))
+                            continue;
+                        key = (uint64_t)vacaps_triple(pi, entrypoint, bit)
+                              << 32 | device->fourccs[i];
+                        frow = vacaps_matcher_fourcc_row(matcher, key);
+                        if (frow < 0)
+                            goto fail;
+                        matcher->fourcc_bits[frow * matcher->words + word] |=
+                            device_bit;
+                    }
+                }
+            }
+        }
+    }
+
+    return matcher;
+
+fail:
+    vacaps_matcher_destroy(matcher);
+    return NULL;
+}
+
+void vacaps_matcher_destroy(VACapsMatcher *matcher)
+{
+    int i;
+
+    if (!matcher)
+        return;
+    free(matcher->triple_rows);
+    free(matcher->triple_bits);
+    for (i = 0; i < 4; i++)
+        free(matcher->limits[i]);
+    free(matcher->fourcc_keys);
+    free(matcher->fourcc_slot_rows);
+    free(matcher->fourcc_bits);
+    free(matcher);
+}
+
+int vacaps_matcher_set_kernel(VACapsMatcher *matcher, const char *name)
+{
+    static const struct vacaps_kernel *const kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+        &vacaps_avx2_kernel,
+        &vacaps_sse2_kernel,
+#endif
+        &vacaps_scalar_kernel,
+    };
+    int i;
+
+    if (!name) {
+        matcher->kernel = vacaps_best_kernel();
+        return 0;
+    }
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(kernels[i]->name, name))
+            continue;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (kernels[i] == &vacaps_avx2_kernel &&
+            !__builtin_cpu_supports("avx2"))
+            return -1;
+#endif
+        matcher->kernel = kernels[i];
+        return 0;
+    }
+    return -1;
+}
+
+const char *vacaps_matcher_kernel(const VACapsMatcher *matcher)
+{
+    return matcher->kernel->name;
+}
+
+int vacaps_matcher_words(const VACapsMatcher *matcher)
+{
+    return matcher->words;
+}
+
+uint32_t vacaps_matcher_entrypoints(const VACapsMatcher *matcher,
+                                    VAProfile profile)
+{
+    unsigned int pi = profile + 1, entrypoint;
+    uint32_t entrypoints = 0;
+
+    if (pi >= VACAPS_PROFILES)
+        return 0;
+    for (entrypoint = 0; entrypoint < VACAPS_ENTRYPOINTS; entrypoint++) {
+        if (matcher->rt_formats[pi][entrypoint])
+            entrypoints |= 1u << entrypoint;
+    }
+    return entrypoints;
+}
+
+unsigned int vacaps_matcher_rt_formats(const VACapsMatcher *matcher,
+                                       VAProfile profile,
+                                       VAEntrypoint entrypoint)
+{
+    unsigned int pi = profile + 1;
+
+    if (pi >= VACAPS_PROFILES ||
+        (unsigned int)entrypoint >= VACAPS_ENTRYPOINTS)
+        return 0;
+    return matcher->rt_formats[pi][entrypoint];
+}
+
+int vacaps_matcher_match(const VACapsMatcher *matcher, const VACapsJob *job,
+                         uint64_t *result)
+{
+    const struct vacaps_kernel *kernel = matcher->kernel;
+    int words = matcher->words, padded = 64 * words;
+    unsigned int pi = job->profile + 1, rt_formats;
+    uint64_t row_bits[words];
+    int i, count;
+
+    memset(result, 0, words * sizeof(uint64_t));
+    if (pi >= VACAPS_PROFILES ||
+        (unsigned int)job->entrypoint >= VACAPS_ENTRYPOINTS)
+        return 0;
+    // No device has any pixel formats, so none has this one.
+    if (job->fourcc && !matcher->fourcc_slots_size)
+        return 0;
+
+    rt_formats = matcher->rt_formats[pi][job->entrypoint];
+    if (job->rt_format)
+        rt_formats &= job->rt_format;
+
+    // A device matches if any one of the allowed rt_formats satisfies
+    // all of the other constraints.
+    while (rt_formats) {
+        unsigned int bit = __builtin_ctz(rt_formats);
+        unsigned int triple = vacaps_triple(pi, job->entrypoint, bit);
+        int row = matcher->triple_rows[triple] - 1;
+        rt_formats &= rt_formats - 1;
+
+        memcpy(row_bits, matcher->triple_bits + row * words,
+               words * sizeof(uint64_t));
+
+        if (job->fourcc) {
+            uint64_t key = (uint64_t)triple << 32 | job->fourcc;
+            unsigned int slot = vacaps_fourcc_row_slot(matcher, key);
+            int frow = matcher->fourcc_slot_rows[slot] - 1;
+            if (frow < 0)
+                continue;
+            kernel->and_rows(row_bits, matcher->fourcc_bits + frow * words,
+                             words);
+        }
+
+        if (job->width > 0 || job->height > 0) {
+            const int32_t *const limits[4] = {
+                matcher->limits[0] + row * padded,
+                matcher->limits[1] + row * padded,
+                matcher->limits[2] + row * padded,
+                matcher->limits[3] + row * padded,
+            };
+            kernel->size_rows(row_bits, limits, job->width, job->height,
+                              job->width > 0, job->height > 0, words);
+        }
+
+        kernel->or_rows(result, row_bits, words);
+    }
+
+    for (i = count = 0; i < words; i++)
+        count += __builtin_popcountll(result[i]);
+    return count;
+}
@@ -0,0 +1,69 @@
+/*
+ * matcher - libvacaps matcher checks which need no device
+ * Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vacaps.h"
+
+static int failures;
+
+static void expect(const VACapsMatcher *matcher, const char *name,
+                   const VACapsJob *job, int count)
+{
+    uint64_t result[vacaps_matcher_words(matcher)];
+    int got = vacaps_matcher_match(matcher, job, result);
+    if (got != count) {
+        fprintf(stderr, "%s: matched %d devices, expected %d.\n",
+                name, got, count);
+        ++failures;
+    }
+}
+
+int main(void)
+{
+    VACapsDevice *device[2];
+    VACapsMatcher *matcher;
+    int i;
+
+    // Devices whose surface attribute queries all failed have configs
+    // but no pixel formats.
+    for (i = 0; i < 2; i++) {
+        device[i] = vacaps_device_alloc();
+        if (!device[i] ||
+            vacaps_device_add_config(device[i], VAProfileH264Main,
+                                     VAEntrypointVLD, VA_RT_FORMAT_YUV420))
+            return 1;
+    }
+    matcher = vacaps_matcher_create((const VACapsDevice *const *)device, 2);
+    if (!matcher)
+        return 1;
+
+    expect(matcher, "no surfaces", &(VACapsJob) {
+            .profile = VAProfileH264Main, .entrypoint = VAEntrypointVLD,
+        }, 2);
+    expect(matcher, "no surfaces, with fourcc", &(VACapsJob) {
+            .profile = VAProfileH264Main, .entrypoint = VAEntrypointVLD,
+            .fourcc  = VA_FOURCC_NV12,
+        }, 0);
+
+    vacaps_matcher_destroy(matcher);
+    for (i = 0; i < 2; i++)
+        vacaps_device_destroy(device[i]);
+    return failures != 0;
+}
@@ -0,0 +1,260 @@
+#!/bin/sh
+#
+# va_names.sh - generate name tables from the libva headers
+# Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Usage: va_names.sh <compiler> [cflags...] > va_names.h
+#
+# Runs the headers through the preprocessor and writes a table of names
+# for every enum and flag set which vadumpcaps prints, indexed directly by
+# value (or by bit number for flags), so that the names always cover the
+# libva being built against.  Enum values are left to the compiler; flag
+# values must be literals, and any which are not (such as deprecated
+# aliases) are left out.
+
+set -e
+
+# Preprocessed to a file first, so that a failure stops the script rather
+# than giving tables with no names.
+headers=$(mktemp)
+trap 'rm -f "$headers"' EXIT
+printf '#include <va/va.h>\n#include <va/va_vpp.h>\n#include <va/va_drmcommon.h>\n' |
+"$@" -E -P -dD -x c - > "$headers"
+
+awk '
+BEGIN {
+    # Enums: type, enumerator prefix, table name, value of index 0.
+    nb_enums = split("VAProfile VAProfile profile VAProfileNone " \
+                     "VAEntrypoint VAEntrypoint entrypoint 0 " \
+                     "VAProcFilterType VAProcFilter filter 0 " \
+                     "VAProcDeinterlacingType VAProcDeinterlacing " \
+                         "deinterlacer 0 " \
+                     "VAProcColorBalanceType VAProcColorBalance " \
+                         "colour_balance 0 " \
+                     "VAProcTotalColorCorrectionType " \
+                         "VAProcTotalColorCorrection " \
+                         "total_colour_correction 0 " \
+                     "VAProcColorStandardType VAProcColorStandard " \
+                         "colour_standard 0 " \
+                     "VAProcHighDynamicRangeMetadataType " \
+                         "VAProcHighDynamicRangeMetadata hdr_metadata 0",
+                     enum_spec, " ") / 4
+    for (i = 0; i < nb_enums; i++)
+        enum_index[enum_spec[4 * i + 1]] = i
+
+    # Macros: prefix, table name, and whether they are flags (indexed by
+    # bit number) or values.
+    nb_macros = split("VA_RT_FORMAT_ rt_format 1 " \
+                      "VA_RC_ rate_control 1 " \
+                      "VA_DEC_SLICE_MODE_ dec_slice_mode 1 " \
+                      "VA_ENC_PACKED_HEADER_ packed_header 1 " \
+                      "VA_ENC_INTERLACED_ interlaced 1 " \
+                      "VA_ENC_SLICE_STRUCTURE_ slice_structure 1 " \
+                      "VA_ENC_QUANTIZATION_ quantization 1 " \
+                      "VA_ENC_INTRA_REFRESH_ intra_refresh 1 " \
+                      "VA_PROCESSING_RATE_ processing_rate 1 " \
+                      "VA_FEI_FUNCTION_ fei_function 1 " \
+                      "VA_PREDICTION_DIRECTION_ prediction_direction 1 " \
+                      "VA_SURFACE_ATTRIB_MEM_TYPE_ mem_type 1 " \
+                      "VA_SURFACE_ATTRIB_USAGE_HINT_ usage_hint 1 " \
+                      "VA_SUBPICTURE_ subpicture_flag 1 " \
+                      "VA_PROC_PIPELINE_ proc_pipeline 1 " \
+                      "VA_TONE_MAPPING_ tone_mapping 1 " \
+                      "VA_3DLUT_CHANNEL_ tdlut_channel 1 " \
+                      "VA_ROTATION_ rotation 0 " \
+                      "VA_BLEND_ blend 0 " \
+                      "VA_MIRROR_ mirror 0",
+                      macro_spec, " ") / 3
+
+    text = ""
+}
+
+function literal(s,    v, i, c, digits, shift) {
+    gsub(/[ \t()]/, "", s)
+    if (s ~ /^1<<[0-9]+[uUlL]*$/) {
+        shift = substr(s, 4) + 0
+        v = 1
+        for (i = 0; i < shift; i++)
+            v *= 2
+        return v
+    }
+    sub(/[uUlL]+$/, "", s)
+    if (s ~ /^0[xX][0-9a-fA-F]+$/) {
+        digits = "0123456789abcdef"
+        v = 0
+        for (i = 3; i <= length(s); i++) {
+            c = tolower(substr(s, i, 1))
+            v = v * 16 + index(digits, c) - 1
+        }
+        return v
+    }
+    if (s ~ /^[0-9]+$/)
+        return s + 0
+    return -1
+}
+
+function bit_number(v,    b) {
+    if (v < 1)
+        return -1
+    for (b = 0; v > 1; b++) {
+        if (v % 2)
+            return -1
+        v = v / 2
+    }
+    return b
+}
+
+# A table, the value of its first entry, and a lookup function which
+# gives NULL for values without a name.
+function emit(table, base, size, lines) {
+    print ""
+    print "#define VA_" toupper(table) "_NAMES_BASE " \
+          (base == 0 ? "0" : "(" base ")")
+    print "static const char *const va_" table "_names[" size "] = {"
+    printf "%s", lines == "" ? "    NULL,\n" : lines
+    print "};"
+    print "static inline const char *va_" table "_name(long value)"
+    print "{"
+    print "    value -= VA_" toupper(table) "_NAMES_BASE;"
+    print "    return value >= 0 && value < (long)(sizeof(va_" table "_names) /"
+    print "        sizeof(va_" table "_names[0])) ? va_" table "_names[value] : NULL;"
+    print "}"
+}
+
+/^#define / {
+    name = $2
+    if (name ~ /\(/)
+        next
+    for (i = 0; i < nb_macros; i++) {
+        prefix = macro_spec[3 * i + 1]
+        if (substr(name, 1, length(prefix)) != prefix)
+            continue
+        body = $0
+        sub(/^#define[ \t]+[A-Za-z0-9_]+[ \t]*/, "", body)
+        v = literal(body)
+        if (v < 0)
+            break
+        # Flag tables have 32 entries, one for each bit of a 32-bit value.
+        if (macro_spec[3 * i + 3] == 1) {
+            v = bit_number(v)
+            if (v > 31)
+                break
+        }
+        if (v < 0 || v > 64)
+            break
+        n = macro_count[i]++
+        macro_name[i, n]  = substr(name, length(prefix) + 1)
+        macro_value[i, n] = v
+        break
+    }
+    next
+}
+
+/^#/ { next }
+
+{ text = text " " $0 }
+
+END {
+    # Every libva has these, so without them the headers were not found.
+    if (text !~ /\}[ \t]*VAProfile[ \t]*;/ ||
+        text !~ /\}[ \t]*VAEntrypoint[ \t]*;/ || !macro_count[0]) {
+        print "va_names.sh: no libva enums in the headers" > "/dev/stderr"
+        exit 1
+    }
+
+    print "/* Generated by va_names.sh from the libva headers; do not edit. */"
+    print ""
+    print "#pragma GCC diagnostic push"
+    print "#pragma GCC diagnostic ignored \"-Wdeprecated-declarations\""
+
+    # Find each typedef enum { ... } Name; in the preprocessed headers.
+    while (match(text, /typedef[ \t]+enum[ \t]*[A-Za-z0-9_]*[ \t]*\{[^}]*\}[ \t]*[A-Za-z0-9_]+[ \t]*;/)) {
+        decl = substr(text, RSTART, RLENGTH)
+        text = substr(text, RSTART + RLENGTH)
+
+        type = decl
+        sub(/^.*\}[ \t]*/, "", type)
+        sub(/[ \t]*;$/, "", type)
+        if (!(type in enum_index))
+            continue
+        i = enum_index[type]
+        prefix = enum_spec[4 * i + 2]
+        table  = enum_spec[4 * i + 3]
+        base   = enum_spec[4 * i + 4]
+
+        body = decl
+        sub(/^[^{]*\{/, "", body)
+        sub(/\}.*$/, "", body)
+        # Attributes such as deprecation notices.
+        gsub(/__attribute__[ \t]*\(\([^)]*\)\)/, "", body)
+
+        n = split(body, items, ",")
+        count = 0
+        for (j = 1; j <= n; j++) {
+            item = items[j]
+            gsub(/^[ \t]+|[ \t]+$/, "", item)
+            if (item == "")
+                continue
+            name = item
+            sub(/[ \t=].*$/, "", name)
+            if (substr(name, 1, length(prefix)) != prefix)
+                continue
+            short = substr(name, length(prefix) + 1)
+            if (short ~ /(Count|Max)$/)
+                continue
+            # Aliases of other values.
+            value = item
+            if (value ~ /=/) {
+                sub(/^[^=]*=[ \t]*/, "", value)
+                if (substr(value, 1, length(prefix)) == prefix)
+                    continue
+            }
+            enumerator[count++] = name
+        }
+
+        # Reversed, so that the first of any equal values is the one kept.
+        lines = ""
+        for (j = count - 1; j >= 0; j--) {
+            if (base == 0)
+                index_expr = enumerator[j]
+            else
+                index_expr = enumerator[j] " - " base
+            lines = lines sprintf("    [%s] = \"%s\",\n", index_expr,
+                                  substr(enumerator[j], length(prefix) + 1))
+        }
+        emit(table, base, "", lines)
+        done[table] = 1
+    }
+
+    for (i = 0; i < nb_macros; i++) {
+        lines = ""
+        for (j = macro_count[i] - 1; j >= 0; j--)
+            lines = lines sprintf("    [%d] = \"%s\",\n", macro_value[i, j],
+                                  macro_name[i, j])
+        emit(macro_spec[3 * i + 2], 0,
+             macro_spec[3 * i + 3] == 1 ? "32" : "", lines)
+    }
+
+    # Enums missing from older headers still get an (empty) table.
+    for (i = 0; i < nb_enums; i++) {
+        if (!(enum_spec[4 * i + 3] in done))
+            emit(enum_spec[4 * i + 3], 0, "", "")
+    }
+
+    print ""
+    print "#pragma GCC diagnostic pop"
+}
+' "$headers"
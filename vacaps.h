@@ -0,0 +1,138 @@
+/*
+ * libvacaps - compiled VAAPI capability queries
+ * Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VACAPS_H
+#define VACAPS_H
+
+#include <stdint.h>
+
+#include <va/va.h>
+
+/*
+ * A VACapsDevice holds the capabilities of one VADisplay, probed once when
+ * it is created: the entrypoints supported with each profile, the
+ * rt_formats of each profile/entrypoint pair, and for each of those
+ * rt_formats the pixel formats and surface size range.  The queries below
+ * are constant-time lookups into that and never call libva.  Only what is
+ * needed to place a job is kept; the rest of what vadumpcaps dumps (config
+ * attributes, VPP capabilities, image formats) is not probed here.
+ *
+ * rt_format arguments are single VA_RT_FORMAT_* values.  Sets of pixel
+ * formats are bitmasks of indices into the device's fourcc table.
+ */
+
+typedef struct VACapsDevice VACapsDevice;
+
+typedef struct VACapsSizeRange {
+    int min_width;
+    int max_width;
+    int min_height;
+    int max_height;
+} VACapsSizeRange;
+
+// Returns NULL if the display could not be probed.
+VACapsDevice *vacaps_device_create(VADisplay display);
+void vacaps_device_destroy(VACapsDevice *device);
+
+// Mask of (1 << entrypoint) for each entrypoint usable with the profile.
+uint32_t vacaps_entrypoints(const VACapsDevice *device, VAProfile profile);
+
+int vacaps_supports(const VACapsDevice *device,
+                    VAProfile profile, VAEntrypoint entrypoint);
+
+// VA_RT_FORMAT_* mask, or 0 if the pair is not supported.
+unsigned int vacaps_rt_formats(const VACapsDevice *device,
+                               VAProfile profile, VAEntrypoint entrypoint);
+
+uint64_t vacaps_pixel_formats(const VACapsDevice *device,
+                              VAProfile profile, VAEntrypoint entrypoint,
+                              unsigned int rt_format);
+
+int vacaps_supports_pixel_format(const VACapsDevice *device,
+                                 VAProfile profile, VAEntrypoint entrypoint,
+                                 unsigned int rt_format, uint32_t fourcc);
+
+// Returns zero and fills the range if the surface size limits are known.
+int vacaps_size_range(const VACapsDevice *device,
+                      VAProfile profile, VAEntrypoint entrypoint,
+                      unsigned int rt_format, VACapsSizeRange *range);
+
+int      vacaps_nb_fourccs(const VACapsDevice *device);
+uint32_t vacaps_fourcc(const VACapsDevice *device, int index);
+// Index of the fourcc in the table, or -1 if no surface supports it.
+int      vacaps_fourcc_index(const VACapsDevice *device, uint32_t fourcc);
+// Pixel formats left out of surfaces because the table holds only 64
+// fourccs; lookups of those formats fail.
+int      vacaps_nb_dropped_fourccs(const VACapsDevice *device);
+
+/*
+ * Building a device by hand, for example from a stored dump.  Adding a
+ * surface also adds its rt_format to the profile/entrypoint pair; a NULL
+ * range leaves the size unlimited.  These return zero on success.
+ */
+VACapsDevice *vacaps_device_alloc(void);
+int vacaps_device_add_config(VACapsDevice *device, VAProfile profile,
+                             VAEntrypoint entrypoint, unsigned int rt_formats);
+int vacaps_device_add_surface(VACapsDevice *device, VAProfile profile,
+                              VAEntrypoint entrypoint, unsigned int rt_format,
+                              const uint32_t *fourccs, int nb_fourccs,
+                              const VACapsSizeRange *range);
+
+/*
+ * A VACapsMatcher answers which of a set of devices can run a job.  It
+ * copies what it needs, so the devices may be destroyed after it has been
+ * created.  The vector kernel used is chosen for the running CPU.
+ */
+typedef struct VACapsMatcher VACapsMatcher;
+
+// Zero fields (and VAProfileNone as a profile) impose no constraint,
+// except that the profile and entrypoint are always matched.
+typedef struct VACapsJob {
+    VAProfile    profile;
+    VAEntrypoint entrypoint;
+    unsigned int rt_format;
+    uint32_t     fourcc;
+    int          width;
+    int          height;
+} VACapsJob;
+
+// Returns NULL if memory could not be allocated.
+VACapsMatcher *vacaps_matcher_create(const VACapsDevice *const *devices,
+                                     int nb_devices);
+void vacaps_matcher_destroy(VACapsMatcher *matcher);
+
+// Words of 64 bits needed for a result.
+int vacaps_matcher_words(const VACapsMatcher *matcher);
+
+// Sets bit (1 << d % 64) of result[d / 64] for each device d which can run
+// the job, returning the number of them.
+int vacaps_matcher_match(const VACapsMatcher *matcher, const VACapsJob *job,
+                         uint64_t *result);
+
+// As vacaps_entrypoints() and vacaps_rt_formats(), over all of the devices.
+uint32_t vacaps_matcher_entrypoints(const VACapsMatcher *matcher,
+                                    VAProfile profile);
+unsigned int vacaps_matcher_rt_formats(const VACapsMatcher *matcher,
+                                       VAProfile profile,
+                                       VAEntrypoint entrypoint);
+
+// "avx2", "sse2" or "scalar"; setting NULL selects the best available.
+const char *vacaps_matcher_kernel(const VACapsMatcher *matcher);
+int vacaps_matcher_set_kernel(VACapsMatcher *matcher, const char *name);
+
+#endif /* VACAPS_H */
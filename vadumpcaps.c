@@ -22,10 +22,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <va/va.h>
 
@@ -34,9 +53,13 @@
 #endif
 
 #include <va/va_vpp.h>
+#include <va/va_enc_h264.h>
 #include <va/va_drm.h>
 #include <va/va_drmcommon.h>
 
+#include "vacaps.h"
+#include "va_names.h"
+
 #define LIBVA_1_3_0  VA_CHECK_VERSION(0, 35, 0)
 #define LIBVA_1_3_1  VA_CHECK_VERSION(0, 35, 1)
 #define LIBVA_1_4_0  VA_CHECK_VERSION(0, 36, 0)
@@ -84,1920 +107,11662 @@ static void error_vas(VAStatus vas, const char *format, ...)
     fprintf(stderr, ": %d (%s)\n", vas, vaErrorStr(vas));
 }
 
+static void die(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    exit(1);
+}
+
+/*
+ * Probe statistics, for the metrics output: the time spent in each phase
+ * of probing a device and the number of calls made into libva.  Each libva
+ * function used is replaced by a macro of the same name calling a wrapper,
+ * below, which counts the call.
+ */
+#define VA_CALLS(X)                                                     \
+    X(vaInitialize) X(vaTerminate) X(vaSetDriverName)                   \
+    X(vaGetDisplayDRM) X(vaQueryVendorString)                           \
+    X(vaMaxNumProfiles) X(vaQueryConfigProfiles)                        \
+    X(vaMaxNumEntrypoints) X(vaQueryConfigEntrypoints)                  \
+    X(vaGetConfigAttributes) X(vaQuerySurfaceAttributes)                \
+    X(vaCreateConfig) X(vaDestroyConfig)                                \
+    X(vaCreateContext) X(vaDestroyContext)                              \
+    X(vaCreateBuffer) X(vaDestroyBuffer)                                \
+    X(vaQueryVideoProcFilters) X(vaQueryVideoProcFilterCaps)            \
+    X(vaQueryVideoProcPipelineCaps)                                     \
+    X(vaMaxNumImageFormats) X(vaQueryImageFormats)                      \
+    X(vaMaxNumSubpictureFormats) X(vaQuerySubpictureFormats)
+
 enum {
-    DUMP_PROFILES,
-    DUMP_ENTRYPOINTS,
-    DUMP_ATTRIBUTES,
-    DUMP_SURFACE_FORMATS,
-    DUMP_FILTERS,
-    DUMP_FILTER_CAPS,
-    DUMP_PIPELINE_CAPS,
-    DUMP_IMAGE_FORMATS,
-    DUMP_SUBPICTURE_FORMATS,
-    DUMP_MAX,
+#define VA_CALL_ENUM(name) VA_CALL_ ## name,
+    VA_CALLS(VA_CALL_ENUM)
+#undef VA_CALL_ENUM
+    VA_CALL_COUNT,
 };
-static int dump_mask;
-#define DUMP(name) (dump_mask & (1 << DUMP_ ## name))
 
-static int indent_depth  = 0;
-static int indent_size   = 4;
-static bool pretty_print = true;
+static const char *const va_call_names[] = {
+#define VA_CALL_NAME(name) #name,
+    VA_CALLS(VA_CALL_NAME)
+#undef VA_CALL_NAME
+};
 
-static void print_indent(void)
-{
-    if (!pretty_print)
-        return;
-    int i, j;
-    for (i = 0; i < indent_depth; i++)
-        for (j = 0; j < indent_size; j++)
-            putchar(' ');
-}
+enum {
+    PHASE_OTHER,
+    PHASE_INITIALISE,
+    PHASE_PROFILES,
+    PHASE_VPP,
+    PHASE_FORMATS,
+    PHASE_COST_MODEL,
+    PHASE_COUNT,
+};
 
-static void print_newline(void)
-{
-    if (pretty_print)
-        printf("\n");
-}
+static const char *const phase_names[] = {
+    [PHASE_OTHER]      = "other",
+    [PHASE_INITIALISE] = "initialise",
+    [PHASE_PROFILES]   = "profiles",
+    [PHASE_VPP]        = "vpp",
+    [PHASE_FORMATS]    = "formats",
+    [PHASE_COST_MODEL] = "cost_model",
+};
+
+// Host CPU use, counted with --cpu-stats.
+enum {
+    CPU_NS,
+    CPU_CYCLES,
+    CPU_INSTRUCTIONS,
+    CPU_SWITCHES,
+    CPU_COUNT,
+};
+
+struct cpu_usage {
+    uint64_t value[CPU_COUNT];
+};
 
-static void print_tag(const char *tag)
+static struct {
+    bool     probed;
+    int      phase;
+    uint64_t phase_start;
+    uint64_t phase_ns[PHASE_COUNT];
+    unsigned int calls[VA_CALL_COUNT];
+    uint64_t cpu[VA_CALL_COUNT][CPU_COUNT];
+} probe_stats;
+
+static uint64_t clock_ns(void)
 {
-    if (tag) {
-        printf("\"%s\":", tag);
-        if (pretty_print)
-            printf(" ");
-    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-static void start_array(const char *tag)
+static void probe_stats_reset(void)
 {
-    print_indent();
-    print_tag(tag);
-    printf("[");
-    print_newline();
-    ++indent_depth;
+    memset(&probe_stats, 0, sizeof(probe_stats));
+    probe_stats.probed      = true;
+    probe_stats.phase_start = clock_ns();
 }
 
-static void end_array(void)
+// Switches the phase time is counted against, returning the previous one
+// so that nested phases can restore it.
+static int probe_phase(int phase)
 {
-    --indent_depth;
-    print_indent();
-    printf("],");
-    print_newline();
+    uint64_t now = clock_ns();
+    int previous = probe_stats.phase;
+
+    probe_stats.phase_ns[previous] += now - probe_stats.phase_start;
+    probe_stats.phase_start = now;
+    probe_stats.phase = phase;
+    return previous;
 }
 
-static void start_object(const char *tag)
+/*
+ * Host CPU use (--cpu-stats), for finding how much the driver spends
+ * building commands.  Each thread counts its own with perf_event_open:
+ * task clock, cycles, instructions and context switches, in the kernel
+ * too if allowed.  Without perf events, getrusage gives the time and
+ * switches only.  Counted for every libva call made through the wrappers
+ * below, and by the benchmarks for each frame.
+ */
+// Linux-specific, so not declared without _GNU_SOURCE.
+#ifndef RUSAGE_THREAD
+#define RUSAGE_THREAD 1
+#endif
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} cpu_events[CPU_COUNT] = {
+    [CPU_NS]           = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK     },
+    [CPU_CYCLES]       = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES     },
+    [CPU_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS   },
+    [CPU_SWITCHES]     = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static struct {
+    bool enabled;
+    bool user_only;
+    // Which counters this machine has, found by cpu_stats_init().
+    bool have[CPU_COUNT];
+    const char *source;
+    pthread_key_t key;
+} cpu_stats;
+
+// A thread's counters, as a group led by the task clock.
+struct cpu_counters {
+    int fd[CPU_COUNT];
+    // Position of each counter in a read of the group, or -1.
+    int index[CPU_COUNT];
+};
+
+static int cpu_event_open(int counter, int group)
 {
-    print_indent();
-    print_tag(tag);
-    printf("{");
-    print_newline();
-    ++indent_depth;
+    struct perf_event_attr attr = {
+        .type           = cpu_events[counter].type,
+        .size           = sizeof(attr),
+        .config         = cpu_events[counter].config,
+        .read_format    = PERF_FORMAT_GROUP,
+        .exclude_kernel = cpu_stats.user_only,
+        .exclude_hv     = 1,
+    };
+    return syscall(__NR_perf_event_open, &attr, 0, -1, group,
+                   PERF_FLAG_FD_CLOEXEC);
 }
 
-static void end_object(void)
+static void cpu_counters_close(void *arg)
 {
-    --indent_depth;
-    print_indent();
-    printf("},");
-    print_newline();
+    struct cpu_counters *c = arg;
+    int i;
+
+    for (i = CPU_COUNT - 1; i >= 0; i--) {
+        if (c->fd[i] >= 0)
+            close(c->fd[i]);
+    }
+    free(c);
 }
 
-static void print_boolean(const char *tag, bool value)
+static struct cpu_counters *cpu_counters_open(void)
 {
-    print_indent();
-    print_tag(tag);
-    printf("%s,", value ? "true" : "false");
-    print_newline();
+    struct cpu_counters *c = malloc(sizeof(*c));
+    int i, nb_open = 0;
+
+    if (!c)
+        die("Out of memory.\n");
+    for (i = 0; i < CPU_COUNT; i++) {
+        c->fd[i] = c->index[i] = -1;
+        if (!cpu_stats.have[i] || (i > 0 && c->fd[0] < 0))
+            continue;
+        c->fd[i] = cpu_event_open(i, i > 0 ? c->fd[0] : -1);
+        if (c->fd[i] >= 0)
+            c->index[i] = nb_open++;
+    }
+    pthread_setspecific(cpu_stats.key, c);
+    return c;
 }
 
-static void print_integer(const char *tag, int64_t value)
+// Finds the counters there are, before any are counted.
+static void cpu_stats_init(void)
 {
-    print_indent();
-    print_tag(tag);
-    printf("%"PRId64",", value);
-    print_newline();
+    int fd, i;
+
+    cpu_stats.enabled = true;
+    if (pthread_key_create(&cpu_stats.key, &cpu_counters_close))
+        die("Failed to make key for CPU counters.\n");
+
+    fd = cpu_event_open(CPU_NS, -1);
+    if (fd < 0 && errno == EACCES) {
+        cpu_stats.user_only = true;
+        fd = cpu_event_open(CPU_NS, -1);
+    }
+    if (fd < 0) {
+        cpu_stats.source = "getrusage";
+        return;
+    }
+    cpu_stats.source = cpu_stats.user_only ? "perf_user" : "perf";
+    cpu_stats.have[CPU_NS] = true;
+    for (i = 1; i < CPU_COUNT; i++) {
+        int member = cpu_event_open(i, fd);
+        cpu_stats.have[i] = member >= 0;
+        if (member >= 0)
+            close(member);
+    }
+    close(fd);
 }
 
-static void print_double(const char *tag, double value)
+static void cpu_read(struct cpu_usage *usage)
 {
-    print_indent();
-    print_tag(tag);
-    printf("%lg,", value);
-    print_newline();
+    struct cpu_counters *c = pthread_getspecific(cpu_stats.key);
+    uint64_t values[1 + CPU_COUNT];
+    struct rusage ru;
+    int i;
+
+    memset(usage, 0, sizeof(*usage));
+    if (!cpu_stats.enabled)
+        return;
+    if (!c)
+        c = cpu_counters_open();
+
+    if (c->fd[0] >= 0 && read(c->fd[0], values, sizeof(values)) > 0) {
+        for (i = 0; i < CPU_COUNT; i++) {
+            if (c->index[i] >= 0 && c->index[i] < values[0])
+                usage->value[i] = values[1 + c->index[i]];
+        }
+        return;
+    }
+
+    if (getrusage(RUSAGE_THREAD, &ru))
+        return;
+    usage->value[CPU_NS] =
+        (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * UINT64_C(1000000000) +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * UINT64_C(1000);
+    usage->value[CPU_SWITCHES] = ru.ru_nvcsw + ru.ru_nivcsw;
 }
 
-static void print_string(const char *tag, const char *format, ...)
+// Adds what was used since start to total.
+static void cpu_add(struct cpu_usage *total, const struct cpu_usage *start)
 {
-    print_indent();
-    print_tag(tag);
-    printf("\"");
-
-    va_list args;
-    va_start(args, format);
-    vfprintf(stdout, format, args);
-    va_end(args);
+    struct cpu_usage now;
+    int i;
 
-    printf("\",");
-    print_newline();
+    cpu_read(&now);
+    for (i = 0; i < CPU_COUNT; i++)
+        total->value[i] += now.value[i] - start->value[i];
 }
 
+/*
+ * Tapes of libva calls.  With --record, every call made through the
+ * macros below is written to a file along with its arguments, its result,
+ * everything it wrote back and how long it took.  With --replay, the calls
+ * are answered from such a file without touching libva, so that the time
+ * vadumpcaps spends by itself can be measured on a machine without the
+ * hardware the tape was made on.
+ *
+ * A tape is a header followed by one record per call, with numbers as
+ * LEB128 varints (the result zigzagged):
+ *   call, result, latency_ns, inputs length, inputs,
+ *   then for each output: length, bytes.
+ * Structures are stored as they are in memory, so a tape can only be
+ * replayed by a build against the same libva version on the same
+ * architecture.
+ */
+#define TAPE_MAGIC   "VACAPTAP"
+#define TAPE_VERSION 1
+
 enum {
-    EP_ATTRIBUTES = 1,
-    EP_SURFACES   = 2,
-    EP_FILTERS    = 4,
+    TAPE_OFF,
+    TAPE_RECORD,
+    TAPE_REPLAY,
 };
 
-static const struct {
-    VAEntrypoint entrypoint;
-    const char *name;
-    const char *description;
-    int flags;
-} entrypoints[] = {
-#define E(name, desc, flags) { VAEntrypoint ## name, #name, desc, flags }
-    E(VLD,        "Decode Slice",             EP_ATTRIBUTES | EP_SURFACES),
-    E(IZZ,        "(Legacy) ZigZag Scan",     EP_ATTRIBUTES),
-    E(IDCT,       "(Legacy) Inverse DCT",     EP_ATTRIBUTES),
-    E(MoComp,     "(Legacy) Motion Compensation",
-                                              EP_ATTRIBUTES),
-    E(Deblocking, "(Legacy) Deblocking",      EP_ATTRIBUTES),
-    E(EncSlice,   "Encode Slice",             EP_ATTRIBUTES | EP_SURFACES),
-    E(EncPicture, "Encode Picture",           EP_ATTRIBUTES | EP_SURFACES),
-#if LIBVA(1, 7, 1)
-    E(EncSliceLP, "Encode Slice (Low Power)", EP_ATTRIBUTES | EP_SURFACES),
-#endif
-    E(VideoProc,  "Video Processing",
-                                 EP_FILTERS | EP_ATTRIBUTES | EP_SURFACES),
-#if LIBVA(2, 0, 0)
-    E(FEI,        "Flexible Encode",          EP_ATTRIBUTES | EP_SURFACES),
-#endif
-#if LIBVA(2, 1, 0)
-    E(Stats,      "Stats",                    EP_ATTRIBUTES),
-#endif
-#if LIBVA(2, 11, 0)
-    E(ProtectedTEEComm, "Communicate with Trusted Execution Environment",
-                                              EP_ATTRIBUTES),
-    E(ProtectedContent, "Decrypt Protected Content",
-                                              EP_ATTRIBUTES),
-#endif
-#undef E
+struct tape_buffer {
+    uint8_t *data;
+    size_t size;
+    size_t alloc;
 };
 
-static const struct {
-    VAProfile profile;
-    const char *name;
-    const char *description;
-} profiles[] = {
-#define P(name, desc) { VAProfile ## name,  #name, desc }
-    P(None,                "Video Processing"),
-    P(MPEG2Simple,         "MPEG-2 Simple Profile"),
-    P(MPEG2Main,           "MPEG-2 Main Profile"),
-    P(MPEG4Simple,         "MPEG-4 part 2 Simple Profile"),
-    P(MPEG4AdvancedSimple, "MPEG-4 part 2 Advanced Simple Profile"),
-    P(MPEG4Main,           "MPEG-4 part 2 Main Profile"),
-    P(H264Baseline,        "H.264 / MPEG-4 part 10 (AVC) Baseline Profile"),
-    P(H264Main,            "H.264 / MPEG-4 part 10 (AVC) Main Profile"),
-    P(H264High,            "H.264 / MPEG-4 part 10 (AVC) High Profile"),
-    P(VC1Simple,           "VC-1 / SMPTE 421M / WMV 9 / WMV3 Simple Profile"),
-    P(VC1Main,             "VC-1 / SMPTE 421M / WMV 9 / WMV3 Main Profile"),
-    P(VC1Advanced,         "VC-1 / SMPTE 421M / WMV 9 / WMV3 Advanced Profile"),
-    P(H263Baseline,        "H.263"),
-    P(JPEGBaseline,        "JPEG"),
-    P(H264ConstrainedBaseline,
-      "H.264 / MPEG-4 part 10 (AVC) Constrained Baseline Profile"),
-#if LIBVA(1, 3, 0)
-    P(VP8Version0_3,       "VP8 profile versions 0-3"),
-#endif
-#if LIBVA(1, 4, 0)
-    P(H264MultiviewHigh,   "H.264 / MPEG-4 part 10 (AVC) Multiview High Profile"),
-    P(H264StereoHigh,      "H.264 / MPEG-4 part 10 (AVC) Stereo High Profile"),
-#endif
-#if LIBVA(1, 5, 0)
-    P(HEVCMain,            "H.265 / MPEG-H part 2 (HEVC) Main Profile"),
-    P(HEVCMain10,          "H.265 / MPEG-H part 2 (HEVC) Main 10 Profile"),
-#endif
-#if LIBVA(1, 6, 0)
-    P(VP9Profile0,         "VP9 profile 0"),
-#endif
-#if LIBVA(1, 7, 0)
-    P(VP9Profile1,         "VP9 profile 1"),
-    P(VP9Profile2,         "VP9 profile 2"),
-    P(VP9Profile3,         "VP9 profile 3"),
-#endif
-#if LIBVA(2, 2, 0)
-    P(HEVCMain12,          "H.265 / MPEG-H part 2 (HEVC) RExt Main 12 Profile"),
-    P(HEVCMain422_10,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:2:2 10 Profile"),
-    P(HEVCMain422_12,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:2:2 12 Profile"),
-    P(HEVCMain444,         "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:4:4 Profile"),
-    P(HEVCMain444_10,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:4:4 10 Profile"),
-    P(HEVCMain444_12,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:4:4 12 Profile"),
-    P(HEVCSccMain,         "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main Profile"),
-    P(HEVCSccMain10,       "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main 10 Profile"),
-    P(HEVCSccMain444,      "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main 4:4:4 Profile"),
-#endif
-#if LIBVA(2, 7, 0)
-    P(AV1Profile0,         "AV1 Main Profile"),
-    P(AV1Profile1,         "AV1 High Profile"),
-#endif
-#if LIBVA(2, 8, 0)
-    P(HEVCSccMain444_10,   "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main 4:4:4 10 Profile"),
-#endif
-#undef P
+static struct {
+    int mode;
+    bool timing;
+    const char *path;
+    FILE *file;
+    struct tape_buffer record;
+
+    const uint8_t *data;
+    const uint8_t *p;
+    const uint8_t *end;
+
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t latency_ns;
+} tape;
+
+struct tape_call {
+    int call;
+    uint64_t start;
+    uint64_t latency_ns;
+    bool cpu_live;
+    struct cpu_usage cpu;
+
+    // Recording.
+    struct tape_buffer in;
+    struct tape_buffer out;
+
+    // Replaying.
+    int64_t result;
+    const uint8_t *recorded_in;
+    size_t recorded_in_size;
+    size_t in_pos;
 };
 
-static const struct {
-    unsigned int value;
-    const char *name;
-} rt_format_types[] = {
-#define R(name) { VA_RT_FORMAT_ ## name, #name }
-    R(YUV420),
-    R(YUV422),
-    R(YUV444),
-    R(YUV411),
-    R(YUV400),
-#if LIBVA(2, 2, 0)
-    R(YUV420_10),
-    R(YUV422_10),
-    R(YUV444_10),
-    R(YUV420_12),
-    R(YUV422_12),
-    R(YUV444_12),
-#elif LIBVA(1, 6, 2)
-    R(YUV420_10BPP),
-#endif
-    R(RGB16),
-    R(RGB32),
-    R(RGBP),
-#if LIBVA(2, 2, 0)
-    R(RGB32_10),
-#elif LIBVA(2, 1, 0)
-    R(RGB32_10BPP),
-#endif
-#undef R
-};
+static char *read_file(const char *path, size_t *size);
 
-static const struct {
-    VAProcFilterType filter;
-    const char *name;
-} filters[] = {
-#define F(name) { VAProcFilter ## name, #name }
-    F(None),
-    F(NoiseReduction),
-    F(Deinterlacing),
-    F(Sharpening),
-    F(ColorBalance),
-#if LIBVA(1, 3, 1)
-    F(SkinToneEnhancement),
-#endif
-#if LIBVA(2, 1, 0)
-    F(TotalColorCorrection),
-#endif
-#if LIBVA(2, 3, 0)
-    F(HVSNoiseReduction),
-#endif
-#if LIBVA(2, 4, 0)
-    F(HighDynamicRangeToneMapping),
-#endif
-#if LIBVA(2, 12, 0)
-    F(3DLUT),
-#endif
-#undef F
-};
+static uint32_t tape_layout(void)
+{
+    return VA_MAJOR_VERSION << 24 | VA_MINOR_VERSION << 16 |
+           sizeof(void*) << 8 | sizeof(long);
+}
 
-static const struct {
-    uint32_t flag;
-    const char *name;
-} proc_pipeline_flags[] = {
-#define F(name) { VA_PROC_PIPELINE_ ## name, #name }
-    F(SUBPICTURES),
-    F(FAST),
-#undef F
-}, proc_filter_flags[] = {
-#define F(name) { VA_ ## name, #name }
-    F(PROC_FILTER_MANDATORY),
-    F(FRAME_PICTURE),
-    F(TOP_FIELD),
-    F(BOTTOM_FIELD),
-    F(SRC_BT601),
-    F(SRC_BT709),
-    F(SRC_SMPTE_240),
-    F(FILTER_SCALING_DEFAULT),
-    F(FILTER_SCALING_FAST),
-    F(FILTER_SCALING_HQ),
-    F(FILTER_SCALING_NL_ANAMORPHIC),
-#if LIBVA(2, 9, 0)
-    F(FILTER_INTERPOLATION_NEAREST_NEIGHBOR),
-    F(FILTER_INTERPOLATION_BILINEAR),
-    F(FILTER_INTERPOLATION_ADVANCED),
-#endif
-#undef F
-};
+static void tape_append(struct tape_buffer *buffer,
+                        const void *data, size_t size)
+{
+    if (!size)
+        return;
+    if (buffer->size + size > buffer->alloc) {
+        buffer->alloc = 2 * (buffer->size + size) + 64;
+        buffer->data  = realloc(buffer->data, buffer->alloc);
+        if (!buffer->data)
+            die("Failed to allocate tape buffer.\n");
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
 
-static const struct {
-    VAProcDeinterlacingType type;
-    const char *name;
-} deinterlacer_types[] = {
-#define D(name) { VAProcDeinterlacing ## name, #name }
-    D(None),
-    D(Bob),
-    D(Weave),
-    D(MotionAdaptive),
-    D(MotionCompensated),
-#undef D
-};
+static void tape_append_varint(struct tape_buffer *buffer, uint64_t v)
+{
+    uint8_t bytes[10];
+    int len = 0;
+    do {
+        bytes[len++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while (v);
+    tape_append(buffer, bytes, len);
+}
 
-static const struct {
-    VAProcColorBalanceType type;
-    const char *name;
-} colour_balance_types[] = {
-#define C(name) { VAProcColorBalance ## name, #name }
-    C(None),
-    C(Hue),
-    C(Saturation),
-    C(Brightness),
-    C(Contrast),
-    C(AutoSaturation),
-    C(AutoBrightness),
-    C(AutoContrast),
-#undef C
-};
+static void tape_truncated(void)
+{
+    die("Tape %s is truncated at call %"PRIu64".\n", tape.path, tape.calls);
+}
 
-#if LIBVA(2, 1, 0)
-static const struct {
-    VAProcTotalColorCorrectionType type;
-    const char *name;
-} total_colour_correction_types[] = {
-#define C(name) { VAProcTotalColorCorrection ## name, #name }
-    C(None),
-    C(Red),
-    C(Green),
-    C(Blue),
-    C(Cyan),
-    C(Magenta),
-    C(Yellow),
-#undef C
-};
-#endif
+static uint64_t tape_read_varint(void)
+{
+    uint64_t v = 0;
+    int shift;
+    for (shift = 0; tape.p < tape.end && shift < 64; shift += 7) {
+        uint8_t byte = *tape.p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return v;
+    }
+    tape_truncated();
+    return 0;
+}
 
-static const struct {
-    VAProcColorStandardType type;
-    const char *name;
-} colour_types[] = {
-#define C(name) { VAProcColorStandard ## name, #name }
-    C(None),
-    C(BT601),
-    C(BT709),
-    C(BT470M),
-    C(BT470BG),
-    C(SMPTE170M),
-    C(SMPTE240M),
-    C(GenericFilm),
-#if LIBVA(2, 1, 0)
-    C(SRGB),
-    C(STRGB),
-    C(XVYCC601),
-    C(XVYCC709),
-    C(BT2020),
-#endif
-#undef C
-};
+static const uint8_t *tape_read_bytes(size_t *size)
+{
+    const uint8_t *bytes;
+    *size = tape_read_varint();
+    if (*size > tape.end - tape.p)
+        tape_truncated();
+    bytes = tape.p;
+    tape.p += *size;
+    return bytes;
+}
 
-static const struct {
-    int type;
-    const char *name;
-} rotation_types[] = {
-#define R(name) { VA_ROTATION_ ## name, #name }
-    R(NONE),
-    R(90),
-    R(180),
-    R(270),
-#undef R
-};
+static void tape_start_record(const char *path)
+{
+    uint32_t header[2] = { TAPE_VERSION, tape_layout() };
+
+    tape.file = fopen(path, "wb");
+    if (!tape.file)
+        die("Failed to open %s: %m.\n", path);
+    if (fwrite(TAPE_MAGIC, 8, 1, tape.file) != 1 ||
+        fwrite(header, sizeof(header), 1, tape.file) != 1)
+        die("Failed to write %s: %m.\n", path);
+    tape.mode = TAPE_RECORD;
+    tape.path = path;
+}
 
-#if LIBVA(2, 1, 0)
-static const struct {
-    int type;
-    const char *name;
-} blend_types[] = {
-#define B(name) { VA_BLEND_ ## name, #name }
-    B(GLOBAL_ALPHA),
-    B(PREMULTIPLIED_ALPHA),
-    B(LUMA_KEY),
-#undef B
-};
+static void tape_start_replay(const char *path, bool timing)
+{
+    uint32_t header[2];
+    size_t size;
+
+    tape.data = (const uint8_t*)read_file(path, &size);
+    if (!tape.data)
+        die("Failed to read %s: %m.\n", path);
+    if (size < 8 + sizeof(header) || memcmp(tape.data, TAPE_MAGIC, 8))
+        die("%s is not a tape.\n", path);
+    memcpy(header, tape.data + 8, sizeof(header));
+    if (header[0] != TAPE_VERSION)
+        die("Tape %s has unsupported version %"PRIu32".\n", path, header[0]);
+    if (header[1] != tape_layout())
+        die("Tape %s was recorded with a different libva version or "
+            "architecture.\n", path);
+
+    tape.mode   = TAPE_REPLAY;
+    tape.timing = timing;
+    tape.path   = path;
+    tape.p      = tape.data + 8 + sizeof(header);
+    tape.end    = tape.data + size;
+}
 
-static const struct {
-    int type;
-    const char *name;
-} mirror_types[] = {
-#define M(name) { VA_MIRROR_ ## name, #name }
-    M(NONE),
-    M(HORIZONTAL),
-    M(VERTICAL),
-#undef M
-};
-#endif
+static void tape_finish(void)
+{
+    if (tape.mode == TAPE_RECORD) {
+        if (fclose(tape.file))
+            die("Failed to write %s: %m.\n", tape.path);
+        fprintf(stderr, "Recorded %"PRIu64" calls in %"PRIu64" bytes, "
+                "taking %.3f ms in libva.\n", tape.calls, tape.bytes,
+                tape.latency_ns / 1e6);
+    } else if (tape.mode == TAPE_REPLAY) {
+        if (tape.p < tape.end)
+            fprintf(stderr, "Tape %s has %zu bytes of calls left over.\n",
+                    tape.path, (size_t)(tape.end - tape.p));
+        fprintf(stderr, "Replayed %"PRIu64" calls, recorded as taking "
+                "%.3f ms in libva.\n", tape.calls, tape.latency_ns / 1e6);
+    }
+}
 
-#if LIBVA(2, 4, 0)
-static const struct {
-    int type;
-    const char *name;
-} hdr_metadata_types[] = {
-#define H(name) { VAProcHighDynamicRangeMetadata ## name, #name }
-    H(None),
-    H(HDR10),
-#undef H
-};
+static void tape_diverged(const struct tape_call *call, const char *what)
+{
+    die("Replay of %s diverged at call %"PRIu64" (%s): %s.\n",
+        tape.path, tape.calls, va_call_names[call->call], what);
+}
 
-static const struct {
-    int type;
-    const char *name;
-} tone_mapping_types[] = {
-#define M(name) { VA_TONE_MAPPING_ ## name, #name }
-    M(HDR_TO_HDR),
-    M(HDR_TO_SDR),
-    M(HDR_TO_EDR),
-    M(SDR_TO_HDR),
-#undef M
-};
-#endif
+static void tape_begin(struct tape_call *call, int index)
+{
+    // Filter chains may be probed from several threads.
+    __atomic_add_fetch(&probe_stats.calls[index], 1, __ATOMIC_RELAXED);
+    *call = (struct tape_call) { .call = index };
 
-#if LIBVA(2, 12, 0)
-static const struct {
-    int type;
-    const char *name;
-} tdlut_channel_types[] = {
-#define L(name) { VA_3DLUT_CHANNEL_ ## name, #name }
-    L(RGB_RGB),
-    L(YUV_RGB),
-    L(VUY_RGB),
-#undef L
-};
+    if (tape.mode != TAPE_REPLAY)
+        return;
+
+    if (tape.p >= tape.end)
+        tape_diverged(call, "the tape has ended");
+    if (tape_read_varint() != index)
+        tape_diverged(call, "a different call was recorded");
+    uint64_t result = tape_read_varint();
+    call->result = (int64_t)(result >> 1) ^ -(int64_t)(result & 1);
+    call->latency_ns  = tape_read_varint();
+    call->recorded_in = tape_read_bytes(&call->recorded_in_size);
+}
+
+static void tape_in(struct tape_call *call, const void *data, size_t size)
+{
+    if (tape.mode == TAPE_RECORD) {
+        tape_append(&call->in, data, size);
+    } else if (tape.mode == TAPE_REPLAY) {
+        if (call->in_pos + size > call->recorded_in_size ||
+            (size && memcmp(call->recorded_in + call->in_pos, data, size)))
+            tape_diverged(call, "the arguments differ");
+        call->in_pos += size;
+    }
+}
+
+// Whether to make the real call, which is timed from here to tape_end().
+// On replay, the recorded result is used instead.
+static bool tape_live(struct tape_call *call)
+{
+    if (tape.mode == TAPE_REPLAY) {
+        if (call->in_pos != call->recorded_in_size)
+            tape_diverged(call, "the arguments differ");
+        return false;
+    }
+    if (cpu_stats.enabled) {
+        call->cpu_live = true;
+        cpu_read(&call->cpu);
+    }
+    if (tape.mode == TAPE_RECORD)
+        call->start = clock_ns();
+    return true;
+}
+
+static void tape_out(struct tape_call *call, void *data, size_t size)
+{
+    if (tape.mode == TAPE_RECORD) {
+        tape_append_varint(&call->out, size);
+        tape_append(&call->out, data, size);
+    } else if (tape.mode == TAPE_REPLAY) {
+        size_t recorded_size;
+        const uint8_t *bytes = tape_read_bytes(&recorded_size);
+        if (recorded_size != size)
+            tape_diverged(call, "the outputs differ in size");
+        if (size)
+            memcpy(data, bytes, size);
+    }
+}
+
+// For arrays which the driver owns and returns a pointer to: on replay,
+// they are allocated if the caller did not supply one, and never freed.
+static void tape_out_array(struct tape_call *call, void *pointer,
+                           size_t size)
+{
+    void **array = pointer;
+    if (tape.mode == TAPE_REPLAY && !*array && size) {
+        *array = malloc(size);
+        if (!*array)
+            die("Failed to allocate replayed array.\n");
+    }
+    tape_out(call, *array, size);
+}
+
+static int64_t tape_end(struct tape_call *call, int64_t result)
+{
+    if (call->cpu_live) {
+        struct cpu_usage used = { { 0 } };
+        int i;
+
+        cpu_add(&used, &call->cpu);
+        for (i = 0; i < CPU_COUNT; i++)
+            __atomic_add_fetch(&probe_stats.cpu[call->call][i],
+                               used.value[i], __ATOMIC_RELAXED);
+    }
+
+    if (tape.mode == TAPE_RECORD) {
+        struct tape_buffer *record = &tape.record;
+
+        call->latency_ns = clock_ns() - call->start;
+
+        record->size = 0;
+        tape_append_varint(record, call->call);
+        tape_append_varint(record, (uint64_t)result << 1 ^
+                                   (uint64_t)(result >> 63));
+        tape_append_varint(record, call->latency_ns);
+        tape_append_varint(record, call->in.size);
+        tape_append(record, call->in.data, call->in.size);
+        tape_append(record, call->out.data, call->out.size);
+        if (fwrite(record->data, record->size, 1, tape.file) != 1)
+            die("Failed to write %s: %m.\n", tape.path);
+        tape.bytes += record->size;
+
+        free(call->in.data);
+        free(call->out.data);
+    } else if (tape.mode == TAPE_REPLAY) {
+        if (tape.timing && call->latency_ns) {
+            struct timespec ts = {
+                .tv_sec  = call->latency_ns / 1000000000,
+                .tv_nsec = call->latency_ns % 1000000000,
+            };
+            while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+        }
+        result = call->result;
+    }
+    // Without a tape, calls may be made from several threads.
+    if (tape.mode != TAPE_OFF) {
+        ++tape.calls;
+        tape.latency_ns += call->latency_ns;
+    }
+    return result;
+}
+
+#define TAPE_IN(call, value)  tape_in(call, &(value), sizeof(value))
+#define TAPE_OUT(call, value) tape_out(call, &(value), sizeof(value))
+
+/*
+ * A wrapper for each libva function used, with the real function called
+ * by its name in parentheses so as not to expand the macro replacing it.
+ * Outputs are only recorded if the call succeeded, and the counts of
+ * arrays before the arrays themselves, so that replay knows how much to
+ * read back.
+ */
+
+#define TAPE_CALL(call, var, real) \
+    (tape_live(call) ? (var = real) : (var = (call)->result))
+
+static VAStatus tape_vaInitialize(VADisplay display, int *major, int *minor)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaInitialize);
+    TAPE_CALL(&call, vas, (vaInitialize)(display, major, minor));
+    if (vas == VA_STATUS_SUCCESS) {
+        tape_out(&call, major, sizeof(*major));
+        tape_out(&call, minor, sizeof(*minor));
+    }
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaTerminate(VADisplay display)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaTerminate);
+    TAPE_CALL(&call, vas, (vaTerminate)(display));
+    return tape_end(&call, vas);
+}
+
+#if LIBVA(1, 6, 0)
+static VAStatus tape_vaSetDriverName(VADisplay display, char *driver)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaSetDriverName);
+    tape_in(&call, driver, strlen(driver) + 1);
+    TAPE_CALL(&call, vas, (vaSetDriverName)(display, driver));
+    return tape_end(&call, vas);
+}
 #endif
 
+// The display is only a handle, so on replay any pointer will do.
+static VADisplay tape_vaGetDisplayDRM(int fd)
+{
+    struct tape_call call;
+    VADisplay display = NULL;
+    tape_begin(&call, VA_CALL_vaGetDisplayDRM);
+    if (tape_live(&call))
+        display = (vaGetDisplayDRM)(fd);
+    else if (call.result)
+        display = (VADisplay)&tape;
+    tape_end(&call, display != NULL);
+    return display;
+}
+
+static const char *tape_vaQueryVendorString(VADisplay display)
+{
+    struct tape_call call;
+    const char *vendor = NULL;
+    int64_t size;
+    tape_begin(&call, VA_CALL_vaQueryVendorString);
+    if (tape_live(&call)) {
+        vendor = (vaQueryVendorString)(display);
+        size = vendor ? strlen(vendor) + 1 : 0;
+    } else {
+        size = call.result;
+    }
+    tape_out_array(&call, &vendor, size);
+    tape_end(&call, size);
+    return vendor;
+}
+
+#define TAPE_MAX_NUM(name)                                              \
+    static int tape_ ## name(VADisplay display)                         \
+    {                                                                   \
+        struct tape_call call;                                          \
+        int value;                                                      \
+        tape_begin(&call, VA_CALL_ ## name);                            \
+        TAPE_CALL(&call, value, (name)(display));                       \
+        return tape_end(&call, value);                                  \
+    }
+TAPE_MAX_NUM(vaMaxNumProfiles)
+TAPE_MAX_NUM(vaMaxNumEntrypoints)
+TAPE_MAX_NUM(vaMaxNumImageFormats)
+TAPE_MAX_NUM(vaMaxNumSubpictureFormats)
+#undef TAPE_MAX_NUM
+
+static VAStatus tape_vaQueryConfigProfiles(VADisplay display,
+                                           VAProfile *profile_list,
+                                           int *num_profiles)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaQueryConfigProfiles);
+    TAPE_CALL(&call, vas, (vaQueryConfigProfiles)(display, profile_list,
+                                                  num_profiles));
+    if (vas == VA_STATUS_SUCCESS) {
+        tape_out(&call, num_profiles, sizeof(*num_profiles));
+        tape_out(&call, profile_list, *num_profiles * sizeof(*profile_list));
+    }
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaQueryConfigEntrypoints(VADisplay display,
+                                              VAProfile profile,
+                                              VAEntrypoint *entrypoint_list,
+                                              int *num_entrypoints)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaQueryConfigEntrypoints);
+    TAPE_IN(&call, profile);
+    TAPE_CALL(&call, vas, (vaQueryConfigEntrypoints)(display, profile,
+                                                     entrypoint_list,
+                                                     num_entrypoints));
+    if (vas == VA_STATUS_SUCCESS) {
+        tape_out(&call, num_entrypoints, sizeof(*num_entrypoints));
+        tape_out(&call, entrypoint_list,
+                 *num_entrypoints * sizeof(*entrypoint_list));
+    }
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaGetConfigAttributes(VADisplay display,
+                                           VAProfile profile,
+                                           VAEntrypoint entrypoint,
+                                           VAConfigAttrib *attrib_list,
+                                           int num_attribs)
+{
+    struct tape_call call;
+    VAStatus vas;
+    int i;
+    tape_begin(&call, VA_CALL_vaGetConfigAttributes);
+    TAPE_IN(&call, profile);
+    TAPE_IN(&call, entrypoint);
+    // Only the types are read.
+    for (i = 0; i < num_attribs; i++)
+        TAPE_IN(&call, attrib_list[i].type);
+    TAPE_CALL(&call, vas, (vaGetConfigAttributes)(display, profile,
+                                                  entrypoint, attrib_list,
+                                                  num_attribs));
+    if (vas == VA_STATUS_SUCCESS)
+        tape_out(&call, attrib_list, num_attribs * sizeof(*attrib_list));
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaQuerySurfaceAttributes(VADisplay display,
+                                              VAConfigID config,
+                                              VASurfaceAttrib *attrib_list,
+                                              unsigned int *num_attribs)
+{
+    struct tape_call call;
+    VAStatus vas;
+    bool fill = attrib_list;
+    unsigned int i;
+
+    tape_begin(&call, VA_CALL_vaQuerySurfaceAttributes);
+    TAPE_IN(&call, config);
+    TAPE_IN(&call, fill);
+    if (fill)
+        tape_in(&call, num_attribs, sizeof(*num_attribs));
+    TAPE_CALL(&call, vas, (vaQuerySurfaceAttributes)(display, config,
+                                                     attrib_list,
+                                                     num_attribs));
+    if (vas == VA_STATUS_SUCCESS || vas == VA_STATUS_ERROR_MAX_NUM_EXCEEDED)
+        tape_out(&call, num_attribs, sizeof(*num_attribs));
+    if (vas == VA_STATUS_SUCCESS && fill) {
+        tape_out(&call, attrib_list, *num_attribs * sizeof(*attrib_list));
 #if LIBVA(2, 12, 0)
-static const char *const feature_values[] = {
-    [VA_FEATURE_NOT_SUPPORTED] = "not_supported",
-    [VA_FEATURE_SUPPORTED]     = "supported",
-    [VA_FEATURE_REQUIRED]      = "required",
-    [3]                        = "undefined",
-};
+        // The list of modifiers is owned by the driver.
+        for (i = 0; i < *num_attribs; i++) {
+            VADRMFormatModifierList *list;
+            if (attrib_list[i].type != VASurfaceAttribDRMFormatModifiers)
+                continue;
+            if (tape.mode == TAPE_REPLAY)
+                attrib_list[i].value.value.p = NULL;
+            tape_out_array(&call, &attrib_list[i].value.value.p,
+                           sizeof(*list));
+            list = attrib_list[i].value.value.p;
+            if (tape.mode == TAPE_REPLAY)
+                list->modifiers = NULL;
+            tape_out_array(&call, &list->modifiers,
+                           list->num_modifiers * sizeof(*list->modifiers));
+        }
+#else
+        (void)i;
 #endif
+    }
+    return tape_end(&call, vas);
+}
 
-static void dump_config_attributes(VADisplay display,
-                                   VAProfile profile, VAEntrypoint entrypoint,
-                                   unsigned int *rt_formats)
+static VAStatus tape_vaCreateConfig(VADisplay display, VAProfile profile,
+                                    VAEntrypoint entrypoint,
+                                    VAConfigAttrib *attrib_list,
+                                    int num_attribs, VAConfigID *config)
 {
-    VAConfigAttrib attr_list[VAConfigAttribTypeMax];
-    int i, j;
-    for (i = 0; i < VAConfigAttribTypeMax; i++)
-        attr_list[i].type = i;
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaCreateConfig);
+    TAPE_IN(&call, profile);
+    TAPE_IN(&call, entrypoint);
+    tape_in(&call, attrib_list, num_attribs * sizeof(*attrib_list));
+    TAPE_CALL(&call, vas, (vaCreateConfig)(display, profile, entrypoint,
+                                           attrib_list, num_attribs,
+                                           config));
+    if (vas == VA_STATUS_SUCCESS)
+        tape_out(&call, config, sizeof(*config));
+    return tape_end(&call, vas);
+}
 
-    VAStatus vas = vaGetConfigAttributes(display, profile, entrypoint,
-                                         attr_list, VAConfigAttribTypeMax);
-    CHECK_VAS("Unable to get config attributes");
+static VAStatus tape_vaDestroyConfig(VADisplay display, VAConfigID config)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaDestroyConfig);
+    TAPE_IN(&call, config);
+    TAPE_CALL(&call, vas, (vaDestroyConfig)(display, config));
+    return tape_end(&call, vas);
+}
 
-    for (i = 0; i < VAConfigAttribTypeMax; i++) {
-        uint32_t value = attr_list[i].value;
-        if (value == VA_ATTRIB_NOT_SUPPORTED)
-            continue;
+static VAStatus tape_vaCreateContext(VADisplay display, VAConfigID config,
+                                     int width, int height, int flag,
+                                     VASurfaceID *render_targets,
+                                     int num_render_targets,
+                                     VAContextID *context)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaCreateContext);
+    TAPE_IN(&call, config);
+    TAPE_IN(&call, width);
+    TAPE_IN(&call, height);
+    TAPE_IN(&call, flag);
+    tape_in(&call, render_targets,
+            num_render_targets * sizeof(*render_targets));
+    TAPE_CALL(&call, vas, (vaCreateContext)(display, config, width, height,
+                                            flag, render_targets,
+                                            num_render_targets, context));
+    if (vas == VA_STATUS_SUCCESS)
+        tape_out(&call, context, sizeof(*context));
+    return tape_end(&call, vas);
+}
 
-#define AV(type, bit) do { \
-            if (value & VA_ ## type ## _ ## bit) \
-                print_string(NULL, #bit); \
-        } while (0)
-#define AF(var, field) do { \
-            print_string(#field, feature_values[var.bits.field]); \
-        } while (0)
+static VAStatus tape_vaDestroyContext(VADisplay display, VAContextID context)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaDestroyContext);
+    TAPE_IN(&call, context);
+    TAPE_CALL(&call, vas, (vaDestroyContext)(display, context));
+    return tape_end(&call, vas);
+}
 
-        switch(attr_list[i].type) {
-        case VAConfigAttribRTFormat:
-            {
-                *rt_formats = value;
+static VAStatus tape_vaCreateBuffer(VADisplay display, VAContextID context,
+                                    VABufferType type, unsigned int size,
+                                    unsigned int num_elements, void *data,
+                                    VABufferID *buffer)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaCreateBuffer);
+    TAPE_IN(&call, context);
+    TAPE_IN(&call, type);
+    TAPE_IN(&call, size);
+    TAPE_IN(&call, num_elements);
+    // Not the data, whose padding and reserved fields may be uninitialised.
+    TAPE_CALL(&call, vas, (vaCreateBuffer)(display, context, type, size,
+                                           num_elements, data, buffer));
+    if (vas == VA_STATUS_SUCCESS)
+        tape_out(&call, buffer, sizeof(*buffer));
+    return tape_end(&call, vas);
+}
 
-                start_array("rt_formats");
-                for (j = 0; j < ARRAY_LENGTH(rt_format_types); j++) {
-                    if (value & rt_format_types[j].value)
-                        print_string(NULL, rt_format_types[j].name);
-                }
-                end_array();
-            }
-            break;
-        case VAConfigAttribRateControl:
-            {
-                start_array("rate_control_modes");
-                AV(RC, NONE);
-                AV(RC, CBR);
-                AV(RC, VBR);
-                AV(RC, VCM);
-                AV(RC, CQP);
-                AV(RC, VBR_CONSTRAINED);
-#if LIBVA(2, 1, 0)
-                AV(RC, ICQ);
-#endif
-#if LIBVA(1, 7, 1)
-                AV(RC, MB);
-#endif
+static VAStatus tape_vaDestroyBuffer(VADisplay display, VABufferID buffer)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaDestroyBuffer);
+    TAPE_IN(&call, buffer);
+    TAPE_CALL(&call, vas, (vaDestroyBuffer)(display, buffer));
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaQueryVideoProcFilters(VADisplay display,
+                                             VAContextID context,
+                                             VAProcFilterType *filters,
+                                             unsigned int *num_filters)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaQueryVideoProcFilters);
+    TAPE_IN(&call, context);
+    tape_in(&call, num_filters, sizeof(*num_filters));
+    TAPE_CALL(&call, vas, (vaQueryVideoProcFilters)(display, context,
+                                                    filters, num_filters));
+    if (vas == VA_STATUS_SUCCESS || vas == VA_STATUS_ERROR_MAX_NUM_EXCEEDED)
+        tape_out(&call, num_filters, sizeof(*num_filters));
+    if (vas == VA_STATUS_SUCCESS)
+        tape_out(&call, filters, *num_filters * sizeof(*filters));
+    return tape_end(&call, vas);
+}
+
+static size_t tape_filter_cap_size(VAProcFilterType type)
+{
+    switch (type) {
+    case VAProcFilterDeinterlacing:
+        return sizeof(VAProcFilterCapDeinterlacing);
+    case VAProcFilterColorBalance:
+        return sizeof(VAProcFilterCapColorBalance);
 #if LIBVA(2, 1, 0)
-                AV(RC, CFS);
-                AV(RC, PARALLEL);
-#endif
-#if LIBVA(2, 3, 0)
-                AV(RC, QVBR);
-                AV(RC, AVBR);
+    case VAProcFilterTotalColorCorrection:
+        return sizeof(VAProcFilterCapTotalColorCorrection);
 #endif
-#if LIBVA(2, 10, 0)
-                AV(RC, TCBRC);
+#if LIBVA(2, 4, 0)
+    case VAProcFilterHighDynamicRangeToneMapping:
+        return sizeof(VAProcFilterCapHighDynamicRange);
 #endif
-                end_array();
-            }
-            break;
-#if LIBVA(1, 6, 0)
-        case VAConfigAttribDecSliceMode:
-            {
-                start_array("decode_slice_modes");
-                AV(DEC_SLICE_MODE, NORMAL);
-                AV(DEC_SLICE_MODE, BASE);
-                end_array();
-            }
-            break;
+#if LIBVA(2, 12, 0)
+    case VAProcFilter3DLUT:
+        return sizeof(VAProcFilterCap3DLUT);
 #endif
+    default:
+        return sizeof(VAProcFilterCap);
+    }
+}
+
+static VAStatus tape_vaQueryVideoProcFilterCaps(VADisplay display,
+                                                VAContextID context,
+                                                VAProcFilterType type,
+                                                void *filter_caps,
+                                                unsigned int *num_filter_caps)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaQueryVideoProcFilterCaps);
+    TAPE_IN(&call, context);
+    TAPE_IN(&call, type);
+    tape_in(&call, num_filter_caps, sizeof(*num_filter_caps));
+    TAPE_CALL(&call, vas, (vaQueryVideoProcFilterCaps)(display, context,
+                                                       type, filter_caps,
+                                                       num_filter_caps));
+    if (vas == VA_STATUS_SUCCESS || vas == VA_STATUS_ERROR_MAX_NUM_EXCEEDED)
+        tape_out(&call, num_filter_caps, sizeof(*num_filter_caps));
+    if (vas == VA_STATUS_SUCCESS)
+        tape_out(&call, filter_caps,
+                 *num_filter_caps * tape_filter_cap_size(type));
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaQueryVideoProcPipelineCaps(VADisplay display,
+                                                  VAContextID context,
+                                                  VABufferID *filters,
+                                                  unsigned int num_filters,
+                                                  VAProcPipelineCaps *caps)
+{
+    VAProcPipelineCaps given = *caps;
+    struct tape_call call;
+    VAStatus vas;
+
+    tape_begin(&call, VA_CALL_vaQueryVideoProcPipelineCaps);
+    TAPE_IN(&call, context);
+    tape_in(&call, filters, num_filters * sizeof(*filters));
+    TAPE_CALL(&call, vas, (vaQueryVideoProcPipelineCaps)(display, context,
+                                                         filters,
+                                                         num_filters, caps));
+    if (vas != VA_STATUS_SUCCESS)
+        return tape_end(&call, vas);
+
+    // The arrays are the caller's if it gave them, else the driver's.
+    tape_out(&call, caps, sizeof(*caps));
+    if (tape.mode == TAPE_REPLAY) {
+        caps->input_color_standards  = given.input_color_standards;
+        caps->output_color_standards = given.output_color_standards;
 #if LIBVA(2, 1, 0)
-        case VAConfigAttribDecJPEG:
-            {
-                VAConfigAttribValDecJPEG jpeg = { .value = value };
-                start_object("decode_jpeg");
-                start_array("rotation");
-                for (j = 0; j < ARRAY_LENGTH(rotation_types); j++) {
-                    if (jpeg.bits.rotation & 1 << rotation_types[j].type)
-                        print_string(NULL, rotation_types[j].name);
-                }
-                end_array();
-                end_object();
-            }
-            break;
+        caps->input_pixel_format  = given.input_pixel_format;
+        caps->output_pixel_format = given.output_pixel_format;
 #endif
+    }
+    tape_out_array(&call, &caps->input_color_standards,
+                   caps->num_input_color_standards *
+                   sizeof(*caps->input_color_standards));
+    tape_out_array(&call, &caps->output_color_standards,
+                   caps->num_output_color_standards *
+                   sizeof(*caps->output_color_standards));
 #if LIBVA(2, 1, 0)
-        case VAConfigAttribDecProcessing:
-            {
-                print_boolean("decode_processing",
-                              value == VA_DEC_PROCESSING);
-            }
-            break;
+    tape_out_array(&call, &caps->input_pixel_format,
+                   caps->num_input_pixel_formats *
+                   sizeof(*caps->input_pixel_format));
+    tape_out_array(&call, &caps->output_pixel_format,
+                   caps->num_output_pixel_formats *
+                   sizeof(*caps->output_pixel_format));
 #endif
-        case VAConfigAttribEncPackedHeaders:
-            {
-                start_array("packed_headers");
-                AV(ENC_PACKED_HEADER, SEQUENCE);
-                AV(ENC_PACKED_HEADER, PICTURE);
-                AV(ENC_PACKED_HEADER, SLICE);
-                AV(ENC_PACKED_HEADER, MISC);
-                AV(ENC_PACKED_HEADER, RAW_DATA);
-                end_array();
-            }
-            break;
-        case VAConfigAttribEncInterlaced:
-            {
-                start_array("interlace_modes");
-                AV(ENC_INTERLACED, FRAME);
-                AV(ENC_INTERLACED, FIELD);
-                AV(ENC_INTERLACED, MBAFF);
-                AV(ENC_INTERLACED, PAFF);
-                end_array();
-            }
-            break;
-        case VAConfigAttribEncMaxRefFrames:
-            {
-                start_object("max_ref_frames");
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaQueryImageFormats(VADisplay display,
+                                         VAImageFormat *format_list,
+                                         int *num_formats)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaQueryImageFormats);
+    TAPE_CALL(&call, vas, (vaQueryImageFormats)(display, format_list,
+                                                num_formats));
+    if (vas == VA_STATUS_SUCCESS) {
+        tape_out(&call, num_formats, sizeof(*num_formats));
+        tape_out(&call, format_list, *num_formats * sizeof(*format_list));
+    }
+    return tape_end(&call, vas);
+}
+
+static VAStatus tape_vaQuerySubpictureFormats(VADisplay display,
+                                              VAImageFormat *format_list,
+                                              unsigned int *flags,
+                                              unsigned int *num_formats)
+{
+    struct tape_call call;
+    VAStatus vas;
+    tape_begin(&call, VA_CALL_vaQuerySubpictureFormats);
+    TAPE_CALL(&call, vas, (vaQuerySubpictureFormats)(display, format_list,
+                                                     flags, num_formats));
+    if (vas == VA_STATUS_SUCCESS) {
+        tape_out(&call, num_formats, sizeof(*num_formats));
+        tape_out(&call, format_list, *num_formats * sizeof(*format_list));
+        tape_out(&call, flags, *num_formats * sizeof(*flags));
+    }
+    return tape_end(&call, vas);
+}
+
+#define vaInitialize             tape_vaInitialize
+#define vaTerminate              tape_vaTerminate
+#if LIBVA(1, 6, 0)
+#define vaSetDriverName          tape_vaSetDriverName
+#endif
+#define vaGetDisplayDRM          tape_vaGetDisplayDRM
+#define vaQueryVendorString      tape_vaQueryVendorString
+#define vaMaxNumProfiles         tape_vaMaxNumProfiles
+#define vaQueryConfigProfiles    tape_vaQueryConfigProfiles
+#define vaMaxNumEntrypoints      tape_vaMaxNumEntrypoints
+#define vaQueryConfigEntrypoints tape_vaQueryConfigEntrypoints
+#define vaGetConfigAttributes    tape_vaGetConfigAttributes
+#define vaQuerySurfaceAttributes tape_vaQuerySurfaceAttributes
+#define vaCreateConfig           tape_vaCreateConfig
+#define vaDestroyConfig          tape_vaDestroyConfig
+#define vaCreateContext          tape_vaCreateContext
+#define vaDestroyContext         tape_vaDestroyContext
+#define vaCreateBuffer           tape_vaCreateBuffer
+#define vaDestroyBuffer          tape_vaDestroyBuffer
+#define vaQueryVideoProcFilters  tape_vaQueryVideoProcFilters
+#define vaQueryVideoProcFilterCaps   tape_vaQueryVideoProcFilterCaps
+#define vaQueryVideoProcPipelineCaps tape_vaQueryVideoProcPipelineCaps
+#define vaMaxNumImageFormats     tape_vaMaxNumImageFormats
+#define vaQueryImageFormats      tape_vaQueryImageFormats
+#define vaMaxNumSubpictureFormats    tape_vaMaxNumSubpictureFormats
+#define vaQuerySubpictureFormats tape_vaQuerySubpictureFormats
+
+enum {
+    DUMP_PROFILES,
+    DUMP_ENTRYPOINTS,
+    DUMP_ATTRIBUTES,
+    DUMP_SURFACE_FORMATS,
+    DUMP_FILTERS,
+    DUMP_FILTER_CAPS,
+    DUMP_PIPELINE_CAPS,
+    DUMP_IMAGE_FORMATS,
+    DUMP_SUBPICTURE_FORMATS,
+    DUMP_MAX,
+};
+static int dump_mask;
+#define DUMP(name) (dump_mask & (1 << DUMP_ ## name))
+
+static int indent_depth  = 0;
+static int indent_size   = 4;
+static bool pretty_print = true;
+
+static FILE *out;
+
+/*
+ * Output is written through one of a set of formats, all of which see
+ * the same sequence of start/end/print calls and so represent the same
+ * logical tree.  Tags are only meaningful inside objects.
+ */
+struct binary_encoding;
+
+// Per thread, so that filters can be probed for several formats at once.
+static __thread const struct output_format {
+    const char *name;
+    void (*start_array)(const char *tag);
+    void (*end_array)(void);
+    void (*start_object)(const char *tag);
+    void (*end_object)(void);
+    void (*print_boolean)(const char *tag, bool value);
+    void (*print_integer)(const char *tag, int64_t value);
+    void (*print_double)(const char *tag, double value);
+    void (*print_string)(const char *tag, const char *value);
+    const struct binary_encoding *encoding;
+    // Called once all output has been written, for formats which hold
+    // some of it back.
+    void (*finish)(void);
+} *output;
+
+static bool json_first;
+
+static void json_indent(void)
+{
+    if (!pretty_print)
+        return;
+    int i, j;
+    for (i = 0; i < indent_depth; i++)
+        for (j = 0; j < indent_size; j++)
+            putc(' ', out);
+}
+
+static void json_newline(void)
+{
+    if (pretty_print)
+        putc('\n', out);
+}
+
+// Returns the length of the escape sequence written to escape, or zero
+// if the character can be written as-is.
+static int json_escape(unsigned char c, char escape[8])
+{
+    switch (c) {
+    case '"':  return snprintf(escape, 8, "\\\"");
+    case '\\': return snprintf(escape, 8, "\\\\");
+    case '\b': return snprintf(escape, 8, "\\b");
+    case '\f': return snprintf(escape, 8, "\\f");
+    case '\n': return snprintf(escape, 8, "\\n");
+    case '\r': return snprintf(escape, 8, "\\r");
+    case '\t': return snprintf(escape, 8, "\\t");
+    default:
+        if (c < 0x20)
+            return snprintf(escape, 8, "\\u%04x", c);
+        return 0;
+    }
+}
+
+static void json_string(const char *str)
+{
+    const char *p, *run;
+    char escape[8];
+    int len;
+
+    putc('"', out);
+    for (p = run = str; *p; p++) {
+        len = json_escape(*p, escape);
+        if (len) {
+            fwrite(run, 1, p - run, out);
+            fwrite(escape, 1, len, out);
+            run = p + 1;
+        }
+    }
+    fwrite(run, 1, p - run, out);
+    putc('"', out);
+}
+
+// Every value starts here: the separator from the previous element (if
+// any) is written before the value rather than after it, so that no
+// container ever ends with a trailing comma.
+static void json_value(const char *tag)
+{
+    if (indent_depth > 0) {
+        if (!json_first)
+            putc(',', out);
+        json_newline();
+        json_indent();
+    }
+    json_first = false;
+
+    if (tag) {
+        json_string(tag);
+        putc(':', out);
+        if (pretty_print)
+            putc(' ', out);
+    }
+}
+
+static void json_start(const char *tag, char open)
+{
+    json_value(tag);
+    putc(open, out);
+    ++indent_depth;
+    json_first = true;
+}
+
+static void json_end(char close)
+{
+    --indent_depth;
+    if (!json_first) {
+        json_newline();
+        json_indent();
+    }
+    putc(close, out);
+    json_first = false;
+
+    if (indent_depth == 0)
+        putc('\n', out);
+}
+
+static void json_start_array(const char *tag)
+{
+    json_start(tag, '[');
+}
+
+static void json_end_array(void)
+{
+    json_end(']');
+}
+
+static void json_start_object(const char *tag)
+{
+    json_start(tag, '{');
+}
+
+static void json_end_object(void)
+{
+    json_end('}');
+}
+
+static void json_print_boolean(const char *tag, bool value)
+{
+    json_value(tag);
+    fputs(value ? "true" : "false", out);
+}
+
+static void json_print_integer(const char *tag, int64_t value)
+{
+    json_value(tag);
+    fprintf(out, "%"PRId64, value);
+}
+
+static void json_print_double(const char *tag, double value)
+{
+    json_value(tag);
+    // JSON has no representation of infinities or NaNs.
+    if (isfinite(value))
+        fprintf(out, "%lg", value);
+    else
+        fputs("null", out);
+}
+
+static void json_print_string(const char *tag, const char *value)
+{
+    json_value(tag);
+    json_string(value);
+}
+
+/*
+ * The binary formats need the number of elements in each container before
+ * its contents, so the document is built in memory: each container
+ * records where it started and how many elements it has, and the header
+ * is inserted in front of the contents when the container is closed.
+ * The whole document is written out when the outermost container ends.
+ */
+struct binary_encoding {
+    // Each writes at most nine bytes to the buffer and returns the count.
+    int (*boolean)(uint8_t *p, bool value);
+    int (*integer)(uint8_t *p, int64_t value);
+    int (*real)(uint8_t *p, double value);
+    int (*string)(uint8_t *p, size_t length);
+    int (*container)(uint8_t *p, bool map, uint32_t count);
+};
+
+static struct {
+    uint8_t *data;
+    size_t   size;
+    size_t   alloc;
+
+    int depth;
+    struct {
+        size_t   offset;
+        uint32_t count;
+        bool     map;
+    } stack[64];
+} binary;
+
+static void binary_reserve(size_t size)
+{
+    if (binary.size + size > binary.alloc) {
+        binary.alloc = 2 * (binary.size + size);
+        binary.data  = realloc(binary.data, binary.alloc);
+    }
+}
+
+static void binary_write(const void *data, size_t size)
+{
+    binary_reserve(size);
+    memcpy(binary.data + binary.size, data, size);
+    binary.size += size;
+}
+
+static void binary_key(const char *tag)
+{
+    if (binary.depth == 0)
+        return;
+    ++binary.stack[binary.depth - 1].count;
+    if (!binary.stack[binary.depth - 1].map)
+        return;
+    if (!tag)
+        tag = "";
+
+    uint8_t head[9];
+    size_t length = strlen(tag);
+    binary_write(head, output->encoding->string(head, length));
+    binary_write(tag, length);
+}
+
+static void binary_start(const char *tag, bool map)
+{
+    binary_key(tag);
+    if (binary.depth >= ARRAY_LENGTH(binary.stack))
+        die("Output nested too deeply.\n");
+    binary.stack[binary.depth].offset = binary.size;
+    binary.stack[binary.depth].count  = 0;
+    binary.stack[binary.depth].map    = map;
+    ++binary.depth;
+}
+
+static void binary_end(void)
+{
+    --binary.depth;
+
+    uint8_t head[9];
+    size_t offset = binary.stack[binary.depth].offset;
+    int length = output->encoding->container(head,
+                                             binary.stack[binary.depth].map,
+                                             binary.stack[binary.depth].count);
+    binary_reserve(length);
+    memmove(binary.data + offset + length, binary.data + offset,
+            binary.size - offset);
+    memcpy(binary.data + offset, head, length);
+    binary.size += length;
+
+    if (binary.depth == 0) {
+        fwrite(binary.data, 1, binary.size, out);
+        binary.size = 0;
+    }
+}
+
+static void binary_start_array(const char *tag)
+{
+    binary_start(tag, false);
+}
+
+static void binary_start_object(const char *tag)
+{
+    binary_start(tag, true);
+}
+
+static void binary_print_boolean(const char *tag, bool value)
+{
+    uint8_t head[9];
+    binary_key(tag);
+    binary_write(head, output->encoding->boolean(head, value));
+}
+
+static void binary_print_integer(const char *tag, int64_t value)
+{
+    uint8_t head[9];
+    binary_key(tag);
+    binary_write(head, output->encoding->integer(head, value));
+}
+
+static void binary_print_double(const char *tag, double value)
+{
+    uint8_t head[9];
+    binary_key(tag);
+    binary_write(head, output->encoding->real(head, value));
+}
+
+static void binary_print_string(const char *tag, const char *value)
+{
+    uint8_t head[9];
+    size_t length = strlen(value);
+    binary_key(tag);
+    binary_write(head, output->encoding->string(head, length));
+    binary_write(value, length);
+}
+
+static int write_be(uint8_t *p, uint8_t lead, uint64_t value, int bytes)
+{
+    int i;
+    p[0] = lead;
+    for (i = 0; i < bytes; i++)
+        p[1 + i] = value >> 8 * (bytes - 1 - i);
+    return 1 + bytes;
+}
+
+static int write_real(uint8_t *p, uint8_t lead32, uint8_t lead64, double value)
+{
+    // Use single precision where it is exact, which covers everything the
+    // VPP filter ranges actually contain.
+    float f = value;
+    if (f == value) {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return write_be(p, lead32, bits, 4);
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return write_be(p, lead64, bits, 8);
+    }
+}
+
+// CBOR (RFC 8949), always using the shortest head.
+
+static int cbor_head(uint8_t *p, int major, uint64_t value)
+{
+    if (value < 24) {
+        p[0] = major << 5 | value;
+        return 1;
+    }
+    if (value <= UINT8_MAX)
+        return write_be(p, major << 5 | 24, value, 1);
+    if (value <= UINT16_MAX)
+        return write_be(p, major << 5 | 25, value, 2);
+    if (value <= UINT32_MAX)
+        return write_be(p, major << 5 | 26, value, 4);
+    return write_be(p, major << 5 | 27, value, 8);
+}
+
+static int cbor_boolean(uint8_t *p, bool value)
+{
+    p[0] = value ? 0xf5 : 0xf4;
+    return 1;
+}
+
+static int cbor_integer(uint8_t *p, int64_t value)
+{
+    if (value >= 0)
+        return cbor_head(p, 0, value);
+    else
+        return cbor_head(p, 1, -1 - value);
+}
+
+static int cbor_real(uint8_t *p, double value)
+{
+    return write_real(p, 0xfa, 0xfb, value);
+}
+
+static int cbor_string(uint8_t *p, size_t length)
+{
+    return cbor_head(p, 3, length);
+}
+
+static int cbor_container(uint8_t *p, bool map, uint32_t count)
+{
+    return cbor_head(p, map ? 5 : 4, count);
+}
+
+static const struct binary_encoding cbor_encoding = {
+    .boolean   = &cbor_boolean,
+    .integer   = &cbor_integer,
+    .real      = &cbor_real,
+    .string    = &cbor_string,
+    .container = &cbor_container,
+};
+
+// MessagePack, always using the shortest representation.
+
+static int msgpack_boolean(uint8_t *p, bool value)
+{
+    p[0] = value ? 0xc3 : 0xc2;
+    return 1;
+}
+
+static int msgpack_integer(uint8_t *p, int64_t value)
+{
+    if (value >= 0) {
+        if (value < 128) {
+            p[0] = value;
+            return 1;
+        }
+        if (value <= UINT8_MAX)
+            return write_be(p, 0xcc, value, 1);
+        if (value <= UINT16_MAX)
+            return write_be(p, 0xcd, value, 2);
+        if (value <= UINT32_MAX)
+            return write_be(p, 0xce, value, 4);
+        return write_be(p, 0xcf, value, 8);
+    } else {
+        if (value >= -32) {
+            p[0] = (uint8_t)value;
+            return 1;
+        }
+        if (value >= INT8_MIN)
+            return write_be(p, 0xd0, value, 1);
+        if (value >= INT16_MIN)
+            return write_be(p, 0xd1, value, 2);
+        if (value >= INT32_MIN)
+            return write_be(p, 0xd2, value, 4);
+        return write_be(p, 0xd3, value, 8);
+    }
+}
+
+static int msgpack_real(uint8_t *p, double value)
+{
+    return write_real(p, 0xca, 0xcb, value);
+}
+
+static int msgpack_string(uint8_t *p, size_t length)
+{
+    if (length < 32) {
+        p[0] = 0xa0 | length;
+        return 1;
+    }
+    if (length <= UINT8_MAX)
+        return write_be(p, 0xd9, length, 1);
+    if (length <= UINT16_MAX)
+        return write_be(p, 0xda, length, 2);
+    return write_be(p, 0xdb, length, 4);
+}
+
+static int msgpack_container(uint8_t *p, bool map, uint32_t count)
+{
+    if (count < 16) {
+        p[0] = (map ? 0x80 : 0x90) | count;
+        return 1;
+    }
+    if (count <= UINT16_MAX)
+        return write_be(p, map ? 0xde : 0xdc, count, 2);
+    return write_be(p, map ? 0xdf : 0xdd, count, 4);
+}
+
+static const struct binary_encoding msgpack_encoding = {
+    .boolean   = &msgpack_boolean,
+    .integer   = &msgpack_integer,
+    .real      = &msgpack_real,
+    .string    = &msgpack_string,
+    .container = &msgpack_container,
+};
+
+/*
+ * NDJSON: one flat object per line for each leaf of the
+ * device -> profile -> entrypoint -> surface format / filter hierarchy,
+ * written as soon as it is complete.  Each record carries the fields of
+ * all of its ancestors, with keys qualified by the kind of record they
+ * came from (e.g. "entrypoint.name", "surface_format.max_width").  Other
+ * nested objects are flattened into dotted keys, and arrays which are not
+ * themselves lists of records are written inline as JSON values.
+ *
+ * Only the fields of the currently-open records are held, so memory use
+ * does not grow with the size of the output.
+ */
+static const struct {
+    const char *array;
+    const char *kind;
+} ndjson_records[] = {
+    { NULL,                 "device"            },
+    { "profiles",           "profile"           },
+    { "entrypoints",        "entrypoint"        },
+    { "surface_formats",    "surface_format"    },
+    { "filters",            "filter"            },
+    { "filter_chains",      "filter_chain"      },
+    { "context_sizes",      "context_size"      },
+    { "cost_model",         "cost_model"        },
+    { "format_filters",     "format_filter"     },
+    { "image_formats",      "image_format"      },
+    { "subpicture_formats", "subpicture_format" },
+    { "changes",            "change"            },
+};
+
+enum {
+    NDJSON_FLAT,
+    NDJSON_RECORD,
+    NDJSON_RECORD_ARRAY,
+    NDJSON_INLINE,
+};
+
+static const char *device_path;
+
+struct ndjson_frame {
+    int    type;
+    int    kind;
+    bool   array;
+    bool   first;
+    bool   emitted;
+    size_t fields_start;
+    size_t prefix_len;
+};
+
+static struct {
+    char  *fields;
+    size_t size;
+    size_t alloc;
+
+    // Dotted path of the enclosing flattened objects, grown as needed.
+    char  *prefix;
+    size_t prefix_len;
+    size_t prefix_alloc;
+
+    int depth;
+    struct ndjson_frame stack[64];
+} ndjson;
+
+static void ndjson_append(const char *str, size_t len)
+{
+    if (ndjson.size + len > ndjson.alloc) {
+        ndjson.alloc  = 2 * (ndjson.size + len);
+        ndjson.fields = realloc(ndjson.fields, ndjson.alloc);
+        if (!ndjson.fields)
+            die("Out of memory.\n");
+    }
+    memcpy(ndjson.fields + ndjson.size, str, len);
+    ndjson.size += len;
+}
+
+static void ndjson_puts(const char *str)
+{
+    ndjson_append(str, strlen(str));
+}
+
+static void ndjson_escaped(const char *str)
+{
+    const char *p;
+    char escape[8];
+    int len;
+
+    for (p = str; *p; p++) {
+        len = json_escape(*p, escape);
+        if (len)
+            ndjson_append(escape, len);
+        else
+            ndjson_append(p, 1);
+    }
+}
+
+static void ndjson_string(const char *str)
+{
+    ndjson_puts("\"");
+    ndjson_escaped(str);
+    ndjson_puts("\"");
+}
+
+static void ndjson_push(int type, int kind, bool array)
+{
+    if (ndjson.depth >= ARRAY_LENGTH(ndjson.stack))
+        die("Output nested too deeply.\n");
+    ndjson.stack[ndjson.depth++] = (struct ndjson_frame) {
+        .type         = type,
+        .kind         = kind,
+        .array        = array,
+        .first        = true,
+        .fields_start = ndjson.size,
+        .prefix_len   = ndjson.prefix_len,
+    };
+}
+
+static void ndjson_set_prefix(size_t length, const char *add)
+{
+    size_t len = add ? strlen(add) : 0;
+
+    if (length + len + 2 > ndjson.prefix_alloc) {
+        ndjson.prefix_alloc = 2 * (length + len + 2);
+        ndjson.prefix = realloc(ndjson.prefix, ndjson.prefix_alloc);
+        if (!ndjson.prefix)
+            die("Out of memory.\n");
+    }
+    ndjson.prefix_len = length;
+    if (add) {
+        memcpy(ndjson.prefix + length, add, len);
+        ndjson.prefix[length + len] = '.';
+        ndjson.prefix_len += len + 1;
+    }
+    ndjson.prefix[ndjson.prefix_len] = 0;
+}
+
+static bool ndjson_inline(void)
+{
+    return ndjson.depth > 0 &&
+        ndjson.stack[ndjson.depth - 1].type == NDJSON_INLINE;
+}
+
+static void ndjson_key(const char *tag)
+{
+    if (ndjson_inline()) {
+        struct ndjson_frame *top = &ndjson.stack[ndjson.depth - 1];
+        if (!top->first)
+            ndjson_puts(",");
+        top->first = false;
+        if (!top->array && tag) {
+            ndjson_string(tag);
+            ndjson_puts(":");
+        }
+    } else {
+        ndjson_puts("\"");
+        if (ndjson.prefix)
+            ndjson_escaped(ndjson.prefix);
+        if (tag)
+            ndjson_escaped(tag);
+        ndjson_puts("\":");
+    }
+}
+
+static void ndjson_value_end(void)
+{
+    if (!ndjson_inline())
+        ndjson_puts(",");
+}
+
+static void ndjson_emit(int kind)
+{
+    fprintf(out, "{\"record\":\"%s\"", ndjson_records[kind].kind);
+    if (ndjson.size > 0) {
+        // Drop the trailing comma.
+        putc(',', out);
+        fwrite(ndjson.fields, 1, ndjson.size - 1, out);
+    }
+    fputs("}\n", out);
+}
+
+static void ndjson_start_array(const char *tag)
+{
+    int i;
+
+    if (!ndjson_inline()) {
+        for (i = 1; i < ARRAY_LENGTH(ndjson_records); i++) {
+            if (tag && !strcmp(tag, ndjson_records[i].array))
+                break;
+        }
+        if (i < ARRAY_LENGTH(ndjson_records)) {
+            ndjson_push(NDJSON_RECORD_ARRAY, i, true);
+            return;
+        }
+    }
+
+    ndjson_key(tag);
+    ndjson_puts("[");
+    ndjson_push(NDJSON_INLINE, -1, true);
+}
+
+static void ndjson_end_array(void)
+{
+    if (ndjson.stack[--ndjson.depth].type == NDJSON_INLINE) {
+        ndjson_puts("]");
+        ndjson_value_end();
+    }
+}
+
+static void ndjson_start_object(const char *tag)
+{
+    if (ndjson.depth == 0) {
+        ndjson.size = 0;
+        ndjson_set_prefix(0, NULL);
+        ndjson_push(NDJSON_RECORD, 0, false);
+        if (device_path) {
+            ndjson_string("device");
+            ndjson_puts(":");
+            ndjson_string(device_path);
+            ndjson_puts(",");
+        }
+        return;
+    }
+
+    struct ndjson_frame *top = &ndjson.stack[ndjson.depth - 1];
+    if (top->type == NDJSON_INLINE) {
+        ndjson_key(tag);
+        ndjson_puts("{");
+        ndjson_push(NDJSON_INLINE, -1, false);
+    } else if (top->type == NDJSON_RECORD_ARRAY) {
+        int kind = top->kind;
+        ndjson_push(NDJSON_RECORD, kind, false);
+        ndjson_set_prefix(0, ndjson_records[kind].kind);
+    } else {
+        ndjson_push(NDJSON_FLAT, -1, false);
+        ndjson_set_prefix(ndjson.prefix_len, tag);
+    }
+}
+
+static void ndjson_end_object(void)
+{
+    struct ndjson_frame *top = &ndjson.stack[--ndjson.depth];
+    int i;
+
+    switch (top->type) {
+    case NDJSON_INLINE:
+        ndjson_puts("}");
+        ndjson_value_end();
+        break;
+    case NDJSON_RECORD:
+        if (!top->emitted)
+            ndjson_emit(top->kind);
+        ndjson.size = top->fields_start;
+        for (i = ndjson.depth - 1; i >= 0; i--) {
+            if (ndjson.stack[i].type == NDJSON_RECORD) {
+                ndjson.stack[i].emitted = true;
+                break;
+            }
+        }
+        // Fall through.
+    case NDJSON_FLAT:
+        ndjson_set_prefix(top->prefix_len, NULL);
+        break;
+    }
+}
+
+static void ndjson_print_boolean(const char *tag, bool value)
+{
+    ndjson_key(tag);
+    ndjson_puts(value ? "true" : "false");
+    ndjson_value_end();
+}
+
+static void ndjson_print_integer(const char *tag, int64_t value)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%"PRId64, value);
+    ndjson_key(tag);
+    ndjson_puts(buffer);
+    ndjson_value_end();
+}
+
+static void ndjson_print_double(const char *tag, double value)
+{
+    char buffer[32];
+    if (isfinite(value))
+        snprintf(buffer, sizeof(buffer), "%.9g", value);
+    else
+        snprintf(buffer, sizeof(buffer), "null");
+    ndjson_key(tag);
+    ndjson_puts(buffer);
+    ndjson_value_end();
+}
+
+static void ndjson_print_string(const char *tag, const char *value)
+{
+    ndjson_key(tag);
+    ndjson_string(value);
+    ndjson_value_end();
+}
+
+/*
+ * A tree built from the output calls, so that a probe can be captured
+ * once and then written out again (possibly in several formats) without
+ * going back to the driver.
+ */
+enum {
+    NODE_OBJECT,
+    NODE_ARRAY,
+    NODE_BOOLEAN,
+    NODE_INTEGER,
+    NODE_DOUBLE,
+    NODE_STRING,
+    NODE_NULL,
+};
+
+struct node {
+    int   type;
+    char *tag;
+    union {
+        bool     boolean;
+        int64_t  integer;
+        double   real;
+        char    *string;
+    };
+    int nb_children;
+    int alloc_children;
+    struct node *children;
+    // Canonical hash, filled in on first use by node_hash().
+    bool    hashed;
+    uint8_t hash[32];
+};
+
+static __thread struct tree_state {
+    struct node *root;
+    int depth;
+    struct node *stack[64];
+} tree;
+
+static struct node *tree_add(const char *tag, int type)
+{
+    struct node *node;
+
+    if (tree.depth == 0) {
+        node = tree.root = calloc(1, sizeof(*node));
+    } else {
+        struct node *parent = tree.stack[tree.depth - 1];
+        if (parent->nb_children >= parent->alloc_children) {
+            parent->alloc_children = 2 * parent->alloc_children + 4;
+            parent->children = realloc(parent->children,
+                                       parent->alloc_children *
+                                       sizeof(*parent->children));
+        }
+        node = &parent->children[parent->nb_children++];
+        memset(node, 0, sizeof(*node));
+    }
+
+    node->type = type;
+    node->tag  = tag ? strdup(tag) : NULL;
+    return node;
+}
+
+static void tree_start(const char *tag, int type)
+{
+    struct node *node = tree_add(tag, type);
+    if (tree.depth >= ARRAY_LENGTH(tree.stack))
+        die("Output nested too deeply.\n");
+    tree.stack[tree.depth++] = node;
+}
+
+static void tree_start_array(const char *tag)
+{
+    tree_start(tag, NODE_ARRAY);
+}
+
+static void tree_start_object(const char *tag)
+{
+    tree_start(tag, NODE_OBJECT);
+}
+
+static void tree_end(void)
+{
+    --tree.depth;
+}
+
+static void tree_print_boolean(const char *tag, bool value)
+{
+    tree_add(tag, NODE_BOOLEAN)->boolean = value;
+}
+
+static void tree_print_integer(const char *tag, int64_t value)
+{
+    tree_add(tag, NODE_INTEGER)->integer = value;
+}
+
+static void tree_print_double(const char *tag, double value)
+{
+    tree_add(tag, NODE_DOUBLE)->real = value;
+}
+
+static void tree_print_string(const char *tag, const char *value)
+{
+    tree_add(tag, NODE_STRING)->string = strdup(value);
+}
+
+// Takes everything written until capture_end() as a separate tree, even
+// if a tree is already being built.
+struct capture {
+    const struct output_format *output;
+    struct tree_state tree;
+};
+
+static const struct output_format tree_format;
+
+static void capture_begin(struct capture *capture)
+{
+    capture->output = output;
+    capture->tree   = tree;
+    memset(&tree, 0, sizeof(tree));
+    output = &tree_format;
+}
+
+static struct node *capture_end(struct capture *capture)
+{
+    struct node *root = tree.root;
+    tree   = capture->tree;
+    output = capture->output;
+    return root;
+}
+
+static void node_free(struct node *node)
+{
+    int i;
+    for (i = 0; i < node->nb_children; i++)
+        node_free(&node->children[i]);
+    free(node->children);
+    free(node->tag);
+    if (node->type == NODE_STRING)
+        free(node->string);
+}
+
+/*
+ * Strict RFC 8259 JSON parser, building the same tree as above.  Anything
+ * a conforming parser would reject is rejected here too: trailing commas,
+ * leading zeros, unescaped control characters, invalid escapes or UTF-8,
+ * and trailing garbage.
+ */
+struct json_parser {
+    const char *data;
+    const char *end;
+    const char *p;
+    int depth;
+    char error[128];
+};
+
+static bool json_fail(struct json_parser *jp, const char *message)
+{
+    if (!jp->error[0])
+        snprintf(jp->error, sizeof(jp->error), "%s at offset %zu",
+                 message, (size_t)(jp->p - jp->data));
+    return false;
+}
+
+static void json_skip_space(struct json_parser *jp)
+{
+    while (jp->p < jp->end && (*jp->p == ' '  || *jp->p == '\t' ||
+                               *jp->p == '\n' || *jp->p == '\r'))
+        ++jp->p;
+}
+
+static bool json_literal(struct json_parser *jp, const char *literal)
+{
+    size_t len = strlen(literal);
+    if (jp->end - jp->p < len || memcmp(jp->p, literal, len))
+        return json_fail(jp, "Invalid literal");
+    jp->p += len;
+    return true;
+}
+
+static int json_hex4(struct json_parser *jp)
+{
+    int i, value = 0;
+    if (jp->end - jp->p < 4)
+        return -1;
+    for (i = 0; i < 4; i++) {
+        char c = *jp->p++;
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return value;
+}
+
+static int utf8_encode(char *dst, uint32_t cp)
+{
+    if (cp < 0x80) {
+        dst[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        dst[0] = 0xc0 | cp >> 6;
+        dst[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        dst[0] = 0xe0 | cp >> 12;
+        dst[1] = 0x80 | (cp >> 6 & 0x3f);
+        dst[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    } else {
+        dst[0] = 0xf0 | cp >> 18;
+        dst[1] = 0x80 | (cp >> 12 & 0x3f);
+        dst[2] = 0x80 | (cp >> 6 & 0x3f);
+        dst[3] = 0x80 | (cp & 0x3f);
+        return 4;
+    }
+}
+
+// Length of the well-formed UTF-8 sequence at p, or zero.
+static int utf8_length(const unsigned char *p, const unsigned char *end)
+{
+    int len, i;
+    uint32_t cp;
+
+    if (p[0] < 0x80)
+        return 1;
+    else if ((p[0] & 0xe0) == 0xc0)
+        len = 2, cp = p[0] & 0x1f;
+    else if ((p[0] & 0xf0) == 0xe0)
+        len = 3, cp = p[0] & 0x0f;
+    else if ((p[0] & 0xf8) == 0xf0)
+        len = 4, cp = p[0] & 0x07;
+    else
+        return 0;
+
+    if (end - p < len)
+        return 0;
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        cp = cp << 6 | (p[i] & 0x3f);
+    }
+    // Reject overlong forms, surrogates and out-of-range values.
+    if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) ||
+        (len == 4 && cp < 0x10000) || cp > 0x10ffff ||
+        (cp >= 0xd800 && cp <= 0xdfff))
+        return 0;
+    return len;
+}
+
+static char *json_parse_string(struct json_parser *jp)
+{
+    const char *start;
+    char *str, *q;
+
+    if (jp->p >= jp->end || *jp->p != '"') {
+        json_fail(jp, "Expected string");
+        return NULL;
+    }
+    start = ++jp->p;
+
+    // The unescaped string is never longer than the escaped form, so find
+    // the end first and allocate once.
+    while (jp->p < jp->end && *jp->p != '"') {
+        if (*jp->p == '\\' && jp->p + 1 < jp->end)
+            ++jp->p;
+        ++jp->p;
+    }
+    if (jp->p >= jp->end) {
+        json_fail(jp, "Unterminated string");
+        return NULL;
+    }
+
+    str = q = malloc(jp->p - start + 1);
+    jp->p = start;
+    while (*jp->p != '"') {
+        unsigned char c = *jp->p;
+        if (c < 0x20) {
+            json_fail(jp, "Control character in string");
+            goto fail;
+        }
+        if (c != '\\') {
+            int len = utf8_length((const unsigned char*)jp->p,
+                                  (const unsigned char*)jp->end);
+            if (!len) {
+                json_fail(jp, "Invalid UTF-8 in string");
+                goto fail;
+            }
+            memcpy(q, jp->p, len);
+            q     += len;
+            jp->p += len;
+            continue;
+        }
+
+        ++jp->p;
+        switch (*jp->p++) {
+        case '"':  *q++ = '"';  break;
+        case '\\': *q++ = '\\'; break;
+        case '/':  *q++ = '/';  break;
+        case 'b':  *q++ = '\b'; break;
+        case 'f':  *q++ = '\f'; break;
+        case 'n':  *q++ = '\n'; break;
+        case 'r':  *q++ = '\r'; break;
+        case 't':  *q++ = '\t'; break;
+        case 'u':
+            {
+                int cp = json_hex4(jp);
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    int low = -1;
+                    if (jp->end - jp->p >= 2 &&
+                        jp->p[0] == '\\' && jp->p[1] == 'u') {
+                        jp->p += 2;
+                        low = json_hex4(jp);
+                    }
+                    if (low < 0xdc00 || low > 0xdfff) {
+                        json_fail(jp, "Invalid surrogate pair");
+                        goto fail;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                } else if (cp < 0 || (cp >= 0xdc00 && cp <= 0xdfff)) {
+                    json_fail(jp, "Invalid unicode escape");
+                    goto fail;
+                }
+                // A NUL would truncate the string, and nothing we write
+                // ever contains one.
+                if (cp == 0) {
+                    json_fail(jp, "NUL in string");
+                    goto fail;
+                }
+                q += utf8_encode(q, cp);
+            }
+            break;
+        default:
+            json_fail(jp, "Invalid escape");
+            goto fail;
+        }
+    }
+    ++jp->p;
+    *q = 0;
+    return str;
+
+fail:
+    free(str);
+    return NULL;
+}
+
+static bool json_parse_number(struct json_parser *jp, struct node *node)
+{
+    const char *start = jp->p;
+    bool integer = true;
+
+#define DIGITS() do { \
+        if (jp->p >= jp->end || *jp->p < '0' || *jp->p > '9') \
+            return json_fail(jp, "Invalid number"); \
+        while (jp->p < jp->end && *jp->p >= '0' && *jp->p <= '9') \
+            ++jp->p; \
+    } while (0)
+
+    if (jp->p < jp->end && *jp->p == '-')
+        ++jp->p;
+    if (jp->p < jp->end && *jp->p == '0')
+        ++jp->p;
+    else
+        DIGITS();
+    if (jp->p < jp->end && *jp->p == '.') {
+        ++jp->p;
+        DIGITS();
+        integer = false;
+    }
+    if (jp->p < jp->end && (*jp->p == 'e' || *jp->p == 'E')) {
+        ++jp->p;
+        if (jp->p < jp->end && (*jp->p == '+' || *jp->p == '-'))
+            ++jp->p;
+        DIGITS();
+        integer = false;
+    }
+#undef DIGITS
+
+    char buffer[64];
+    size_t len = jp->p - start;
+    if (len >= sizeof(buffer))
+        return json_fail(jp, "Number too long");
+    memcpy(buffer, start, len);
+    buffer[len] = 0;
+
+    if (integer) {
+        char *end;
+        errno = 0;
+        long long value = strtoll(buffer, &end, 10);
+        if (errno != ERANGE) {
+            node->type    = NODE_INTEGER;
+            node->integer = value;
+            return true;
+        }
+    }
+    node->type = NODE_DOUBLE;
+    node->real = strtod(buffer, NULL);
+    return true;
+}
+
+static bool json_parse_value(struct json_parser *jp, struct node *node);
+
+static struct node *json_add_child(struct node *parent)
+{
+    if (parent->nb_children >= parent->alloc_children) {
+        parent->alloc_children = 2 * parent->alloc_children + 4;
+        parent->children = realloc(parent->children,
+                                   parent->alloc_children *
+                                   sizeof(*parent->children));
+    }
+    struct node *child = &parent->children[parent->nb_children++];
+    memset(child, 0, sizeof(*child));
+    return child;
+}
+
+static bool json_parse_container(struct json_parser *jp, struct node *node,
+                                 bool object)
+{
+    char close = object ? '}' : ']';
+
+    if (++jp->depth > 256)
+        return json_fail(jp, "Nesting too deep");
+
+    node->type = object ? NODE_OBJECT : NODE_ARRAY;
+    ++jp->p;
+    json_skip_space(jp);
+    if (jp->p < jp->end && *jp->p == close) {
+        ++jp->p;
+        --jp->depth;
+        return true;
+    }
+
+    while (1) {
+        struct node *child = json_add_child(node);
+        if (object) {
+            child->tag = json_parse_string(jp);
+            if (!child->tag)
+                return false;
+            json_skip_space(jp);
+            if (jp->p >= jp->end || *jp->p++ != ':')
+                return json_fail(jp, "Expected ':'");
+            json_skip_space(jp);
+        }
+        if (!json_parse_value(jp, child))
+            return false;
+
+        json_skip_space(jp);
+        if (jp->p >= jp->end)
+            return json_fail(jp, "Unterminated container");
+        if (*jp->p == close) {
+            ++jp->p;
+            break;
+        }
+        if (*jp->p++ != ',')
+            return json_fail(jp, "Expected ',' or end of container");
+        json_skip_space(jp);
+    }
+
+    --jp->depth;
+    return true;
+}
+
+static bool json_parse_value(struct json_parser *jp, struct node *node)
+{
+    if (jp->p >= jp->end)
+        return json_fail(jp, "Expected value");
+
+    switch (*jp->p) {
+    case '{':
+        return json_parse_container(jp, node, true);
+    case '[':
+        return json_parse_container(jp, node, false);
+    case '"':
+        node->type   = NODE_STRING;
+        node->string = json_parse_string(jp);
+        return node->string != NULL;
+    case 't':
+        node->type    = NODE_BOOLEAN;
+        node->boolean = true;
+        return json_literal(jp, "true");
+    case 'f':
+        node->type    = NODE_BOOLEAN;
+        node->boolean = false;
+        return json_literal(jp, "false");
+    case 'n':
+        node->type = NODE_NULL;
+        return json_literal(jp, "null");
+    default:
+        return json_parse_number(jp, node);
+    }
+}
+
+/*
+ * Parses one JSON text from the start of data, returning the tree and
+ * setting *next to just after it (and any following whitespace), so that
+ * a sequence of texts as written for several devices can be read by
+ * calling this repeatedly.  Returns NULL and fills error on failure.
+ */
+static struct node *json_parse(const char *data, size_t size,
+                               const char **next,
+                               char *error, size_t error_size)
+{
+    struct json_parser jp = {
+        .data = data,
+        .end  = data + size,
+        .p    = data,
+    };
+    struct node *root = calloc(1, sizeof(*root));
+
+    json_skip_space(&jp);
+    if (json_parse_value(&jp, root)) {
+        json_skip_space(&jp);
+        // Only whitespace may separate texts, so each must be followed by
+        // the start of another container or the end of the data.
+        if (jp.p < jp.end && (!next || (*jp.p != '{' && *jp.p != '[')))
+            json_fail(&jp, "Trailing data after JSON text");
+    }
+
+    if (jp.error[0]) {
+        snprintf(error, error_size, "%s", jp.error);
+        node_free(root);
+        free(root);
+        return NULL;
+    }
+    if (next)
+        *next = jp.p;
+    return root;
+}
+
+static void openmetrics_end(void);
+static void openmetrics_finish(void);
+
+static const struct output_format output_formats[] = {
+    {
+        .name          = "json",
+        .start_array   = &json_start_array,
+        .end_array     = &json_end_array,
+        .start_object  = &json_start_object,
+        .end_object    = &json_end_object,
+        .print_boolean = &json_print_boolean,
+        .print_integer = &json_print_integer,
+        .print_double  = &json_print_double,
+        .print_string  = &json_print_string,
+    }, {
+        .name          = "cbor",
+        .start_array   = &binary_start_array,
+        .end_array     = &binary_end,
+        .start_object  = &binary_start_object,
+        .end_object    = &binary_end,
+        .print_boolean = &binary_print_boolean,
+        .print_integer = &binary_print_integer,
+        .print_double  = &binary_print_double,
+        .print_string  = &binary_print_string,
+        .encoding      = &cbor_encoding,
+    }, {
+        .name          = "msgpack",
+        .start_array   = &binary_start_array,
+        .end_array     = &binary_end,
+        .start_object  = &binary_start_object,
+        .end_object    = &binary_end,
+        .print_boolean = &binary_print_boolean,
+        .print_integer = &binary_print_integer,
+        .print_double  = &binary_print_double,
+        .print_string  = &binary_print_string,
+        .encoding      = &msgpack_encoding,
+    }, {
+        .name          = "ndjson",
+        .start_array   = &ndjson_start_array,
+        .end_array     = &ndjson_end_array,
+        .start_object  = &ndjson_start_object,
+        .end_object    = &ndjson_end_object,
+        .print_boolean = &ndjson_print_boolean,
+        .print_integer = &ndjson_print_integer,
+        .print_double  = &ndjson_print_double,
+        .print_string  = &ndjson_print_string,
+    }, {
+        .name          = "openmetrics",
+        .start_array   = &tree_start_array,
+        .end_array     = &openmetrics_end,
+        .start_object  = &tree_start_object,
+        .end_object    = &openmetrics_end,
+        .print_boolean = &tree_print_boolean,
+        .print_integer = &tree_print_integer,
+        .print_double  = &tree_print_double,
+        .print_string  = &tree_print_string,
+        .finish        = &openmetrics_finish,
+    },
+};
+
+static const struct output_format tree_format = {
+    .name          = "tree",
+    .start_array   = &tree_start_array,
+    .end_array     = &tree_end,
+    .start_object  = &tree_start_object,
+    .end_object    = &tree_end,
+    .print_boolean = &tree_print_boolean,
+    .print_integer = &tree_print_integer,
+    .print_double  = &tree_print_double,
+    .print_string  = &tree_print_string,
+};
+
+static void start_array(const char *tag)
+{
+    output->start_array(tag);
+}
+
+static void end_array(void)
+{
+    output->end_array();
+}
+
+static void start_object(const char *tag)
+{
+    output->start_object(tag);
+}
+
+static void end_object(void)
+{
+    output->end_object();
+}
+
+static void print_boolean(const char *tag, bool value)
+{
+    output->print_boolean(tag, value);
+}
+
+static void print_integer(const char *tag, int64_t value)
+{
+    output->print_integer(tag, value);
+}
+
+static void print_double(const char *tag, double value)
+{
+    output->print_double(tag, value);
+}
+
+static void print_string(const char *tag, const char *format, ...)
+{
+    char buffer[1024], *str = buffer;
+    va_list args, retry;
+    int len;
+
+    va_start(args, format);
+    va_copy(retry, args);
+    len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    // Longer strings (driver vendor strings, paths) go to the heap.
+    if (len >= (int)sizeof(buffer)) {
+        str = malloc(len + 1);
+        if (!str)
+            die("Out of memory.\n");
+        vsnprintf(str, len + 1, format, retry);
+    }
+    va_end(retry);
+
+    output->print_string(tag, str);
+    if (str != buffer)
+        free(str);
+}
+
+static void emit_node(const struct node *node);
+
+static void emit_node_as(const struct node *node, const char *tag)
+{
+    int i;
+    switch (node->type) {
+    case NODE_OBJECT:
+    case NODE_ARRAY:
+        if (node->type == NODE_OBJECT)
+            start_object(tag);
+        else
+            start_array(tag);
+        for (i = 0; i < node->nb_children; i++)
+            emit_node(&node->children[i]);
+        if (node->type == NODE_OBJECT)
+            end_object();
+        else
+            end_array();
+        break;
+    case NODE_BOOLEAN:
+        print_boolean(tag, node->boolean);
+        break;
+    case NODE_INTEGER:
+        print_integer(tag, node->integer);
+        break;
+    case NODE_DOUBLE:
+        print_double(tag, node->real);
+        break;
+    case NODE_STRING:
+        output->print_string(tag, node->string);
+        break;
+    case NODE_NULL:
+        // Only written for non-finite doubles, so one goes back out.
+        print_double(tag, NAN);
+        break;
+    }
+}
+
+static void emit_node(const struct node *node)
+{
+    emit_node_as(node, node->tag);
+}
+
+/*
+ * Deduplication of the attribute and surface format blocks.
+ *
+ * Each such subtree is captured as a tree, keyed by its compact JSON
+ * serialisation, and written only as a reference {"$ref": id} to an entry
+ * in a per-device table of unique subtrees, which is written at the end
+ * of the device as "shared".  A reference to an array is wrapped in a
+ * one-element array, so that each field keeps its JSON type.
+ */
+static bool dedup;
+
+struct dedup_entry {
+    uint64_t     hash;
+    char        *key;
+    size_t       key_size;
+    struct node *node;
+};
+
+static struct {
+    int nb_entries;
+    int alloc_entries;
+    struct dedup_entry *entries;
+
+    // Open-addressed on hash, holding index + 1 into entries.
+    unsigned int mask;
+    int *slots;
+
+    struct capture capture;
+
+    long   subtrees;
+    size_t expanded_bytes;
+    size_t deduplicated_bytes;
+} dedup_table;
+
+static uint64_t hash_bytes64(const char *data, size_t size)
+{
+    // FNV-1a.
+    uint64_t hash = UINT64_C(14695981039346656037);
+    size_t i;
+    for (i = 0; i < size; i++)
+        hash = (hash ^ (unsigned char)data[i]) * UINT64_C(1099511628211);
+    return hash;
+}
+
+// Compact JSON of a subtree, written without disturbing the state of any
+// document currently being written.
+static char *node_serialise(const struct node *node, size_t *size)
+{
+    const struct output_format *saved_output = output;
+    FILE *saved_out   = out;
+    bool saved_pretty = pretty_print;
+    bool saved_first  = json_first;
+    int  saved_depth  = indent_depth;
+    char *buffer = NULL;
+
+    out = open_memstream(&buffer, size);
+    if (!out)
+        die("Failed to open memory stream: %m.\n");
+    output       = &output_formats[0];
+    pretty_print = false;
+    indent_depth = 0;
+
+    emit_node_as(node, NULL);
+    fclose(out);
+
+    output       = saved_output;
+    out          = saved_out;
+    pretty_print = saved_pretty;
+    json_first   = saved_first;
+    indent_depth = saved_depth;
+    return buffer;
+}
+
+static void dedup_reset(void)
+{
+    int i;
+    for (i = 0; i < dedup_table.nb_entries; i++) {
+        free(dedup_table.entries[i].key);
+        node_free(dedup_table.entries[i].node);
+        free(dedup_table.entries[i].node);
+    }
+    dedup_table.nb_entries = 0;
+    if (dedup_table.slots)
+        memset(dedup_table.slots, 0,
+               (dedup_table.mask + 1) * sizeof(*dedup_table.slots));
+
+    dedup_table.subtrees           = 0;
+    dedup_table.expanded_bytes     = 0;
+    dedup_table.deduplicated_bytes = 0;
+}
+
+static void dedup_rehash(void)
+{
+    unsigned int size = 2 * (dedup_table.mask + 1);
+    int i;
+
+    if (size < 64)
+        size = 64;
+    free(dedup_table.slots);
+    dedup_table.slots = calloc(size, sizeof(*dedup_table.slots));
+    dedup_table.mask  = size - 1;
+
+    for (i = 0; i < dedup_table.nb_entries; i++) {
+        unsigned int slot = dedup_table.entries[i].hash & dedup_table.mask;
+        while (dedup_table.slots[slot])
+            slot = (slot + 1) & dedup_table.mask;
+        dedup_table.slots[slot] = i + 1;
+    }
+}
+
+// Takes ownership of node, returning the id of the matching entry.
+static int dedup_insert(struct node *node)
+{
+    size_t size;
+    char *key = node_serialise(node, &size);
+    uint64_t hash = hash_bytes64(key, size);
+    unsigned int slot;
+    int id;
+
+    if (2 * (dedup_table.nb_entries + 1) > dedup_table.mask + 1)
+        dedup_rehash();
+
+    ++dedup_table.subtrees;
+    dedup_table.expanded_bytes += size;
+
+    for (slot = hash & dedup_table.mask; dedup_table.slots[slot];
+         slot = (slot + 1) & dedup_table.mask) {
+        struct dedup_entry *entry =
+            &dedup_table.entries[dedup_table.slots[slot] - 1];
+        if (entry->hash == hash && entry->key_size == size &&
+            !memcmp(entry->key, key, size)) {
+            free(key);
+            node_free(node);
+            free(node);
+            return dedup_table.slots[slot] - 1;
+        }
+    }
+
+    if (dedup_table.nb_entries >= dedup_table.alloc_entries) {
+        dedup_table.alloc_entries = 2 * dedup_table.alloc_entries + 16;
+        dedup_table.entries = realloc(dedup_table.entries,
+                                      dedup_table.alloc_entries *
+                                      sizeof(*dedup_table.entries));
+    }
+    id = dedup_table.nb_entries++;
+    dedup_table.entries[id] = (struct dedup_entry) {
+        .hash     = hash,
+        .key      = key,
+        .key_size = size,
+        .node     = node,
+    };
+    dedup_table.slots[slot] = id + 1;
+    dedup_table.deduplicated_bytes += size;
+    return id;
+}
+
+// Everything written between dedup_begin() and dedup_end() must be a
+// single tagged value, which is replaced by a reference.
+static void dedup_begin(void)
+{
+    if (!dedup)
+        return;
+    capture_begin(&dedup_table.capture);
+}
+
+static void dedup_end(void)
+{
+    if (!dedup)
+        return;
+
+    struct node *node = capture_end(&dedup_table.capture);
+    char *tag = node->tag;
+    node->tag = NULL;
+
+    bool is_array = node->type == NODE_ARRAY;
+    int id = dedup_insert(node);
+
+    if (is_array)
+        start_array(tag);
+    start_object(is_array ? NULL : tag);
+    print_integer("$ref", id);
+    end_object();
+    if (is_array)
+        end_array();
+    free(tag);
+
+    // {"$ref":N} or [{"$ref":N}] in compact JSON.
+    dedup_table.deduplicated_bytes += 9 + 2 * is_array +
+                                      snprintf(NULL, 0, "%d", id);
+}
+
+static void dedup_write_table(void)
+{
+    int i;
+
+    if (!dedup)
+        return;
+
+    start_array("shared");
+    for (i = 0; i < dedup_table.nb_entries; i++)
+        emit_node(dedup_table.entries[i].node);
+    end_array();
+
+    start_object("deduplication");
+    print_integer("subtrees",           dedup_table.subtrees);
+    print_integer("unique_subtrees",    dedup_table.nb_entries);
+    print_integer("expanded_bytes",     dedup_table.expanded_bytes);
+    print_integer("deduplicated_bytes", dedup_table.deduplicated_bytes);
+    print_double("ratio", dedup_table.deduplicated_bytes ?
+                 (double)dedup_table.expanded_bytes /
+                 dedup_table.deduplicated_bytes : 1.0);
+    end_object();
+
+    dedup_reset();
+}
+
+/*
+ * Writes a deduplicated dump back out in full, replacing each reference
+ * with the shared subtree it names.
+ */
+static bool is_reference(const struct node *node)
+{
+    return node->type == NODE_OBJECT && node->nb_children == 1 &&
+           node->children[0].type == NODE_INTEGER &&
+           node->children[0].tag && !strcmp(node->children[0].tag, "$ref");
+}
+
+static void expand_node(const struct node *node, const char *tag,
+                        const struct node *shared)
+{
+    int i;
+
+    if (node->type == NODE_ARRAY && node->nb_children == 1 &&
+        is_reference(&node->children[0]))
+        node = &node->children[0];
+    if (is_reference(node)) {
+        int64_t id = node->children[0].integer;
+        if (!shared || id < 0 || id >= shared->nb_children)
+            die("Invalid reference %"PRId64".\n", id);
+        expand_node(&shared->children[id], tag, NULL);
+        return;
+    }
+
+    if (node->type != NODE_OBJECT && node->type != NODE_ARRAY) {
+        emit_node_as(node, tag);
+        return;
+    }
+
+    if (node->type == NODE_OBJECT)
+        start_object(tag);
+    else
+        start_array(tag);
+    for (i = 0; i < node->nb_children; i++)
+        expand_node(&node->children[i], node->children[i].tag, shared);
+    if (node->type == NODE_OBJECT)
+        end_object();
+    else
+        end_array();
+}
+
+enum {
+    EP_ATTRIBUTES = 1,
+    EP_SURFACES   = 2,
+    EP_FILTERS    = 4,
+};
+
+/*
+ * Names come from va_names.h, which is generated from the libva headers;
+ * these add what the headers cannot say, indexed by value.
+ */
+static const struct entrypoint_info {
+    const char *description;
+    int flags;
+} entrypoints[] = {
+#define E(name, desc, flags) [VAEntrypoint ## name] = { desc, flags }
+    E(VLD,        "Decode Slice",             EP_ATTRIBUTES | EP_SURFACES),
+    E(IZZ,        "(Legacy) ZigZag Scan",     EP_ATTRIBUTES),
+    E(IDCT,       "(Legacy) Inverse DCT",     EP_ATTRIBUTES),
+    E(MoComp,     "(Legacy) Motion Compensation",
+                                              EP_ATTRIBUTES),
+    E(Deblocking, "(Legacy) Deblocking",      EP_ATTRIBUTES),
+    E(EncSlice,   "Encode Slice",             EP_ATTRIBUTES | EP_SURFACES),
+    E(EncPicture, "Encode Picture",           EP_ATTRIBUTES | EP_SURFACES),
+#if LIBVA(1, 7, 1)
+    E(EncSliceLP, "Encode Slice (Low Power)", EP_ATTRIBUTES | EP_SURFACES),
+#endif
+    E(VideoProc,  "Video Processing",
+                                 EP_FILTERS | EP_ATTRIBUTES | EP_SURFACES),
+#if LIBVA(2, 0, 0)
+    E(FEI,        "Flexible Encode",          EP_ATTRIBUTES | EP_SURFACES),
+#endif
+#if LIBVA(2, 1, 0)
+    E(Stats,      "Stats",                    EP_ATTRIBUTES),
+#endif
+#if LIBVA(2, 11, 0)
+    E(ProtectedTEEComm, "Communicate with Trusted Execution Environment",
+                                              EP_ATTRIBUTES),
+    E(ProtectedContent, "Decrypt Protected Content",
+                                              EP_ATTRIBUTES),
+#endif
+#undef E
+};
+
+static const char *const profile_descriptions[] = {
+#define P(name, desc) [VAProfile ## name - VAProfileNone] = desc
+    P(None,                "Video Processing"),
+    P(MPEG2Simple,         "MPEG-2 Simple Profile"),
+    P(MPEG2Main,           "MPEG-2 Main Profile"),
+    P(MPEG4Simple,         "MPEG-4 part 2 Simple Profile"),
+    P(MPEG4AdvancedSimple, "MPEG-4 part 2 Advanced Simple Profile"),
+    P(MPEG4Main,           "MPEG-4 part 2 Main Profile"),
+    P(H264Baseline,        "H.264 / MPEG-4 part 10 (AVC) Baseline Profile"),
+    P(H264Main,            "H.264 / MPEG-4 part 10 (AVC) Main Profile"),
+    P(H264High,            "H.264 / MPEG-4 part 10 (AVC) High Profile"),
+    P(VC1Simple,           "VC-1 / SMPTE 421M / WMV 9 / WMV3 Simple Profile"),
+    P(VC1Main,             "VC-1 / SMPTE 421M / WMV 9 / WMV3 Main Profile"),
+    P(VC1Advanced,         "VC-1 / SMPTE 421M / WMV 9 / WMV3 Advanced Profile"),
+    P(H263Baseline,        "H.263"),
+    P(JPEGBaseline,        "JPEG"),
+    P(H264ConstrainedBaseline,
+      "H.264 / MPEG-4 part 10 (AVC) Constrained Baseline Profile"),
+#if LIBVA(1, 3, 0)
+    P(VP8Version0_3,       "VP8 profile versions 0-3"),
+#endif
+#if LIBVA(1, 4, 0)
+    P(H264MultiviewHigh,   "H.264 / MPEG-4 part 10 (AVC) Multiview High Profile"),
+    P(H264StereoHigh,      "H.264 / MPEG-4 part 10 (AVC) Stereo High Profile"),
+#endif
+#if LIBVA(1, 5, 0)
+    P(HEVCMain,            "H.265 / MPEG-H part 2 (HEVC) Main Profile"),
+    P(HEVCMain10,          "H.265 / MPEG-H part 2 (HEVC) Main 10 Profile"),
+#endif
+#if LIBVA(1, 6, 0)
+    P(VP9Profile0,         "VP9 profile 0"),
+#endif
+#if LIBVA(1, 7, 0)
+    P(VP9Profile1,         "VP9 profile 1"),
+    P(VP9Profile2,         "VP9 profile 2"),
+    P(VP9Profile3,         "VP9 profile 3"),
+#endif
+#if LIBVA(2, 2, 0)
+    P(HEVCMain12,          "H.265 / MPEG-H part 2 (HEVC) RExt Main 12 Profile"),
+    P(HEVCMain422_10,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:2:2 10 Profile"),
+    P(HEVCMain422_12,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:2:2 12 Profile"),
+    P(HEVCMain444,         "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:4:4 Profile"),
+    P(HEVCMain444_10,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:4:4 10 Profile"),
+    P(HEVCMain444_12,      "H.265 / MPEG-H part 2 (HEVC) RExt Main 4:4:4 12 Profile"),
+    P(HEVCSccMain,         "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main Profile"),
+    P(HEVCSccMain10,       "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main 10 Profile"),
+    P(HEVCSccMain444,      "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main 4:4:4 Profile"),
+#endif
+#if LIBVA(2, 7, 0)
+    P(AV1Profile0,         "AV1 Main Profile"),
+    P(AV1Profile1,         "AV1 High Profile"),
+#endif
+#if LIBVA(2, 8, 0)
+    P(HEVCSccMain444_10,   "H.265 / MPEG-H part 2 (HEVC) SCC Screen-Extended Main 4:4:4 10 Profile"),
+#endif
+#undef P
+};
+
+// Not generated: the scaling and interpolation modes are fields of several
+// bits rather than flags.
+static const struct {
+    uint32_t flag;
+    const char *name;
+} proc_filter_flags[] = {
+#define F(name) { VA_ ## name, #name }
+    F(PROC_FILTER_MANDATORY),
+    F(FRAME_PICTURE),
+    F(TOP_FIELD),
+    F(BOTTOM_FIELD),
+    F(SRC_BT601),
+    F(SRC_BT709),
+    F(SRC_SMPTE_240),
+    F(FILTER_SCALING_DEFAULT),
+    F(FILTER_SCALING_FAST),
+    F(FILTER_SCALING_HQ),
+    F(FILTER_SCALING_NL_ANAMORPHIC),
+#if LIBVA(2, 9, 0)
+    F(FILTER_INTERPOLATION_NEAREST_NEIGHBOR),
+    F(FILTER_INTERPOLATION_BILINEAR),
+    F(FILTER_INTERPOLATION_ADVANCED),
+#endif
+#undef F
+};
+
+static const struct entrypoint_info *entrypoint_info(VAEntrypoint entrypoint)
+{
+    if (entrypoint < 0 || entrypoint >= ARRAY_LENGTH(entrypoints) ||
+        !entrypoints[entrypoint].description)
+        return NULL;
+    return &entrypoints[entrypoint];
+}
+
+static const char *profile_description(VAProfile profile)
+{
+    long i = (long)profile - VAProfileNone;
+    if (i < 0 || i >= ARRAY_LENGTH(profile_descriptions))
+        return NULL;
+    return profile_descriptions[i];
+}
+
+// Names of the set bits in flags, lowest first, from a table indexed by
+// bit number.
+static void print_flag_names(const char *const *names, uint32_t flags)
+{
+    for (; flags; flags &= flags - 1) {
+        const char *name = names[__builtin_ctz(flags)];
+        if (name)
+            print_string(NULL, "%s", name);
+    }
+}
+
+#if LIBVA(2, 12, 0)
+static const char *const feature_values[] = {
+    [VA_FEATURE_NOT_SUPPORTED] = "not_supported",
+    [VA_FEATURE_SUPPORTED]     = "supported",
+    [VA_FEATURE_REQUIRED]      = "required",
+    [3]                        = "undefined",
+};
+#endif
+
+static void dump_config_attributes(VADisplay display,
+                                   VAProfile profile, VAEntrypoint entrypoint,
+                                   unsigned int *rt_formats)
+{
+    VAConfigAttrib attr_list[VAConfigAttribTypeMax];
+    int i;
+    for (i = 0; i < VAConfigAttribTypeMax; i++)
+        attr_list[i].type = i;
+
+    VAStatus vas = vaGetConfigAttributes(display, profile, entrypoint,
+                                         attr_list, VAConfigAttribTypeMax);
+    CHECK_VAS("Unable to get config attributes");
+
+    for (i = 0; i < VAConfigAttribTypeMax; i++) {
+        uint32_t value = attr_list[i].value;
+        if (value == VA_ATTRIB_NOT_SUPPORTED)
+            continue;
+
+#define AF(var, field) do { \
+            print_string(#field, feature_values[var.bits.field]); \
+        } while (0)
+
+        switch(attr_list[i].type) {
+        case VAConfigAttribRTFormat:
+            {
+                *rt_formats = value;
+
+                start_array("rt_formats");
+                print_flag_names(va_rt_format_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribRateControl:
+            {
+                start_array("rate_control_modes");
+                print_flag_names(va_rate_control_names, value);
+                end_array();
+            }
+            break;
+#if LIBVA(1, 6, 0)
+        case VAConfigAttribDecSliceMode:
+            {
+                start_array("decode_slice_modes");
+                print_flag_names(va_dec_slice_mode_names, value);
+                end_array();
+            }
+            break;
+#endif
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribDecJPEG:
+            {
+                VAConfigAttribValDecJPEG jpeg = { .value = value };
+                int j;
+                start_object("decode_jpeg");
+                start_array("rotation");
+                for (j = 0; j < ARRAY_LENGTH(va_rotation_names); j++) {
+                    if (va_rotation_names[j] && jpeg.bits.rotation & 1 << j)
+                        print_string(NULL, "%s", va_rotation_names[j]);
+                }
+                end_array();
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribDecProcessing:
+            {
+                print_boolean("decode_processing",
+                              value == VA_DEC_PROCESSING);
+            }
+            break;
+#endif
+        case VAConfigAttribEncPackedHeaders:
+            {
+                start_array("packed_headers");
+                print_flag_names(va_packed_header_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribEncInterlaced:
+            {
+                start_array("interlace_modes");
+                print_flag_names(va_interlaced_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribEncMaxRefFrames:
+            {
+                start_object("max_ref_frames");
                 print_integer("list0", value & 0xffff);
                 if (value >> 16)
                     print_integer("list1", value >> 16);
                 end_object();
             }
-            break;
-        case VAConfigAttribEncMaxSlices:
-            {
-                print_integer("max_slices", value);
-            }
-            break;
-        case VAConfigAttribEncSliceStructure:
-            {
-                start_array("slice_structure_modes");
-                AV(ENC_SLICE_STRUCTURE, ARBITRARY_ROWS);
-                AV(ENC_SLICE_STRUCTURE, POWER_OF_TWO_ROWS);
-                AV(ENC_SLICE_STRUCTURE, ARBITRARY_MACROBLOCKS);
-#if LIBVA(2, 0, 0)
-                AV(ENC_SLICE_STRUCTURE, EQUAL_ROWS);
-                AV(ENC_SLICE_STRUCTURE, MAX_SLICE_SIZE);
-#endif
-#if LIBVA(2, 8, 0)
-                AV(ENC_SLICE_STRUCTURE, EQUAL_MULTI_ROWS);
+            break;
+        case VAConfigAttribEncMaxSlices:
+            {
+                print_integer("max_slices", value);
+            }
+            break;
+        case VAConfigAttribEncSliceStructure:
+            {
+                start_array("slice_structure_modes");
+                print_flag_names(va_slice_structure_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribEncMacroblockInfo:
+            {
+                print_integer("macroblock_info", value);
+            }
+            break;
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribMaxPictureWidth:
+            {
+                print_integer("max_picture_width", value);
+            }
+            break;
+        case VAConfigAttribMaxPictureHeight:
+            {
+                print_integer("max_picture_height", value);
+            }
+            break;
+#endif
+#if LIBVA(1, 5, 0)
+        case VAConfigAttribEncJPEG:
+            {
+                VAConfigAttribValEncJPEG jpeg = { .value = value };
+                start_object("encode_jpeg");
+#define JA(name) do { print_integer(#name, jpeg.bits.name); } while (0)
+                JA(arithmatic_coding_mode);
+                JA(progressive_dct_mode);
+                JA(non_interleaved_mode);
+                JA(differential_mode);
+                JA(max_num_components);
+                JA(max_num_scans);
+                JA(max_num_huffman_tables);
+                JA(max_num_quantization_tables);
+#undef JA
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(1, 4, 0)
+        case VAConfigAttribEncQualityRange:
+            {
+                print_integer("quality_range", value);
+            }
+            break;
+#endif
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribEncQuantization:
+            {
+                start_array("quantization");
+                print_flag_names(va_quantization_names, value);
+                end_array();
+            }
+            break;
+#endif
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribEncIntraRefresh:
+            {
+                start_array("intra_refresh");
+                print_flag_names(va_intra_refresh_names, value);
+                end_array();
+            }
+            break;
+#endif
+#if LIBVA(1, 6, 0)
+        case VAConfigAttribEncSkipFrame:
+            {
+                print_integer("skip_frame", value);
+            }
+            break;
+#endif
+#if LIBVA(1, 7, 1)
+        case VAConfigAttribEncROI:
+            {
+                VAConfigAttribValEncROI roi = { .value = value };
+                start_object("roi");
+                print_integer("num_regions", roi.bits.num_roi_regions);
+                print_integer("rc_priority_support",
+                              roi.bits.roi_rc_priority_support);
+#if LIBVA(2, 0, 0)
+                print_integer("rc_qp_delta_support",
+                              roi.bits.roi_rc_qp_delta_support);
+#endif
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(1, 7, 3)
+        case VAConfigAttribEncRateControlExt:
+            {
+                VAConfigAttribValEncRateControlExt rce = { .value = value };
+                start_object("rate_control_ext");
+                print_integer("max_num_temporal_layers_minus1",
+                              rce.bits.max_num_temporal_layers_minus1);
+                print_integer("temporal_layer_bitrate_control_flag",
+                              rce.bits.temporal_layer_bitrate_control_flag);
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribProcessingRate:
+            {
+                start_array("processing_rate");
+                print_flag_names(va_processing_rate_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribEncDirtyRect:
+            {
+                print_boolean("encode_dirty_rectangle", value);
+            }
+            break;
+        case VAConfigAttribEncParallelRateControl:
+            {
+                print_integer("encode_parallel_rate_control_layers", value);
+            }
+            break;
+        case VAConfigAttribEncDynamicScaling:
+            {
+                print_boolean("encode_dynamic_scaling", value);
+            }
+            break;
+        case VAConfigAttribFrameSizeToleranceSupport:
+            {
+                print_boolean("encode_frame_size_tolerance", value);
+            }
+            break;
+#endif
+#if LIBVA(2, 0, 0)
+        case VAConfigAttribFEIFunctionType:
+            {
+                start_array("fei_function_type");
+                print_flag_names(va_fei_function_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribFEIMVPredictors:
+            {
+                print_integer("fei_mv_predictors", value);
+            }
+            break;
+#endif
+#if LIBVA(2, 1, 0)
+        case VAConfigAttribStats:
+            {
+                VAConfigAttribValStats stats = { .value = value };
+                start_object("stats");
+#define SA(name) do { print_integer(#name, stats.bits.name); } while (0)
+                SA(max_num_past_references);
+                SA(max_num_future_references);
+                SA(num_outputs);
+                SA(interlaced);
+#undef SA
+                end_object();
+            }
+            break;
+        case VAConfigAttribEncTileSupport:
+            {
+                print_boolean("encode_tile_support", value);
+            }
+            break;
+        case VAConfigAttribCustomRoundingControl:
+            {
+                print_boolean("custom_rounding_control", value);
+            }
+            break;
+        case VAConfigAttribQPBlockSize:
+            {
+                print_integer("qp_block_size", value);
+            }
+            break;
+#endif
+#if LIBVA(2, 5, 0)
+        case VAConfigAttribMaxFrameSize:
+            {
+                VAConfigAttribValMaxFrameSize mfs = { .value = value };
+                start_object("max_frame_size");
+                print_boolean("max_frame_size", mfs.bits.max_frame_size);
+                print_boolean("multiple_pass",  mfs.bits.multiple_pass);
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(2, 6, 0)
+        case VAConfigAttribPredictionDirection:
+            {
+                start_array("prediction_direction");
+                print_flag_names(va_prediction_direction_names, value);
+                end_array();
+            }
+            break;
+        case VAConfigAttribMultipleFrame:
+            {
+                VAConfigAttribValMultipleFrame mf = { .value = value };
+                start_object("multiple_frame");
+                print_integer("max_num_concurrent_frames",
+                              mf.bits.max_num_concurrent_frames);
+                print_boolean("mixed_quality_level",
+                              mf.bits.mixed_quality_level);
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(2, 9, 0)
+        case VAConfigAttribContextPriority:
+            {
+                VAConfigAttribValContextPriority cp = { .value = value };
+                start_object("context_priority");
+                print_integer("priority", cp.bits.priority);
+                end_object();
+            }
+            break;
+#endif
+#if LIBVA(2, 11, 0)
+        case VAConfigAttribDecAV1Features:
+            {
+                VAConfigAttribValDecAV1Features daf = { .value = value };
+                start_object("dec_av1_features");
+                print_boolean("lst_support", daf.bits.lst_support);
+                end_object();
+            }
+            break;
+        case VAConfigAttribTEEType:
+            {
+                print_integer("tee_type", value);
+            }
+            break;
+        case VAConfigAttribTEETypeClient:
+            {
+                print_integer("tee_type_client", value);
+            }
+            break;
+        case VAConfigAttribProtectedContentCipherAlgorithm:
+            {
+                print_integer("protected_content_cipher_algorithm", value);
+            }
+            break;
+        case VAConfigAttribProtectedContentCipherBlockSize:
+            {
+                print_integer("protected_content_cipher_block_size", value);
+            }
+            break;
+        case VAConfigAttribProtectedContentCipherMode:
+            {
+                print_integer("protected_content_cipher_mode", value);
+            }
+            break;
+        case VAConfigAttribProtectedContentCipherSampleType:
+            {
+                print_integer("protected_content_cipher_sample_type", value);
+            }
+            break;
+        case VAConfigAttribProtectedContentUsage:
+            {
+                print_integer("protected_content_usage", value);
+            }
+            break;
+#endif
+#if LIBVA(2, 12, 0)
+        case VAConfigAttribEncHEVCFeatures:
+            {
+                VAConfigAttribValEncHEVCFeatures ehf = { .value = value };
+                start_object("enc_hevc_features");
+                AF(ehf, separate_colour_planes);
+                AF(ehf, scaling_lists);
+                AF(ehf, amp);
+                AF(ehf, sao);
+                AF(ehf, pcm);
+                AF(ehf, temporal_mvp);
+                AF(ehf, strong_intra_smoothing);
+                AF(ehf, dependent_slices);
+                AF(ehf, sign_data_hiding);
+                AF(ehf, constrained_intra_pred);
+                AF(ehf, transform_skip);
+                AF(ehf, cu_qp_delta);
+                AF(ehf, weighted_prediction);
+                AF(ehf, transquant_bypass);
+                AF(ehf, deblocking_filter_disable);
+                end_object();
+            }
+            break;
+        case VAConfigAttribEncHEVCBlockSizes:
+            {
+                VAConfigAttribValEncHEVCBlockSizes ehbs = { .value = value };
+                start_object("enc_hevc_block_sizes");
+#define BS(name) do { print_integer(#name, ehbs.bits.name); } while (0)
+                BS(log2_max_coding_tree_block_size_minus3);
+                BS(log2_min_coding_tree_block_size_minus3);
+                BS(log2_min_luma_coding_block_size_minus3);
+                BS(log2_max_luma_transform_block_size_minus2);
+                BS(log2_min_luma_transform_block_size_minus2);
+                BS(max_max_transform_hierarchy_depth_inter);
+                BS(min_max_transform_hierarchy_depth_inter);
+                BS(max_max_transform_hierarchy_depth_intra);
+                BS(min_max_transform_hierarchy_depth_intra);
+                BS(log2_max_pcm_coding_block_size_minus3);
+                BS(log2_min_pcm_coding_block_size_minus3);
+#undef BS
+                end_object();
+            }
+            break;
+#endif
+        default:
+            {
+                start_object("unknown");
+                print_integer("type", attr_list[i].type);
+                print_integer("value", value);
+                end_object();
+            }
+            break;
+        }
+    }
+}
+
+static void dump_surface_attributes(VADisplay display,
+                                    VAProfile profile, VAEntrypoint entrypoint,
+                                    unsigned int rt_formats)
+{
+    unsigned int rt_format;
+    for (rt_format = 1; rt_format; rt_format <<= 1) {
+        if (!(rt_format & rt_formats))
+            continue;
+
+        VAConfigAttrib attr_rt_format = {
+            .type  = VAConfigAttribRTFormat,
+            .value = rt_format,
+        };
+
+        VAConfigID config;
+        VAStatus vas = vaCreateConfig(display, profile, entrypoint,
+                                      &attr_rt_format, 1, &config);
+        CHECK_VAS("Unable to create config to test surface attributes");
+
+        VASurfaceAttrib *attr_list;
+        unsigned int attr_count;
+
+        vas = vaQuerySurfaceAttributes(display, config, 0, &attr_count);
+        CHECK_VAS("Unable to query surface attributes");
+
+        attr_list = calloc(attr_count, sizeof(*attr_list));
+
+        vas = vaQuerySurfaceAttributes(display, config,
+                                       attr_list, &attr_count);
+        CHECK_VAS("Unable to query surface attributes");
+
+        start_object(NULL);
+
+        const char *rt_format_name = NULL;
+        unsigned int bits;
+        for (bits = rt_format; bits && !rt_format_name; bits &= bits - 1)
+            rt_format_name = va_rt_format_names[__builtin_ctz(bits)];
+        print_string("rt_format", "%s",
+                     rt_format_name ? rt_format_name : "unknown");
+
+        int i;
+
+        bool has_formats = false;
+
+        for (i = 0; i < attr_count; i++) {
+            switch (attr_list[i].type) {
+            case VASurfaceAttribPixelFormat:
+                has_formats = true;
+                break;
+            case VASurfaceAttribMinWidth:
+                print_integer("min_width", attr_list[i].value.value.i);
+                break;
+            case VASurfaceAttribMaxWidth:
+                print_integer("max_width", attr_list[i].value.value.i);
+                break;
+            case VASurfaceAttribMinHeight:
+                print_integer("min_height", attr_list[i].value.value.i);
+                break;
+            case VASurfaceAttribMaxHeight:
+                print_integer("max_height", attr_list[i].value.value.i);
+                break;
+            case VASurfaceAttribMemoryType:
+                {
+                    start_array("memory_types");
+                    print_flag_names(va_mem_type_names, attr_list[i].value.value.i);
+                    end_array();
+                }
+                break;
+            case VASurfaceAttribExternalBufferDescriptor:
+                // Ignored (write-only).
+                break;
+#if LIBVA(1, 4, 0)
+            case VASurfaceAttribUsageHint:
+                {
+                    start_array("usage_hints");
+                    print_flag_names(va_usage_hint_names, attr_list[i].value.value.i);
+                    end_array();
+                }
+                break;
+#endif
+#if LIBVA(2, 12, 0)
+            case VASurfaceAttribDRMFormatModifiers:
+                {
+                    const VADRMFormatModifierList *fml =
+                        attr_list[i].value.value.p;
+                    start_array("drm_format_modifiers");
+                    for (int j = 0; j < fml->num_modifiers; j++)
+                        print_integer(NULL, fml->modifiers[j]);
+                    end_array();
+                }
+                break;
+#endif
+            default:
+                {
+                    start_object("unknown");
+                    print_integer("type", attr_list[i].type);
+                    print_integer("value", attr_list[i].value.value.i);
+                    end_object();
+                }
+                break;
+            }
+        }
+
+        if (has_formats) {
+            start_array("pixel_formats");
+
+            for (i = 0; i < attr_count; i++) {
+                if (attr_list[i].type != VASurfaceAttribPixelFormat)
+                    continue;
+
+                print_string(NULL, "%.4s", &attr_list[i].value.value.i);
+            }
+
+            end_array();
+        }
+
+        end_object();
+
+        free(attr_list);
+    }
+}
+
+static void dump_colour_standards(VAProcColorStandardType *types, int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        const char *name = va_colour_standard_name(types[i]);
+
+        start_object(NULL);
+
+        print_integer("type", types[i]);
+        print_string("name", "%s", name ? name : "unknown");
+
+        end_object();
+    }
+}
+
+static void dump_filter_caps(VADisplay display, VAContextID context,
+                             VAProcFilterType filter)
+{
+    VAStatus vas;
+    int j;
+
+    switch (filter) {
+    case VAProcFilterDeinterlacing:
+        {
+            VAProcFilterCapDeinterlacing deint[VAProcDeinterlacingCount];
+            unsigned int deint_count = ARRAY_LENGTH(deint);
+            memset(&deint, 0, sizeof(deint));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterDeinterlacing,
+                                             &deint, &deint_count);
+            CHECK_VAS("Failed to query deinterlacing caps");
+
+            start_array("types");
+
+            for (j = 0; j < deint_count; j++) {
+                const char *name = va_deinterlacer_name(deint[j].type);
+
+                start_object(NULL);
+
+                print_integer("type", deint[j].type);
+                if (name)
+                    print_string("name", "%s", name);
+
+                end_object();
+            }
+
+            end_array();
+        }
+        break;
+    case VAProcFilterColorBalance:
+        {
+            VAProcFilterCapColorBalance colour[VAProcColorBalanceCount];
+            unsigned int colour_count = ARRAY_LENGTH(colour);
+            memset(&colour, 0, sizeof(colour));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterColorBalance,
+                                             &colour, &colour_count);
+            CHECK_VAS("Failed to query colour balance caps");
+
+            start_array("types");
+
+            for (j = 0; j < colour_count; j++) {
+                const char *name = va_colour_balance_name(colour[j].type);
+
+                start_object(NULL);
+
+                print_integer("type", colour[j].type);
+                if (name)
+                    print_string("name", "%s", name);
+
+                print_double("min_value",     colour[j].range.min_value);
+                print_double("max_value",     colour[j].range.max_value);
+                print_double("default_value", colour[j].range.default_value);
+                print_double("step",          colour[j].range.step);
+
+                end_object();
+            }
+
+            end_array();
+        }
+        break;
+#if LIBVA(2, 1, 0)
+    case VAProcFilterTotalColorCorrection:
+        {
+            VAProcFilterCapTotalColorCorrection
+                colour[VAProcTotalColorCorrectionCount];
+            unsigned int colour_count = ARRAY_LENGTH(colour);
+            memset(&colour, 0, sizeof(colour));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterTotalColorCorrection,
+                                             &colour, &colour_count);
+            CHECK_VAS("Failed to query total colour correction caps");
+
+            start_array("types");
+
+            for (j = 0; j < colour_count; j++) {
+                const char *name =
+                    va_total_colour_correction_name(colour[j].type);
+
+                start_object(NULL);
+
+                print_integer("type", colour[j].type);
+                if (name)
+                    print_string("name", "%s", name);
+
+                print_double("min_value",     colour[j].range.min_value);
+                print_double("max_value",     colour[j].range.max_value);
+                print_double("default_value", colour[j].range.default_value);
+                print_double("step",          colour[j].range.step);
+
+                end_object();
+            }
+
+            end_array();
+        }
+        break;
+#endif
+#if LIBVA(2, 3, 0)
+    case VAProcFilterHVSNoiseReduction:
+        {
+            // No caps (querying default caps isn't allowed either).
+        }
+        break;
+#endif
+#if LIBVA(2, 4, 0)
+    case VAProcFilterHighDynamicRangeToneMapping:
+        {
+            VAProcFilterCapHighDynamicRange
+                hdr[VAProcHighDynamicRangeMetadataTypeCount];
+            unsigned int hdr_count = ARRAY_LENGTH(hdr);
+            memset(&hdr, 0, sizeof(hdr));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterHighDynamicRangeToneMapping,
+                                             &hdr, &hdr_count);
+            CHECK_VAS("Failed to query HDR tone mapping caps");
+
+            start_array("types");
+
+            for (j = 0; j < hdr_count; j++) {
+                const char *name = va_hdr_metadata_name(hdr[j].metadata_type);
+
+                start_object(NULL);
+
+                print_integer("type", hdr[j].metadata_type);
+                if (name)
+                    print_string("name", "%s", name);
+
+                start_array("tone_mapping");
+                print_flag_names(va_tone_mapping_names, hdr[j].caps_flag);
+                end_array();
+
+                end_object();
+            }
+
+            end_array();
+        }
+        break;
 #endif
+#if LIBVA(2, 12, 0)
+    case VAProcFilter3DLUT:
+        {
+            // No bound on number of LUT types, just ask for a lot of them.
+            VAProcFilterCap3DLUT lut[16];
+            unsigned int lut_count = ARRAY_LENGTH(lut);
+            memset(&lut, 0, sizeof(lut));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilter3DLUT,
+                                             &lut, &lut_count);
+            CHECK_VAS("Failed to query 3D LUT caps");
+
+            start_array("types");
+
+            for (j = 0; j < lut_count; j++) {
+                int k;
+                start_object(NULL);
+                print_integer("lut_size", lut[j].lut_size);
+                start_array("lut_stride");
+                for (k = 0; k < 3; k++)
+                    print_integer(NULL, lut[j].lut_stride[k]);
                 end_array();
+                print_integer("bit_depth", lut[j].bit_depth);
+                print_integer("num_channel", lut[j].num_channel);
+                start_array("channel_mapping");
+                print_flag_names(va_tdlut_channel_names,
+                                 lut[j].channel_mapping);
+                end_array();
+                end_object();
             }
-            break;
-        case VAConfigAttribEncMacroblockInfo:
-            {
-                print_integer("macroblock_info", value);
+
+            end_array();
+        }
+        break;
+#endif
+    default:
+        {
+            VAProcFilterCap cap;
+            unsigned int cap_count = 1;
+            memset(&cap, 0, sizeof(cap));
+
+            vas = vaQueryVideoProcFilterCaps(display, context, filter,
+                                             &cap, &cap_count);
+            CHECK_VAS("Failed to query filter caps");
+
+            if (cap_count > 0) {
+                print_double("min_value",     cap.range.min_value);
+                print_double("max_value",     cap.range.max_value);
+                print_double("default_value", cap.range.default_value);
+                print_double("step",          cap.range.step);
             }
-            break;
+        }
+    }
+}
+
+static void print_pipeline_caps(const VAProcPipelineCaps *caps)
+{
+    const VAProcPipelineCaps pipeline = *caps;
+    int i;
+
+    start_object("pipeline");
+
+    start_array("pipeline_flags");
+    print_flag_names(va_proc_pipeline_names, pipeline.pipeline_flags);
+    end_array();
+    start_array("filter_flags");
+    for (i = 0; i < ARRAY_LENGTH(proc_filter_flags); i++) {
+        if (pipeline.filter_flags & proc_filter_flags[i].flag)
+            print_string(NULL, proc_filter_flags[i].name);
+    }
+    end_array();
+
+    print_integer("num_forward_references",  pipeline.num_forward_references);
+    print_integer("num_backward_references", pipeline.num_backward_references);
+
+    start_array("input_colour_standards");
+    dump_colour_standards(pipeline.input_color_standards,
+                          pipeline.num_input_color_standards);
+    end_array();
+
+    start_array("output_colour_standards");
+    dump_colour_standards(pipeline.output_color_standards,
+                          pipeline.num_output_color_standards);
+    end_array();
+
 #if LIBVA(2, 1, 0)
-        case VAConfigAttribMaxPictureWidth:
-            {
-                print_integer("max_picture_width", value);
-            }
-            break;
-        case VAConfigAttribMaxPictureHeight:
-            {
-                print_integer("max_picture_height", value);
-            }
-            break;
+    start_array("rotation_flags");
+    for (i = 0; i < ARRAY_LENGTH(va_rotation_names) && i < 32; i++) {
+        if (va_rotation_names[i] && pipeline.rotation_flags & 1u << i)
+            print_string(NULL, "%s", va_rotation_names[i]);
+    }
+    end_array();
+
+    start_array("blend_flags");
+    for (i = 0; i < ARRAY_LENGTH(va_blend_names) && i < 32; i++) {
+        if (va_blend_names[i] && pipeline.blend_flags & 1u << i)
+            print_string(NULL, "%s", va_blend_names[i]);
+    }
+    end_array();
+
+    start_array("mirror_flags");
+    for (i = 0; i < ARRAY_LENGTH(va_mirror_names) && i < 32; i++) {
+        if (va_mirror_names[i] && pipeline.mirror_flags & 1u << i)
+            print_string(NULL, "%s", va_mirror_names[i]);
+    }
+    end_array();
+
+    print_integer("num_additional_outputs", pipeline.num_additional_outputs);
+
+    start_array("input_pixel_formats");
+    for (i = 0; i < pipeline.num_input_pixel_formats; i++)
+        print_string(NULL, "%.4s", pipeline.input_pixel_format[i]);
+    end_array();
+
+    start_array("output_pixel_formats");
+    for (i = 0; i < pipeline.num_output_pixel_formats; i++)
+        print_string(NULL, "%.4s", pipeline.output_pixel_format[i]);
+    end_array();
+
+#define ATTR(name) do { print_integer(#name, pipeline.name); } while (0)
+    ATTR(max_input_width);
+    ATTR(max_input_height);
+    ATTR(min_input_width);
+    ATTR(min_input_height);
+
+    ATTR(max_output_width);
+    ATTR(max_output_height);
+    ATTR(min_output_width);
+    ATTR(min_output_height);
+#undef ATTR
 #endif
-#if LIBVA(1, 5, 0)
-        case VAConfigAttribEncJPEG:
-            {
-                VAConfigAttribValEncJPEG jpeg = { .value = value };
-                start_object("encode_jpeg");
-#define JA(name) do { print_integer(#name, jpeg.bits.name); } while (0)
-                JA(arithmatic_coding_mode);
-                JA(progressive_dct_mode);
-                JA(non_interleaved_mode);
-                JA(differential_mode);
-                JA(max_num_components);
-                JA(max_num_scans);
-                JA(max_num_huffman_tables);
-                JA(max_num_quantization_tables);
-#undef JA
-                end_object();
+
+    end_object();
+}
+
+static void dump_pipeline_caps(VADisplay display, VAContextID context,
+                               VABufferID *filter_buffers,
+                               int nb_filter_buffers)
+{
+    VAStatus vas;
+
+    VAProcPipelineCaps pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+
+    vas = vaQueryVideoProcPipelineCaps(display, context,
+                                       filter_buffers, nb_filter_buffers,
+                                       &pipeline);
+    CHECK_VAS("Failed to query pipeline caps");
+
+    print_pipeline_caps(&pipeline);
+}
+
+// Makes a parameter buffer for the filter with its default settings.  The
+// buffer is left as VA_INVALID_ID if the filter caps give nothing to use.
+static void create_filter_buffer(VADisplay display, VAContextID context,
+                                 VAProcFilterType filter,
+                                 VABufferID *buffer)
+{
+    VABufferID filter_buffer = VA_INVALID_ID;
+    VAStatus vas;
+    int i;
+
+    *buffer = VA_INVALID_ID;
+
+    switch (filter) {
+    case VAProcFilterNone:
+        break;
+    case VAProcFilterDeinterlacing:
+        {
+            VAProcFilterCapDeinterlacing deint[VAProcDeinterlacingCount];
+            unsigned int deint_count = ARRAY_LENGTH(deint);
+            memset(&deint, 0, sizeof(deint));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterDeinterlacing,
+                                             &deint, &deint_count);
+            CHECK_VAS("Failed to query deinterlacing caps");
+
+            // Choose the highest value to query.
+            int deint_type = VAProcDeinterlacingNone;
+            for (i = 0; i < deint_count; i++) {
+                if (deint[i].type > deint_type)
+                    deint_type = deint[i].type;
             }
-            break;
-#endif
-#if LIBVA(1, 4, 0)
-        case VAConfigAttribEncQualityRange:
-            {
-                print_integer("quality_range", value);
+
+            if (deint_type != VAProcDeinterlacingNone) {
+                VAProcFilterParameterBufferDeinterlacing param = {
+                    .type      = filter,
+                    .algorithm = deint_type,
+                    .flags     = 0,
+                };
+                vas = vaCreateBuffer(display, context,
+                                     VAProcFilterParameterBufferType,
+                                     sizeof(param), 1,
+                                     &param, &filter_buffer);
+                CHECK_VAS("Failed to create deinterlacing parameter buffer");
+            }
+        }
+        break;
+    case VAProcFilterColorBalance:
+        {
+            VAProcFilterCapColorBalance colour[VAProcColorBalanceCount];
+            unsigned int colour_count = ARRAY_LENGTH(colour);
+            memset(&colour, 0, sizeof(colour));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterColorBalance,
+                                             &colour, &colour_count);
+            CHECK_VAS("Failed to query colour balance caps");
+
+            if (colour_count > 0) {
+                VAProcFilterParameterBufferColorBalance
+                    param[VAProcColorBalanceCount];
+                for (i = 0; i < colour_count; i++) {
+                    param[i] = (VAProcFilterParameterBufferColorBalance) {
+                        .type   = filter,
+                        .attrib = colour[i].type,
+                        .value  = colour[i].range.default_value,
+                    };
+                }
+                vas = vaCreateBuffer(display, context,
+                                     VAProcFilterParameterBufferType,
+                                     colour_count * sizeof(param), 1,
+                                     &param, &filter_buffer);
+                CHECK_VAS("Failed to create colour balance parameter buffer");
             }
-            break;
-#endif
+        }
+        break;
 #if LIBVA(2, 1, 0)
-        case VAConfigAttribEncQuantization:
-            {
-                start_array("quantization");
-                AV(ENC_QUANTIZATION, TRELLIS_SUPPORTED);
-                end_object();
+    case VAProcFilterTotalColorCorrection:
+        {
+            VAProcFilterCapTotalColorCorrection
+                colour[VAProcTotalColorCorrectionCount];
+            unsigned int colour_count = ARRAY_LENGTH(colour);
+            memset(&colour, 0, sizeof(colour));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterTotalColorCorrection,
+                                             &colour, &colour_count);
+            CHECK_VAS("Failed to query total colour correction caps");
+
+            if (colour_count > 0) {
+                VAProcFilterParameterBufferTotalColorCorrection
+                    param[VAProcTotalColorCorrectionCount];
+                for (i = 0; i < colour_count; i++) {
+                    param[i] = (VAProcFilterParameterBufferTotalColorCorrection) {
+                        .type   = filter,
+                        .attrib = colour[i].type,
+                        .value  = colour[i].range.default_value,
+                    };
+                }
+                vas = vaCreateBuffer(display, context,
+                                     VAProcFilterParameterBufferType,
+                                     colour_count * sizeof(param), 1,
+                                     &param, &filter_buffer);
+                CHECK_VAS("Failed to create colour correction parameter buffer");
             }
-            break;
+        }
+        break;
 #endif
-#if LIBVA(2, 1, 0)
-        case VAConfigAttribEncIntraRefresh:
-            {
-                start_array("intra_refresh");
-                AV(ENC_INTRA_REFRESH, ROLLING_COLUMN);
-                AV(ENC_INTRA_REFRESH, ROLLING_ROW);
-                AV(ENC_INTRA_REFRESH, ADAPTIVE);
-                AV(ENC_INTRA_REFRESH, CYCLIC);
-                AV(ENC_INTRA_REFRESH, P_FRAME);
-                AV(ENC_INTRA_REFRESH, B_FRAME);
-                AV(ENC_INTRA_REFRESH, MULTI_REF);
-                end_object();
-            }
-            break;
+#if LIBVA(2, 3, 0)
+    case  VAProcFilterHVSNoiseReduction:
+        {
+            VAProcFilterParameterBufferHVSNoiseReduction param = {
+                .type     = filter,
+                .qp       = 26,
+                .strength = 10,
+            };
+            vas = vaCreateBuffer(display, context,
+                                 VAProcFilterParameterBufferType,
+                                 sizeof(param), 1,
+                                 &param, &filter_buffer);
+            CHECK_VAS("Failed to create HVS NR parameter buffer");
+        }
+        break;
 #endif
-#if LIBVA(1, 6, 0)
-        case VAConfigAttribEncSkipFrame:
-            {
-                print_integer("skip_frame", value);
+#if LIBVA(2, 4, 0)
+    case VAProcFilterHighDynamicRangeToneMapping:
+        {
+            VAProcFilterCapHighDynamicRange
+                hdr[VAProcHighDynamicRangeMetadataTypeCount];
+            unsigned int hdr_count = ARRAY_LENGTH(hdr);
+            memset(&hdr, 0, sizeof(hdr));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilterHighDynamicRangeToneMapping,
+                                             &hdr, &hdr_count);
+            CHECK_VAS("Failed to query HDR tone mapping caps");
+
+            if (hdr_count > 0 &&
+                hdr[0].metadata_type == VAProcHighDynamicRangeMetadataHDR10) {
+                VAHdrMetaDataHDR10 hdr10 = {
+                    .display_primaries_x = { 13245,  7500, 34000 },
+                    .display_primaries_y = { 34500,  3000, 16000 },
+                    .white_point_x = 15635,
+                    .white_point_y = 15635,
+                    .max_display_mastering_luminance = 10000000,
+                    .min_display_mastering_luminance = 10,
+                };
+                VAProcFilterParameterBufferHDRToneMapping param = {
+                    .type = filter,
+                    .data = {
+                        .metadata_type = VAProcHighDynamicRangeMetadataHDR10,
+                        .metadata      = &hdr10,
+                        .metadata_size = sizeof(hdr10),
+                    },
+                };
+                vas = vaCreateBuffer(display, context,
+                                     VAProcFilterParameterBufferType,
+                                     sizeof(param), 1,
+                                     &param, &filter_buffer);
+                CHECK_VAS("Failed to create HDR tone mapping parameter buffer");
             }
-            break;
-#endif
-#if LIBVA(1, 7, 1)
-        case VAConfigAttribEncROI:
-            {
-                VAConfigAttribValEncROI roi = { .value = value };
-                start_object("roi");
-                print_integer("num_regions", roi.bits.num_roi_regions);
-                print_integer("rc_priority_support",
-                              roi.bits.roi_rc_priority_support);
-#if LIBVA(2, 0, 0)
-                print_integer("rc_qp_delta_support",
-                              roi.bits.roi_rc_qp_delta_support);
+        }
+        break;
 #endif
-                end_object();
+#if LIBVA(2, 12, 0)
+    case VAProcFilter3DLUT:
+        {
+            VAProcFilterCap3DLUT lut[16];
+            unsigned int lut_count = ARRAY_LENGTH(lut);
+            memset(&lut, 0, sizeof(lut));
+
+            vas = vaQueryVideoProcFilterCaps(display, context,
+                                             VAProcFilter3DLUT,
+                                             &lut, &lut_count);
+            CHECK_VAS("Failed to query 3D LUT caps");
+
+            if (lut_count > 0) {
+                VAProcFilterParameterBuffer3DLUT param = {
+                    .type = filter,
+                    .lut_surface     = VA_INVALID_ID,
+                    .lut_size        = lut[0].lut_size,
+                    .lut_stride[0]   = lut[0].lut_stride[0],
+                    .lut_stride[1]   = lut[0].lut_stride[1],
+                    .lut_stride[2]   = lut[0].lut_stride[2],
+                    .bit_depth       = lut[0].bit_depth,
+                    .num_channel     = lut[0].num_channel,
+                    .channel_mapping = 1 << (ffs(lut[0].channel_mapping) - 1),
+                };
+                vas = vaCreateBuffer(display, context,
+                                     VAProcFilterParameterBufferType,
+                                     sizeof(param), 1,
+                                     &param, &filter_buffer);
+                CHECK_VAS("Failed to create 3D LUT parameter buffer");
             }
-            break;
+        }
+        break;
 #endif
-#if LIBVA(1, 7, 3)
-        case VAConfigAttribEncRateControlExt:
-            {
-                VAConfigAttribValEncRateControlExt rce = { .value = value };
-                start_object("rate_control_ext");
-                print_integer("max_num_temporal_layers_minus1",
-                              rce.bits.max_num_temporal_layers_minus1);
-                print_integer("temporal_layer_bitrate_control_flag",
-                              rce.bits.temporal_layer_bitrate_control_flag);
-                end_object();
+    default:
+        {
+            VAProcFilterCap cap;
+            unsigned int cap_count = 1;
+            memset(&cap, 0, sizeof(cap));
+
+            vas = vaQueryVideoProcFilterCaps(display, context, filter,
+                                             &cap, &cap_count);
+            CHECK_VAS("Failed to query filter caps");
+
+            if (cap_count > 0) {
+                VAProcFilterParameterBuffer param = {
+                    .type  = filter,
+                    .value = cap.range.default_value,
+                };
+                vas = vaCreateBuffer(display, context,
+                                     VAProcFilterParameterBufferType,
+                                     sizeof(param), 1,
+                                     &param, &filter_buffer);
+                CHECK_VAS("Failed to create filter parameter buffer");
             }
+        }
+    }
+
+    *buffer = filter_buffer;
+}
+
+static void dump_filter_pipelines(VADisplay display, VAContextID context,
+                                  VAProcFilterType filter)
+{
+    VABufferID filter_buffer;
+
+    create_filter_buffer(display, context, filter, &filter_buffer);
+
+    if (filter_buffer == VA_INVALID_ID) {
+        if (filter == VAProcFilterNone) {
+            dump_pipeline_caps(display, context, NULL, 0);
+        } else {
+            // Broken filter caps.
+        }
+    } else {
+        dump_pipeline_caps(display, context, &filter_buffer, 1);
+        vaDestroyBuffer(display, filter_buffer);
+    }
+}
+
+/*
+ * Filter chains (--filter-chains).
+ *
+ * Drivers need not support every combination of the filters they list, so
+ * the pipeline caps are also queried for sets of several filters.  A set
+ * is queried once, in canonical (sorted) order, and sets are taken
+ * smallest first: one containing a set which has already failed is not
+ * tried, so only the smallest failing chains are reported.  The sets of
+ * each size are shared out between workers, each with its own context
+ * and filter buffers on the same config.
+ */
+#define CHAIN_MAX_FILTERS 16
+#define CHAIN_MAX_WORKERS 64
+
+enum {
+    CHAIN_UNTRIED,
+    CHAIN_PRUNED,
+    CHAIN_FAILED,
+    CHAIN_SUPPORTED,
+};
+
+struct chain_result {
+    int status;
+    VAProcPipelineCaps caps;
+};
+
+struct chain_worker {
+    struct chain_probe *probe;
+    VAContextID context;
+    VABufferID buffers[CHAIN_MAX_FILTERS];
+    pthread_t thread;
+};
+
+struct chain_probe {
+    VADisplay display;
+    int nb_filters;
+    VAProcFilterType filters[CHAIN_MAX_FILTERS];
+
+    // Indexed by the set of filters, as a mask over filters[].
+    struct chain_result *results;
+
+    // The sets to query at the current size.
+    uint32_t *level;
+    size_t nb_level;
+    size_t next;
+};
+
+// Zero if not asked for.
+static int filter_chain_workers;
+
+static void *chain_worker_run(void *arg)
+{
+    struct chain_worker *worker = arg;
+    struct chain_probe *probe = worker->probe;
+    VABufferID buffers[CHAIN_MAX_FILTERS];
+
+    while (1) {
+        size_t i = __atomic_fetch_add(&probe->next, 1, __ATOMIC_RELAXED);
+        if (i >= probe->nb_level)
             break;
-#endif
-#if LIBVA(2, 1, 0)
-        case VAConfigAttribProcessingRate:
-            {
-                start_array("processing_rate");
-                AV(PROCESSING_RATE, ENCODE);
-                AV(PROCESSING_RATE, DECODE);
-                end_array();
-            }
+
+        uint32_t set = probe->level[i];
+        struct chain_result *result = &probe->results[set];
+        int j, nb_buffers = 0;
+
+        for (j = 0; j < probe->nb_filters; j++) {
+            if (set & 1 << j)
+                buffers[nb_buffers++] = worker->buffers[j];
+        }
+
+        memset(&result->caps, 0, sizeof(result->caps));
+        VAStatus vas = vaQueryVideoProcPipelineCaps(probe->display,
+                                                    worker->context,
+                                                    buffers, nb_buffers,
+                                                    &result->caps);
+        result->status = vas == VA_STATUS_SUCCESS ? CHAIN_SUPPORTED
+                                                  : CHAIN_FAILED;
+    }
+    return NULL;
+}
+
+// Whether any chain of one filter fewer has not worked.
+static bool chain_has_failed_subset(const struct chain_probe *probe,
+                                    uint32_t set)
+{
+    int i;
+    for (i = 0; i < probe->nb_filters; i++) {
+        if ((set & 1 << i) &&
+            probe->results[set & ~(1 << i)].status != CHAIN_SUPPORTED)
+            return true;
+    }
+    return false;
+}
+
+static int compare_filters(const void *a, const void *b)
+{
+    VAProcFilterType fa = *(const VAProcFilterType*)a;
+    VAProcFilterType fb = *(const VAProcFilterType*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static void print_filter_chain(const struct chain_probe *probe, uint32_t set)
+{
+    char chain[256];
+    size_t len = 0;
+    int i;
+
+    chain[0] = 0;
+    for (i = 0; i < probe->nb_filters; i++) {
+        if (!(set & 1 << i))
+            continue;
+        const char *name = va_filter_name(probe->filters[i]);
+        if (name)
+            len += snprintf(chain + len, sizeof(chain) - len, "%s%s",
+                            len ? "+" : "", name);
+        else
+            len += snprintf(chain + len, sizeof(chain) - len, "%s%d",
+                            len ? "+" : "", probe->filters[i]);
+        if (len >= sizeof(chain))
+            break;
+    }
+
+    start_object(NULL);
+    print_string("chain", "%s", chain);
+    print_integer("length", __builtin_popcount(set));
+    if (probe->results[set].status == CHAIN_SUPPORTED)
+        print_pipeline_caps(&probe->results[set].caps);
+    else
+        print_boolean("supported", false);
+    end_object();
+}
+
+static void dump_filter_chains(VADisplay display, VAConfigID config,
+                               VAContextID context,
+                               const VAProcFilterType *filter_list,
+                               unsigned int filter_count)
+{
+    struct chain_probe probe = { .display = display };
+    struct chain_worker workers[CHAIN_MAX_WORKERS];
+    VAProcFilterType sorted[VAProcFilterCount];
+    int nb_workers, nb_sorted = 0;
+    int i, j, size;
+    uint32_t set;
+
+    for (i = 0; i < filter_count && i < ARRAY_LENGTH(sorted); i++) {
+        if (filter_list[i] != VAProcFilterNone)
+            sorted[nb_sorted++] = filter_list[i];
+    }
+    qsort(sorted, nb_sorted, sizeof(*sorted), &compare_filters);
+
+    // Filters whose parameters can't be made are left out, as they are
+    // in the single-filter pipelines.
+    workers[0] = (struct chain_worker) { .probe = &probe, .context = context };
+    for (i = 0; i < nb_sorted; i++) {
+        if (i > 0 && sorted[i] == sorted[i - 1])
+            continue;
+        if (probe.nb_filters >= CHAIN_MAX_FILTERS)
             break;
-        case VAConfigAttribEncDirtyRect:
-            {
-                print_boolean("encode_dirty_rectangle", value);
-            }
+        create_filter_buffer(display, context, sorted[i],
+                             &workers[0].buffers[probe.nb_filters]);
+        if (workers[0].buffers[probe.nb_filters] != VA_INVALID_ID)
+            probe.filters[probe.nb_filters++] = sorted[i];
+    }
+    if (probe.nb_filters < 2)
+        goto done_buffers;
+
+    // Calls can only go on a tape in order.
+    nb_workers = tape.mode == TAPE_OFF ? filter_chain_workers : 1;
+    if (nb_workers > CHAIN_MAX_WORKERS)
+        nb_workers = CHAIN_MAX_WORKERS;
+
+    for (i = 1; i < nb_workers; i++) {
+        struct chain_worker *worker = &workers[i];
+        VAStatus vas;
+
+        *worker = (struct chain_worker) { .probe = &probe };
+        vas = vaCreateContext(display, config, 1280, 720, 0,
+                              NULL, 0, &worker->context);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-        case VAConfigAttribEncParallelRateControl:
-            {
-                print_integer("encode_parallel_rate_control_layers", value);
-            }
+        for (j = 0; j < probe.nb_filters; j++) {
+            create_filter_buffer(display, worker->context, probe.filters[j],
+                                 &worker->buffers[j]);
+            if (worker->buffers[j] == VA_INVALID_ID)
+                break;
+        }
+        if (j < probe.nb_filters) {
+            while (j-- > 0)
+                vaDestroyBuffer(display, worker->buffers[j]);
+            vaDestroyContext(display, worker->context);
             break;
-        case VAConfigAttribEncDynamicScaling:
-            {
-                print_boolean("encode_dynamic_scaling", value);
-            }
+        }
+    }
+    nb_workers = i;
+
+    probe.results = calloc((size_t)1 << probe.nb_filters,
+                           sizeof(*probe.results));
+    probe.level   = calloc((size_t)1 << probe.nb_filters,
+                           sizeof(*probe.level));
+    if (!probe.results || !probe.level)
+        die("Failed to allocate filter chain results.\n");
+
+    for (size = 1; size <= probe.nb_filters; size++) {
+        probe.nb_level = 0;
+        probe.next     = 0;
+
+        for (set = 1; set < (uint32_t)1 << probe.nb_filters; set++) {
+            if (__builtin_popcount(set) != size)
+                continue;
+            if (size > 1 && chain_has_failed_subset(&probe, set))
+                probe.results[set].status = CHAIN_PRUNED;
+            else
+                probe.level[probe.nb_level++] = set;
+        }
+        if (probe.nb_level == 0)
             break;
-        case VAConfigAttribFrameSizeToleranceSupport:
-            {
-                print_boolean("encode_frame_size_tolerance", value);
-            }
+
+        for (i = 1; i < nb_workers; i++) {
+            if (pthread_create(&workers[i].thread, NULL,
+                               &chain_worker_run, &workers[i]))
+                die("Failed to start filter chain worker.\n");
+        }
+        chain_worker_run(&workers[0]);
+        for (i = 1; i < nb_workers; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    start_array("filter_chains");
+    for (size = 2; size <= probe.nb_filters; size++) {
+        for (set = 1; set < (uint32_t)1 << probe.nb_filters; set++) {
+            if (__builtin_popcount(set) == size &&
+                (probe.results[set].status == CHAIN_SUPPORTED ||
+                 probe.results[set].status == CHAIN_FAILED))
+                print_filter_chain(&probe, set);
+        }
+    }
+    end_array();
+
+    free(probe.results);
+    free(probe.level);
+
+    for (i = 1; i < nb_workers; i++) {
+        for (j = 0; j < probe.nb_filters; j++)
+            vaDestroyBuffer(display, workers[i].buffers[j]);
+        vaDestroyContext(display, workers[i].context);
+    }
+done_buffers:
+    for (i = 0; i < probe.nb_filters; i++)
+        vaDestroyBuffer(display, workers[0].buffers[i]);
+}
+
+// The size of the context filters are probed with; others can be added
+// with --context-sizes.
+#define FILTER_CONTEXT_WIDTH  1280
+#define FILTER_CONTEXT_HEIGHT 720
+#define MAX_CONTEXT_SIZES     16
+
+static const char *const default_context_sizes =
+    "640x480,1920x1080,3840x2160,7680x4320";
+
+static struct {
+    int width;
+    int height;
+} context_sizes[MAX_CONTEXT_SIZES];
+static int nb_context_sizes;
+
+static void parse_context_sizes(const char *list)
+{
+    const char *p = list;
+    int width, height, len;
+
+    nb_context_sizes = 0;
+    while (*p) {
+        if (sscanf(p, "%dx%d%n", &width, &height, &len) != 2 ||
+            width < 1 || height < 1 || (p[len] && p[len] != ','))
+            die("Invalid context sizes %s.\n", list);
+        if (nb_context_sizes >= MAX_CONTEXT_SIZES)
+            die("Too many context sizes.\n");
+        context_sizes[nb_context_sizes].width  = width;
+        context_sizes[nb_context_sizes].height = height;
+        ++nb_context_sizes;
+        p += len;
+        if (*p)
+            ++p;
+    }
+}
+
+static int diff_subtrees(const struct node *a, const struct node *b);
+static void node_hash(const struct node *node, uint8_t hash[32]);
+
+// Writes the filters array for the context, returning the number of
+// filters or -1 if they could not be queried.
+static int dump_filter_list(VADisplay display, VAContextID context,
+                            VAProcFilterType *filter_list)
+{
+    VAStatus vas;
+    int i;
+
+    unsigned int filter_count = VAProcFilterCount;
+    vas = vaQueryVideoProcFilters(display, context,
+                                  filter_list, &filter_count);
+    if (vas != VA_STATUS_SUCCESS) {
+        error_vas(vas, "Failed to query filters");
+        return -1;
+    }
+
+    start_array("filters");
+
+    for (i = -1; i < (int)filter_count; i++) {
+        VAProcFilterType filter;
+        if (i == -1)
+            filter = VAProcFilterNone;
+        else
+            filter = filter_list[i];
+
+        const char *name = va_filter_name(filter);
+
+        start_object(NULL);
+
+        print_integer("filter", filter);
+        if (name)
+            print_string("name", "%s", name);
+
+        if (DUMP(FILTER_CAPS) && filter != VAProcFilterNone)
+            dump_filter_caps(display, context, filter);
+
+        if (DUMP(PIPELINE_CAPS))
+            dump_filter_pipelines(display, context, filter);
+
+        end_object();
+    }
+
+    end_array();
+
+    return filter_count;
+}
+
+// Probes the filters again with a context of each size, writing only what
+// differs from the default size.  The config is shared by all of them.
+static void dump_filter_context_sizes(VADisplay display, VAConfigID config,
+                                      const struct node *base)
+{
+    VAProcFilterType filter_list[VAProcFilterCount];
+    struct capture capture;
+    int i;
+
+    start_array("context_sizes");
+    for (i = 0; i < nb_context_sizes; i++) {
+        int width  = context_sizes[i].width;
+        int height = context_sizes[i].height;
+        VAContextID context;
+        VAStatus vas;
+
+        // Nothing to compare.
+        if (width == FILTER_CONTEXT_WIDTH && height == FILTER_CONTEXT_HEIGHT)
+            continue;
+
+        start_object(NULL);
+        print_string("size", "%dx%d", width, height);
+        print_integer("width",  width);
+        print_integer("height", height);
+
+        vas = vaCreateContext(display, config, width, height, 0,
+                              NULL, 0, &context);
+        if (vas != VA_STATUS_SUCCESS) {
+            print_boolean("supported", false);
+            end_object();
+            continue;
+        }
+
+        capture_begin(&capture);
+        int filter_count = dump_filter_list(display, context, filter_list);
+        struct node *root = capture_end(&capture);
+        vaDestroyContext(display, context);
+
+        if (filter_count < 0) {
+            print_boolean("supported", false);
+        } else {
+            start_array("changes");
+            int changes = diff_subtrees(base, root);
+            end_array();
+            print_boolean("identical", changes == 0);
+        }
+        if (root) {
+            node_free(root);
+            free(root);
+        }
+        end_object();
+    }
+    end_array();
+}
+
+static void dump_filters(VADisplay display, unsigned int rt_format)
+{
+    VAStatus vas;
+    int filter_count;
+
+    VAConfigAttrib attr_rt_format = {
+        .type  = VAConfigAttribRTFormat,
+        .value = rt_format,
+    };
+
+    VAConfigID config;
+    vas = vaCreateConfig(display, VAProfileNone,
+                         VAEntrypointVideoProc,
+                         &attr_rt_format, 1, &config);
+    CHECK_VAS("Unable to create config to test filters");
+
+    VAContextID context;
+    vas = vaCreateContext(display, config,
+                          FILTER_CONTEXT_WIDTH, FILTER_CONTEXT_HEIGHT, 0,
+                          NULL, 0, &context);
+    CHECK_VAS("Unable to create context to test filters");
+
+    VAProcFilterType filter_list[VAProcFilterCount];
+    if (nb_context_sizes) {
+        // Kept to compare the other sizes with.
+        struct capture capture;
+        capture_begin(&capture);
+        filter_count = dump_filter_list(display, context, filter_list);
+        struct node *base = capture_end(&capture);
+        if (base) {
+            emit_node(base);
+            if (filter_count >= 0)
+                dump_filter_context_sizes(display, config, base);
+            node_free(base);
+            free(base);
+        }
+    } else {
+        filter_count = dump_filter_list(display, context, filter_list);
+    }
+
+    if (filter_count >= 0 && filter_chain_workers && DUMP(PIPELINE_CAPS))
+        dump_filter_chains(display, config, context,
+                           filter_list, filter_count);
+
+    vaDestroyContext(display, context);
+    vaDestroyConfig(display, config);
+}
+
+/*
+ * Filters for each rt_format alone (--filters-by-format).
+ *
+ * The filters above are for a config taking every rt_format at once.
+ * Here each format gets its own config and context, probed into a tree by
+ * a pool of at most filters_by_format threads, and formats with the same
+ * results share an entry.
+ */
+static int filters_by_format;
+
+struct format_probe {
+    VADisplay display;
+    unsigned int rt_format;
+    // NULL if the format can't be used for VPP.
+    struct node *root;
+};
+
+struct format_worker {
+    struct format_probe *probes;
+    int nb_probes;
+    int *next;
+    pthread_t thread;
+};
+
+static void format_probe_run(struct format_probe *probe)
+{
+    VAProcFilterType filter_list[VAProcFilterCount];
+    struct capture capture;
+    VAStatus vas;
+
+    VAConfigAttrib attr_rt_format = {
+        .type  = VAConfigAttribRTFormat,
+        .value = probe->rt_format,
+    };
+
+    VAConfigID config;
+    vas = vaCreateConfig(probe->display, VAProfileNone,
+                         VAEntrypointVideoProc,
+                         &attr_rt_format, 1, &config);
+    if (vas != VA_STATUS_SUCCESS)
+        return;
+
+    VAContextID context;
+    vas = vaCreateContext(probe->display, config,
+                          FILTER_CONTEXT_WIDTH, FILTER_CONTEXT_HEIGHT, 0,
+                          NULL, 0, &context);
+    if (vas == VA_STATUS_SUCCESS) {
+        capture_begin(&capture);
+        int filter_count = dump_filter_list(probe->display, context,
+                                            filter_list);
+        probe->root = capture_end(&capture);
+        if (filter_count < 0 && probe->root) {
+            node_free(probe->root);
+            free(probe->root);
+            probe->root = NULL;
+        }
+        vaDestroyContext(probe->display, context);
+    }
+
+    vaDestroyConfig(probe->display, config);
+}
+
+static void *format_worker_run(void *arg)
+{
+    struct format_worker *worker = arg;
+
+    while (1) {
+        int i = __atomic_fetch_add(worker->next, 1, __ATOMIC_RELAXED);
+        if (i >= worker->nb_probes)
             break;
-#endif
-#if LIBVA(2, 0, 0)
-        case VAConfigAttribFEIFunctionType:
-            {
-                start_array("fei_function_type");
-                AV(FEI_FUNCTION, ENC);
-                AV(FEI_FUNCTION, PAK);
-                AV(FEI_FUNCTION, ENC_PAK);
-                end_array();
-            }
+        format_probe_run(&worker->probes[i]);
+    }
+    return NULL;
+}
+
+static void dump_format_filters(VADisplay display, unsigned int rt_formats)
+{
+    struct format_probe probes[32];
+    struct format_worker workers[32];
+    uint8_t hashes[32][32];
+    int nb_probes = 0, nb_workers, next = 0;
+    int i, j;
+
+    for (; rt_formats; rt_formats &= rt_formats - 1) {
+        probes[nb_probes++] = (struct format_probe) {
+            .display   = display,
+            .rt_format = 1u << __builtin_ctz(rt_formats),
+        };
+    }
+
+    // Calls can only go on a tape in order.
+    nb_workers = tape.mode == TAPE_OFF ? filters_by_format : 1;
+    if (nb_workers > nb_probes)
+        nb_workers = nb_probes;
+    for (i = 0; i < nb_workers; i++) {
+        workers[i] = (struct format_worker) {
+            .probes    = probes,
+            .nb_probes = nb_probes,
+            .next      = &next,
+        };
+    }
+    for (i = 1; i < nb_workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL,
+                           &format_worker_run, &workers[i]))
+            die("Failed to start filter probe thread.\n");
+    }
+    if (nb_workers)
+        format_worker_run(&workers[0]);
+    for (i = 1; i < nb_workers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (i = 0; i < nb_probes; i++) {
+        if (probes[i].root)
+            node_hash(probes[i].root, hashes[i]);
+    }
+
+    start_array("format_filters");
+    for (i = 0; i < nb_probes; i++) {
+        unsigned int group = 0;
+
+        // Already written with an earlier format.
+        if (probes[i].rt_format == 0)
+            continue;
+
+        for (j = i; j < nb_probes; j++) {
+            if (probes[j].rt_format == 0 ||
+                !probes[i].root != !probes[j].root ||
+                (probes[i].root && memcmp(hashes[i], hashes[j], 32)))
+                continue;
+            group |= probes[j].rt_format;
+            if (j > i)
+                probes[j].rt_format = 0;
+        }
+
+        start_object(NULL);
+        start_array("rt_formats");
+        print_flag_names(va_rt_format_names, group);
+        end_array();
+        if (probes[i].root)
+            emit_node(probes[i].root);
+        else
+            print_boolean("supported", false);
+        end_object();
+    }
+    end_array();
+
+    for (i = 0; i < nb_probes; i++) {
+        if (probes[i].root) {
+            node_free(probes[i].root);
+            free(probes[i].root);
+        }
+    }
+}
+
+/*
+ * Sizes each workload is timed at for the cost model (--cost-model).  The
+ * model itself is with the benchmarks, whose workloads it uses.
+ */
+#define MAX_COST_MODEL_SIZES 8
+
+static const char *const default_cost_model_sizes =
+    "640x360,1280x720,1920x1080";
+
+static struct {
+    int width;
+    int height;
+} cost_model_sizes[MAX_COST_MODEL_SIZES];
+static int nb_cost_model_sizes;
+
+static void parse_cost_model_sizes(const char *list)
+{
+    const char *p = list;
+    int width, height, len, i;
+
+    nb_cost_model_sizes = 0;
+    while (*p) {
+        if (sscanf(p, "%dx%d%n", &width, &height, &len) != 2 ||
+            width < 16 || height < 16 || width > 16384 || height > 16384 ||
+            width % 2 || height % 2 || width <= height / 4 ||
+            (p[len] && p[len] != ','))
+            die("Invalid cost model sizes %s.\n", list);
+        if (nb_cost_model_sizes >= MAX_COST_MODEL_SIZES)
+            die("Too many cost model sizes.\n");
+        cost_model_sizes[nb_cost_model_sizes].width  = width;
+        cost_model_sizes[nb_cost_model_sizes].height = height;
+        ++nb_cost_model_sizes;
+        p += len;
+        if (*p)
+            ++p;
+    }
+
+    // A line needs two different numbers of pixels.
+    for (i = 1; i < nb_cost_model_sizes; i++) {
+        if (cost_model_sizes[i].width * cost_model_sizes[i].height !=
+            cost_model_sizes[0].width * cost_model_sizes[0].height)
+            return;
+    }
+    die("Cost model sizes need at least two different areas.\n");
+}
+
+static void dump_cost_model(VADisplay display, VAProfile profile,
+                            VAEntrypoint entrypoint,
+                            unsigned int rt_formats);
+
+static void dump_entrypoints(VADisplay display, VAProfile profile)
+{
+    int entrypoint_count = vaMaxNumEntrypoints(display);
+    VAEntrypoint *entrypoint_list = calloc(entrypoint_count,
+                                           sizeof(*entrypoint_list));
+
+    VAStatus vas = vaQueryConfigEntrypoints(display, profile,
+                                            entrypoint_list, &entrypoint_count);
+    CHECK_VAS("Unable to query entrypoints");
+
+    int i;
+    for (i = 0; i < entrypoint_count; i++) {
+        const char *name = va_entrypoint_name(entrypoint_list[i]);
+        const struct entrypoint_info *info =
+            entrypoint_info(entrypoint_list[i]);
+
+        start_object(NULL);
+
+        unsigned int flags = EP_ATTRIBUTES;
+
+        print_integer("entrypoint", entrypoint_list[i]);
+        if (name)
+            print_string("name", "%s", name);
+        if (info) {
+            print_string("description", "%s", info->description);
+            flags = info->flags;
+        }
+
+        unsigned int rt_formats = 0;
+
+        if (DUMP(ATTRIBUTES) && (flags & EP_ATTRIBUTES)) {
+            dedup_begin();
+            start_object("attributes");
+            dump_config_attributes(display, profile, entrypoint_list[i],
+                                   &rt_formats);
+            end_object();
+            dedup_end();
+        } else if (DUMP(SURFACE_FORMATS) || DUMP(FILTERS) ||
+                   nb_cost_model_sizes) {
+            // Surfaces, filters and costs are found per rt_format even
+            // when the attributes are not being dumped.
+            VAConfigAttrib attr = { .type = VAConfigAttribRTFormat };
+            if (vaGetConfigAttributes(display, profile, entrypoint_list[i],
+                                      &attr, 1) == VA_STATUS_SUCCESS &&
+                attr.value != VA_ATTRIB_NOT_SUPPORTED)
+                rt_formats = attr.value;
+        }
+
+        if (DUMP(SURFACE_FORMATS) && (flags & EP_SURFACES)) {
+            dedup_begin();
+            start_array("surface_formats");
+            dump_surface_attributes(display, profile, entrypoint_list[i],
+                                    rt_formats);
+            end_array();
+            dedup_end();
+        }
+
+        if (DUMP(FILTERS) && (flags & EP_FILTERS)) {
+            int phase = probe_phase(PHASE_VPP);
+            dump_filters(display, rt_formats);
+            if (filters_by_format)
+                dump_format_filters(display, rt_formats);
+            probe_phase(phase);
+        }
+
+        if (nb_cost_model_sizes)
+            dump_cost_model(display, profile, entrypoint_list[i],
+                            rt_formats);
+
+        end_object();
+    }
+
+    free(entrypoint_list);
+}
+
+static void dump_profiles(VADisplay display)
+{
+    int profile_count = vaMaxNumProfiles(display);
+    VAProfile *profile_list = calloc(profile_count, sizeof(*profile_list));
+
+    VAStatus vas = vaQueryConfigProfiles(display,
+                                         profile_list, &profile_count);
+    CHECK_VAS("Unable to query profiles");
+
+    int i;
+    for (i = 0; i < profile_count; i++) {
+        const char *name = va_profile_name(profile_list[i]);
+        const char *description = profile_description(profile_list[i]);
+
+        start_object(NULL);
+
+        print_integer("profile", profile_list[i]);
+        if (name)
+            print_string("name", "%s", name);
+        if (description)
+            print_string("description", "%s", description);
+
+        if (DUMP(ENTRYPOINTS)) {
+            start_array("entrypoints");
+            dump_entrypoints(display, profile_list[i]);
+            end_array();
+        }
+
+        end_object();
+    }
+
+    free(profile_list);
+}
+
+static void dump_image_formats(VADisplay display)
+{
+    int format_count = vaMaxNumImageFormats(display);
+    VAImageFormat *format_list = calloc(format_count, sizeof(*format_list));
+
+    VAStatus vas = vaQueryImageFormats(display, format_list, &format_count);
+    CHECK_VAS("Unable to query image formats");
+
+    int i;
+    for (i = 0; i < format_count; i++) {
+        start_object(NULL);
+
+        print_string("pixel_format", "%.4s", &format_list[i].fourcc);
+
+        print_string("byte_order",
+                     format_list[i].byte_order == VA_LSB_FIRST ? "LE" :
+                     format_list[i].byte_order == VA_MSB_FIRST ? "BE" :
+                     "unknown");
+
+        print_integer("bits_per_pixel", format_list[i].bits_per_pixel);
+
+        if (format_list[i].depth) {
+            print_integer("depth", format_list[i].depth);
+
+            print_integer("red_mask",   format_list[i].red_mask);
+            print_integer("green_mask", format_list[i].green_mask);
+            print_integer("blue_mask",  format_list[i].blue_mask);
+            print_integer("alpha_mask", format_list[i].alpha_mask);
+        }
+
+        end_object();
+    }
+
+    free(format_list);
+}
+
+static void dump_subpicture_formats(VADisplay display)
+{
+    unsigned int format_count = vaMaxNumSubpictureFormats(display);
+    VAImageFormat *format_list = calloc(format_count, sizeof(*format_list));
+    unsigned int *flags_list = calloc(format_count, sizeof(*flags_list));
+
+    VAStatus vas = vaQuerySubpictureFormats(display, format_list,
+                                            flags_list, &format_count);
+    CHECK_VAS("Unable to query subpicture formats");
+
+    int i;
+    for (i = 0; i < format_count; i++) {
+        start_object(NULL);
+
+        print_string("pixel_format", "%.4s", &format_list[i].fourcc);
+
+        print_string("byte_order",
+                     format_list[i].byte_order == VA_LSB_FIRST ? "LE" :
+                     format_list[i].byte_order == VA_MSB_FIRST ? "BE" :
+                     "unknown");
+
+        print_integer("bits_per_pixel", format_list[i].bits_per_pixel);
+
+        if (format_list[i].depth) {
+            print_integer("depth", format_list[i].depth);
+
+            print_integer("red_mask",   format_list[i].red_mask);
+            print_integer("green_mask", format_list[i].green_mask);
+            print_integer("blue_mask",  format_list[i].blue_mask);
+            print_integer("alpha_mask", format_list[i].alpha_mask);
+        }
+
+        start_array("flags");
+        print_flag_names(va_subpicture_flag_names, flags_list[i]);
+        end_array();
+
+        end_object();
+    }
+
+    free(format_list);
+    free(flags_list);
+}
+
+/*
+ * Batch checking.
+ *
+ * The device is probed once into the compiled form kept by libvacaps, and
+ * job specs are then answered from that without calling libva again.
+ */
+
+/*
+ * Names in job specs are resolved through small open-addressed hash
+ * tables built from the name tables above, so that no per-line work
+ * scales with the number of known profiles or entrypoints.
+ */
+
+struct name_hash {
+    unsigned int mask;
+    struct {
+        const char *name;
+        size_t len;
+        int64_t value;
+    } *slots;
+};
+
+static uint32_t hash_bytes(const char *str, size_t len)
+{
+    // FNV-1a.
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
+
+static void name_hash_init(struct name_hash *nh, int count)
+{
+    unsigned int size = 16;
+    while (size < 2 * count)
+        size <<= 1;
+    nh->mask  = size - 1;
+    nh->slots = calloc(size, sizeof(*nh->slots));
+}
+
+static void name_hash_add(struct name_hash *nh, const char *name,
+                          int64_t value)
+{
+    size_t len = strlen(name);
+    unsigned int i = hash_bytes(name, len) & nh->mask;
+    while (nh->slots[i].name)
+        i = (i + 1) & nh->mask;
+    nh->slots[i].name  = name;
+    nh->slots[i].len   = len;
+    nh->slots[i].value = value;
+}
+
+static bool name_hash_find(const struct name_hash *nh,
+                           const char *str, size_t len, int64_t *value)
+{
+    unsigned int i = hash_bytes(str, len) & nh->mask;
+    while (nh->slots[i].name) {
+        if (nh->slots[i].len == len &&
+            !memcmp(nh->slots[i].name, str, len)) {
+            *value = nh->slots[i].value;
+            return true;
+        }
+        i = (i + 1) & nh->mask;
+    }
+    return false;
+}
+
+static struct name_hash profile_names, entrypoint_names, rt_format_names;
+
+static void init_name_hashes(void)
+{
+    int i;
+
+    name_hash_init(&profile_names, ARRAY_LENGTH(va_profile_names));
+    for (i = 0; i < ARRAY_LENGTH(va_profile_names); i++) {
+        if (va_profile_names[i])
+            name_hash_add(&profile_names, va_profile_names[i],
+                          i + VA_PROFILE_NAMES_BASE);
+    }
+
+    name_hash_init(&entrypoint_names, ARRAY_LENGTH(va_entrypoint_names));
+    for (i = 0; i < ARRAY_LENGTH(va_entrypoint_names); i++) {
+        if (va_entrypoint_names[i])
+            name_hash_add(&entrypoint_names, va_entrypoint_names[i],
+                          i + VA_ENTRYPOINT_NAMES_BASE);
+    }
+
+    name_hash_init(&rt_format_names, ARRAY_LENGTH(va_rt_format_names));
+    for (i = 0; i < ARRAY_LENGTH(va_rt_format_names); i++) {
+        if (va_rt_format_names[i])
+            name_hash_add(&rt_format_names, va_rt_format_names[i], 1u << i);
+    }
+}
+
+/*
+ * Job specs are single-line flat JSON objects, for example:
+ *   {"id":17,"profile":"HEVCMain10","entrypoint":"VLD",
+ *    "rt_format":"YUV420_10","pixel_format":"P010",
+ *    "width":3840,"height":2160}
+ * Every field other than profile and entrypoint is optional, and profile
+ * and entrypoint may also be given by number as in the dump output.
+ */
+
+struct job_spec {
+    const char *id;
+    size_t id_len;
+
+    int64_t profile;
+    int64_t entrypoint;
+    int64_t rt_format;
+    int64_t fourcc;
+    int64_t width;
+    int64_t height;
+
+    bool has_profile, has_entrypoint, has_rt_format;
+    bool has_fourcc, has_width, has_height;
+};
+
+enum {
+    CHECK_OK,
+    CHECK_PARSE_ERROR,
+    CHECK_PROFILE,
+    CHECK_ENTRYPOINT,
+    CHECK_RT_FORMAT,
+    CHECK_PIXEL_FORMAT,
+    CHECK_SIZE,
+};
+
+static const char *const check_reasons[] = {
+    [CHECK_OK]           = NULL,
+    [CHECK_PARSE_ERROR]  = "parse_error",
+    [CHECK_PROFILE]      = "profile",
+    [CHECK_ENTRYPOINT]   = "entrypoint",
+    [CHECK_RT_FORMAT]    = "rt_format",
+    [CHECK_PIXEL_FORMAT] = "pixel_format",
+    [CHECK_SIZE]         = "size",
+};
+
+static const char *skip_space(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        ++p;
+    return p;
+}
+
+static const char *scan_string(const char *p, const char **str, size_t *len)
+{
+    // Escapes are skipped over but not decoded: none of the names we
+    // match against contain any.
+    if (*p != '"')
+        return NULL;
+    *str = ++p;
+    while (*p != '"') {
+        if (!*p)
+            return NULL;
+        if (*p == '\\' && p[1])
+            ++p;
+        ++p;
+    }
+    *len = p - *str;
+    return p + 1;
+}
+
+static const char *scan_value(const char *p, const char **str, size_t *len,
+                              bool *is_string)
+{
+    if (*p == '"') {
+        *is_string = true;
+        return scan_string(p, str, len);
+    }
+    *is_string = false;
+    *str = p;
+    while (*p && *p != ',' && *p != '}' &&
+           *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        ++p;
+    *len = p - *str;
+    return *len ? p : NULL;
+}
+
+static bool parse_integer(const char *str, size_t len, int64_t *value)
+{
+    int64_t v = 0;
+    bool negative = false;
+    size_t i = 0;
+
+    if (len > 0 && str[0] == '-') {
+        negative = true;
+        i = 1;
+    }
+    if (i == len || len - i > 18)
+        return false;
+    for (; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return false;
+        v = 10 * v + (str[i] - '0');
+    }
+    *value = negative ? -v : v;
+    return true;
+}
+
+// A JSON number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool is_json_number(const char *str, size_t len)
+{
+    size_t i = 0, digits;
+
+    if (i < len && str[i] == '-')
+        ++i;
+    for (digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+        ++digits;
+    if (!digits || (digits > 1 && str[i - digits] == '0'))
+        return false;
+    if (i < len && str[i] == '.') {
+        for (++i, digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+            ++digits;
+        if (!digits)
+            return false;
+    }
+    if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+        ++i;
+        if (i < len && (str[i] == '+' || str[i] == '-'))
+            ++i;
+        for (digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++)
+            ++digits;
+        if (!digits)
+            return false;
+    }
+    return i == len;
+}
+
+static bool parse_named(const struct name_hash *nh,
+                        const char *str, size_t len, bool is_string,
+                        int64_t *value)
+{
+    if (is_string)
+        return name_hash_find(nh, str, len, value);
+    else
+        return parse_integer(str, len, value);
+}
+
+static int parse_job_spec(const char *line, struct job_spec *job)
+{
+    const char *p = skip_space(line);
+    memset(job, 0, sizeof(*job));
+
+    if (*p++ != '{')
+        return CHECK_PARSE_ERROR;
+    p = skip_space(p);
+    if (*p == '}')
+        return CHECK_OK;
+
+    while (1) {
+        const char *key, *value;
+        size_t key_len, value_len;
+        bool is_string;
+
+        p = scan_string(p, &key, &key_len);
+        if (!p)
+            return CHECK_PARSE_ERROR;
+        p = skip_space(p);
+        if (*p++ != ':')
+            return CHECK_PARSE_ERROR;
+        p = skip_space(p);
+        p = scan_value(p, &value, &value_len, &is_string);
+        if (!p)
+            return CHECK_PARSE_ERROR;
+
+#define KEY(name) (key_len == sizeof(name) - 1 && \
+                   !memcmp(key, name, sizeof(name) - 1))
+        if (KEY("id")) {
+            // Echoed back verbatim, quotes included, so anything other
+            // than a string or a number would break the verdict.
+            if (!is_string && !is_json_number(value, value_len))
+                return CHECK_PARSE_ERROR;
+            job->id     = is_string ? value - 1 : value;
+            job->id_len = is_string ? value_len + 2 : value_len;
+        } else if (KEY("profile")) {
+            job->has_profile = true;
+            if (!parse_named(&profile_names, value, value_len,
+                             is_string, &job->profile))
+                return CHECK_PROFILE;
+        } else if (KEY("entrypoint")) {
+            job->has_entrypoint = true;
+            if (!parse_named(&entrypoint_names, value, value_len,
+                             is_string, &job->entrypoint))
+                return CHECK_ENTRYPOINT;
+        } else if (KEY("rt_format")) {
+            job->has_rt_format = true;
+            if (!parse_named(&rt_format_names, value, value_len,
+                             is_string, &job->rt_format))
+                return CHECK_RT_FORMAT;
+        } else if (KEY("pixel_format")) {
+            job->has_fourcc = true;
+            if (!is_string || value_len != 4)
+                return CHECK_PIXEL_FORMAT;
+            job->fourcc = (uint32_t)(unsigned char)value[0]       |
+                          (uint32_t)(unsigned char)value[1] <<  8 |
+                          (uint32_t)(unsigned char)value[2] << 16 |
+                          (uint32_t)(unsigned char)value[3] << 24;
+        } else if (KEY("width")) {
+            job->has_width = true;
+            if (is_string || !parse_integer(value, value_len, &job->width))
+                return CHECK_PARSE_ERROR;
+        } else if (KEY("height")) {
+            job->has_height = true;
+            if (is_string || !parse_integer(value, value_len, &job->height))
+                return CHECK_PARSE_ERROR;
+        }
+#undef KEY
+
+        p = skip_space(p);
+        if (*p == '}')
             break;
-        case VAConfigAttribFEIMVPredictors:
-            {
-                print_integer("fei_mv_predictors", value);
-            }
+        if (*p++ != ',')
+            return CHECK_PARSE_ERROR;
+        p = skip_space(p);
+    }
+
+    if (!job->has_profile)
+        return CHECK_PROFILE;
+    if (!job->has_entrypoint)
+        return CHECK_ENTRYPOINT;
+    return CHECK_OK;
+}
+
+static int check_surface(const VACapsDevice *caps,
+                         const struct job_spec *job, unsigned int rt_format)
+{
+    VACapsSizeRange range;
+
+    if (job->has_fourcc &&
+        !vacaps_supports_pixel_format(caps, job->profile, job->entrypoint,
+                                      rt_format, job->fourcc))
+        return CHECK_PIXEL_FORMAT;
+    if (job->has_width || job->has_height) {
+        if (vacaps_size_range(caps, job->profile, job->entrypoint,
+                              rt_format, &range))
+            return CHECK_SIZE;
+        if (job->has_width && (job->width  < range.min_width ||
+                               job->width  > range.max_width))
+            return CHECK_SIZE;
+        if (job->has_height && (job->height < range.min_height ||
+                                job->height > range.max_height))
+            return CHECK_SIZE;
+    }
+    return CHECK_OK;
+}
+
+static int check_job_spec(const VACapsDevice *caps,
+                          const struct job_spec *job)
+{
+    if (job->profile < INT_MIN || job->profile > INT_MAX ||
+        !vacaps_entrypoints(caps, job->profile))
+        return CHECK_PROFILE;
+    if (job->entrypoint < 0 || job->entrypoint > INT_MAX ||
+        !vacaps_supports(caps, job->profile, job->entrypoint))
+        return CHECK_ENTRYPOINT;
+
+    unsigned int rt_formats = vacaps_rt_formats(caps, job->profile,
+                                                job->entrypoint);
+    if (job->has_rt_format) {
+        if (!(rt_formats & job->rt_format))
+            return CHECK_RT_FORMAT;
+        rt_formats &= job->rt_format;
+    }
+
+    if (!job->has_fourcc && !job->has_width && !job->has_height)
+        return CHECK_OK;
+
+    // Any single rt_format satisfying the remaining constraints will do;
+    // report the failure from the last one tried otherwise.
+    int result = CHECK_PIXEL_FORMAT;
+    while (rt_formats) {
+        result = check_surface(caps, job, rt_formats & -rt_formats);
+        if (result == CHECK_OK)
             break;
-#endif
-#if LIBVA(2, 1, 0)
-        case VAConfigAttribStats:
-            {
-                VAConfigAttribValStats stats = { .value = value };
-                start_object("stats");
-#define SA(name) do { print_integer(#name, stats.bits.name); } while (0)
-                SA(max_num_past_references);
-                SA(max_num_future_references);
-                SA(num_outputs);
-                SA(interlaced);
-#undef SA
-                end_object();
+        rt_formats &= rt_formats - 1;
+    }
+    return result;
+}
+
+static void job_spec_to_vacaps(const struct job_spec *job, VACapsJob *out)
+{
+    *out = (VACapsJob) {
+        .profile    = job->profile,
+        .entrypoint = job->entrypoint,
+        .rt_format  = job->has_rt_format ? job->rt_format : 0,
+        .fourcc     = job->has_fourcc    ? job->fourcc    : 0,
+        .width      = job->has_width     ? job->width     : 0,
+        .height     = job->has_height    ? job->height    : 0,
+    };
+}
+
+// The reason a job matched no device, if no device at all has its
+// profile, entrypoint or rt_format; otherwise the devices failed on
+// different constraints and there is no one reason.
+static int check_matcher_reason(const VACapsMatcher *matcher,
+                                const struct job_spec *job)
+{
+    if (job->profile < INT_MIN || job->profile > INT_MAX ||
+        !vacaps_matcher_entrypoints(matcher, job->profile))
+        return CHECK_PROFILE;
+    if (job->entrypoint < 0 || job->entrypoint >= 32 ||
+        !(vacaps_matcher_entrypoints(matcher, job->profile) &
+          1u << job->entrypoint))
+        return CHECK_ENTRYPOINT;
+    if (job->has_rt_format &&
+        !(vacaps_matcher_rt_formats(matcher, job->profile,
+                                    job->entrypoint) & job->rt_format))
+        return CHECK_RT_FORMAT;
+    return CHECK_OK;
+}
+
+/*
+ * With one device each verdict gives the reason for a failure.  With
+ * several, the jobs are matched against all of them at once and the
+ * verdict lists the devices which can run it instead, with a reason only
+ * when none of them has the profile, entrypoint or rt_format.
+ */
+static void run_check(VACapsDevice *const *caps, const char *const *paths,
+                      int nb_caps)
+{
+    VACapsMatcher *matcher = NULL;
+    uint64_t *matched = NULL;
+    struct timespec start, end;
+    FILE *saved_out = out;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t count = 0, supported = 0;
+    int i;
+
+    if (nb_caps > 1) {
+        matcher = vacaps_matcher_create((const VACapsDevice *const *)caps,
+                                        nb_caps);
+        if (!matcher)
+            die("Failed to create matcher.\n");
+        matched = calloc(vacaps_matcher_words(matcher), sizeof(*matched));
+        if (!matched)
+            die("Out of memory.\n");
+    }
+    init_name_hashes();
+
+    static char out_buffer[1 << 16];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    // Verdicts always go to stdout, with paths escaped by json_string().
+    out = stdout;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (getline(&line, &line_size, stdin) >= 0) {
+        struct job_spec job;
+        const char *p = skip_space(line);
+        if (!*p)
+            continue;
+
+        int result = parse_job_spec(p, &job);
+        int nb_matched = 0, reason = CHECK_OK;
+        if (result == CHECK_OK && matcher) {
+            VACapsJob vjob;
+            job_spec_to_vacaps(&job, &vjob);
+            if (job.profile >= INT_MIN && job.profile <= INT_MAX &&
+                job.entrypoint >= 0 && job.entrypoint <= INT_MAX &&
+                !(job.has_rt_format && !job.rt_format))
+                nb_matched = vacaps_matcher_match(matcher, &vjob, matched);
+            if (!nb_matched)
+                reason = check_matcher_reason(matcher, &job);
+        } else if (result == CHECK_OK) {
+            result = check_job_spec(caps[0], &job);
+        }
+
+        fputs("{", stdout);
+        if (job.id) {
+            fputs("\"id\":", stdout);
+            fwrite(job.id, 1, job.id_len, stdout);
+            fputs(",", stdout);
+        }
+        if (result == CHECK_OK && matcher) {
+            if (nb_matched) {
+                fputs("\"supported\":true,\"devices\":[", stdout);
+                ++supported;
+            } else if (reason != CHECK_OK) {
+                fputs("\"supported\":false,\"reason\":\"", stdout);
+                fputs(check_reasons[reason], stdout);
+                fputs("\",\"devices\":[", stdout);
+            } else {
+                fputs("\"supported\":false,\"devices\":[", stdout);
             }
-            break;
-        case VAConfigAttribEncTileSupport:
-            {
-                print_boolean("encode_tile_support", value);
+            for (i = 0; i < nb_caps; i++) {
+                if (matched[i / 64] & UINT64_C(1) << i % 64) {
+                    json_string(paths[i]);
+                    if (--nb_matched)
+                        putc(',', stdout);
+                }
             }
-            break;
-        case VAConfigAttribCustomRoundingControl:
-            {
-                print_boolean("custom_rounding_control", value);
+            fputs("]}\n", stdout);
+        } else if (result == CHECK_OK) {
+            fputs("\"supported\":true}\n", stdout);
+            ++supported;
+        } else {
+            fputs("\"supported\":false,\"reason\":\"", stdout);
+            fputs(check_reasons[result], stdout);
+            fputs("\"}\n", stdout);
+        }
+        ++count;
+    }
+    fflush(stdout);
+    out = saved_out;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Checked %zu job specs (%zu supported) in %.3fs: "
+            "%.0f per second.\n", count, supported, elapsed,
+            elapsed > 0 ? count / elapsed : 0.0);
+
+    free(line);
+    free(matched);
+    vacaps_matcher_destroy(matcher);
+}
+
+/*
+ * GPU engine and memory use while a benchmark runs (--fdinfo), read from
+ * the DRM fdinfo of the device.  Engines report busy time either in
+ * nanoseconds (drm-engine-*, over drm-engine-capacity-* instances) or in
+ * cycles against a running total (drm-cycles-*, drm-total-cycles-*).
+ * A thread samples them so that the peak over any one interval can be
+ * given as well as the mean; it keeps its own CPU time under half a
+ * percent by sampling less often if reading takes too long.
+ */
+#define FDINFO_MAX_ENGINES 16
+#define FDINFO_MAX_REGIONS 8
+#define FDINFO_MAX_CPU     0.005
+#define FDINFO_DEFAULT_RATE 50
+
+static int fdinfo_rate;
+
+struct fdinfo_engine {
+    char name[32];
+    uint64_t busy;
+    uint64_t total;
+    unsigned int capacity;
+
+    uint64_t start_busy;
+    uint64_t start_total;
+    uint64_t last_busy;
+    uint64_t last_total;
+    double peak;
+};
+
+struct fdinfo_region {
+    char name[32];
+    uint64_t resident_kib;
+    uint64_t peak_kib;
+};
+
+static struct {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+
+    uint64_t interval_ns;
+    uint64_t time;
+    uint64_t start_time;
+    uint64_t last_time;
+    uint64_t samples;
+    uint64_t cpu_ns;
+    uint64_t start_cpu_ns;
+
+    struct fdinfo_engine engines[FDINFO_MAX_ENGINES];
+    int nb_engines;
+    struct fdinfo_region regions[FDINFO_MAX_REGIONS];
+    int nb_regions;
+} fdinfo = {
+    .fd   = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *fdinfo_find(void *table, int *count, int max, size_t size,
+                         const char *name, size_t len)
+{
+    char *entry = table;
+    int i;
+
+    if (len >= 32)
+        return NULL;
+    for (i = 0; i < *count; i++, entry += size) {
+        if (!strncmp(entry, name, len) && !entry[len])
+            return entry;
+    }
+    if (*count == max)
+        return NULL;
+    ++*count;
+    memset(entry, 0, size);
+    memcpy(entry, name, len);
+    return entry;
+}
+
+static struct fdinfo_engine *fdinfo_engine(const char *name, size_t len)
+{
+    return fdinfo_find(fdinfo.engines, &fdinfo.nb_engines,
+                       FDINFO_MAX_ENGINES, sizeof(fdinfo.engines[0]),
+                       name, len);
+}
+
+// Reads the current values, with the lock held.
+static void fdinfo_read(void)
+{
+    char buffer[4096];
+    const char *p, *end;
+    ssize_t size;
+
+    size = pread(fdinfo.fd, buffer, sizeof(buffer) - 1, 0);
+    if (size <= 0)
+        return;
+    buffer[size] = 0;
+    fdinfo.time = clock_ns();
+
+    for (p = buffer; *p; p = end + (*end == '\n')) {
+        static const struct {
+            const char *prefix;
+            int kind;
+        } keys[] = {
+            // Longest first where one is a prefix of another.
+            { "drm-engine-capacity-", 0 },
+            { "drm-engine-",          1 },
+            { "drm-total-cycles-",    2 },
+            { "drm-cycles-",          3 },
+            { "drm-resident-",        4 },
+            { "drm-memory-",          4 },
+        };
+        const char *colon;
+        char *unit;
+        uint64_t value;
+        int i;
+
+        end = strchr(p, '\n');
+        if (!end)
+            end = p + strlen(p);
+        colon = memchr(p, ':', end - p);
+        if (!colon)
+            continue;
+        for (i = 0; i < ARRAY_LENGTH(keys); i++) {
+            if (!strncmp(p, keys[i].prefix, strlen(keys[i].prefix)))
+                break;
+        }
+        if (i == ARRAY_LENGTH(keys))
+            continue;
+
+        const char *name = p + strlen(keys[i].prefix);
+        size_t len = colon - name;
+        value = strtoull(colon + 1, &unit, 10);
+        while (*unit == ' ')
+            ++unit;
+
+        if (keys[i].kind == 4) {
+            struct fdinfo_region *region =
+                fdinfo_find(fdinfo.regions, &fdinfo.nb_regions,
+                            FDINFO_MAX_REGIONS, sizeof(fdinfo.regions[0]),
+                            name, len);
+            if (!region)
+                continue;
+            if (!strncmp(unit, "MiB", 3))
+                value *= 1024;
+            else if (strncmp(unit, "KiB", 3))
+                value /= 1024;
+            region->resident_kib = value;
+            if (value > region->peak_kib)
+                region->peak_kib = value;
+        } else {
+            struct fdinfo_engine *engine = fdinfo_engine(name, len);
+            if (!engine)
+                continue;
+            if (keys[i].kind == 0)
+                engine->capacity = value;
+            else if (keys[i].kind == 2)
+                engine->total = value;
+            else
+                engine->busy = value;
+        }
+    }
+}
+
+// Busy percentage of an engine between two readings.
+static double fdinfo_busy(const struct fdinfo_engine *engine,
+                          uint64_t busy, uint64_t total, uint64_t time)
+{
+    if (engine->total) {
+        if (engine->total <= total)
+            return 0;
+        return 100.0 * (engine->busy - busy) / (engine->total - total);
+    }
+    if (fdinfo.time <= time)
+        return 0;
+    return 100.0 * (engine->busy - busy) / (fdinfo.time - time) /
+           (engine->capacity ? engine->capacity : 1);
+}
+
+static void fdinfo_sample(void)
+{
+    int i;
+
+    fdinfo_read();
+    for (i = 0; i < fdinfo.nb_engines; i++) {
+        struct fdinfo_engine *engine = &fdinfo.engines[i];
+        double busy = fdinfo_busy(engine, engine->last_busy,
+                                  engine->last_total, fdinfo.last_time);
+        if (busy > engine->peak)
+            engine->peak = busy;
+        engine->last_busy  = engine->busy;
+        engine->last_total = engine->total;
+    }
+    fdinfo.last_time = fdinfo.time;
+    ++fdinfo.samples;
+}
+
+static uint64_t fdinfo_thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *fdinfo_run(void *arg)
+{
+    uint64_t cpu_start = fdinfo_thread_cpu_ns(), cpu_last = cpu_start;
+    uint64_t next = clock_ns();
+    struct timespec wake;
+
+    pthread_mutex_lock(&fdinfo.lock);
+    while (fdinfo.running) {
+        next += fdinfo.interval_ns;
+        wake.tv_sec  = next / 1000000000;
+        wake.tv_nsec = next % 1000000000;
+        if (pthread_cond_timedwait(&fdinfo.cond, &fdinfo.lock, &wake) !=
+            ETIMEDOUT)
+            continue;
+
+        fdinfo_sample();
+
+        // What the last interval cost, waking included.
+        uint64_t cpu = fdinfo_thread_cpu_ns();
+        if (cpu - cpu_last > FDINFO_MAX_CPU * fdinfo.interval_ns)
+            fdinfo.interval_ns *= 2;
+        cpu_last = cpu;
+        fdinfo.cpu_ns = cpu - cpu_start;
+    }
+    pthread_mutex_unlock(&fdinfo.lock);
+    return NULL;
+}
+
+static void fdinfo_start(int drm_fd)
+{
+    char path[64];
+    pthread_condattr_t attr;
+
+    if (!fdinfo_rate || drm_fd < 0)
+        return;
+    snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", drm_fd);
+    fdinfo.fd = open(path, O_RDONLY);
+    if (fdinfo.fd < 0) {
+        fprintf(stderr, "Failed to open %s: %m.\n", path);
+        return;
+    }
+
+    fdinfo.interval_ns = 1000000000 / fdinfo_rate;
+    fdinfo.nb_engines = fdinfo.nb_regions = 0;
+    fdinfo.running = true;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&fdinfo.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&fdinfo.thread, NULL, &fdinfo_run, NULL))
+        die("Failed to start fdinfo sampler.\n");
+}
+
+static void fdinfo_stop(void)
+{
+    if (fdinfo.fd < 0)
+        return;
+    pthread_mutex_lock(&fdinfo.lock);
+    fdinfo.running = false;
+    pthread_cond_signal(&fdinfo.cond);
+    pthread_mutex_unlock(&fdinfo.lock);
+    pthread_join(fdinfo.thread, NULL);
+    pthread_cond_destroy(&fdinfo.cond);
+    close(fdinfo.fd);
+    fdinfo.fd = -1;
+}
+
+// Starts the period a benchmark result covers.
+static void fdinfo_begin(void)
+{
+    int i;
+
+    if (fdinfo.fd < 0)
+        return;
+    pthread_mutex_lock(&fdinfo.lock);
+    fdinfo_sample();
+    fdinfo.start_time   = fdinfo.time;
+    fdinfo.start_cpu_ns = fdinfo.cpu_ns;
+    fdinfo.samples = 0;
+    for (i = 0; i < fdinfo.nb_engines; i++) {
+        fdinfo.engines[i].start_busy  = fdinfo.engines[i].busy;
+        fdinfo.engines[i].start_total = fdinfo.engines[i].total;
+        fdinfo.engines[i].peak = 0;
+    }
+    for (i = 0; i < fdinfo.nb_regions; i++)
+        fdinfo.regions[i].peak_kib = fdinfo.regions[i].resident_kib;
+    pthread_mutex_unlock(&fdinfo.lock);
+}
+
+// Writes the use since fdinfo_begin() into the current object.
+static void fdinfo_print(void)
+{
+    int i;
+
+    if (fdinfo.fd < 0)
+        return;
+    pthread_mutex_lock(&fdinfo.lock);
+    fdinfo_sample();
+
+    start_object("gpu");
+    print_integer("samples", fdinfo.samples);
+    print_double("interval_ms", fdinfo.interval_ns / 1e6);
+    start_array("engines");
+    for (i = 0; i < fdinfo.nb_engines; i++) {
+        const struct fdinfo_engine *engine = &fdinfo.engines[i];
+        // Capacity alone says nothing.
+        if (!engine->busy && !engine->total)
+            continue;
+        start_object(NULL);
+        print_string("engine", "%s", engine->name);
+        print_double("busy_percent",
+                     fdinfo_busy(engine, engine->start_busy,
+                                 engine->start_total, fdinfo.start_time));
+        print_double("peak_percent", engine->peak);
+        end_object();
+    }
+    end_array();
+    start_array("memory");
+    for (i = 0; i < fdinfo.nb_regions; i++) {
+        start_object(NULL);
+        print_string("region", "%s", fdinfo.regions[i].name);
+        print_integer("resident_kib", fdinfo.regions[i].resident_kib);
+        print_integer("peak_kib", fdinfo.regions[i].peak_kib);
+        end_object();
+    }
+    end_array();
+    print_double("sampler_cpu_percent",
+                 fdinfo.time > fdinfo.start_time ?
+                 100.0 * (fdinfo.cpu_ns - fdinfo.start_cpu_ns) /
+                 (fdinfo.time - fdinfo.start_time) : 0);
+    end_object();
+
+    pthread_mutex_unlock(&fdinfo.lock);
+}
+
+static uint64_t xorshift(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/*
+ * Measures the cost of each libvacaps lookup, over queries mostly drawn
+ * from what the device supports with some which it does not.
+ */
+static void bench_lookup(VADisplay display)
+{
+    enum {
+        LOOKUP_SUPPORTS,
+        LOOKUP_RT_FORMATS,
+        LOOKUP_PIXEL_FORMATS,
+        LOOKUP_SUPPORTS_PIXEL_FORMAT,
+        LOOKUP_SIZE_RANGE,
+        LOOKUP_COUNT,
+    };
+    static const char *const lookup_names[] = {
+        [LOOKUP_SUPPORTS]              = "supports",
+        [LOOKUP_RT_FORMATS]            = "rt_formats",
+        [LOOKUP_PIXEL_FORMATS]         = "pixel_formats",
+        [LOOKUP_SUPPORTS_PIXEL_FORMAT] = "supports_pixel_format",
+        [LOOKUP_SIZE_RANGE]            = "size_range",
+    };
+    static struct {
+        VAProfile    profile;
+        VAEntrypoint entrypoint;
+        unsigned int rt_format;
+        uint32_t     fourcc;
+    } queries[4096];
+    struct {
+        VAProfile    profile;
+        VAEntrypoint entrypoint;
+    } pairs[256];
+    int nb_pairs = 0;
+    struct timespec start, now;
+    double create_seconds, elapsed[LOOKUP_COUNT];
+    long iterations[LOOKUP_COUNT];
+    uint64_t state = 0x2545f4914f6cdd1d, sink = 0;
+    VACapsDevice *caps;
+    int i, j;
+
+    fdinfo_begin();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    caps = vacaps_device_create(display);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!caps)
+        die("Failed to probe capabilities.\n");
+    create_seconds = (now.tv_sec - start.tv_sec) +
+                     (now.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (i = -1; i < 63; i++) {
+        uint32_t entrypoints = vacaps_entrypoints(caps, i);
+        while (entrypoints && nb_pairs < ARRAY_LENGTH(pairs)) {
+            pairs[nb_pairs].profile    = i;
+            pairs[nb_pairs].entrypoint = __builtin_ctz(entrypoints);
+            ++nb_pairs;
+            entrypoints &= entrypoints - 1;
+        }
+    }
+
+    for (i = 0; i < ARRAY_LENGTH(queries); i++) {
+        uint64_t r = xorshift(&state);
+        if (nb_pairs > 0 && r % 4) {
+            int pair = (r >> 8) % nb_pairs;
+            unsigned int rt_formats =
+                vacaps_rt_formats(caps, pairs[pair].profile,
+                                  pairs[pair].entrypoint);
+            int nb_bits = __builtin_popcount(rt_formats);
+            queries[i].profile    = pairs[pair].profile;
+            queries[i].entrypoint = pairs[pair].entrypoint;
+            queries[i].rt_format  = 0;
+            for (j = nb_bits ? (r >> 16) % nb_bits : 0; rt_formats; j--) {
+                queries[i].rt_format = rt_formats & -rt_formats;
+                if (j == 0)
+                    break;
+                rt_formats &= rt_formats - 1;
             }
-            break;
-        case VAConfigAttribQPBlockSize:
-            {
-                print_integer("qp_block_size", value);
+            queries[i].fourcc = vacaps_nb_fourccs(caps) ?
+                vacaps_fourcc(caps, (r >> 24) % vacaps_nb_fourccs(caps)) : 0;
+        } else {
+            queries[i].profile    = (int)(r >> 8 & 63) - 1;
+            queries[i].entrypoint = r >> 16 & 31;
+            queries[i].rt_format  = 1u << (r >> 24 & 31);
+            queries[i].fourcc     = r >> 32;
+        }
+    }
+
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        iterations[i] = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (j = 0; j < ARRAY_LENGTH(queries); j++) {
+                VAProfile    p = queries[j].profile;
+                VAEntrypoint e = queries[j].entrypoint;
+                unsigned int rt = queries[j].rt_format;
+                VACapsSizeRange range;
+                switch (i) {
+                case LOOKUP_SUPPORTS:
+                    sink += vacaps_supports(caps, p, e);
+                    break;
+                case LOOKUP_RT_FORMATS:
+                    sink += vacaps_rt_formats(caps, p, e);
+                    break;
+                case LOOKUP_PIXEL_FORMATS:
+                    sink += vacaps_pixel_formats(caps, p, e, rt);
+                    break;
+                case LOOKUP_SUPPORTS_PIXEL_FORMAT:
+                    sink += vacaps_supports_pixel_format(caps, p, e, rt,
+                                                         queries[j].fourcc);
+                    break;
+                case LOOKUP_SIZE_RANGE:
+                    if (!vacaps_size_range(caps, p, e, rt, &range))
+                        sink += range.max_width;
+                    break;
+                }
             }
-            break;
-#endif
-#if LIBVA(2, 5, 0)
-        case VAConfigAttribMaxFrameSize:
-            {
-                VAConfigAttribValMaxFrameSize mfs = { .value = value };
-                start_object("max_frame_size");
-                print_boolean("max_frame_size", mfs.bits.max_frame_size);
-                print_boolean("multiple_pass",  mfs.bits.multiple_pass);
-                end_object();
+            iterations[i] += ARRAY_LENGTH(queries);
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed[i] = (now.tv_sec - start.tv_sec) +
+                         (now.tv_nsec - start.tv_nsec) / 1e9;
+        } while (elapsed[i] < 0.25);
+    }
+
+    start_object(NULL);
+    print_double("create_us", 1e6 * create_seconds);
+    print_integer("supported_pairs", nb_pairs);
+    print_integer("fourccs", vacaps_nb_fourccs(caps));
+    start_array("lookups");
+    for (i = 0; i < LOOKUP_COUNT; i++) {
+        start_object(NULL);
+        print_string("lookup", "%s", lookup_names[i]);
+        print_integer("iterations", iterations[i]);
+        print_double("ns_per_lookup", 1e9 * elapsed[i] / iterations[i]);
+        end_object();
+    }
+    end_array();
+    // Printed so that the lookups cannot be optimised away.
+    print_integer("checksum", sink & INT64_MAX);
+    fdinfo_print();
+    end_object();
+
+    vacaps_device_destroy(caps);
+}
+
+/*
+ * Makes a device like base but missing some of its capabilities, with
+ * smaller size limits on some surfaces, to stand in for a fleet.
+ */
+static VACapsDevice *bench_match_device(const VACapsDevice *base,
+                                        uint64_t *state)
+{
+    VACapsDevice *caps = vacaps_device_alloc();
+    uint32_t fourccs[64];
+    int profile, i;
+
+    if (!caps)
+        die("Out of memory.\n");
+
+    for (profile = -1; profile < 63; profile++) {
+        uint32_t entrypoints = vacaps_entrypoints(base, profile);
+        while (entrypoints) {
+            VAEntrypoint entrypoint = __builtin_ctz(entrypoints);
+            unsigned int rt_formats;
+            entrypoints &= entrypoints - 1;
+            if (xorshift(state) % 8 == 0)
+                continue;
+
+            rt_formats = vacaps_rt_formats(base, profile, entrypoint);
+            vacaps_device_add_config(caps, profile, entrypoint, rt_formats);
+            while (rt_formats) {
+                unsigned int rt_format = rt_formats & -rt_formats;
+                uint64_t pixel_formats, r = xorshift(state);
+                VACapsSizeRange range;
+                int nb_fourccs = 0;
+                rt_formats &= rt_formats - 1;
+
+                if (vacaps_size_range(base, profile, entrypoint,
+                                      rt_format, &range))
+                    continue;
+                pixel_formats = vacaps_pixel_formats(base, profile,
+                                                     entrypoint, rt_format);
+                for (i = 0; i < vacaps_nb_fourccs(base); i++) {
+                    if (pixel_formats & UINT64_C(1) << i &&
+                        xorshift(state) % 8)
+                        fourccs[nb_fourccs++] = vacaps_fourcc(base, i);
+                }
+                if (r % 4 == 0) {
+                    range.max_width  /= 2;
+                    range.max_height /= 2;
+                }
+                vacaps_device_add_surface(caps, profile, entrypoint,
+                                          rt_format, fourccs, nb_fourccs,
+                                          &range);
             }
-            break;
+        }
+    }
+    return caps;
+}
+
+/*
+ * Measures the matcher against fleets of increasing size made from the
+ * probed devices, with each vector kernel available and with a plain
+ * loop over the devices doing single-device checks.  All of them must
+ * agree on every job.
+ */
+static void bench_match(VACapsDevice *const *base, int nb_base)
+{
+    static const int fleet_sizes[] = { 16, 128, 1024 };
+    static const char *const kernels[] = {
+        "per_device", "scalar", "sse2", "avx2",
+    };
+    static const int sizes[][2] = {
+        { 640, 480 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 },
+    };
+    enum { NB_JOBS = 4096, MAX_DEVICES = 1024 };
+    static struct job_spec jobs[NB_JOBS];
+    static VACapsJob vjobs[NB_JOBS];
+    static VACapsDevice *devices[MAX_DEVICES];
+    uint64_t state = 0x2545f4914f6cdd1d;
+    int f, k, i, j, d;
+
+    for (d = 0; d < MAX_DEVICES; d++)
+        devices[d] = bench_match_device(base[d % nb_base], &state);
+
+    // Jobs are drawn from what the probed devices support, with some
+    // constraints left out.
+    for (i = 0; i < NB_JOBS; i++) {
+        const VACapsDevice *caps = base[i % nb_base];
+        struct job_spec *job = &jobs[i];
+        uint64_t r = xorshift(&state);
+        int profile, nb_entrypoints;
+        uint32_t entrypoints;
+        unsigned int rt_formats;
+
+        *job = (struct job_spec) {
+            .has_profile = true, .has_entrypoint = true,
+        };
+        for (j = 0; j < 64; j++) {
+            profile = (int)(xorshift(&state) % 64) - 1;
+            if (vacaps_entrypoints(caps, profile))
+                break;
+        }
+        entrypoints = vacaps_entrypoints(caps, profile);
+        job->profile = profile;
+        nb_entrypoints = __builtin_popcount(entrypoints);
+        for (j = nb_entrypoints ? r % nb_entrypoints : 0; j > 0; j--)
+            entrypoints &= entrypoints - 1;
+        job->entrypoint = entrypoints ? __builtin_ctz(entrypoints) : 0;
+
+        rt_formats = vacaps_rt_formats(caps, profile, job->entrypoint);
+        if (rt_formats && r >> 8 & 3) {
+            for (j = (r >> 12) % __builtin_popcount(rt_formats); j > 0; j--)
+                rt_formats &= rt_formats - 1;
+            job->has_rt_format = true;
+            job->rt_format = rt_formats & -rt_formats;
+        }
+        if (vacaps_nb_fourccs(caps) && r >> 16 & 1) {
+            job->has_fourcc = true;
+            job->fourcc = vacaps_fourcc(caps, (r >> 20) %
+                                        vacaps_nb_fourccs(caps));
+        }
+        if (r >> 32 & 1) {
+            job->has_width  = job->has_height = true;
+            job->width  = sizes[r >> 40 & 3][0];
+            job->height = sizes[r >> 40 & 3][1];
+        }
+        job_spec_to_vacaps(job, &vjobs[i]);
+    }
+
+    start_object(NULL);
+    print_integer("probed_devices", nb_base);
+    print_integer("jobs", NB_JOBS);
+    start_array("runs");
+    for (f = 0; f < ARRAY_LENGTH(fleet_sizes); f++) {
+        int nb_devices = fleet_sizes[f];
+        VACapsMatcher *matcher =
+            vacaps_matcher_create((const VACapsDevice *const *)devices,
+                                  nb_devices);
+        if (!matcher)
+            die("Failed to create matcher.\n");
+        int words = vacaps_matcher_words(matcher);
+        uint64_t matched[words], expected = 0;
+
+        for (k = 0; k < ARRAY_LENGTH(kernels); k++) {
+            struct timespec start, now;
+            uint64_t checksum = 0, total = 0;
+            double elapsed;
+            long iterations = 0;
+
+            if (k > 0 && vacaps_matcher_set_kernel(matcher, kernels[k]))
+                continue;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            do {
+                checksum = total = 0;
+                for (i = 0; i < NB_JOBS; i++) {
+                    if (k == 0) {
+                        memset(matched, 0, sizeof(matched));
+                        for (d = 0; d < nb_devices; d++) {
+                            if (check_job_spec(devices[d], &jobs[i]) ==
+                                CHECK_OK)
+                                matched[d / 64] |= UINT64_C(1) << d % 64;
+                        }
+                    } else {
+                        vacaps_matcher_match(matcher, &vjobs[i], matched);
+                    }
+                    for (j = 0; j < words; j++) {
+                        checksum = (checksum ^ matched[j]) *
+                                   UINT64_C(0x100000001b3);
+                        total += __builtin_popcountll(matched[j]);
+                    }
+                }
+                iterations += NB_JOBS;
+
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                elapsed = (now.tv_sec - start.tv_sec) +
+                          (now.tv_nsec - start.tv_nsec) / 1e9;
+            } while (elapsed < 0.25);
+
+            if (k == 0)
+                expected = checksum;
+            else if (checksum != expected)
+                die("Matcher kernel %s disagrees with per-device checks "
+                    "for %d devices.\n", kernels[k], nb_devices);
+
+            start_object(NULL);
+            print_integer("devices", nb_devices);
+            print_string("kernel", "%s", kernels[k]);
+            print_integer("iterations", iterations);
+            print_double("matches_per_second", iterations / elapsed);
+            print_double("device_checks_per_second",
+                         (double)iterations * nb_devices / elapsed);
+            print_double("mean_matching_devices", (double)total / NB_JOBS);
+            end_object();
+        }
+        vacaps_matcher_destroy(matcher);
+    }
+    end_array();
+    end_object();
+
+    for (d = 0; d < MAX_DEVICES; d++)
+        vacaps_device_destroy(devices[d]);
+}
+
+/*
+ * Encoder speed and quality at each quality level (--bench-encode).
+ *
+ * The same synthetic sequence is encoded IPPP at a fixed QP with each
+ * quality level of each encoder.  Quality is the PSNR of the reconstructed
+ * frames (exactly what a decoder would show) against the source, and each
+ * frame goes through alone, so its latency runs from making its parameter
+ * buffers to vaSyncSurface().  Only H.264 has parameters written for it;
+ * other encoders are listed as skipped.
+ */
+#define BENCH_ENCODE_QP         26
+#define BENCH_ENCODE_FRAME_RATE 30
+// PSNR of identical frames, which would otherwise be infinite.
+#define BENCH_PSNR_MAX          100.0
+
+static int bench_width  = 1920;
+static int bench_height = 1080;
+static int bench_frames = 60;
+#define BENCH_MAX_DEPTH 16
+// Zero if not given.
+static double bench_psnr_floor;
+
+static void parse_bench_size(const char *arg)
+{
+    int len;
+    // The block moving across bench_frame() is a quarter of the height
+    // square, and must have room to move.
+    if (sscanf(arg, "%dx%d%n", &bench_width, &bench_height, &len) != 2 ||
+        arg[len] || bench_width < 16 || bench_height < 16 ||
+        bench_width > 16384 || bench_height > 16384 ||
+        bench_width % 2 || bench_height % 2 ||
+        bench_width <= bench_height / 4)
+        die("Invalid benchmark size %s.\n", arg);
+}
+
+// Sum of squared differences of two rows of at most 65536 samples.
+struct sse_kernel {
+    const char *name;
+    uint64_t (*sse)(const uint8_t *a, const uint8_t *b, int n);
+};
+
+static uint64_t scalar_sse(const uint8_t *a, const uint8_t *b, int n)
+{
+    uint64_t sum = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        int d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static const struct sse_kernel scalar_sse_kernel = {
+    .name = "scalar",
+    .sse  = &scalar_sse,
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Each 32-bit lane gains at most 2 * 2 * 255^2 per 16 samples, so a row
+// of 65536 can't overflow it.
+__attribute__((target("sse2")))
+static uint64_t sse2_sse(const uint8_t *a, const uint8_t *b, int n)
+{
+    __m128i zero = _mm_setzero_si128(), acc = _mm_setzero_si128();
+    uint32_t lanes[4];
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero),
+                                   _mm_unpacklo_epi8(y, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero),
+                                   _mm_unpackhi_epi8(y, zero));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           scalar_sse(a + i, b + i, n - i);
+}
+
+static const struct sse_kernel sse2_sse_kernel = {
+    .name = "sse2",
+    .sse  = &sse2_sse,
+};
+
+__attribute__((target("avx2")))
+static uint64_t avx2_sse(const uint8_t *a, const uint8_t *b, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    uint32_t lanes[8];
+    uint64_t sum;
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*)(a + i)));
+        __m256i y = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*)(b + i)));
+        __m256i d = _mm256_sub_epi16(x, y);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    sum = scalar_sse(a + i, b + i, n - i);
+    for (i = 0; i < 8; i++)
+        sum += lanes[i];
+    return sum;
+}
+
+static const struct sse_kernel avx2_sse_kernel = {
+    .name = "avx2",
+    .sse  = &avx2_sse,
+};
+
 #endif
-#if LIBVA(2, 6, 0)
-        case VAConfigAttribPredictionDirection:
-            {
-                start_array("prediction_direction");
-                AV(PREDICTION_DIRECTION, PREVIOUS);
-                AV(PREDICTION_DIRECTION, FUTURE);
-#if LIBVA(2, 8, 0)
-                AV(PREDICTION_DIRECTION, BI_NOT_EMPTY);
+
+static const struct sse_kernel *best_sse_kernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return &avx2_sse_kernel;
+    if (__builtin_cpu_supports("sse2"))
+        return &sse2_sse_kernel;
 #endif
-                end_array();
-            }
+    return &scalar_sse_kernel;
+}
+
+static double psnr(uint64_t sse, uint64_t samples)
+{
+    if (sse == 0)
+        return BENCH_PSNR_MAX;
+    return 10.0 * log10(255.0 * 255.0 * samples / sse);
+}
+
+static uint32_t bench_hash(uint32_t x, uint32_t y)
+{
+    uint32_t h = x * 73856093u ^ y * 19349663u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    return h ^ h >> 15;
+}
+
+// One NV12 frame of the sequence: a background of gradients scrolling at
+// different speeds, crossed by a square of fine texture, so that there is
+// both motion to find and detail to lose.
+static void bench_frame(uint8_t *frame, int width, int height, int index)
+{
+    uint8_t *luma = frame, *chroma = frame + width * height;
+    int size = height / 4;
+    int bx = index * 8 % (width - size);
+    int by = index * 3 % (height - size);
+    int x, y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            if (x >= bx && x < bx + size && y >= by && y < by + size)
+                luma[y * width + x] = 96 + (bench_hash(x - bx, y - by) & 63);
+            else
+                luma[y * width + x] = 64 + ((x + 2 * index) & 127) / 2 +
+                                      ((y + index) & 63);
+        }
+    }
+    for (y = 0; y < height / 2; y++) {
+        for (x = 0; x < width / 2; x++) {
+            bool in = 2 * x >= bx && 2 * x < bx + size &&
+                      2 * y >= by && 2 * y < by + size;
+            chroma[y * width + 2 * x]     = in ? 90  : 112 + ((x + index) & 31);
+            chroma[y * width + 2 * x + 1] = in ? 170 : 112 + (y & 31);
+        }
+    }
+}
+
+static VAStatus bench_upload(VADisplay display, VAImage *image,
+                             VASurfaceID surface, const uint8_t *frame,
+                             int width, int height)
+{
+    VAStatus vas;
+    uint8_t *data;
+    int y;
+
+    vas = vaMapBuffer(display, image->buf, (void**)&data);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    for (y = 0; y < height; y++)
+        memcpy(data + image->offsets[0] + y * image->pitches[0],
+               frame + y * width, width);
+    for (y = 0; y < height / 2; y++)
+        memcpy(data + image->offsets[1] + y * image->pitches[1],
+               frame + (height + y) * width, width);
+    vaUnmapBuffer(display, image->buf);
+
+    return vaPutImage(display, surface, image->image_id,
+                      0, 0, width, height, 0, 0, width, height);
+}
+
+// Squared errors of the luma and chroma of a surface against the frame.
+static VAStatus bench_compare(VADisplay display, VAImage *image,
+                              VASurfaceID surface, const uint8_t *frame,
+                              int width, int height,
+                              const struct sse_kernel *kernel,
+                              uint64_t *luma_sse, uint64_t *chroma_sse)
+{
+    VAStatus vas;
+    uint8_t *data;
+    int y;
+
+    vas = vaGetImage(display, surface, 0, 0, width, height, image->image_id);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    vas = vaMapBuffer(display, image->buf, (void**)&data);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+
+    *luma_sse = *chroma_sse = 0;
+    for (y = 0; y < height; y++)
+        *luma_sse += kernel->sse(data + image->offsets[0] +
+                                 y * image->pitches[0],
+                                 frame + y * width, width);
+    for (y = 0; y < height / 2; y++)
+        *chroma_sse += kernel->sse(data + image->offsets[1] +
+                                   y * image->pitches[1],
+                                   frame + (height + y) * width, width);
+
+    vaUnmapBuffer(display, image->buf);
+    return VA_STATUS_SUCCESS;
+}
+
+// Encodes reading from the given source surfaces, into reconstructed
+// surfaces and coded buffers of its own, used in turn.
+struct bench_encoder {
+    VADisplay display;
+    VAProfile profile;
+    int width;
+    int height;
+    int frames;
+    int width_in_mbs;
+    int height_in_mbs;
+    VAConfigID config;
+    VAContextID context;
+    bool have_recon;
+    VASurfaceID recon[2];
+    VABufferID coded[BENCH_MAX_DEPTH];
+    int nb_coded;
+};
+
+static VAStatus bench_encoder_init(struct bench_encoder *enc,
+                                   VADisplay display, VAProfile profile,
+                                   VAEntrypoint entrypoint,
+                                   int width, int height, int frames,
+                                   const VASurfaceID *sources,
+                                   int nb_sources, int nb_coded)
+{
+    VASurfaceID targets[BENCH_MAX_DEPTH + 2];
+    VAConfigAttrib attrs[] = {
+        { .type = VAConfigAttribRTFormat,    .value = VA_RT_FORMAT_YUV420 },
+        { .type = VAConfigAttribRateControl, .value = VA_RC_CQP },
+    };
+    VAStatus vas;
+
+    *enc = (struct bench_encoder) {
+        .display       = display,
+        .profile       = profile,
+        .width         = width,
+        .height        = height,
+        .frames        = frames,
+        .width_in_mbs  = (width  + 15) / 16,
+        .height_in_mbs = (height + 15) / 16,
+        .config        = VA_INVALID_ID,
+        .context       = VA_INVALID_ID,
+    };
+
+    vas = vaCreateConfig(display, profile, entrypoint,
+                         attrs, ARRAY_LENGTH(attrs), &enc->config);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420, width, height,
+                           enc->recon, 2, NULL, 0);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    enc->have_recon = true;
+
+    memcpy(targets, sources, nb_sources * sizeof(*sources));
+    targets[nb_sources]     = enc->recon[0];
+    targets[nb_sources + 1] = enc->recon[1];
+    vas = vaCreateContext(display, enc->config, width, height,
+                          VA_PROGRESSIVE, targets, nb_sources + 2,
+                          &enc->context);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+
+    for (; enc->nb_coded < nb_coded; enc->nb_coded++) {
+        vas = vaCreateBuffer(display, enc->context, VAEncCodedBufferType,
+                             width * height * 3 / 2, 1, NULL,
+                             &enc->coded[enc->nb_coded]);
+        if (vas != VA_STATUS_SUCCESS)
+            return vas;
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+static void bench_encoder_uninit(struct bench_encoder *enc)
+{
+    int i;
+    for (i = 0; i < enc->nb_coded; i++)
+        vaDestroyBuffer(enc->display, enc->coded[i]);
+    if (enc->context != VA_INVALID_ID)
+        vaDestroyContext(enc->display, enc->context);
+    if (enc->have_recon)
+        vaDestroySurfaces(enc->display, enc->recon, 2);
+    if (enc->config != VA_INVALID_ID)
+        vaDestroyConfig(enc->display, enc->config);
+}
+
+static VAPictureH264 bench_h264_picture(VASurfaceID surface, int index)
+{
+    return (VAPictureH264) {
+        .picture_id          = surface,
+        .frame_idx           = index,
+        .flags               = VA_PICTURE_H264_SHORT_TERM_REFERENCE,
+        .TopFieldOrderCnt    = 2 * index,
+        .BottomFieldOrderCnt = 2 * index,
+    };
+}
+
+static const VAPictureH264 bench_h264_invalid = {
+    .picture_id = VA_INVALID_SURFACE,
+    .flags      = VA_PICTURE_H264_INVALID,
+};
+
+// Makes the parameter buffers for frame index at the quality level,
+// returning how many were made.
+static int bench_h264_params(struct bench_encoder *enc, int index,
+                             unsigned int quality_level, VABufferID *buffers)
+{
+    VADisplay display = enc->display;
+    int mbs = enc->width_in_mbs * enc->height_in_mbs;
+    bool cabac = enc->profile != VAProfileH264ConstrainedBaseline &&
+                 enc->profile != VAProfileH264Baseline;
+    int nb_buffers = 0;
+    VAStatus vas;
+    int i;
+
+    if (index == 0) {
+        VAEncSequenceParameterBufferH264 seq = {
+            .level_idc             = mbs <= 8192 ? 41 : mbs <= 36864 ? 51 : 62,
+            .intra_period          = enc->frames,
+            .intra_idr_period      = enc->frames,
+            .ip_period             = 1,
+            .max_num_ref_frames    = 1,
+            .picture_width_in_mbs  = enc->width_in_mbs,
+            .picture_height_in_mbs = enc->height_in_mbs,
+            .seq_fields.bits = {
+                .chroma_format_idc                 = 1,
+                .frame_mbs_only_flag               = 1,
+                .direct_8x8_inference_flag         = 1,
+                .log2_max_frame_num_minus4         = 12,
+                .log2_max_pic_order_cnt_lsb_minus4 = 12,
+            },
+        };
+        if (enc->width % 16 || enc->height % 16) {
+            seq.frame_cropping_flag       = 1;
+            seq.frame_crop_right_offset   =
+                (16 * enc->width_in_mbs - enc->width) / 2;
+            seq.frame_crop_bottom_offset  =
+                (16 * enc->height_in_mbs - enc->height) / 2;
+        }
+        vas = vaCreateBuffer(display, enc->context,
+                             VAEncSequenceParameterBufferType,
+                             sizeof(seq), 1, &seq, &buffers[nb_buffers]);
+        if (vas != VA_STATUS_SUCCESS)
+            return -1;
+        ++nb_buffers;
+
+        if (quality_level) {
+            uint8_t misc[sizeof(VAEncMiscParameterBuffer) +
+                         sizeof(VAEncMiscParameterBufferQualityLevel)];
+            VAEncMiscParameterBuffer header = {
+                .type = VAEncMiscParameterTypeQualityLevel,
+            };
+            VAEncMiscParameterBufferQualityLevel quality = {
+                .quality_level = quality_level,
+            };
+            memcpy(misc, &header, sizeof(header));
+            memcpy(misc + sizeof(header), &quality, sizeof(quality));
+            vas = vaCreateBuffer(display, enc->context,
+                                 VAEncMiscParameterBufferType,
+                                 sizeof(misc), 1, misc,
+                                 &buffers[nb_buffers]);
+            if (vas != VA_STATUS_SUCCESS)
+                goto fail;
+            ++nb_buffers;
+        }
+    }
+
+    VAEncPictureParameterBufferH264 pic = {
+        .CurrPic      = bench_h264_picture(enc->recon[index % 2], index),
+        .coded_buf    = enc->coded[index % enc->nb_coded],
+        .last_picture = index == enc->frames - 1,
+        .frame_num    = index,
+        .pic_init_qp  = BENCH_ENCODE_QP,
+        .pic_fields.bits = {
+            .idr_pic_flag                           = index == 0,
+            .reference_pic_flag                     = 1,
+            .entropy_coding_mode_flag               = cabac,
+            .transform_8x8_mode_flag                =
+                enc->profile == VAProfileH264High,
+            .deblocking_filter_control_present_flag = 1,
+        },
+    };
+    for (i = 0; i < ARRAY_LENGTH(pic.ReferenceFrames); i++)
+        pic.ReferenceFrames[i] = bench_h264_invalid;
+    if (index > 0)
+        pic.ReferenceFrames[0] =
+            bench_h264_picture(enc->recon[(index - 1) % 2], index - 1);
+    vas = vaCreateBuffer(display, enc->context,
+                         VAEncPictureParameterBufferType,
+                         sizeof(pic), 1, &pic, &buffers[nb_buffers]);
+    if (vas != VA_STATUS_SUCCESS)
+        goto fail;
+    ++nb_buffers;
+
+    VAEncSliceParameterBufferH264 slice = {
+        .num_macroblocks   = mbs,
+        .macroblock_info   = VA_INVALID_ID,
+        .slice_type        = index == 0 ? 2 : 0,
+        .pic_order_cnt_lsb = 2 * index,
+    };
+    for (i = 0; i < ARRAY_LENGTH(slice.RefPicList0); i++) {
+        slice.RefPicList0[i] = bench_h264_invalid;
+        slice.RefPicList1[i] = bench_h264_invalid;
+    }
+    if (index > 0)
+        slice.RefPicList0[0] = pic.ReferenceFrames[0];
+    vas = vaCreateBuffer(display, enc->context,
+                         VAEncSliceParameterBufferType,
+                         sizeof(slice), 1, &slice, &buffers[nb_buffers]);
+    if (vas != VA_STATUS_SUCCESS)
+        goto fail;
+    return nb_buffers + 1;
+
+fail:
+    for (i = 0; i < nb_buffers; i++)
+        vaDestroyBuffer(display, buffers[i]);
+    return -1;
+}
+
+static VAStatus bench_encode_submit(struct bench_encoder *enc, int index,
+                                    unsigned int quality_level,
+                                    VASurfaceID source)
+{
+    VABufferID buffers[4];
+    VAStatus vas;
+    int i, nb_buffers;
+
+    nb_buffers = bench_h264_params(enc, index, quality_level, buffers);
+    if (nb_buffers < 0)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    vas = vaBeginPicture(enc->display, enc->context, source);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaRenderPicture(enc->display, enc->context,
+                              buffers, nb_buffers);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaEndPicture(enc->display, enc->context);
+    for (i = 0; i < nb_buffers; i++)
+        vaDestroyBuffer(enc->display, buffers[i]);
+    return vas;
+}
+
+// Adds the size of the coded frame index to bytes, and appends the frame
+// itself to stream if it is given.
+static VAStatus bench_encode_output(struct bench_encoder *enc, int index,
+                                    uint64_t *bytes,
+                                    struct tape_buffer *stream)
+{
+    VABufferID coded = enc->coded[index % enc->nb_coded];
+    VACodedBufferSegment *segment;
+    VAStatus vas;
+
+    vas = vaMapBuffer(enc->display, coded, (void**)&segment);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    for (; segment; segment = segment->next) {
+        *bytes += segment->size;
+        if (stream)
+            tape_append(stream, segment->buf, segment->size);
+    }
+    return vaUnmapBuffer(enc->display, coded);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the latencies and writes their distribution in milliseconds.
+static void print_latency(const char *tag, uint64_t *latency_ns, int count)
+{
+    uint64_t total = 0;
+    int i;
+
+    qsort(latency_ns, count, sizeof(*latency_ns), &compare_u64);
+    for (i = 0; i < count; i++)
+        total += latency_ns[i];
+
+    start_object(tag);
+    print_double("mean", total / 1e6 / count);
+    print_double("p50", latency_ns[count / 2] / 1e6);
+    print_double("p95", latency_ns[count * 95 / 100] / 1e6);
+    print_double("p99", latency_ns[count * 99 / 100] / 1e6);
+    print_double("max", latency_ns[count - 1] / 1e6);
+    end_object();
+}
+
+// Writes the CPU used on average by each of count frames.
+static void cpu_print(const char *tag, const struct cpu_usage *usage,
+                      uint64_t count)
+{
+    if (!cpu_stats.enabled || !count)
+        return;
+
+    start_object(tag);
+    print_double("us_per_frame", usage->value[CPU_NS] / 1e3 / count);
+    if (cpu_stats.have[CPU_CYCLES])
+        print_double("cycles_per_frame",
+                     (double)usage->value[CPU_CYCLES] / count);
+    if (cpu_stats.have[CPU_INSTRUCTIONS])
+        print_double("instructions_per_frame",
+                     (double)usage->value[CPU_INSTRUCTIONS] / count);
+    print_double("context_switches_per_frame",
+                 (double)usage->value[CPU_SWITCHES] / count);
+    end_object();
+}
+
+struct bench_level_result {
+    double fps;
+    double psnr;
+};
+
+// Encodes the whole sequence at one quality level, writing the results.
+static VAStatus bench_encode_level(struct bench_encoder *enc,
+                                   unsigned int quality_level,
+                                   VASurfaceID source,
+                                   VAImage *upload, VAImage *download,
+                                   uint8_t *frame,
+                                   const struct sse_kernel *kernel,
+                                   struct bench_level_result *result)
+{
+    VADisplay display = enc->display;
+    uint64_t *latency = calloc(bench_frames, sizeof(*latency));
+    uint64_t total_ns = 0, bytes = 0, luma_sse, chroma_sse;
+    uint64_t luma_samples   = (uint64_t)bench_width * bench_height;
+    uint64_t chroma_samples = luma_samples / 2;
+    double psnr_y = 0, psnr_chroma = 0, psnr_all = 0, psnr_min = INFINITY;
+    struct cpu_usage cpu = { { 0 } }, cpu_start;
+    VAStatus vas = VA_STATUS_SUCCESS;
+    int i;
+
+    if (!latency)
+        die("Out of memory.\n");
+
+    fdinfo_begin();
+    for (i = 0; i < bench_frames; i++) {
+        bench_frame(frame, bench_width, bench_height, i);
+        vas = bench_upload(display, upload, source, frame,
+                           bench_width, bench_height);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-        case VAConfigAttribMultipleFrame:
-            {
-                VAConfigAttribValMultipleFrame mf = { .value = value };
-                start_object("multiple_frame");
-                print_integer("max_num_concurrent_frames",
-                              mf.bits.max_num_concurrent_frames);
-                print_boolean("mixed_quality_level",
-                              mf.bits.mixed_quality_level);
-                end_object();
-            }
+
+        uint64_t start = clock_ns();
+        cpu_read(&cpu_start);
+        vas = bench_encode_submit(enc, i, quality_level, source);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, source);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-#endif
-#if LIBVA(2, 9, 0)
-        case VAConfigAttribContextPriority:
-            {
-                VAConfigAttribValContextPriority cp = { .value = value };
-                start_object("context_priority");
-                print_integer("priority", cp.bits.priority);
-                end_object();
-            }
+        cpu_add(&cpu, &cpu_start);
+        latency[i] = clock_ns() - start;
+        total_ns += latency[i];
+
+        vas = bench_encode_output(enc, i, &bytes, NULL);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-#endif
-#if LIBVA(2, 11, 0)
-        case VAConfigAttribDecAV1Features:
-            {
-                VAConfigAttribValDecAV1Features daf = { .value = value };
-                start_object("dec_av1_features");
-                print_boolean("lst_support", daf.bits.lst_support);
-                end_object();
-            }
+
+        vas = bench_compare(display, download, enc->recon[i % 2], frame,
+                            bench_width, bench_height, kernel,
+                            &luma_sse, &chroma_sse);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-        case VAConfigAttribTEEType:
-            {
-                print_integer("tee_type", value);
-            }
+        double p = psnr(luma_sse + chroma_sse, luma_samples + chroma_samples);
+        psnr_y      += psnr(luma_sse, luma_samples);
+        psnr_chroma += psnr(chroma_sse, chroma_samples);
+        psnr_all    += p;
+        if (p < psnr_min)
+            psnr_min = p;
+    }
+    if (vas != VA_STATUS_SUCCESS) {
+        free(latency);
+        return vas;
+    }
+
+    result->fps  = total_ns ? 1e9 * bench_frames / total_ns : 0;
+    result->psnr = psnr_all / bench_frames;
+
+    start_object(NULL);
+    print_integer("quality_level", quality_level);
+    print_double("fps", result->fps);
+    print_latency("latency_ms", latency, bench_frames);
+    print_integer("bytes", bytes);
+    print_double("bitrate_kbps", bytes * 8.0 * BENCH_ENCODE_FRAME_RATE /
+                                 bench_frames / 1000);
+    print_double("psnr_y", psnr_y / bench_frames);
+    print_double("psnr_chroma", psnr_chroma / bench_frames);
+    print_double("psnr", result->psnr);
+    print_double("min_psnr", psnr_min);
+    cpu_print("cpu", &cpu, bench_frames);
+    fdinfo_print();
+    end_object();
+
+    free(latency);
+    return VA_STATUS_SUCCESS;
+}
+
+static bool bench_h264_profile(VAProfile profile)
+{
+    return profile == VAProfileH264ConstrainedBaseline ||
+           profile == VAProfileH264Main ||
+           profile == VAProfileH264High;
+}
+
+// Why the benchmarks can't use an encoder, or NULL if they can.  Also
+// finds the number of quality levels it has.
+static const char *bench_encoder_unusable(VADisplay display,
+                                          VAProfile profile,
+                                          VAEntrypoint entrypoint,
+                                          unsigned int *nb_levels)
+{
+    VAConfigAttrib attrs[] = {
+        { .type = VAConfigAttribRTFormat        },
+        { .type = VAConfigAttribRateControl     },
+        { .type = VAConfigAttribEncQualityRange },
+    };
+
+    if (!bench_h264_profile(profile))
+        return "no parameters for this codec";
+    if (vaGetConfigAttributes(display, profile, entrypoint,
+                              attrs, ARRAY_LENGTH(attrs)) !=
+        VA_STATUS_SUCCESS)
+        return "attributes not available";
+    if (attrs[0].value == VA_ATTRIB_NOT_SUPPORTED ||
+        !(attrs[0].value & VA_RT_FORMAT_YUV420))
+        return "no 4:2:0 support";
+    if (attrs[1].value == VA_ATTRIB_NOT_SUPPORTED ||
+        !(attrs[1].value & VA_RC_CQP))
+        return "no constant-QP rate control";
+    // Level 0 is the driver default, used if there are no others.
+    *nb_levels = attrs[2].value == VA_ATTRIB_NOT_SUPPORTED ? 0 :
+                 attrs[2].value;
+    return NULL;
+}
+
+static void bench_encoder(VADisplay display, VAProfile profile,
+                          VAEntrypoint entrypoint,
+                          const VAImageFormat *nv12,
+                          const struct sse_kernel *kernel, uint8_t *frame)
+{
+    struct bench_encoder enc = {
+        .display = display,
+        .config  = VA_INVALID_ID,
+        .context = VA_INVALID_ID,
+    };
+    VAImage upload = { .image_id = VA_INVALID_ID };
+    VAImage download = { .image_id = VA_INVALID_ID };
+    VASurfaceID source = VA_INVALID_SURFACE;
+    const char *error = NULL, *skipped;
+    unsigned int level, nb_levels;
+    int fastest = -1;
+    double fastest_fps = 0;
+    VAStatus vas;
+
+    start_object(NULL);
+    print_string("profile", "%s", va_profile_name(profile));
+    print_string("entrypoint", "%s", va_entrypoint_name(entrypoint));
+
+    skipped = bench_encoder_unusable(display, profile, entrypoint,
+                                     &nb_levels);
+    if (skipped) {
+        print_string("skipped", "%s", skipped);
+        end_object();
+        return;
+    }
+    print_integer("quality_levels", nb_levels);
+
+    vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420,
+                           bench_width, bench_height, &source, 1, NULL, 0);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = bench_encoder_init(&enc, display, profile, entrypoint,
+                                 bench_width, bench_height, bench_frames,
+                                 &source, 1, 1);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaCreateImage(display, (VAImageFormat*)nv12,
+                            bench_width, bench_height, &upload);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaCreateImage(display, (VAImageFormat*)nv12,
+                            bench_width, bench_height, &download);
+    if (vas != VA_STATUS_SUCCESS) {
+        error = vaErrorStr(vas);
+        goto done;
+    }
+
+    start_array("levels");
+    for (level = nb_levels ? 1 : 0; level <= nb_levels; level++) {
+        struct bench_level_result result;
+        vas = bench_encode_level(&enc, level, source, &upload, &download,
+                                 frame, kernel, &result);
+        if (vas != VA_STATUS_SUCCESS) {
+            error = vaErrorStr(vas);
             break;
-        case VAConfigAttribTEETypeClient:
-            {
-                print_integer("tee_type_client", value);
-            }
+        }
+        if (bench_psnr_floor > 0 && result.psnr >= bench_psnr_floor &&
+            result.fps > fastest_fps) {
+            fastest     = level;
+            fastest_fps = result.fps;
+        }
+    }
+    end_array();
+
+    // Left out if no level reached the floor.
+    if (fastest >= 0)
+        print_integer("fastest_level", fastest);
+
+done:
+    if (error)
+        print_string("error", "%s", error);
+    end_object();
+
+    if (download.image_id != VA_INVALID_ID)
+        vaDestroyImage(display, download.image_id);
+    if (upload.image_id != VA_INVALID_ID)
+        vaDestroyImage(display, upload.image_id);
+    bench_encoder_uninit(&enc);
+    if (source != VA_INVALID_SURFACE)
+        vaDestroySurfaces(display, &source, 1);
+}
+
+// The image format the benchmark sequence is uploaded in.
+static VAImageFormat bench_nv12_format(VADisplay display)
+{
+    VAImageFormat nv12 = { 0 };
+    int i;
+
+    int nb_formats = vaMaxNumImageFormats(display);
+    VAImageFormat *formats = calloc(nb_formats, sizeof(*formats));
+    if (!formats ||
+        vaQueryImageFormats(display, formats, &nb_formats) !=
+        VA_STATUS_SUCCESS)
+        nb_formats = 0;
+    for (i = 0; i < nb_formats; i++) {
+        if (formats[i].fourcc == VA_FOURCC_NV12)
+            nv12 = formats[i];
+    }
+    free(formats);
+    if (!nv12.fourcc)
+        die("No NV12 images to make the benchmark sequence with.\n");
+    return nv12;
+}
+
+static void bench_encode(VADisplay display)
+{
+    const struct sse_kernel *kernel = best_sse_kernel();
+    VAImageFormat nv12 = bench_nv12_format(display);
+    int i, j;
+
+    int nb_profiles = vaMaxNumProfiles(display);
+    VAProfile *profiles = calloc(nb_profiles, sizeof(*profiles));
+    int nb_entrypoints = vaMaxNumEntrypoints(display);
+    VAEntrypoint *entrypoints = calloc(nb_entrypoints, sizeof(*entrypoints));
+    uint8_t *frame = malloc((size_t)bench_width * bench_height * 3 / 2);
+    if (!profiles || !entrypoints || !frame)
+        die("Out of memory.\n");
+    if (vaQueryConfigProfiles(display, profiles, &nb_profiles) !=
+        VA_STATUS_SUCCESS)
+        die("Failed to query profiles.\n");
+
+    start_object(NULL);
+    print_string("device", "%s", device_path);
+    print_integer("width",  bench_width);
+    print_integer("height", bench_height);
+    print_integer("frames", bench_frames);
+    print_integer("frame_rate", BENCH_ENCODE_FRAME_RATE);
+    print_integer("qp", BENCH_ENCODE_QP);
+    print_string("psnr_kernel", "%s", kernel->name);
+    if (bench_psnr_floor > 0)
+        print_double("psnr_floor", bench_psnr_floor);
+
+    start_array("encoders");
+    for (i = 0; i < nb_profiles; i++) {
+        int count = nb_entrypoints;
+        if (vaQueryConfigEntrypoints(display, profiles[i], entrypoints,
+                                     &count) != VA_STATUS_SUCCESS)
+            continue;
+        for (j = 0; j < count; j++) {
+            if (entrypoints[j] == VAEntrypointEncSlice ||
+                entrypoints[j] == VAEntrypointEncSliceLP)
+                bench_encoder(display, profiles[i], entrypoints[j],
+                              &nv12, kernel, frame);
+        }
+    }
+    end_array();
+    end_object();
+
+    free(frame);
+    free(entrypoints);
+    free(profiles);
+}
+
+/*
+ * Decode, scale and encode chained on the device (--bench-transcode).
+ *
+ * The H.264 stream to decode is made first, by encoding the benchmark
+ * sequence at --bench-size, and its headers are parsed here to give the
+ * decoder its parameters.  Each decoded frame is scaled to every size of
+ * the ladder and encoded there, with surfaces passed straight from one
+ * stage to the next and up to --bench-depth frames in flight.  Each stage
+ * is also timed alone on every frame; its utilisation is that time
+ * multiplied by the frame rate of the whole chain, so the stage nearest
+ * 100% is the one holding it back.
+ */
+#define TRANSCODE_MAX_RUNGS 8
+
+static VAProfile transcode_decode_profile = VAProfileH264Main;
+static VAProfile transcode_encode_profile = VAProfileH264Main;
+
+static const char *const default_bench_ladder = "1280x720,640x360";
+static struct {
+    int width;
+    int height;
+} bench_ladder[TRANSCODE_MAX_RUNGS];
+static int nb_bench_ladder;
+static int bench_depth = 4;
+
+static void parse_transcode_profiles(const char *arg)
+{
+    const char *colon = strchr(arg, ':');
+    int64_t decode, encode;
+
+    init_name_hashes();
+    if (!colon ||
+        !name_hash_find(&profile_names, arg, colon - arg, &decode) ||
+        !name_hash_find(&profile_names, colon + 1, strlen(colon + 1),
+                        &encode))
+        die("Invalid transcode profiles %s.\n", arg);
+    if (!bench_h264_profile(decode))
+        die("Only H.264 streams can be made to decode.\n");
+    transcode_decode_profile = decode;
+    transcode_encode_profile = encode;
+}
+
+static void parse_bench_ladder(const char *list)
+{
+    const char *p = list;
+    int width, height, len;
+
+    nb_bench_ladder = 0;
+    while (*p) {
+        if (sscanf(p, "%dx%d%n", &width, &height, &len) != 2 ||
+            width < 16 || height < 16 || width > 16384 || height > 16384 ||
+            width % 2 || height % 2 || (p[len] && p[len] != ','))
+            die("Invalid ladder %s.\n", list);
+        if (nb_bench_ladder >= TRANSCODE_MAX_RUNGS)
+            die("Too many ladder sizes.\n");
+        bench_ladder[nb_bench_ladder].width  = width;
+        bench_ladder[nb_bench_ladder].height = height;
+        ++nb_bench_ladder;
+        p += len;
+        if (*p)
+            ++p;
+    }
+}
+
+// Reads H.264 RBSP (with emulation prevention removed), giving zeroes
+// past the end.
+struct h264_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+};
+
+static uint32_t h264_read(struct h264_reader *r, int bits)
+{
+    uint32_t value = 0;
+    for (; bits > 0; bits--, r->pos++) {
+        value <<= 1;
+        if (r->pos < 8 * r->size)
+            value |= r->data[r->pos / 8] >> (7 - r->pos % 8) & 1;
+    }
+    return value;
+}
+
+static uint32_t h264_read_ue(struct h264_reader *r)
+{
+    int zeros = 0;
+    while (zeros < 32 && !h264_read(r, 1))
+        ++zeros;
+    if (zeros == 32)
+        return UINT32_MAX;
+    return (1u << zeros) - 1 + h264_read(r, zeros);
+}
+
+static int32_t h264_read_se(struct h264_reader *r)
+{
+    uint32_t k = h264_read_ue(r);
+    return k & 1 ? (int32_t)(k / 2 + 1) : -(int32_t)(k / 2);
+}
+
+static bool h264_overrun(const struct h264_reader *r)
+{
+    return r->pos > 8 * r->size;
+}
+
+// Whether there is anything before the RBSP stop bit.
+static bool h264_more_data(const struct h264_reader *r)
+{
+    size_t last = r->size;
+    while (last > 0 && !r->data[last - 1])
+        --last;
+    if (!last)
+        return false;
+    return r->pos < 8 * last - 1 - __builtin_ctz(r->data[last - 1]);
+}
+
+static size_t h264_unescape(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t i, n = 0;
+    int zeros = 0;
+    for (i = 0; i < size; i++) {
+        if (zeros >= 2 && src[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] ? 0 : zeros + 1;
+    }
+    return n;
+}
+
+// The position of the next start code at or after pos, or size.
+static size_t h264_next_start(const uint8_t *data, size_t size, size_t pos)
+{
+    for (; pos + 3 <= size; pos++) {
+        if (!data[pos] && !data[pos + 1] && data[pos + 2] == 1)
+            return pos;
+    }
+    return size;
+}
+
+struct transcode_slice {
+    size_t offset;
+    VASliceParameterBufferH264 param;
+};
+
+// Pictures in the parameters are identified by frame index until they
+// are submitted.
+struct transcode_frame {
+    VAPictureParameterBufferH264 pic;
+    struct transcode_slice *slices;
+    int nb_slices;
+};
+
+struct h264_stream {
+    // Filled from the SPS and PPS.
+    VAPictureParameterBufferH264 pic;
+    bool have_sps;
+    bool have_pps;
+    unsigned int pps_id;
+    int num_ref_idx_l0_default;
+
+    // Short-term references, oldest first.
+    VAPictureH264 refs[16];
+    int nb_refs;
+    int max_refs;
+    int prev_poc_msb;
+    int prev_poc_lsb;
+    int prev_frame_num;
+    int frame_num_offset;
+
+    struct transcode_frame *frames;
+    int nb_frames;
+};
+
+static const char *h264_parse_sps(struct h264_stream *s,
+                                  struct h264_reader *r)
+{
+    VAPictureParameterBufferH264 *pic = &s->pic;
+    int profile_idc, level_idc;
+    uint32_t v;
+
+    profile_idc = h264_read(r, 8);
+    h264_read(r, 8);
+    level_idc   = h264_read(r, 8);
+    h264_read_ue(r);
+
+    pic->seq_fields.bits.chroma_format_idc = 1;
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
+        profile_idc == 244 || profile_idc == 44  || profile_idc == 83  ||
+        profile_idc == 86  || profile_idc == 118 || profile_idc == 128 ||
+        profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+        profile_idc == 135) {
+        if (h264_read_ue(r) != 1)
+            return "stream is not 4:2:0";
+        if (h264_read_ue(r) || h264_read_ue(r))
+            return "stream is not 8-bit";
+        h264_read(r, 1);
+        if (h264_read(r, 1))
+            return "stream has scaling matrices";
+    }
+
+    v = h264_read_ue(r);
+    if (v > 12)
+        return "invalid log2_max_frame_num";
+    pic->seq_fields.bits.log2_max_frame_num_minus4 = v;
+    v = h264_read_ue(r);
+    if (v == 1 || v > 2)
+        return "unsupported picture order count type";
+    pic->seq_fields.bits.pic_order_cnt_type = v;
+    if (v == 0) {
+        v = h264_read_ue(r);
+        if (v > 12)
+            return "invalid log2_max_pic_order_cnt_lsb";
+        pic->seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 = v;
+    }
+    v = h264_read_ue(r);
+    if (v > 16)
+        return "invalid max_num_ref_frames";
+    pic->num_ref_frames = v;
+    s->max_refs = v ? v : 1;
+    pic->seq_fields.bits.gaps_in_frame_num_value_allowed_flag =
+        h264_read(r, 1);
+    v = h264_read_ue(r);
+    if (v > 1023)
+        return "invalid picture width";
+    pic->picture_width_in_mbs_minus1 = v;
+    v = h264_read_ue(r);
+    if (v > 1023)
+        return "invalid picture height";
+    pic->picture_height_in_mbs_minus1 = v;
+    if (!h264_read(r, 1))
+        return "stream is interlaced";
+    pic->seq_fields.bits.frame_mbs_only_flag = 1;
+    pic->seq_fields.bits.direct_8x8_inference_flag = h264_read(r, 1);
+    pic->seq_fields.bits.MinLumaBiPredSize8x8 = level_idc >= 31;
+
+    if (h264_overrun(r))
+        return "truncated SPS";
+    s->have_sps = true;
+    return NULL;
+}
+
+static const char *h264_parse_pps(struct h264_stream *s,
+                                  struct h264_reader *r)
+{
+    VAPictureParameterBufferH264 *pic = &s->pic;
+    uint32_t v;
+
+    s->pps_id = h264_read_ue(r);
+    h264_read_ue(r);
+    pic->pic_fields.bits.entropy_coding_mode_flag = h264_read(r, 1);
+    pic->pic_fields.bits.pic_order_present_flag   = h264_read(r, 1);
+    if (h264_read_ue(r))
+        return "stream has slice groups";
+    v = h264_read_ue(r);
+    if (v > 31)
+        return "invalid num_ref_idx_l0_default_active";
+    s->num_ref_idx_l0_default = v + 1;
+    h264_read_ue(r);
+    pic->pic_fields.bits.weighted_pred_flag  = h264_read(r, 1);
+    pic->pic_fields.bits.weighted_bipred_idc = h264_read(r, 2);
+    pic->pic_init_qp_minus26    = h264_read_se(r);
+    pic->pic_init_qs_minus26    = h264_read_se(r);
+    pic->chroma_qp_index_offset = h264_read_se(r);
+    pic->pic_fields.bits.deblocking_filter_control_present_flag =
+        h264_read(r, 1);
+    pic->pic_fields.bits.constrained_intra_pred_flag    = h264_read(r, 1);
+    pic->pic_fields.bits.redundant_pic_cnt_present_flag = h264_read(r, 1);
+    if (h264_more_data(r)) {
+        pic->pic_fields.bits.transform_8x8_mode_flag = h264_read(r, 1);
+        if (h264_read(r, 1))
+            return "stream has scaling matrices";
+        pic->second_chroma_qp_index_offset = h264_read_se(r);
+    } else {
+        pic->pic_fields.bits.transform_8x8_mode_flag = 0;
+        pic->second_chroma_qp_index_offset = pic->chroma_qp_index_offset;
+    }
+
+    if (h264_overrun(r))
+        return "truncated PPS";
+    s->have_pps = true;
+    return NULL;
+}
+
+// Starts a new frame, working out its order count and references.
+static void h264_start_frame(struct h264_stream *s, bool idr, int ref_idc,
+                             int frame_num, int poc_lsb, int delta_bottom)
+{
+    const VAPictureParameterBufferH264 *pic = &s->pic;
+    struct transcode_frame *frame;
+    int top, bottom, i;
+
+    if (idr) {
+        s->nb_refs = 0;
+        s->prev_poc_msb = s->prev_poc_lsb = 0;
+        s->prev_frame_num = s->frame_num_offset = 0;
+    }
+
+    if (pic->seq_fields.bits.pic_order_cnt_type == 0) {
+        int max_lsb = 1 << (pic->seq_fields.bits.
+                            log2_max_pic_order_cnt_lsb_minus4 + 4);
+        int msb = s->prev_poc_msb;
+        if (poc_lsb < s->prev_poc_lsb &&
+            s->prev_poc_lsb - poc_lsb >= max_lsb / 2)
+            msb += max_lsb;
+        else if (poc_lsb > s->prev_poc_lsb &&
+                 poc_lsb - s->prev_poc_lsb > max_lsb / 2)
+            msb -= max_lsb;
+        top    = msb + poc_lsb;
+        bottom = top + delta_bottom;
+        if (ref_idc) {
+            s->prev_poc_msb = msb;
+            s->prev_poc_lsb = poc_lsb;
+        }
+    } else {
+        if (!idr && s->prev_frame_num > frame_num)
+            s->frame_num_offset +=
+                1 << (pic->seq_fields.bits.log2_max_frame_num_minus4 + 4);
+        top = bottom = idr ? 0 : 2 * (s->frame_num_offset + frame_num) -
+                                 !ref_idc;
+    }
+    s->prev_frame_num = frame_num;
+
+    s->frames = realloc(s->frames, (s->nb_frames + 1) * sizeof(*s->frames));
+    if (!s->frames)
+        die("Out of memory.\n");
+    frame = &s->frames[s->nb_frames];
+    *frame = (struct transcode_frame) {
+        .pic = *pic,
+    };
+    frame->pic.CurrPic = (VAPictureH264) {
+        .picture_id          = s->nb_frames,
+        .frame_idx           = frame_num,
+        .TopFieldOrderCnt    = top,
+        .BottomFieldOrderCnt = bottom,
+    };
+    for (i = 0; i < ARRAY_LENGTH(frame->pic.ReferenceFrames); i++)
+        frame->pic.ReferenceFrames[i] = i < s->nb_refs ? s->refs[i] :
+                                        bench_h264_invalid;
+    frame->pic.frame_num = frame_num;
+    frame->pic.pic_fields.bits.reference_pic_flag = ref_idc != 0;
+    ++s->nb_frames;
+
+    // Sliding window marking.
+    if (ref_idc) {
+        if (s->nb_refs == s->max_refs)
+            memmove(&s->refs[0], &s->refs[1],
+                    --s->nb_refs * sizeof(s->refs[0]));
+        s->refs[s->nb_refs] = frame->pic.CurrPic;
+        s->refs[s->nb_refs].flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE;
+        ++s->nb_refs;
+    }
+}
+
+static const char *h264_parse_slice(struct h264_stream *s,
+                                    struct h264_reader *r, int nal_type,
+                                    int ref_idc, size_t offset, size_t size)
+{
+    const VAPictureParameterBufferH264 *pic = &s->pic;
+    VASliceParameterBufferH264 slice = {
+        .slice_data_size = size,
+        .slice_data_flag = VA_SLICE_DATA_FLAG_ALL,
+    };
+    bool idr = nal_type == 5;
+    int first_mb, slice_type, frame_num, num_ref_idx;
+    int poc_lsb = 0, delta_bottom = 0, i;
+
+    if (!s->have_sps || !s->have_pps)
+        return "slice before parameter sets";
+
+    first_mb   = h264_read_ue(r);
+    slice_type = h264_read_ue(r) % 5;
+    if (slice_type == 1)
+        return "stream has B slices";
+    if (slice_type > 2)
+        return "stream has switching slices";
+    if (h264_read_ue(r) != s->pps_id)
+        return "stream has several PPSs";
+    frame_num = h264_read(r, pic->seq_fields.bits.
+                          log2_max_frame_num_minus4 + 4);
+    if (idr)
+        h264_read_ue(r);
+    if (pic->seq_fields.bits.pic_order_cnt_type == 0) {
+        poc_lsb = h264_read(r, pic->seq_fields.bits.
+                            log2_max_pic_order_cnt_lsb_minus4 + 4);
+        if (pic->pic_fields.bits.pic_order_present_flag)
+            delta_bottom = h264_read_se(r);
+    }
+    if (pic->pic_fields.bits.redundant_pic_cnt_present_flag)
+        h264_read_ue(r);
+
+    num_ref_idx = s->num_ref_idx_l0_default;
+    if (slice_type == 0) {
+        if (h264_read(r, 1))
+            num_ref_idx = h264_read_ue(r) + 1;
+        if (num_ref_idx > 32)
+            return "invalid num_ref_idx_active";
+        if (h264_read(r, 1))
+            return "stream reorders references";
+        if (pic->pic_fields.bits.weighted_pred_flag)
+            return "stream has weighted prediction";
+    }
+    if (ref_idc) {
+        if (idr)
+            h264_read(r, 2);
+        else if (h264_read(r, 1))
+            return "stream has memory management operations";
+    }
+    if (pic->pic_fields.bits.entropy_coding_mode_flag && slice_type != 2)
+        slice.cabac_init_idc = h264_read_ue(r);
+    slice.slice_qp_delta = h264_read_se(r);
+    if (pic->pic_fields.bits.deblocking_filter_control_present_flag) {
+        slice.disable_deblocking_filter_idc = h264_read_ue(r);
+        if (slice.disable_deblocking_filter_idc != 1) {
+            slice.slice_alpha_c0_offset_div2 = h264_read_se(r);
+            slice.slice_beta_offset_div2     = h264_read_se(r);
+        }
+    }
+    if (h264_overrun(r))
+        return "truncated slice header";
+
+    if (first_mb == 0)
+        h264_start_frame(s, idr, ref_idc, frame_num, poc_lsb, delta_bottom);
+    else if (!s->nb_frames)
+        return "stream starts part way through a frame";
+
+    struct transcode_frame *frame = &s->frames[s->nb_frames - 1];
+    int nb_refs = 0;
+    while (nb_refs < ARRAY_LENGTH(frame->pic.ReferenceFrames) &&
+           !(frame->pic.ReferenceFrames[nb_refs].flags &
+             VA_PICTURE_H264_INVALID))
+        ++nb_refs;
+
+    slice.slice_data_bit_offset = r->pos;
+    slice.first_mb_in_slice     = first_mb;
+    slice.slice_type            = slice_type;
+    // The default list for P slices is the most recent first.
+    for (i = 0; i < ARRAY_LENGTH(slice.RefPicList0); i++) {
+        slice.RefPicList0[i] = bench_h264_invalid;
+        slice.RefPicList1[i] = bench_h264_invalid;
+    }
+    if (slice_type == 0) {
+        if (num_ref_idx > nb_refs)
+            return "slice has missing references";
+        slice.num_ref_idx_l0_active_minus1 = num_ref_idx - 1;
+        for (i = 0; i < num_ref_idx; i++)
+            slice.RefPicList0[i] = frame->pic.ReferenceFrames[nb_refs - 1 - i];
+    }
+
+    frame->slices = realloc(frame->slices, (frame->nb_slices + 1) *
+                            sizeof(*frame->slices));
+    if (!frame->slices)
+        die("Out of memory.\n");
+    frame->slices[frame->nb_slices++] = (struct transcode_slice) {
+        .offset = offset,
+        .param  = slice,
+    };
+    return NULL;
+}
+
+// Splits the stream into frames ready to decode, or returns why it can't.
+static const char *h264_parse(struct h264_stream *s,
+                              const uint8_t *data, size_t size)
+{
+    uint8_t *rbsp = malloc(size);
+    const char *error = NULL;
+    size_t start, end;
+
+    if (!rbsp)
+        die("Out of memory.\n");
+
+    for (start = h264_next_start(data, size, 0); start < size && !error;
+         start = end) {
+        start += 3;
+        end = h264_next_start(data, size, start);
+        size_t nal_size = end - start;
+        while (nal_size > 0 && !data[start + nal_size - 1])
+            --nal_size;
+        if (!nal_size)
+            continue;
+
+        struct h264_reader r = {
+            .data = rbsp,
+            .size = h264_unescape(rbsp, data + start, nal_size),
+        };
+        h264_read(&r, 1);
+        int ref_idc  = h264_read(&r, 2);
+        int nal_type = h264_read(&r, 5);
+        if (nal_type == 7)
+            error = h264_parse_sps(s, &r);
+        else if (nal_type == 8)
+            error = h264_parse_pps(s, &r);
+        else if (nal_type == 1 || nal_type == 5)
+            error = h264_parse_slice(s, &r, nal_type, ref_idc,
+                                     start, nal_size);
+    }
+    if (!error && !s->nb_frames)
+        error = "stream has no frames";
+
+    free(rbsp);
+    return error;
+}
+
+struct transcode_rung {
+    int width;
+    int height;
+    VAContextID vpp_context;
+    bool have_surfaces;
+    VASurfaceID surfaces[BENCH_MAX_DEPTH];
+    struct bench_encoder enc;
+
+    uint64_t vpp_ns;
+    uint64_t encode_ns;
+    struct cpu_usage vpp_cpu;
+    struct cpu_usage encode_cpu;
+    uint64_t bytes;
+};
+
+struct transcode {
+    VADisplay display;
+    int depth;
+
+    struct tape_buffer stream;
+    struct h264_stream h264;
+
+    VAConfigID decode_config;
+    VAContextID decode_context;
+    bool have_pool;
+    VASurfaceID pool[16 + BENCH_MAX_DEPTH + 1];
+    int nb_pool;
+    uint64_t decode_ns;
+    struct cpu_usage decode_cpu;
+
+    VAConfigID vpp_config;
+    struct transcode_rung rungs[TRANSCODE_MAX_RUNGS];
+    int nb_rungs;
+};
+
+// Encodes frames of the benchmark sequence at width x height into the
+// stream to be decoded.
+static VAStatus transcode_make_stream(struct transcode *t, VAProfile profile,
+                                      VAEntrypoint entrypoint,
+                                      int width, int height, int frames)
+{
+    VADisplay display = t->display;
+    VAImageFormat nv12 = bench_nv12_format(display);
+    struct bench_encoder enc = {
+        .display = display,
+        .config  = VA_INVALID_ID,
+        .context = VA_INVALID_ID,
+    };
+    VAImage upload = { .image_id = VA_INVALID_ID };
+    VASurfaceID source = VA_INVALID_SURFACE;
+    uint8_t *frame = malloc((size_t)width * height * 3 / 2);
+    uint64_t bytes = 0;
+    VAStatus vas;
+    int i;
+
+    if (!frame)
+        die("Out of memory.\n");
+
+    vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420,
+                           width, height, &source, 1, NULL, 0);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = bench_encoder_init(&enc, display, profile, entrypoint,
+                                 width, height, frames, &source, 1, 1);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaCreateImage(display, &nv12, width, height, &upload);
+    for (i = 0; i < frames && vas == VA_STATUS_SUCCESS; i++) {
+        bench_frame(frame, width, height, i);
+        vas = bench_upload(display, &upload, source, frame, width, height);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_encode_submit(&enc, i, 0, source);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, source);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_encode_output(&enc, i, &bytes, &t->stream);
+    }
+
+    if (upload.image_id != VA_INVALID_ID)
+        vaDestroyImage(display, upload.image_id);
+    bench_encoder_uninit(&enc);
+    if (source != VA_INVALID_SURFACE)
+        vaDestroySurfaces(display, &source, 1);
+    free(frame);
+    return vas;
+}
+
+static void transcode_map_picture(const struct transcode *t,
+                                  VAPictureH264 *picture)
+{
+    if (!(picture->flags & VA_PICTURE_H264_INVALID))
+        picture->picture_id = t->pool[picture->picture_id % t->nb_pool];
+}
+
+static VAStatus transcode_decode(struct transcode *t, int index)
+{
+    const struct transcode_frame *frame = &t->h264.frames[index];
+    VAPictureParameterBufferH264 pic = frame->pic;
+    VAIQMatrixBufferH264 iq;
+    VABufferID buffers[2 + 2 * frame->nb_slices];
+    VADisplay display = t->display;
+    VAStatus vas;
+    int i, j, nb_buffers = 0;
+
+    transcode_map_picture(t, &pic.CurrPic);
+    for (i = 0; i < ARRAY_LENGTH(pic.ReferenceFrames); i++)
+        transcode_map_picture(t, &pic.ReferenceFrames[i]);
+    memset(&iq, 0, sizeof(iq));
+    memset(iq.ScalingList4x4, 16, sizeof(iq.ScalingList4x4));
+    memset(iq.ScalingList8x8, 16, sizeof(iq.ScalingList8x8));
+
+    vas = vaCreateBuffer(display, t->decode_context,
+                         VAPictureParameterBufferType, sizeof(pic), 1,
+                         &pic, &buffers[nb_buffers]);
+    if (vas != VA_STATUS_SUCCESS)
+        goto done;
+    ++nb_buffers;
+    vas = vaCreateBuffer(display, t->decode_context, VAIQMatrixBufferType,
+                         sizeof(iq), 1, &iq, &buffers[nb_buffers]);
+    if (vas != VA_STATUS_SUCCESS)
+        goto done;
+    ++nb_buffers;
+
+    for (i = 0; i < frame->nb_slices; i++) {
+        VASliceParameterBufferH264 slice = frame->slices[i].param;
+        for (j = 0; j <= slice.num_ref_idx_l0_active_minus1; j++)
+            transcode_map_picture(t, &slice.RefPicList0[j]);
+        vas = vaCreateBuffer(display, t->decode_context,
+                             VASliceParameterBufferType, sizeof(slice), 1,
+                             &slice, &buffers[nb_buffers]);
+        if (vas != VA_STATUS_SUCCESS)
+            goto done;
+        ++nb_buffers;
+        vas = vaCreateBuffer(display, t->decode_context,
+                             VASliceDataBufferType, slice.slice_data_size, 1,
+                             t->stream.data + frame->slices[i].offset,
+                             &buffers[nb_buffers]);
+        if (vas != VA_STATUS_SUCCESS)
+            goto done;
+        ++nb_buffers;
+    }
+
+    vas = vaBeginPicture(display, t->decode_context, pic.CurrPic.picture_id);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaRenderPicture(display, t->decode_context,
+                              buffers, nb_buffers);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaEndPicture(display, t->decode_context);
+
+done:
+    for (i = 0; i < nb_buffers; i++)
+        vaDestroyBuffer(display, buffers[i]);
+    return vas;
+}
+
+// Scales decoded frame index into its slot in the rung.
+static VAStatus transcode_scale(struct transcode *t,
+                                struct transcode_rung *rung, int index)
+{
+    VARectangle input = {
+        .width  = bench_width,
+        .height = bench_height,
+    };
+    VAProcPipelineParameterBuffer params = {
+        .surface                 = t->pool[index % t->nb_pool],
+        .surface_region          = &input,
+        .output_background_color = 0xff000000,
+        .filter_flags            = VA_FILTER_SCALING_DEFAULT,
+    };
+    VABufferID buffer;
+    VAStatus vas;
+
+    vas = vaCreateBuffer(t->display, rung->vpp_context,
+                         VAProcPipelineParameterBufferType,
+                         sizeof(params), 1, &params, &buffer);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    vas = vaBeginPicture(t->display, rung->vpp_context,
+                         rung->surfaces[index % t->depth]);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaRenderPicture(t->display, rung->vpp_context, &buffer, 1);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaEndPicture(t->display, rung->vpp_context);
+    vaDestroyBuffer(t->display, buffer);
+    return vas;
+}
+
+static void transcode_reset(struct transcode *t, VADisplay display,
+                            int depth)
+{
+    int i;
+
+    *t = (struct transcode) {
+        .display        = display,
+        .depth          = depth,
+        .decode_config  = VA_INVALID_ID,
+        .decode_context = VA_INVALID_ID,
+        .vpp_config     = VA_INVALID_ID,
+    };
+    for (i = 0; i < TRANSCODE_MAX_RUNGS; i++) {
+        t->rungs[i].vpp_context = VA_INVALID_ID;
+        t->rungs[i].enc = (struct bench_encoder) {
+            .display = display,
+            .config  = VA_INVALID_ID,
+            .context = VA_INVALID_ID,
+        };
+    }
+}
+
+// Sets up decoding of the parsed stream.
+static VAStatus transcode_init_decode(struct transcode *t, VAProfile profile)
+{
+    VADisplay display = t->display;
+    const VAPictureParameterBufferH264 *pic = &t->h264.pic;
+    VAConfigAttrib attr = {
+        .type  = VAConfigAttribRTFormat,
+        .value = VA_RT_FORMAT_YUV420,
+    };
+    int coded_width  = 16 * (pic->picture_width_in_mbs_minus1 + 1);
+    int coded_height = 16 * (pic->picture_height_in_mbs_minus1 + 1);
+    VAStatus vas;
+
+    // Enough that a surface is neither referenced nor in flight when it
+    // comes round again.
+    t->nb_pool = t->h264.max_refs + t->depth + 1;
+
+    vas = vaCreateConfig(display, profile, VAEntrypointVLD,
+                         &attr, 1, &t->decode_config);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420,
+                           coded_width, coded_height,
+                           t->pool, t->nb_pool, NULL, 0);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    t->have_pool = true;
+    return vaCreateContext(display, t->decode_config,
+                           coded_width, coded_height, VA_PROGRESSIVE,
+                           t->pool, t->nb_pool, &t->decode_context);
+}
+
+// Adds a rung scaling to width x height, once the VPP config is made.
+static VAStatus transcode_init_rung(struct transcode *t,
+                                    int width, int height)
+{
+    struct transcode_rung *rung = &t->rungs[t->nb_rungs++];
+    VAStatus vas;
+
+    rung->width  = width;
+    rung->height = height;
+
+    vas = vaCreateSurfaces(t->display, VA_RT_FORMAT_YUV420,
+                           rung->width, rung->height,
+                           rung->surfaces, t->depth, NULL, 0);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+    rung->have_surfaces = true;
+    return vaCreateContext(t->display, t->vpp_config,
+                           rung->width, rung->height, VA_PROGRESSIVE,
+                           rung->surfaces, t->depth, &rung->vpp_context);
+}
+
+static VAStatus transcode_init(struct transcode *t, VAEntrypoint entrypoint)
+{
+    VADisplay display = t->display;
+    VAStatus vas;
+    int i;
+
+    vas = transcode_init_decode(t, transcode_decode_profile);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+
+    vas = vaCreateConfig(display, VAProfileNone, VAEntrypointVideoProc,
+                         NULL, 0, &t->vpp_config);
+    if (vas != VA_STATUS_SUCCESS)
+        return vas;
+
+    for (i = 0; i < nb_bench_ladder; i++) {
+        struct transcode_rung *rung = &t->rungs[i];
+
+        vas = transcode_init_rung(t, bench_ladder[i].width,
+                                  bench_ladder[i].height);
+        if (vas != VA_STATUS_SUCCESS)
+            return vas;
+        vas = bench_encoder_init(&rung->enc, display,
+                                 transcode_encode_profile, entrypoint,
+                                 rung->width, rung->height,
+                                 t->h264.nb_frames, rung->surfaces,
+                                 t->depth, t->depth);
+        if (vas != VA_STATUS_SUCCESS)
+            return vas;
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+static void transcode_uninit(struct transcode *t)
+{
+    VADisplay display = t->display;
+    int i;
+
+    for (i = 0; i < t->nb_rungs; i++) {
+        struct transcode_rung *rung = &t->rungs[i];
+        bench_encoder_uninit(&rung->enc);
+        if (rung->vpp_context != VA_INVALID_ID)
+            vaDestroyContext(display, rung->vpp_context);
+        if (rung->have_surfaces)
+            vaDestroySurfaces(display, rung->surfaces, t->depth);
+    }
+    if (t->vpp_config != VA_INVALID_ID)
+        vaDestroyConfig(display, t->vpp_config);
+    if (t->decode_context != VA_INVALID_ID)
+        vaDestroyContext(display, t->decode_context);
+    if (t->have_pool)
+        vaDestroySurfaces(display, t->pool, t->nb_pool);
+    if (t->decode_config != VA_INVALID_ID)
+        vaDestroyConfig(display, t->decode_config);
+
+    for (i = 0; i < t->h264.nb_frames; i++)
+        free(t->h264.frames[i].slices);
+    free(t->h264.frames);
+    free(t->stream.data);
+}
+
+// Runs each stage alone on every frame, timing it.
+static VAStatus transcode_stages(struct transcode *t)
+{
+    VADisplay display = t->display;
+    uint64_t start, bytes = 0;
+    struct cpu_usage cpu;
+    VAStatus vas;
+    int i, j;
+
+    for (i = 0; i < t->h264.nb_frames; i++) {
+        start = clock_ns();
+        cpu_read(&cpu);
+        vas = transcode_decode(t, i);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, t->pool[i % t->nb_pool]);
+        if (vas != VA_STATUS_SUCCESS)
+            return vas;
+        cpu_add(&t->decode_cpu, &cpu);
+        t->decode_ns += clock_ns() - start;
+
+        for (j = 0; j < t->nb_rungs; j++) {
+            struct transcode_rung *rung = &t->rungs[j];
+            VASurfaceID surface = rung->surfaces[i % t->depth];
+
+            start = clock_ns();
+            cpu_read(&cpu);
+            vas = transcode_scale(t, rung, i);
+            if (vas == VA_STATUS_SUCCESS)
+                vas = vaSyncSurface(display, surface);
+            if (vas != VA_STATUS_SUCCESS)
+                return vas;
+            cpu_add(&rung->vpp_cpu, &cpu);
+            rung->vpp_ns += clock_ns() - start;
+
+            start = clock_ns();
+            cpu_read(&cpu);
+            vas = bench_encode_submit(&rung->enc, i, 0, surface);
+            if (vas == VA_STATUS_SUCCESS)
+                vas = vaSyncSurface(display, surface);
+            if (vas == VA_STATUS_SUCCESS)
+                vas = bench_encode_output(&rung->enc, i, &bytes, NULL);
+            if (vas != VA_STATUS_SUCCESS)
+                return vas;
+            cpu_add(&rung->encode_cpu, &cpu);
+            rung->encode_ns += clock_ns() - start;
+        }
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+// Waits for every rung to finish encoding frame index.
+static VAStatus transcode_retire(struct transcode *t, int index)
+{
+    VAStatus vas;
+    int i;
+
+    for (i = 0; i < t->nb_rungs; i++) {
+        struct transcode_rung *rung = &t->rungs[i];
+        vas = vaSyncSurface(t->display, rung->surfaces[index % t->depth]);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_encode_output(&rung->enc, index, &rung->bytes, NULL);
+        if (vas != VA_STATUS_SUCCESS)
+            return vas;
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+// Runs the whole chain with up to depth frames in flight.
+static VAStatus transcode_pipeline(struct transcode *t, uint64_t *latency,
+                                   uint64_t *elapsed)
+{
+    int nb_frames = t->h264.nb_frames;
+    uint64_t begin = clock_ns();
+    VAStatus vas = VA_STATUS_SUCCESS;
+    int i, j;
+
+    for (i = 0; i < nb_frames + t->depth && vas == VA_STATUS_SUCCESS; i++) {
+        // Latencies hold the start times until the frames are done.
+        if (i >= t->depth) {
+            vas = transcode_retire(t, i - t->depth);
+            latency[i - t->depth] = clock_ns() - latency[i - t->depth];
+        }
+        if (i >= nb_frames || vas != VA_STATUS_SUCCESS)
+            continue;
+
+        latency[i] = clock_ns();
+        vas = transcode_decode(t, i);
+        for (j = 0; j < t->nb_rungs && vas == VA_STATUS_SUCCESS; j++) {
+            struct transcode_rung *rung = &t->rungs[j];
+            vas = transcode_scale(t, rung, i);
+            if (vas == VA_STATUS_SUCCESS)
+                vas = bench_encode_submit(&rung->enc, i, 0,
+                                          rung->surfaces[i % t->depth]);
+        }
+    }
+    *elapsed = clock_ns() - begin;
+    return vas;
+}
+
+static int bench_encode_entrypoint(VADisplay display, VAProfile profile)
+{
+    int nb_entrypoints = vaMaxNumEntrypoints(display);
+    VAEntrypoint entrypoints[nb_entrypoints > 0 ? nb_entrypoints : 1];
+    int i, found = -1;
+
+    if (vaQueryConfigEntrypoints(display, profile, entrypoints,
+                                 &nb_entrypoints) != VA_STATUS_SUCCESS)
+        return -1;
+    for (i = 0; i < nb_entrypoints; i++) {
+        if (entrypoints[i] == VAEntrypointEncSlice)
+            return VAEntrypointEncSlice;
+        if (entrypoints[i] == VAEntrypointEncSliceLP)
+            found = VAEntrypointEncSliceLP;
+    }
+    return found;
+}
+
+static void bench_transcode(VADisplay display)
+{
+    struct transcode t;
+    int stream_entrypoint, encode_entrypoint;
+    const char *error = NULL;
+    uint64_t *latency = NULL, elapsed;
+    struct cpu_usage cpu = { { 0 } }, cpu_start;
+    unsigned int nb_levels;
+    double fps, frames;
+    VAStatus vas;
+    int i;
+
+    transcode_reset(&t, display, bench_depth);
+
+    start_object(NULL);
+    print_string("device", "%s", device_path);
+    print_integer("frames", bench_frames);
+    print_integer("depth", t.depth);
+
+    stream_entrypoint = bench_encode_entrypoint(display,
+                                                transcode_decode_profile);
+    encode_entrypoint = bench_encode_entrypoint(display,
+                                                transcode_encode_profile);
+    if (stream_entrypoint < 0) {
+        error = "no encoder to make the stream with";
+        goto done;
+    }
+    if (encode_entrypoint < 0) {
+        error = "no encoder for the encode profile";
+        goto done;
+    }
+    error = bench_encoder_unusable(display, transcode_decode_profile,
+                                   stream_entrypoint, &nb_levels);
+    if (!error)
+        error = bench_encoder_unusable(display, transcode_encode_profile,
+                                       encode_entrypoint, &nb_levels);
+    if (error)
+        goto done;
+
+    vas = transcode_make_stream(&t, transcode_decode_profile,
+                                stream_entrypoint, bench_width,
+                                bench_height, bench_frames);
+    if (vas != VA_STATUS_SUCCESS) {
+        error = vaErrorStr(vas);
+        goto done;
+    }
+    error = h264_parse(&t.h264, t.stream.data, t.stream.size);
+    if (error)
+        goto done;
+
+    start_object("decode");
+    print_string("profile", "%s", va_profile_name(transcode_decode_profile));
+    print_integer("width",  bench_width);
+    print_integer("height", bench_height);
+    print_integer("bytes",  t.stream.size);
+    end_object();
+    start_object("encode");
+    print_string("profile", "%s", va_profile_name(transcode_encode_profile));
+    print_string("entrypoint", "%s", va_entrypoint_name(encode_entrypoint));
+    end_object();
+
+    vas = transcode_init(&t, encode_entrypoint);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = transcode_stages(&t);
+    if (vas != VA_STATUS_SUCCESS) {
+        error = vaErrorStr(vas);
+        goto done;
+    }
+
+    latency = calloc(t.h264.nb_frames, sizeof(*latency));
+    if (!latency)
+        die("Out of memory.\n");
+    fdinfo_begin();
+    cpu_read(&cpu_start);
+    vas = transcode_pipeline(&t, latency, &elapsed);
+    if (vas != VA_STATUS_SUCCESS) {
+        error = vaErrorStr(vas);
+        goto done;
+    }
+    cpu_add(&cpu, &cpu_start);
+
+    frames = t.h264.nb_frames;
+    fps = elapsed ? 1e9 * frames / elapsed : 0;
+    print_double("fps", fps);
+    print_latency("latency_ms", latency, t.h264.nb_frames);
+    cpu_print("cpu", &cpu, t.h264.nb_frames);
+
+    start_array("stages");
+    start_object(NULL);
+    print_string("stage", "decode");
+    print_integer("width",  bench_width);
+    print_integer("height", bench_height);
+    print_double("ms_per_frame", t.decode_ns / 1e6 / frames);
+    print_double("utilization", t.decode_ns / 1e9 / frames * fps);
+    cpu_print("cpu", &t.decode_cpu, t.h264.nb_frames);
+    end_object();
+    for (i = 0; i < t.nb_rungs; i++) {
+        const struct transcode_rung *rung = &t.rungs[i];
+        start_object(NULL);
+        print_string("stage", "vpp");
+        print_integer("width",  rung->width);
+        print_integer("height", rung->height);
+        print_double("ms_per_frame", rung->vpp_ns / 1e6 / frames);
+        print_double("utilization", rung->vpp_ns / 1e9 / frames * fps);
+        cpu_print("cpu", &rung->vpp_cpu, t.h264.nb_frames);
+        end_object();
+        start_object(NULL);
+        print_string("stage", "encode");
+        print_integer("width",  rung->width);
+        print_integer("height", rung->height);
+        print_double("ms_per_frame", rung->encode_ns / 1e6 / frames);
+        print_double("utilization", rung->encode_ns / 1e9 / frames * fps);
+        cpu_print("cpu", &rung->encode_cpu, t.h264.nb_frames);
+        print_integer("bytes", rung->bytes);
+        print_double("bitrate_kbps", rung->bytes * 8.0 *
+                     BENCH_ENCODE_FRAME_RATE / frames / 1000);
+        end_object();
+    }
+    end_array();
+    // Covers only the pipelined run, not the stages timed alone.
+    fdinfo_print();
+
+done:
+    if (error)
+        print_string("error", "%s", error);
+    end_object();
+
+    free(latency);
+    transcode_uninit(&t);
+}
+
+/*
+ * How much the workloads a device can run slow each other down when they
+ * share it.  Each is run alone and then beside every other and beside a
+ * second copy of itself, in its own thread on its own context, for the
+ * same length of time; the slowdown of one beside another is its frame
+ * rate alone over its frame rate in the pair.
+ */
+#define INTERFERENCE_RUN_NS 500000000
+
+static const VAEntrypoint interference_entrypoints[] = {
+    VAEntrypointVLD,
+    VAEntrypointEncSlice,
+    VAEntrypointEncSliceLP,
+    VAEntrypointVideoProc,
+};
+
+struct workload {
+    VAEntrypoint entrypoint;
+    // Decode, or the source and scaler for VPP.
+    struct transcode t;
+    struct bench_encoder enc;
+    VASurfaceID source;
+    uint64_t bytes;
+
+    pthread_t thread;
+    uint64_t frames;
+    uint64_t elapsed;
+    struct cpu_usage cpu;
+    VAStatus vas;
+};
+
+static struct {
+    pthread_barrier_t start;
+    bool stop;
+} interference;
+
+static VAProfile workload_profile(VAEntrypoint entrypoint)
+{
+    if (entrypoint == VAEntrypointVLD)
+        return transcode_decode_profile;
+    if (entrypoint == VAEntrypointVideoProc)
+        return VAProfileNone;
+    return transcode_encode_profile;
+}
+
+// Why a workload can't be run, or NULL if it can.
+static const char *workload_unusable(VADisplay display,
+                                     VAEntrypoint entrypoint)
+{
+    VAProfile profile = workload_profile(entrypoint);
+    int nb_entrypoints = vaMaxNumEntrypoints(display);
+    VAEntrypoint entrypoints[nb_entrypoints > 0 ? nb_entrypoints : 1];
+    unsigned int nb_levels;
+    int i, stream_entrypoint;
+
+    if (vaQueryConfigEntrypoints(display, profile, entrypoints,
+                                 &nb_entrypoints) != VA_STATUS_SUCCESS)
+        nb_entrypoints = 0;
+    for (i = 0; i < nb_entrypoints; i++) {
+        if (entrypoints[i] == entrypoint)
             break;
-        case VAConfigAttribProtectedContentCipherAlgorithm:
-            {
-                print_integer("protected_content_cipher_algorithm", value);
-            }
+    }
+    if (i == nb_entrypoints)
+        return "not supported";
+
+    if (entrypoint == VAEntrypointVideoProc)
+        return NULL;
+    if (entrypoint != VAEntrypointVLD)
+        return bench_encoder_unusable(display, profile, entrypoint,
+                                      &nb_levels);
+    stream_entrypoint = bench_encode_entrypoint(display, profile);
+    if (stream_entrypoint < 0)
+        return "no encoder to make the stream with";
+    return bench_encoder_unusable(display, profile, stream_entrypoint,
+                                  &nb_levels);
+}
+
+static void workload_reset(struct workload *w, VADisplay display,
+                           VAEntrypoint entrypoint)
+{
+    *w = (struct workload) {
+        .entrypoint = entrypoint,
+        .source     = VA_INVALID_SURFACE,
+        .enc = {
+            .display = display,
+            .config  = VA_INVALID_ID,
+            .context = VA_INVALID_ID,
+        },
+    };
+    transcode_reset(&w->t, display, 1);
+}
+
+// Decode workloads share stream, which is already parsed.
+static VAStatus workload_init(struct workload *w,
+                              const struct transcode *stream,
+                              VAImage *upload, const uint8_t *frame)
+{
+    VADisplay display = w->t.display;
+    VAStatus vas;
+
+    switch (w->entrypoint) {
+    case VAEntrypointVLD:
+        w->t.stream = stream->stream;
+        w->t.h264   = stream->h264;
+        return transcode_init_decode(&w->t, transcode_decode_profile);
+
+    case VAEntrypointVideoProc:
+        vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420,
+                               bench_width, bench_height,
+                               w->t.pool, 1, NULL, 0);
+        if (vas != VA_STATUS_SUCCESS)
+            return vas;
+        w->t.have_pool = true;
+        w->t.nb_pool   = 1;
+        vas = bench_upload(display, upload, w->t.pool[0], frame,
+                           bench_width, bench_height);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaCreateConfig(display, VAProfileNone,
+                                 VAEntrypointVideoProc, NULL, 0,
+                                 &w->t.vpp_config);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = transcode_init_rung(&w->t, bench_ladder[0].width,
+                                      bench_ladder[0].height);
+        return vas;
+
+    default:
+        vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420,
+                               bench_width, bench_height,
+                               &w->source, 1, NULL, 0);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_upload(display, upload, w->source, frame,
+                               bench_width, bench_height);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_encoder_init(&w->enc, display,
+                                     transcode_encode_profile,
+                                     w->entrypoint,
+                                     bench_width, bench_height,
+                                     bench_frames, &w->source, 1, 1);
+        return vas;
+    }
+}
+
+static void workload_uninit(struct workload *w)
+{
+    VADisplay display = w->t.display;
+
+    // The stream belongs to the caller.
+    w->t.stream = (struct tape_buffer) { 0 };
+    w->t.h264.frames    = NULL;
+    w->t.h264.nb_frames = 0;
+    transcode_uninit(&w->t);
+
+    bench_encoder_uninit(&w->enc);
+    if (w->source != VA_INVALID_SURFACE)
+        vaDestroySurfaces(display, &w->source, 1);
+}
+
+// Runs frame index of the workload to completion.
+static VAStatus workload_frame(struct workload *w, uint64_t index)
+{
+    VADisplay display = w->t.display;
+    VAStatus vas;
+    int i;
+
+    switch (w->entrypoint) {
+    case VAEntrypointVLD:
+        i = index % w->t.h264.nb_frames;
+        vas = transcode_decode(&w->t, i);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, w->t.pool[i % w->t.nb_pool]);
+        return vas;
+
+    case VAEntrypointVideoProc:
+        vas = transcode_scale(&w->t, &w->t.rungs[0], 0);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, w->t.rungs[0].surfaces[0]);
+        return vas;
+
+    default:
+        i = index % w->enc.frames;
+        vas = bench_encode_submit(&w->enc, i, 0, w->source);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, w->source);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_encode_output(&w->enc, i, &w->bytes, NULL);
+        return vas;
+    }
+}
+
+static void *workload_thread(void *arg)
+{
+    struct workload *w = arg;
+    struct cpu_usage cpu;
+    uint64_t start;
+
+    pthread_barrier_wait(&interference.start);
+    start = clock_ns();
+    cpu_read(&cpu);
+    w->cpu = (struct cpu_usage) { { 0 } };
+    w->vas = VA_STATUS_SUCCESS;
+    for (w->frames = 0;
+         !__atomic_load_n(&interference.stop, __ATOMIC_RELAXED);
+         w->frames++) {
+        w->vas = workload_frame(w, w->frames);
+        if (w->vas != VA_STATUS_SUCCESS)
             break;
-        case VAConfigAttribProtectedContentCipherBlockSize:
-            {
-                print_integer("protected_content_cipher_block_size", value);
-            }
+    }
+    w->elapsed = clock_ns() - start;
+    cpu_add(&w->cpu, &cpu);
+    return NULL;
+}
+
+// Runs the workloads side by side, giving the frame rate of each.
+static VAStatus interference_run(struct workload **w, int count,
+                                 double *fps)
+{
+    struct timespec ts = {
+        .tv_sec  = INTERFERENCE_RUN_NS / 1000000000,
+        .tv_nsec = INTERFERENCE_RUN_NS % 1000000000,
+    };
+    VAStatus vas = VA_STATUS_SUCCESS;
+    int i;
+
+    interference.stop = false;
+    pthread_barrier_init(&interference.start, NULL, count + 1);
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&w[i]->thread, NULL, &workload_thread, w[i]))
+            die("Failed to start workload thread.\n");
+    }
+    pthread_barrier_wait(&interference.start);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    __atomic_store_n(&interference.stop, true, __ATOMIC_RELAXED);
+
+    for (i = 0; i < count; i++) {
+        pthread_join(w[i]->thread, NULL);
+        if (w[i]->vas != VA_STATUS_SUCCESS)
+            vas = w[i]->vas;
+        fps[i] = w[i]->elapsed ? 1e9 * w[i]->frames / w[i]->elapsed : 0;
+    }
+    pthread_barrier_destroy(&interference.start);
+    return vas;
+}
+
+static void bench_interference(VADisplay display)
+{
+    enum { MAX_WORKLOADS = ARRAY_LENGTH(interference_entrypoints) };
+    struct workload workloads[MAX_WORKLOADS][2];
+    double alone[MAX_WORKLOADS];
+    double slowdown[MAX_WORKLOADS][MAX_WORKLOADS];
+    int index[MAX_WORKLOADS], nb_workloads = 0;
+    VAImageFormat nv12 = bench_nv12_format(display);
+    VAImage upload = { .image_id = VA_INVALID_ID };
+    struct transcode stream;
+    const char *error = NULL;
+    uint8_t *frame;
+    VAStatus vas;
+    int i, j;
+
+    transcode_reset(&stream, display, 1);
+    frame = malloc((size_t)bench_width * bench_height * 3 / 2);
+    if (!frame)
+        die("Out of memory.\n");
+    bench_frame(frame, bench_width, bench_height, 0);
+
+    start_object(NULL);
+    print_string("device", "%s", device_path);
+    print_integer("width",  bench_width);
+    print_integer("height", bench_height);
+    print_double("run_seconds", INTERFERENCE_RUN_NS / 1e9);
+
+    start_array("workloads");
+    for (i = 0; i < MAX_WORKLOADS; i++) {
+        VAEntrypoint entrypoint = interference_entrypoints[i];
+        const char *skipped = workload_unusable(display, entrypoint);
+
+        start_object(NULL);
+        print_string("entrypoint", "%s", va_entrypoint_name(entrypoint));
+        print_string("profile", "%s",
+                     va_profile_name(workload_profile(entrypoint)));
+        if (skipped)
+            print_string("skipped", "%s", skipped);
+        end_object();
+        if (!skipped)
+            index[nb_workloads++] = i;
+    }
+    end_array();
+
+    for (i = 0; i < nb_workloads; i++) {
+        for (j = 0; j < 2; j++)
+            workload_reset(&workloads[i][j], display,
+                           interference_entrypoints[index[i]]);
+    }
+
+    // VLD comes first, so is only at index[0].
+    vas = vaCreateImage(display, &nv12, bench_width, bench_height, &upload);
+    if (vas == VA_STATUS_SUCCESS && nb_workloads > 0 &&
+        interference_entrypoints[index[0]] == VAEntrypointVLD) {
+        int entrypoint = bench_encode_entrypoint(display,
+                                                 transcode_decode_profile);
+        vas = transcode_make_stream(&stream, transcode_decode_profile,
+                                    entrypoint, bench_width, bench_height,
+                                    bench_frames);
+        if (vas == VA_STATUS_SUCCESS)
+            error = h264_parse(&stream.h264, stream.stream.data,
+                               stream.stream.size);
+    }
+    for (i = 0; i < nb_workloads && vas == VA_STATUS_SUCCESS && !error;
+         i++) {
+        for (j = 0; j < 2 && vas == VA_STATUS_SUCCESS; j++)
+            vas = workload_init(&workloads[i][j], &stream, &upload, frame);
+    }
+    if (vas != VA_STATUS_SUCCESS)
+        error = vaErrorStr(vas);
+    if (error)
+        goto done;
+
+    start_array("alone");
+    for (i = 0; i < nb_workloads && !error; i++) {
+        struct workload *w = &workloads[i][0];
+
+        fdinfo_begin();
+        vas = interference_run(&w, 1, &alone[i]);
+        if (vas != VA_STATUS_SUCCESS) {
+            error = vaErrorStr(vas);
             break;
-        case VAConfigAttribProtectedContentCipherMode:
-            {
-                print_integer("protected_content_cipher_mode", value);
+        }
+        start_object(NULL);
+        print_string("entrypoint", "%s", va_entrypoint_name(w->entrypoint));
+        print_double("fps", alone[i]);
+        cpu_print("cpu", &w->cpu, w->frames);
+        fdinfo_print();
+        end_object();
+    }
+    end_array();
+
+    start_array("pairs");
+    for (i = 0; i < nb_workloads && !error; i++) {
+        for (j = i; j < nb_workloads; j++) {
+            struct workload *w[2] = { &workloads[i][0], &workloads[j][1] };
+            double fps[2];
+
+            fdinfo_begin();
+            vas = interference_run(w, 2, fps);
+            if (vas != VA_STATUS_SUCCESS) {
+                error = vaErrorStr(vas);
+                break;
             }
-            break;
-        case VAConfigAttribProtectedContentCipherSampleType:
-            {
-                print_integer("protected_content_cipher_sample_type", value);
+            if (i == j) {
+                slowdown[i][i] = alone[i] * 2 / (fps[0] + fps[1]);
+            } else {
+                slowdown[i][j] = alone[i] / fps[0];
+                slowdown[j][i] = alone[j] / fps[1];
             }
+
+            start_object(NULL);
+            start_array("entrypoints");
+            print_string(NULL, "%s", va_entrypoint_name(w[0]->entrypoint));
+            print_string(NULL, "%s", va_entrypoint_name(w[1]->entrypoint));
+            end_array();
+            start_array("fps");
+            print_double(NULL, fps[0]);
+            print_double(NULL, fps[1]);
+            end_array();
+            fdinfo_print();
+            end_object();
+        }
+    }
+    end_array();
+    if (error)
+        goto done;
+
+    // Row i, column j: how many times slower i runs beside j.
+    start_object("slowdown");
+    start_array("entrypoints");
+    for (i = 0; i < nb_workloads; i++)
+        print_string(NULL, "%s",
+                     va_entrypoint_name(interference_entrypoints[index[i]]));
+    end_array();
+    start_array("matrix");
+    for (i = 0; i < nb_workloads; i++) {
+        start_array(NULL);
+        for (j = 0; j < nb_workloads; j++)
+            print_double(NULL, slowdown[i][j]);
+        end_array();
+    }
+    end_array();
+    end_object();
+
+done:
+    if (error)
+        print_string("error", "%s", error);
+    end_object();
+
+    for (i = 0; i < nb_workloads; i++) {
+        for (j = 0; j < 2; j++)
+            workload_uninit(&workloads[i][j]);
+    }
+    if (upload.image_id != VA_INVALID_ID)
+        vaDestroyImage(display, upload.image_id);
+    transcode_uninit(&stream);
+    free(frame);
+}
+
+/*
+ * The cost model (--cost-model): each workload the benchmarks can run is
+ * timed at every cost model size, and a line fitted to the time per frame
+ * against the number of pixels, so that its frame rate at any size can be
+ * predicted as 1e9 / (frame_ns + pixel_ns * width * height).
+ */
+#define COST_MODEL_FRAMES 16
+
+// Why a workload can't be modelled, or NULL if it can.
+static const char *cost_model_unusable(VADisplay display, VAProfile profile,
+                                       VAEntrypoint entrypoint,
+                                       unsigned int rt_format)
+{
+    unsigned int nb_levels;
+    int stream_entrypoint;
+
+    if (entrypoint == VAEntrypointVideoProc)
+        return NULL;
+    if (!bench_h264_profile(profile))
+        return "no parameters for this codec";
+    if (rt_format != VA_RT_FORMAT_YUV420)
+        return "only 8-bit 4:2:0 is benchmarked";
+    if (entrypoint != VAEntrypointVLD)
+        return bench_encoder_unusable(display, profile, entrypoint,
+                                      &nb_levels);
+    stream_entrypoint = bench_encode_entrypoint(display, profile);
+    if (stream_entrypoint < 0)
+        return "no encoder to make the stream with";
+    return bench_encoder_unusable(display, profile, stream_entrypoint,
+                                  &nb_levels);
+}
+
+static const char *cost_model_decode(VADisplay display, VAProfile profile,
+                                     int width, int height, uint64_t *ns)
+{
+    struct transcode t;
+    const char *error = NULL;
+    VAStatus vas;
+    int i;
+
+    transcode_reset(&t, display, 1);
+    vas = transcode_make_stream(&t, profile,
+                                bench_encode_entrypoint(display, profile),
+                                width, height, COST_MODEL_FRAMES);
+    if (vas == VA_STATUS_SUCCESS) {
+        error = h264_parse(&t.h264, t.stream.data, t.stream.size);
+        if (!error)
+            vas = transcode_init_decode(&t, profile);
+    }
+
+    *ns = 0;
+    for (i = 0; i < COST_MODEL_FRAMES && !error &&
+                vas == VA_STATUS_SUCCESS; i++) {
+        uint64_t start = clock_ns();
+        vas = transcode_decode(&t, i);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, t.pool[i % t.nb_pool]);
+        *ns += clock_ns() - start;
+    }
+
+    transcode_uninit(&t);
+    return error ? error : vas == VA_STATUS_SUCCESS ? NULL : vaErrorStr(vas);
+}
+
+static const char *cost_model_encode(VADisplay display, VAProfile profile,
+                                     VAEntrypoint entrypoint,
+                                     int width, int height, uint64_t *ns)
+{
+    struct bench_encoder enc = {
+        .display = display,
+        .config  = VA_INVALID_ID,
+        .context = VA_INVALID_ID,
+    };
+    VAImageFormat nv12 = bench_nv12_format(display);
+    VAImage upload = { .image_id = VA_INVALID_ID };
+    VASurfaceID source = VA_INVALID_SURFACE;
+    uint8_t *frame = malloc((size_t)width * height * 3 / 2);
+    uint64_t bytes = 0;
+    VAStatus vas;
+    int i;
+
+    if (!frame)
+        die("Out of memory.\n");
+
+    vas = vaCreateSurfaces(display, VA_RT_FORMAT_YUV420,
+                           width, height, &source, 1, NULL, 0);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = bench_encoder_init(&enc, display, profile, entrypoint,
+                                 width, height, COST_MODEL_FRAMES,
+                                 &source, 1, 1);
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaCreateImage(display, &nv12, width, height, &upload);
+
+    *ns = 0;
+    for (i = 0; i < COST_MODEL_FRAMES && vas == VA_STATUS_SUCCESS; i++) {
+        bench_frame(frame, width, height, i);
+        vas = bench_upload(display, &upload, source, frame, width, height);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-        case VAConfigAttribProtectedContentUsage:
-            {
-                print_integer("protected_content_usage", value);
-            }
+
+        uint64_t start = clock_ns();
+        vas = bench_encode_submit(&enc, i, 0, source);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, source);
+        *ns += clock_ns() - start;
+        if (vas == VA_STATUS_SUCCESS)
+            vas = bench_encode_output(&enc, i, &bytes, NULL);
+    }
+
+    if (upload.image_id != VA_INVALID_ID)
+        vaDestroyImage(display, upload.image_id);
+    bench_encoder_uninit(&enc);
+    if (source != VA_INVALID_SURFACE)
+        vaDestroySurfaces(display, &source, 1);
+    free(frame);
+    return vas == VA_STATUS_SUCCESS ? NULL : vaErrorStr(vas);
+}
+
+// Copies between surfaces of the rt_format, converting nothing.
+static const char *cost_model_vpp(VADisplay display, unsigned int rt_format,
+                                  int width, int height, uint64_t *ns)
+{
+    VASurfaceID surfaces[2];
+    VAConfigID config = VA_INVALID_ID;
+    VAContextID context = VA_INVALID_ID;
+    bool have_surfaces = false;
+    VAStatus vas;
+    int i;
+
+    vas = vaCreateSurfaces(display, rt_format, width, height,
+                           surfaces, 2, NULL, 0);
+    if (vas == VA_STATUS_SUCCESS) {
+        have_surfaces = true;
+        vas = vaCreateConfig(display, VAProfileNone, VAEntrypointVideoProc,
+                             NULL, 0, &config);
+    }
+    if (vas == VA_STATUS_SUCCESS)
+        vas = vaCreateContext(display, config, width, height,
+                              VA_PROGRESSIVE, &surfaces[1], 1, &context);
+
+    *ns = 0;
+    for (i = 0; i < COST_MODEL_FRAMES && vas == VA_STATUS_SUCCESS; i++) {
+        VAProcPipelineParameterBuffer params = {
+            .surface                 = surfaces[0],
+            .output_background_color = 0xff000000,
+            .filter_flags            = VA_FILTER_SCALING_DEFAULT,
+        };
+        VABufferID buffer;
+
+        uint64_t start = clock_ns();
+        vas = vaCreateBuffer(display, context,
+                             VAProcPipelineParameterBufferType,
+                             sizeof(params), 1, &params, &buffer);
+        if (vas != VA_STATUS_SUCCESS)
             break;
-#endif
-#if LIBVA(2, 12, 0)
-        case VAConfigAttribEncHEVCFeatures:
-            {
-                VAConfigAttribValEncHEVCFeatures ehf = { .value = value };
-                start_object("enc_hevc_features");
-                AF(ehf, separate_colour_planes);
-                AF(ehf, scaling_lists);
-                AF(ehf, amp);
-                AF(ehf, sao);
-                AF(ehf, pcm);
-                AF(ehf, temporal_mvp);
-                AF(ehf, strong_intra_smoothing);
-                AF(ehf, dependent_slices);
-                AF(ehf, sign_data_hiding);
-                AF(ehf, constrained_intra_pred);
-                AF(ehf, transform_skip);
-                AF(ehf, cu_qp_delta);
-                AF(ehf, weighted_prediction);
-                AF(ehf, transquant_bypass);
-                AF(ehf, deblocking_filter_disable);
-                end_object();
+        vas = vaBeginPicture(display, context, surfaces[1]);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaRenderPicture(display, context, &buffer, 1);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaEndPicture(display, context);
+        if (vas == VA_STATUS_SUCCESS)
+            vas = vaSyncSurface(display, surfaces[1]);
+        *ns += clock_ns() - start;
+        vaDestroyBuffer(display, buffer);
+    }
+
+    if (context != VA_INVALID_ID)
+        vaDestroyContext(display, context);
+    if (config != VA_INVALID_ID)
+        vaDestroyConfig(display, config);
+    if (have_surfaces)
+        vaDestroySurfaces(display, surfaces, 2);
+    return vas == VA_STATUS_SUCCESS ? NULL : vaErrorStr(vas);
+}
+
+// Least squares fit of ns = frame_ns + pixel_ns * pixels.
+static void cost_model_fit(const double *pixels, const double *ns, int count,
+                           double *frame_ns, double *pixel_ns)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        sx  += pixels[i];
+        sy  += ns[i];
+        sxx += pixels[i] * pixels[i];
+        sxy += pixels[i] * ns[i];
+    }
+    *pixel_ns = (count * sxy - sx * sy) / (count * sxx - sx * sx);
+    *frame_ns = (sy - *pixel_ns * sx) / count;
+}
+
+static void dump_cost_model(VADisplay display, VAProfile profile,
+                            VAEntrypoint entrypoint,
+                            unsigned int rt_formats)
+{
+    double pixels[MAX_COST_MODEL_SIZES], ns[MAX_COST_MODEL_SIZES];
+    unsigned int bits;
+    int i;
+
+    if (entrypoint != VAEntrypointVLD &&
+        entrypoint != VAEntrypointEncSlice &&
+        entrypoint != VAEntrypointEncSliceLP &&
+        entrypoint != VAEntrypointVideoProc)
+        return;
+
+    int phase = probe_phase(PHASE_COST_MODEL);
+    start_array("cost_model");
+    for (bits = rt_formats; bits; bits &= bits - 1) {
+        unsigned int rt_format = bits & -bits;
+        const char *name = va_rt_format_names[__builtin_ctz(bits)];
+        const char *error;
+
+        start_object(NULL);
+        print_string("rt_format", "%s", name ? name : "unknown");
+
+        // Formats which were not timed get no coefficients, rather than
+        // those of another format.
+        error = cost_model_unusable(display, profile, entrypoint, rt_format);
+        if (error) {
+            print_boolean("measured", false);
+            print_string("skipped", "%s", error);
+            end_object();
+            continue;
+        }
+
+        start_array("samples");
+        for (i = 0; i < nb_cost_model_sizes && !error; i++) {
+            int width  = cost_model_sizes[i].width;
+            int height = cost_model_sizes[i].height;
+            uint64_t total;
+
+            if (entrypoint == VAEntrypointVLD)
+                error = cost_model_decode(display, profile,
+                                          width, height, &total);
+            else if (entrypoint == VAEntrypointVideoProc)
+                error = cost_model_vpp(display, rt_format,
+                                       width, height, &total);
+            else
+                error = cost_model_encode(display, profile, entrypoint,
+                                          width, height, &total);
+            if (error)
+                break;
+
+            pixels[i] = (double)width * height;
+            ns[i]     = (double)total / COST_MODEL_FRAMES;
+            start_object(NULL);
+            print_string("size", "%dx%d", width, height);
+            print_double("ns_per_frame", ns[i]);
+            end_object();
+        }
+        end_array();
+
+        print_boolean("measured", !error);
+        if (error) {
+            print_string("error", "%s", error);
+        } else {
+            double frame_ns, pixel_ns, max_error = 0;
+            cost_model_fit(pixels, ns, nb_cost_model_sizes,
+                           &frame_ns, &pixel_ns);
+            for (i = 0; i < nb_cost_model_sizes; i++) {
+                double e = fabs(frame_ns + pixel_ns * pixels[i] - ns[i]) /
+                           ns[i];
+                if (e > max_error)
+                    max_error = e;
             }
-            break;
-        case VAConfigAttribEncHEVCBlockSizes:
-            {
-                VAConfigAttribValEncHEVCBlockSizes ehbs = { .value = value };
-                start_object("enc_hevc_block_sizes");
-#define BS(name) do { print_integer(#name, ehbs.bits.name); } while (0)
-                BS(log2_max_coding_tree_block_size_minus3);
-                BS(log2_min_coding_tree_block_size_minus3);
-                BS(log2_min_luma_coding_block_size_minus3);
-                BS(log2_max_luma_transform_block_size_minus2);
-                BS(log2_min_luma_transform_block_size_minus2);
-                BS(max_max_transform_hierarchy_depth_inter);
-                BS(min_max_transform_hierarchy_depth_inter);
-                BS(max_max_transform_hierarchy_depth_intra);
-                BS(min_max_transform_hierarchy_depth_intra);
-                BS(log2_max_pcm_coding_block_size_minus3);
-                BS(log2_min_pcm_coding_block_size_minus3);
-#undef BS
-                end_object();
+            print_double("pixel_ns", pixel_ns);
+            print_double("frame_ns", frame_ns);
+            // Of the fit at the sizes measured, relative to them.
+            print_double("max_error", max_error);
+        }
+        end_object();
+    }
+    end_array();
+    probe_phase(phase);
+}
+
+// A random entry of a generated name table, skipping the gaps.
+static const char *random_name(uint64_t *state, const char *const *names,
+                               size_t count)
+{
+    const char *name;
+    do
+        name = names[xorshift(state) % count];
+    while (!name);
+    return name;
+}
+
+/*
+ * Writes random job specs to stdout, drawn from the names this program
+ * knows about, for feeding to --check as a throughput benchmark.
+ */
+static void generate_job_specs(long count)
+{
+    static const char *const pixel_formats[] = {
+        "NV12", "P010", "P016", "YUY2", "Y210", "AYUV", "Y410",
+        "I420", "YV12", "BGRA", "BGRX", "RGBA", "RGBX", "422H",
+    };
+    static const int sizes[][2] = {
+        { 176, 144 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+        { 2560, 1440 }, { 3840, 2160 }, { 7680, 4320 }, { 16384, 16384 },
+    };
+    uint64_t state = 0x9e3779b97f4a7c15;
+    long i;
+
+    for (i = 0; i < count; i++) {
+        const char *profile =
+            random_name(&state, va_profile_names,
+                        ARRAY_LENGTH(va_profile_names));
+        const char *entrypoint =
+            random_name(&state, va_entrypoint_names,
+                        ARRAY_LENGTH(va_entrypoint_names));
+        const char *rt_format =
+            random_name(&state, va_rt_format_names,
+                        ARRAY_LENGTH(va_rt_format_names));
+        int pix_fmt     = xorshift(&state) % ARRAY_LENGTH(pixel_formats);
+        int size        = xorshift(&state) % ARRAY_LENGTH(sizes);
+
+        printf("{\"id\":%ld,\"profile\":\"%s\",\"entrypoint\":\"%s\","
+               "\"rt_format\":\"%s\",\"pixel_format\":\"%s\","
+               "\"width\":%d,\"height\":%d}\n", i,
+               profile, entrypoint, rt_format, pixel_formats[pix_fmt],
+               sizes[size][0], sizes[size][1]);
+    }
+}
+
+// The CPU used in each libva function so far.
+static void dump_cpu_stats(void)
+{
+    int i, j;
+
+    start_object("cpu");
+    print_string("source", "%s", cpu_stats.source);
+    start_array("calls");
+    for (i = 0; i < VA_CALL_COUNT; i++) {
+        static const char *const names[CPU_COUNT] = {
+            [CPU_CYCLES]       = "cycles",
+            [CPU_INSTRUCTIONS] = "instructions",
+            [CPU_SWITCHES]     = "context_switches",
+        };
+        const uint64_t *used = probe_stats.cpu[i];
+
+        if (!probe_stats.calls[i])
+            continue;
+        start_object(NULL);
+        print_string("function", "%s", va_call_names[i]);
+        print_integer("calls", probe_stats.calls[i]);
+        print_double("us", used[CPU_NS] / 1e3);
+        print_double("us_per_call",
+                     used[CPU_NS] / 1e3 / probe_stats.calls[i]);
+        for (j = CPU_CYCLES; j < CPU_COUNT; j++) {
+            if (j == CPU_SWITCHES || cpu_stats.have[j])
+                print_integer(names[j], used[j]);
+        }
+        end_object();
+    }
+    end_array();
+    end_object();
+}
+
+static void dump_device(VADisplay display, int major, int minor)
+{
+    start_object(NULL);
+
+    start_object("build_version");
+    print_integer("major", VA_MAJOR_VERSION);
+    print_integer("minor", VA_MINOR_VERSION);
+    print_integer("micro", VA_MICRO_VERSION);
+    end_object();
+
+    start_object("driver_version");
+    print_integer("major", major);
+    print_integer("minor", minor);
+    end_object();
+
+    const char *vendor_string = vaQueryVendorString(display);
+    if (vendor_string)
+        print_string("driver_vendor", "%s", vendor_string);
+    else
+        print_string("driver_vendor", "unknown");
+
+    int phase = probe_phase(PHASE_PROFILES);
+    if (DUMP(PROFILES)) {
+        start_array("profiles");
+        dump_profiles(display);
+        end_array();
+    }
+
+    probe_phase(PHASE_FORMATS);
+    if (DUMP(IMAGE_FORMATS)) {
+        start_array("image_formats");
+        dump_image_formats(display);
+        end_array();
+    }
+
+    if (DUMP(SUBPICTURE_FORMATS)) {
+        start_array("subpicture_formats");
+        dump_subpicture_formats(display);
+        end_array();
+    }
+    probe_phase(phase);
+
+    dedup_write_table();
+
+    if (cpu_stats.enabled)
+        dump_cpu_stats();
+
+    end_object();
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    char *data = NULL;
+    size_t alloc = 0, got;
+
+    if (!file)
+        return NULL;
+
+    *size = 0;
+    do {
+        if (*size + 65536 + 1 > alloc) {
+            alloc = 2 * (*size + 65536 + 1);
+            data  = realloc(data, alloc);
+        }
+        got = fread(data + *size, 1, alloc - *size - 1, file);
+        *size += got;
+    } while (got > 0);
+    data[*size] = 0;
+
+    if (file != stdin)
+        fclose(file);
+    return data;
+}
+
+// Checks that data is a sequence of one or more strictly valid JSON
+// texts, returning how many or -1 on failure.
+static long validate_json(const char *data, size_t size,
+                          char *error, size_t error_size)
+{
+    const char *p = data, *end = data + size;
+    long count = 0;
+
+    do {
+        const char *next;
+        struct node *root = json_parse(p, end - p, &next,
+                                       error, error_size);
+        if (!root)
+            return -1;
+        node_free(root);
+        free(root);
+        ++count;
+        p = next;
+    } while (p < end);
+
+    return count;
+}
+
+static void run_validate(const char *path)
+{
+    struct timespec start, end;
+    char error[160];
+    size_t size;
+    char *data = read_file(path, &size);
+    if (!data)
+        die("Failed to read %s: %m.\n", path);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long count = validate_json(data, size, error, sizeof(error));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    free(data);
+
+    if (count < 0)
+        die("%s: invalid JSON: %s.\n", path, error);
+    fprintf(stderr, "%s: %ld valid JSON text%s, %zu bytes, "
+            "parsed at %.1f MB/s.\n", path, count, count == 1 ? "" : "s",
+            size, elapsed > 0 ? size / elapsed / 1e6 : 0.0);
+}
+
+static const struct node *node_child(const struct node *node, const char *tag)
+{
+    int i;
+    for (i = 0; i < node->nb_children; i++) {
+        if (node->children[i].tag && !strcmp(node->children[i].tag, tag))
+            return &node->children[i];
+    }
+    return NULL;
+}
+
+// Writes a dump with any --dedup references resolved.
+static void expand_root(const struct node *root)
+{
+    const struct node *shared = node_child(root, "shared");
+    int i;
+
+    if (root->type != NODE_OBJECT) {
+        emit_node(root);
+        return;
+    }
+
+    start_object(NULL);
+    for (i = 0; i < root->nb_children; i++) {
+        const struct node *child = &root->children[i];
+        if (child == shared ||
+            (child->tag && !strcmp(child->tag, "deduplication")))
+            continue;
+        expand_node(child, child->tag, shared);
+    }
+    end_object();
+}
+
+/*
+ * Reads the dumps stored in a file one at a time, with any references
+ * resolved, advancing *p.  Returns NULL at the end of the data.
+ */
+static struct node *load_next(const char *path, const char **p,
+                              const char *end)
+{
+    const struct output_format *saved_output = output;
+    char error[160];
+
+    if (*p >= end)
+        return NULL;
+
+    struct node *root = json_parse(*p, end - *p, p, error, sizeof(error));
+    if (!root)
+        die("%s: invalid JSON: %s.\n", path, error);
+
+    output = &tree_format;
+    expand_root(root);
+    output = saved_output;
+
+    node_free(root);
+    free(root);
+
+    root = tree.root;
+    tree.root = NULL;
+    return root;
+}
+
+static void run_expand(const char *path)
+{
+    size_t size;
+    char *data = read_file(path, &size);
+    if (!data)
+        die("Failed to read %s: %m.\n", path);
+
+    const char *p = data, *end = data + size;
+    struct node *root;
+    while ((root = load_next(path, &p, end))) {
+        emit_node(root);
+        node_free(root);
+        free(root);
+    }
+
+    free(data);
+}
+
+/*
+ * SHA-256 (FIPS 180-4), for the capability fingerprints.
+ */
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t  block[64];
+    size_t   used;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(struct sha256 *ctx, const uint8_t *block)
+{
+    uint32_t w[64], t1, t2;
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 |
+               block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (i = 16; i < 64; i++)
+        w[i] = w[i - 16] + w[i - 7] +
+               (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ w[i - 15] >> 3) +
+               (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+    a = ctx->state[0]; b = ctx->state[1];
+    c = ctx->state[2]; d = ctx->state[3];
+    e = ctx->state[4]; f = ctx->state[5];
+    g = ctx->state[6]; h = ctx->state[7];
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+             ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b;
+    ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f;
+    ctx->state[6] += g; ctx->state[7] += h;
+}
+
+#undef ROR32
+
+static void sha256_init(struct sha256 *ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->used   = 0;
+}
+
+static void sha256_update(struct sha256 *ctx, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    ctx->length += size;
+    while (size > 0) {
+        size_t n = 64 - ctx->used;
+        if (n > size)
+            n = size;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p         += n;
+        size      -= n;
+        if (ctx->used == 64) {
+            sha256_block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256_final(struct sha256 *ctx, uint8_t digest[32])
+{
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        sha256_block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (i = 0; i < 8; i++)
+        ctx->block[56 + i] = bits >> 8 * (7 - i);
+    sha256_block(ctx, ctx->block);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i]     = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+/*
+ * Capability fingerprints.
+ *
+ * Each node is hashed over a canonical form, Merkle-style, so that equal
+ * subtrees have equal hashes however they were produced:
+ *  - object members are taken in order of key;
+ *  - arrays are treated as sets, and their elements taken in order of
+ *    hash, except for the few whose order carries meaning;
+ *  - numbers are taken as they appear in the JSON output, and integral
+ *    values are always integers, so a dump loaded back from JSON hashes
+ *    the same as the probe which wrote it.
+ * The build_version of this program is not part of the capabilities.
+ */
+static const char *const fingerprint_ordered_arrays[] = {
+    "lut_stride",
+};
+
+static const char *const fingerprint_ignored_keys[] = {
+    "build_version",
+};
+
+struct hashed_child {
+    const struct node *node;
+    uint8_t hash[32];
+};
+
+static int compare_hashed_key(const void *a, const void *b)
+{
+    const struct hashed_child *x = a, *y = b;
+    int c = strcmp(x->node->tag ? x->node->tag : "",
+                   y->node->tag ? y->node->tag : "");
+    return c ? c : memcmp(x->hash, y->hash, 32);
+}
+
+static int compare_hashed_value(const void *a, const void *b)
+{
+    const struct hashed_child *x = a, *y = b;
+    return memcmp(x->hash, y->hash, 32);
+}
+
+static bool string_in(const char *str, const char *const *list, int count)
+{
+    int i;
+    for (i = 0; str && i < count; i++) {
+        if (!strcmp(str, list[i]))
+            return true;
+    }
+    return false;
+}
+
+static void sha256_u64(struct sha256 *ctx, uint64_t value)
+{
+    uint8_t b[8];
+    int i;
+    for (i = 0; i < 8; i++)
+        b[i] = value >> 8 * (7 - i);
+    sha256_update(ctx, b, sizeof(b));
+}
+
+// Length-prefixed data, with a single length byte for the common case.
+static void sha256_bytes(struct sha256 *ctx, const void *data, size_t len)
+{
+    uint8_t short_len = len < 255 ? len : 255;
+    sha256_update(ctx, &short_len, 1);
+    if (len >= 255)
+        sha256_u64(ctx, len);
+    sha256_update(ctx, data, len);
+}
+
+static void sha256_str(struct sha256 *ctx, const char *str)
+{
+    sha256_bytes(ctx, str, strlen(str));
+}
+
+// Short scalars are their own hash: a type letter followed by the value,
+// padded with zeroes.  Everything else is hashed with SHA-256.
+static void node_hash_integer(uint8_t leaf[32], int64_t value)
+{
+    int i;
+    leaf[0] = 'i';
+    for (i = 0; i < 8; i++)
+        leaf[1 + i] = (uint64_t)value >> 8 * (7 - i);
+}
+
+static void node_hash(const struct node *node, uint8_t hash[32])
+{
+    struct sha256 ctx;
+    uint8_t leaf[32] = { 0 };
+    char buffer[32];
+    int i, count;
+
+    if (node->hashed) {
+        memcpy(hash, node->hash, 32);
+        return;
+    }
+
+    sha256_init(&ctx);
+
+    switch (node->type) {
+    case NODE_OBJECT:
+    case NODE_ARRAY:
+        {
+            struct hashed_child local[16], *children = local;
+            bool object = node->type == NODE_OBJECT;
+
+            if (node->nb_children > ARRAY_LENGTH(local))
+                children = malloc(node->nb_children * sizeof(*children));
+
+            for (i = count = 0; i < node->nb_children; i++) {
+                const struct node *child = &node->children[i];
+                if (object &&
+                    string_in(child->tag, fingerprint_ignored_keys,
+                              ARRAY_LENGTH(fingerprint_ignored_keys)))
+                    continue;
+                children[count].node = child;
+                node_hash(child, children[count].hash);
+                ++count;
             }
-            break;
-#endif
-        default:
-            {
-                start_object("unknown");
-                print_integer("type", attr_list[i].type);
-                print_integer("value", value);
-                end_object();
+            if (object)
+                qsort(children, count, sizeof(*children),
+                      &compare_hashed_key);
+            else if (!string_in(node->tag, fingerprint_ordered_arrays,
+                                ARRAY_LENGTH(fingerprint_ordered_arrays)))
+                qsort(children, count, sizeof(*children),
+                      &compare_hashed_value);
+
+            sha256_update(&ctx, object ? "o" : "a", 1);
+            sha256_u64(&ctx, count);
+            for (i = 0; i < count; i++) {
+                int len = 32;
+                if (object)
+                    sha256_str(&ctx, children[i].node->tag);
+                // Leave off the padding of short scalars.
+                while (len > 0 && !children[i].hash[len - 1])
+                    --len;
+                sha256_bytes(&ctx, children[i].hash, len);
             }
-            break;
+            if (children != local)
+                free(children);
         }
-#undef AV
+        break;
+    case NODE_BOOLEAN:
+        leaf[0] = node->boolean ? 't' : 'f';
+        break;
+    case NODE_INTEGER:
+        node_hash_integer(leaf, node->integer);
+        break;
+    case NODE_DOUBLE:
+        {
+            snprintf(buffer, sizeof(buffer), "%lg", node->real);
+            double value = strtod(buffer, NULL);
+            if (fabs(value) < 9e18 && value == (int64_t)value)
+                node_hash_integer(leaf, (int64_t)value);
+            else
+                snprintf((char *)leaf, sizeof(leaf), "d%.30s", buffer);
+        }
+        break;
+    case NODE_STRING:
+        if (strlen(node->string) < sizeof(leaf) - 1) {
+            snprintf((char *)leaf, sizeof(leaf), "s%s", node->string);
+        } else {
+            sha256_update(&ctx, "s", 1);
+            sha256_str(&ctx, node->string);
+        }
+        break;
+    case NODE_NULL:
+        leaf[0] = 'n';
+        break;
     }
+
+    if (leaf[0])
+        memcpy(hash, leaf, 32);
+    else
+        sha256_final(&ctx, hash);
+
+    // Trees are not changed once built, so the hash can be kept.
+    struct node *cache = (struct node *)node;
+    memcpy(cache->hash, hash, 32);
+    cache->hashed = true;
 }
 
-static void dump_surface_attributes(VADisplay display,
-                                    VAProfile profile, VAEntrypoint entrypoint,
-                                    unsigned int rt_formats)
+static void print_hash(const char *tag, const uint8_t hash[32])
 {
-    unsigned int rt_format;
-    for (rt_format = 1; rt_format; rt_format <<= 1) {
-        if (!(rt_format & rt_formats))
-            continue;
+    char hex[65];
+    int i;
+    for (i = 0; i < 32; i++)
+        snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    print_string(tag, "%s", hex);
+}
 
-        VAConfigAttrib attr_rt_format = {
-            .type  = VAConfigAttribRTFormat,
-            .value = rt_format,
-        };
+// The name used for an element of profiles or entrypoints in the
+// subtree paths: its name if it has one, otherwise its number.
+static void node_label(const struct node *node, const char *number_tag,
+                       char *label, size_t size)
+{
+    const struct node *name   = node_child(node, "name");
+    const struct node *number = node_child(node, number_tag);
 
-        VAConfigID config;
-        VAStatus vas = vaCreateConfig(display, profile, entrypoint,
-                                      &attr_rt_format, 1, &config);
-        CHECK_VAS("Unable to create config to test surface attributes");
+    if (name && name->type == NODE_STRING)
+        snprintf(label, size, "%s", name->string);
+    else if (number && number->type == NODE_INTEGER)
+        snprintf(label, size, "%"PRId64, number->integer);
+    else
+        snprintf(label, size, "unknown");
+}
 
-        VASurfaceAttrib *attr_list;
-        unsigned int attr_count;
+static void fingerprint_tree(const struct node *root)
+{
+    uint8_t hash[32];
+    char path[256], label[64];
+    int i, j, k;
 
-        vas = vaQuerySurfaceAttributes(display, config, 0, &attr_count);
-        CHECK_VAS("Unable to query surface attributes");
+    node_hash(root, hash);
 
-        attr_list = calloc(attr_count, sizeof(*attr_list));
+    start_object(NULL);
+    print_hash("fingerprint", hash);
+    start_object("subtrees");
+
+    for (i = 0; i < root->nb_children; i++) {
+        const struct node *child = &root->children[i];
+        if (!child->tag ||
+            string_in(child->tag, fingerprint_ignored_keys,
+                      ARRAY_LENGTH(fingerprint_ignored_keys)))
+            continue;
 
-        vas = vaQuerySurfaceAttributes(display, config,
-                                       attr_list, &attr_count);
-        CHECK_VAS("Unable to query surface attributes");
+        node_hash(child, hash);
+        print_hash(child->tag, hash);
 
-        start_object(NULL);
+        if (strcmp(child->tag, "profiles") || child->type != NODE_ARRAY)
+            continue;
 
-        int i;
-        for (i = 0; i < ARRAY_LENGTH(rt_format_types); i++) {
-            if (rt_format & rt_format_types[i].value) {
-                print_string("rt_format", rt_format_types[i].name);
-                break;
+        for (j = 0; j < child->nb_children; j++) {
+            const struct node *profile = &child->children[j];
+            const struct node *entrypoints;
+
+            node_label(profile, "profile", label, sizeof(label));
+            snprintf(path, sizeof(path), "profiles/%s", label);
+            node_hash(profile, hash);
+            print_hash(path, hash);
+
+            entrypoints = node_child(profile, "entrypoints");
+            if (!entrypoints || entrypoints->type != NODE_ARRAY)
+                continue;
+            for (k = 0; k < entrypoints->nb_children; k++) {
+                const struct node *entrypoint = &entrypoints->children[k];
+                node_label(entrypoint, "entrypoint", label, sizeof(label));
+                snprintf(path + strlen(path), sizeof(path) - strlen(path),
+                         "/%s", label);
+                node_hash(entrypoint, hash);
+                print_hash(path, hash);
+                *strrchr(path, '/') = 0;
             }
         }
-        if (!(i < ARRAY_LENGTH(rt_format_types)))
-            print_string("rt_format", "unknown");
+    }
 
-        bool has_formats = false;
+    end_object();
+    end_object();
+}
 
-        for (i = 0; i < attr_count; i++) {
-#define AV(type, bit) do { \
-                if (attr_list[i].value.value.i & VA_ ## type ## _ ## bit) \
-                    print_string(NULL, #bit); \
-            } while (0)
+/*
+ * OpenMetrics output, for the node_exporter textfile collector.
+ *
+ * Each device is built as a tree and turned into samples as soon as it is
+ * complete.  A metric family may only appear once in the exposition, so
+ * samples are gathered per family and all written at the end.  The
+ * textfile collector does not take the info type, so info metrics are
+ * gauges named *_info with the value 1.
+ */
+enum {
+    OM_DEVICE,
+    OM_ENTRYPOINT,
+    OM_PROFILES,
+    OM_MIN_WIDTH,
+    OM_MAX_WIDTH,
+    OM_MIN_HEIGHT,
+    OM_MAX_HEIGHT,
+    OM_PIXEL_FORMATS,
+    OM_FILTERS,
+    OM_IMAGE_FORMATS,
+    OM_SUBPICTURE_FORMATS,
+    OM_PROBE_SECONDS,
+    OM_LIBVA_CALLS,
+    OM_LIBVA_CPU_SECONDS,
+    OM_LIBVA_CYCLES,
+};
 
-            switch (attr_list[i].type) {
-            case VASurfaceAttribPixelFormat:
-                has_formats = true;
-                break;
-            case VASurfaceAttribMinWidth:
-                print_integer("min_width", attr_list[i].value.value.i);
-                break;
-            case VASurfaceAttribMaxWidth:
-                print_integer("max_width", attr_list[i].value.value.i);
-                break;
-            case VASurfaceAttribMinHeight:
-                print_integer("min_height", attr_list[i].value.value.i);
-                break;
-            case VASurfaceAttribMaxHeight:
-                print_integer("max_height", attr_list[i].value.value.i);
-                break;
-            case VASurfaceAttribMemoryType:
-                {
-                    start_array("memory_types");
-                    AV(SURFACE_ATTRIB_MEM_TYPE, VA);
-                    AV(SURFACE_ATTRIB_MEM_TYPE, V4L2);
-                    AV(SURFACE_ATTRIB_MEM_TYPE, USER_PTR);
-                    AV(SURFACE_ATTRIB_MEM_TYPE, KERNEL_DRM);
-                    AV(SURFACE_ATTRIB_MEM_TYPE, DRM_PRIME);
-#if LIBVA(2, 1, 0)
-                    AV(SURFACE_ATTRIB_MEM_TYPE, DRM_PRIME_2);
-#endif
-                    end_array();
-                }
-                break;
-            case VASurfaceAttribExternalBufferDescriptor:
-                // Ignored (write-only).
-                break;
-#if LIBVA(1, 4, 0)
-            case VASurfaceAttribUsageHint:
-                {
-                    start_array("usage_hints");
-                    AV(SURFACE_ATTRIB_USAGE_HINT, DECODER);
-                    AV(SURFACE_ATTRIB_USAGE_HINT, ENCODER);
-                    AV(SURFACE_ATTRIB_USAGE_HINT, VPP_READ);
-                    AV(SURFACE_ATTRIB_USAGE_HINT, VPP_WRITE);
-                    AV(SURFACE_ATTRIB_USAGE_HINT, DISPLAY);
-                    end_array();
-                }
-                break;
-#endif
-#if LIBVA(2, 12, 0)
-            case VASurfaceAttribDRMFormatModifiers:
-                {
-                    const VADRMFormatModifierList *fml =
-                        attr_list[i].value.value.p;
-                    start_array("drm_format_modifiers");
-                    for (int j = 0; j < fml->num_modifiers; j++)
-                        print_integer(NULL, fml->modifiers[j]);
-                    end_array();
-                }
-                break;
-#endif
-            default:
-                {
-                    start_object("unknown");
-                    print_integer("type", attr_list[i].type);
-                    print_integer("value", attr_list[i].value.value.i);
-                    end_object();
-                }
-                break;
-            }
+static struct openmetrics_family {
+    const char *name;
+    const char *type;
+    const char *unit;
+    const char *help;
+    FILE   *samples;
+    char   *buffer;
+    size_t  size;
+} openmetrics_families[] = {
+    [OM_DEVICE] = {
+        "vadumpcaps_device_info", "gauge", NULL,
+        "Driver in use on the device" },
+    [OM_ENTRYPOINT] = {
+        "vadumpcaps_entrypoint_info", "gauge", NULL,
+        "Supported profile and entrypoint" },
+    [OM_PROFILES] = {
+        "vadumpcaps_profiles", "gauge", NULL,
+        "Number of supported profiles" },
+    [OM_MIN_WIDTH] = {
+        "vadumpcaps_surface_min_width", "gauge", NULL,
+        "Minimum surface width" },
+    [OM_MAX_WIDTH] = {
+        "vadumpcaps_surface_max_width", "gauge", NULL,
+        "Maximum surface width" },
+    [OM_MIN_HEIGHT] = {
+        "vadumpcaps_surface_min_height", "gauge", NULL,
+        "Minimum surface height" },
+    [OM_MAX_HEIGHT] = {
+        "vadumpcaps_surface_max_height", "gauge", NULL,
+        "Maximum surface height" },
+    [OM_PIXEL_FORMATS] = {
+        "vadumpcaps_surface_pixel_formats", "gauge", NULL,
+        "Number of pixel formats supported for surfaces" },
+    [OM_FILTERS] = {
+        "vadumpcaps_filters", "gauge", NULL,
+        "Number of video processing filters" },
+    [OM_IMAGE_FORMATS] = {
+        "vadumpcaps_image_formats", "gauge", NULL,
+        "Number of image formats" },
+    [OM_SUBPICTURE_FORMATS] = {
+        "vadumpcaps_subpicture_formats", "gauge", NULL,
+        "Number of subpicture formats" },
+    [OM_PROBE_SECONDS] = {
+        "vadumpcaps_probe_seconds", "gauge", "seconds",
+        "Time spent in each phase of the probe" },
+    [OM_LIBVA_CALLS] = {
+        "vadumpcaps_probe_libva_calls", "gauge", NULL,
+        "Calls made into libva by the probe" },
+    [OM_LIBVA_CPU_SECONDS] = {
+        "vadumpcaps_probe_libva_cpu_seconds", "gauge", "seconds",
+        "Host CPU time used in libva calls by the probe" },
+    [OM_LIBVA_CYCLES] = {
+        "vadumpcaps_probe_libva_cycles", "gauge", NULL,
+        "Host CPU cycles used in libva calls by the probe" },
+};
 
-#undef AV
+// Returns a new copy of the labels with one more added, sized for the
+// value to be escaped in full; the caller frees it.
+static char *openmetrics_label(const char *labels,
+                               const char *name, const char *value)
+{
+    size_t len = strlen(labels);
+    size_t size = len + strlen(name) + 2 * strlen(value) + 5;
+    char *result = malloc(size);
+    const char *p;
+
+    if (!result)
+        die("Out of memory.\n");
+    len = snprintf(result, size, "%s%s%s=\"", labels, len ? "," : "", name);
+    for (p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            result[len++] = '\\';
+            result[len++] = *p;
+        } else if (*p == '\n') {
+            result[len++] = '\\';
+            result[len++] = 'n';
+        } else {
+            result[len++] = *p;
         }
+    }
+    result[len++] = '"';
+    result[len]   = 0;
+    return result;
+}
 
-        if (has_formats) {
-            start_array("pixel_formats");
+static void openmetrics_sample(int family, const char *labels, double value)
+{
+    struct openmetrics_family *f = &openmetrics_families[family];
 
-            for (i = 0; i < attr_count; i++) {
-                if (attr_list[i].type != VASurfaceAttribPixelFormat)
-                    continue;
+    if (!f->samples)
+        f->samples = open_memstream(&f->buffer, &f->size);
+    fprintf(f->samples, "%s{%s} %.9g\n", f->name, labels, value);
+}
 
-                print_string(NULL, "%.4s", &attr_list[i].value.value.i);
-            }
+static void openmetrics_count(int family, const char *labels,
+                              const struct node *node, const char *tag)
+{
+    const struct node *child = node_child(node, tag);
+    if (child && child->type == NODE_ARRAY)
+        openmetrics_sample(family, labels, child->nb_children);
+}
 
-            end_array();
-        }
+static void openmetrics_integer(int family, const char *labels,
+                                const struct node *node, const char *tag)
+{
+    const struct node *child = node_child(node, tag);
+    if (child && child->type == NODE_INTEGER)
+        openmetrics_sample(family, labels, child->integer);
+}
 
-        end_object();
+static void openmetrics_surfaces(const char *entrypoint_labels,
+                                 const struct node *surfaces)
+{
+    char *labels;
+    int i;
 
-        free(attr_list);
+    for (i = 0; i < surfaces->nb_children; i++) {
+        const struct node *surface = &surfaces->children[i];
+        const struct node *rt_format = node_child(surface, "rt_format");
+        if (!rt_format || rt_format->type != NODE_STRING)
+            continue;
+
+        labels = openmetrics_label(entrypoint_labels,
+                                   "rt_format", rt_format->string);
+        openmetrics_integer(OM_MIN_WIDTH,  labels, surface, "min_width");
+        openmetrics_integer(OM_MAX_WIDTH,  labels, surface, "max_width");
+        openmetrics_integer(OM_MIN_HEIGHT, labels, surface, "min_height");
+        openmetrics_integer(OM_MAX_HEIGHT, labels, surface, "max_height");
+        openmetrics_count(OM_PIXEL_FORMATS, labels, surface,
+                          "pixel_formats");
+        free(labels);
     }
 }
 
-static void dump_colour_standards(VAProcColorStandardType *types, int num)
+static void openmetrics_profiles(const char *device_labels,
+                                 const struct node *profiles)
 {
-    int i, j;
-    for (i = 0; i < num; i++) {
-        for (j = 0; j < ARRAY_LENGTH(colour_types); j++) {
-            if (types[i] == colour_types[j].type)
-                break;
-        }
+    char *profile_labels, *labels, label[64];
+    const struct node *entrypoints, *list;
+    int i, j, k, count;
 
-        start_object(NULL);
+    openmetrics_sample(OM_PROFILES, device_labels, profiles->nb_children);
 
-        print_integer("type", types[i]);
-        if (j < ARRAY_LENGTH(colour_types))
-            print_string("name", colour_types[j].name);
-        else
-            print_string("name", "unknown");
+    for (i = 0; i < profiles->nb_children; i++) {
+        const struct node *profile = &profiles->children[i];
 
-        end_object();
+        node_label(profile, "profile", label, sizeof(label));
+        entrypoints = node_child(profile, "entrypoints");
+        if (!entrypoints || entrypoints->type != NODE_ARRAY)
+            continue;
+        profile_labels = openmetrics_label(device_labels, "profile", label);
+
+        for (j = 0; j < entrypoints->nb_children; j++) {
+            const struct node *entrypoint = &entrypoints->children[j];
+
+            node_label(entrypoint, "entrypoint", label, sizeof(label));
+            labels = openmetrics_label(profile_labels, "entrypoint", label);
+            openmetrics_sample(OM_ENTRYPOINT, labels, 1);
+
+            list = node_child(entrypoint, "surface_formats");
+            if (list && list->type == NODE_ARRAY)
+                openmetrics_surfaces(labels, list);
+
+            // The list of filters also includes VAProcFilterNone.
+            list = node_child(entrypoint, "filters");
+            if (list && list->type == NODE_ARRAY) {
+                for (k = count = 0; k < list->nb_children; k++) {
+                    const struct node *filter =
+                        node_child(&list->children[k], "filter");
+                    if (filter && filter->type == NODE_INTEGER &&
+                        filter->integer != VAProcFilterNone)
+                        ++count;
+                }
+                openmetrics_sample(OM_FILTERS, labels, count);
+            }
+            free(labels);
+        }
+        free(profile_labels);
     }
 }
 
-static void dump_filter_caps(VADisplay display, VAContextID context,
-                             VAProcFilterType filter)
+static void openmetrics_device(const struct node *root)
 {
-    VAStatus vas;
-    int j, k;
+    char *device_labels, *vendor_labels, *labels, version[32];
+    const char *info_labels;
+    const struct node *node;
+    int i;
 
-    switch (filter) {
-    case VAProcFilterDeinterlacing:
-        {
-            VAProcFilterCapDeinterlacing deint[VAProcDeinterlacingCount];
-            unsigned int deint_count = ARRAY_LENGTH(deint);
-            memset(&deint, 0, sizeof(deint));
+    device_labels = openmetrics_label("", "device",
+                                      device_path ? device_path : "");
+
+    node = node_child(root, "driver_vendor");
+    vendor_labels = node && node->type == NODE_STRING ?
+        openmetrics_label(device_labels, "driver_vendor", node->string) :
+        NULL;
+    info_labels = vendor_labels ? vendor_labels : device_labels;
+    node = node_child(root, "driver_version");
+    version[0] = 0;
+    if (node) {
+        const struct node *major = node_child(node, "major");
+        const struct node *minor = node_child(node, "minor");
+        if (major && minor && major->type == NODE_INTEGER &&
+            minor->type == NODE_INTEGER)
+            snprintf(version, sizeof(version), "%"PRId64".%"PRId64,
+                     major->integer, minor->integer);
+    }
+    labels = version[0] ?
+        openmetrics_label(info_labels, "driver_version", version) : NULL;
+    openmetrics_sample(OM_DEVICE, labels ? labels : info_labels, 1);
+    free(labels);
+    free(vendor_labels);
+
+    node = node_child(root, "profiles");
+    if (node && node->type == NODE_ARRAY)
+        openmetrics_profiles(device_labels, node);
+
+    openmetrics_count(OM_IMAGE_FORMATS, device_labels,
+                      root, "image_formats");
+    openmetrics_count(OM_SUBPICTURE_FORMATS, device_labels,
+                      root, "subpicture_formats");
+
+    // Loaded dumps were not probed here, so have no timings.
+    if (!probe_stats.probed) {
+        free(device_labels);
+        return;
+    }
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterDeinterlacing,
-                                             &deint, &deint_count);
-            CHECK_VAS("Failed to query deinterlacing caps");
+    probe_phase(probe_stats.phase);
+    for (i = 0; i < PHASE_COUNT; i++) {
+        labels = openmetrics_label(device_labels, "phase", phase_names[i]);
+        openmetrics_sample(OM_PROBE_SECONDS, labels,
+                           probe_stats.phase_ns[i] / 1e9);
+        free(labels);
+    }
+    for (i = 0; i < VA_CALL_COUNT; i++) {
+        if (!probe_stats.calls[i])
+            continue;
+        labels = openmetrics_label(device_labels,
+                                   "function", va_call_names[i]);
+        openmetrics_sample(OM_LIBVA_CALLS, labels, probe_stats.calls[i]);
+        if (cpu_stats.enabled)
+            openmetrics_sample(OM_LIBVA_CPU_SECONDS, labels,
+                               probe_stats.cpu[i][CPU_NS] / 1e9);
+        if (cpu_stats.have[CPU_CYCLES])
+            openmetrics_sample(OM_LIBVA_CYCLES, labels,
+                               probe_stats.cpu[i][CPU_CYCLES]);
+        free(labels);
+    }
+    free(device_labels);
+}
 
-            start_array("types");
+static void openmetrics_end(void)
+{
+    tree_end();
+    if (tree.depth > 0)
+        return;
 
-            for (j = 0; j < deint_count; j++) {
-                for (k = 0; k < ARRAY_LENGTH(deinterlacer_types); k++) {
-                    if (deint[j].type == deinterlacer_types[k].type)
-                        break;
-                }
+    openmetrics_device(tree.root);
+    node_free(tree.root);
+    free(tree.root);
+    tree.root = NULL;
+}
 
-                start_object(NULL);
+static void openmetrics_finish(void)
+{
+    int i;
 
-                print_integer("type", deint[j].type);
-                if (k < ARRAY_LENGTH(deinterlacer_types))
-                    print_string("name", deinterlacer_types[k].name);
+    for (i = 0; i < ARRAY_LENGTH(openmetrics_families); i++) {
+        struct openmetrics_family *f = &openmetrics_families[i];
+        if (!f->samples)
+            continue;
+        fclose(f->samples);
+
+        fprintf(out, "# TYPE %s %s\n", f->name, f->type);
+        if (f->unit)
+            fprintf(out, "# UNIT %s %s\n", f->name, f->unit);
+        fprintf(out, "# HELP %s %s.\n", f->name, f->help);
+        fwrite(f->buffer, 1, f->size, out);
+        free(f->buffer);
+        f->samples = NULL;
+    }
+    fputs("# EOF\n", out);
+}
 
-                end_object();
-            }
+/*
+ * Structural diff of two trees.  Subtrees whose canonical hashes match are
+ * skipped without being walked, and the hashes of a baseline are kept
+ * between diffs, so comparing many dumps against one baseline costs little
+ * more than reading them.
+ */
 
-            end_array();
-        }
-        break;
-    case VAProcFilterColorBalance:
-        {
-            VAProcFilterCapColorBalance colour[VAProcColorBalanceCount];
-            unsigned int colour_count = ARRAY_LENGTH(colour);
-            memset(&colour, 0, sizeof(colour));
+// The member identifying each element of an array of objects, so that an
+// element which changed is compared rather than reported as removed and
+// added again.
+static const struct {
+    const char *array;
+    const char *key;
+} diff_identity_keys[] = {
+    { "profiles",           "name"         },
+    { "entrypoints",        "name"         },
+    { "surface_formats",    "rt_format"    },
+    { "filters",            "name"         },
+    { "filter_chains",      "chain"        },
+    { "context_sizes",      "size"         },
+    { "cost_model",         "rt_format"    },
+    { "samples",            "size"         },
+    { "types",              "name"         },
+    { "image_formats",      "pixel_format" },
+    { "subpicture_formats", "pixel_format" },
+};
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterColorBalance,
-                                             &colour, &colour_count);
-            CHECK_VAS("Failed to query colour balance caps");
+static struct {
+    int changes;
+    int compared;
+    int skipped;
+} diff_stats;
 
-            start_array("types");
+static bool node_hash_equal(const struct node *a, const struct node *b)
+{
+    uint8_t x[32], y[32];
+    node_hash(a, x);
+    node_hash(b, y);
+    return !memcmp(x, y, 32);
+}
 
-            for (j = 0; j < colour_count; j++) {
-                for (k = 0; k < ARRAY_LENGTH(colour_balance_types); k++) {
-                    if (colour[j].type == colour_balance_types[k].type)
-                        break;
-                }
+static const char *diff_identity(const char *array, const struct node *node)
+{
+    const struct node *key;
+    int i;
 
-                start_object(NULL);
+    if (!array || node->type != NODE_OBJECT)
+        return NULL;
+    for (i = 0; i < ARRAY_LENGTH(diff_identity_keys); i++) {
+        if (strcmp(array, diff_identity_keys[i].array))
+            continue;
+        key = node_child(node, diff_identity_keys[i].key);
+        return key && key->type == NODE_STRING ? key->string : NULL;
+    }
+    return NULL;
+}
 
-                print_integer("type", colour[j].type);
-                if (k < ARRAY_LENGTH(colour_balance_types))
-                    print_string("name", colour_balance_types[k].name);
+static void diff_change(const char *op, const char *path,
+                        const struct node *from, const struct node *to)
+{
+    start_object(NULL);
+    print_string("op", "%s", op);
+    print_string("path", "%s", path);
+    if (from)
+        emit_node_as(from, to ? "from" : "value");
+    if (to)
+        emit_node_as(to, from ? "to" : "value");
+    end_object();
+    ++diff_stats.changes;
+}
 
-                print_double("min_value",     colour[j].range.min_value);
-                print_double("max_value",     colour[j].range.max_value);
-                print_double("default_value", colour[j].range.default_value);
-                print_double("step",          colour[j].range.step);
+// Appends to the path, returning the previous length to restore it to.
+static size_t diff_path(char *path, size_t size, const char *format,
+                        const char *name)
+{
+    size_t length = strlen(path);
+    snprintf(path + length, size - length, format, name);
+    return length;
+}
 
-                end_object();
-            }
+#define DIFF_PATH_SIZE 1024
 
-            end_array();
-        }
-        break;
-#if LIBVA(2, 1, 0)
-    case VAProcFilterTotalColorCorrection:
-        {
-            VAProcFilterCapTotalColorCorrection
-                colour[VAProcTotalColorCorrectionCount];
-            unsigned int colour_count = ARRAY_LENGTH(colour);
-            memset(&colour, 0, sizeof(colour));
+static void diff_node(const struct node *a, const struct node *b,
+                      char *path);
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterTotalColorCorrection,
-                                             &colour, &colour_count);
-            CHECK_VAS("Failed to query total colour correction caps");
+static void diff_object(const struct node *a, const struct node *b,
+                        char *path)
+{
+    const char *format = *path ? ".%s" : "%s";
+    const struct node *child, *other;
+    size_t length;
+    int i;
 
-            start_array("types");
+    for (i = 0; i < a->nb_children; i++) {
+        child = &a->children[i];
+        if (!child->tag ||
+            string_in(child->tag, fingerprint_ignored_keys,
+                      ARRAY_LENGTH(fingerprint_ignored_keys)))
+            continue;
+        length = diff_path(path, DIFF_PATH_SIZE, format, child->tag);
+        other = node_child(b, child->tag);
+        if (other)
+            diff_node(child, other, path);
+        else
+            diff_change("removed", path, child, NULL);
+        path[length] = 0;
+    }
 
-            for (j = 0; j < colour_count; j++) {
-                for (k = 0; k < ARRAY_LENGTH(total_colour_correction_types); k++) {
-                    if (colour[j].type == total_colour_correction_types[k].type)
-                        break;
-                }
+    for (i = 0; i < b->nb_children; i++) {
+        child = &b->children[i];
+        if (!child->tag || node_child(a, child->tag) ||
+            string_in(child->tag, fingerprint_ignored_keys,
+                      ARRAY_LENGTH(fingerprint_ignored_keys)))
+            continue;
+        length = diff_path(path, DIFF_PATH_SIZE, format, child->tag);
+        diff_change("added", path, NULL, child);
+        path[length] = 0;
+    }
+}
 
-                start_object(NULL);
+static struct hashed_child *diff_sorted(const struct node *node)
+{
+    struct hashed_child *children =
+        calloc(node->nb_children + 1, sizeof(*children));
+    int i;
 
-                print_integer("type", colour[j].type);
-                if (k < ARRAY_LENGTH(total_colour_correction_types))
-                    print_string("name", total_colour_correction_types[k].name);
+    for (i = 0; i < node->nb_children; i++) {
+        children[i].node = &node->children[i];
+        node_hash(children[i].node, children[i].hash);
+    }
+    qsort(children, node->nb_children, sizeof(*children),
+          &compare_hashed_value);
+    return children;
+}
 
-                print_double("min_value",     colour[j].range.min_value);
-                print_double("max_value",     colour[j].range.max_value);
-                print_double("default_value", colour[j].range.default_value);
-                print_double("step",          colour[j].range.step);
+static void diff_array(const struct node *a, const struct node *b,
+                       char *path)
+{
+    struct hashed_child *x, *y;
+    const char *id;
+    size_t length;
+    int i, j, c;
+
+    if (string_in(a->tag, fingerprint_ordered_arrays,
+                  ARRAY_LENGTH(fingerprint_ordered_arrays))) {
+        diff_change("changed", path, a, b);
+        return;
+    }
 
-                end_object();
-            }
+    // Pair up equal elements first; whatever is left over has changed.
+    // Matched entries have their node pointer cleared.
+    x = diff_sorted(a);
+    y = diff_sorted(b);
+    for (i = j = 0; i < a->nb_children && j < b->nb_children;) {
+        c = memcmp(x[i].hash, y[j].hash, 32);
+        if (c == 0) {
+            x[i++].node = NULL;
+            y[j++].node = NULL;
+            ++diff_stats.skipped;
+        } else if (c < 0) {
+            ++i;
+        } else {
+            ++j;
+        }
+    }
 
-            end_array();
+    for (i = 0; i < a->nb_children; i++) {
+        if (!x[i].node)
+            continue;
+        id = diff_identity(a->tag, x[i].node);
+        for (j = 0; id && j < b->nb_children; j++) {
+            const char *other;
+            if (!y[j].node)
+                continue;
+            other = diff_identity(b->tag, y[j].node);
+            if (other && !strcmp(id, other))
+                break;
         }
-        break;
-#endif
-#if LIBVA(2, 3, 0)
-    case VAProcFilterHVSNoiseReduction:
-        {
-            // No caps (querying default caps isn't allowed either).
+        if (id && j < b->nb_children) {
+            length = diff_path(path, DIFF_PATH_SIZE, "[%s]", id);
+            diff_node(x[i].node, y[j].node, path);
+            path[length] = 0;
+            y[j].node = NULL;
+        } else {
+            diff_change("removed", path, x[i].node, NULL);
         }
-        break;
-#endif
-#if LIBVA(2, 4, 0)
-    case VAProcFilterHighDynamicRangeToneMapping:
-        {
-            VAProcFilterCapHighDynamicRange
-                hdr[VAProcHighDynamicRangeMetadataTypeCount];
-            unsigned int hdr_count = ARRAY_LENGTH(hdr);
-            memset(&hdr, 0, sizeof(hdr));
-
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterHighDynamicRangeToneMapping,
-                                             &hdr, &hdr_count);
-            CHECK_VAS("Failed to query HDR tone mapping caps");
-
-            start_array("types");
+    }
+    for (j = 0; j < b->nb_children; j++) {
+        if (y[j].node)
+            diff_change("added", path, NULL, y[j].node);
+    }
 
-            for (j = 0; j < hdr_count; j++) {
-                for (k = 0; k < ARRAY_LENGTH(hdr_metadata_types); k++) {
-                    if (hdr[j].metadata_type == hdr_metadata_types[k].type)
-                        break;
-                }
+    free(x);
+    free(y);
+}
 
-                start_object(NULL);
+static void diff_node(const struct node *a, const struct node *b,
+                      char *path)
+{
+    ++diff_stats.compared;
+    if (node_hash_equal(a, b)) {
+        ++diff_stats.skipped;
+        return;
+    }
 
-                print_integer("type", hdr[j].metadata_type);
-                if (k < ARRAY_LENGTH(hdr_metadata_types))
-                    print_string("name", hdr_metadata_types[k].name);
+    if (a->type != b->type)
+        diff_change("changed", path, a, b);
+    else if (a->type == NODE_OBJECT)
+        diff_object(a, b, path);
+    else if (a->type == NODE_ARRAY)
+        diff_array(a, b, path);
+    else
+        diff_change("changed", path, a, b);
+}
 
-                start_array("tone_mapping");
-                for (k = 0; k < ARRAY_LENGTH(tone_mapping_types); k++) {
-                    if (hdr[j].caps_flag & tone_mapping_types[k].type)
-                        print_string(NULL, tone_mapping_types[k].name);
-                }
-                end_array();
+// Writes the changes between two trees as elements of the array currently
+// open, returning how many there were.
+static int diff_subtrees(const struct node *a, const struct node *b)
+{
+    char path[DIFF_PATH_SIZE];
+    int changes = diff_stats.changes;
 
-                end_object();
-            }
+    snprintf(path, sizeof(path), "%s", a->tag ? a->tag : "");
+    diff_node(a, b, path);
+    return diff_stats.changes - changes;
+}
 
-            end_array();
-        }
-        break;
-#endif
-#if LIBVA(2, 12, 0)
-    case VAProcFilter3DLUT:
-        {
-            // No bound on number of LUT types, just ask for a lot of them.
-            VAProcFilterCap3DLUT lut[16];
-            unsigned int lut_count = ARRAY_LENGTH(lut);
-            memset(&lut, 0, sizeof(lut));
+static void diff_tree(const char *tag, const struct node *baseline,
+                      const struct node *root)
+{
+    char path[DIFF_PATH_SIZE] = "";
+    uint8_t hash[32];
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilter3DLUT,
-                                             &lut, &lut_count);
-            CHECK_VAS("Failed to query 3D LUT caps");
+    memset(&diff_stats, 0, sizeof(diff_stats));
 
-            start_array("types");
+    start_object(tag);
+    node_hash(baseline, hash);
+    print_hash("baseline", hash);
+    node_hash(root, hash);
+    print_hash("fingerprint", hash);
 
-            for (j = 0; j < lut_count; j++) {
-                start_object(NULL);
-                print_integer("lut_size", lut[j].lut_size);
-                start_array("lut_stride");
-                for (k = 0; k < 3; k++)
-                    print_integer(NULL, lut[j].lut_stride[k]);
-                end_array();
-                print_integer("bit_depth", lut[j].bit_depth);
-                print_integer("num_channel", lut[j].num_channel);
-                start_array("channel_mapping");
-                for (k = 0; k < ARRAY_LENGTH(tdlut_channel_types); k++) {
-                    if (lut[j].channel_mapping & tdlut_channel_types[k].type)
-                        print_string(NULL, tdlut_channel_types[k].name);
-                }
-                end_array();
-                end_object();
-            }
+    start_array("changes");
+    diff_node(baseline, root, path);
+    end_array();
 
-            end_array();
-        }
-        break;
-#endif
-    default:
-        {
-            VAProcFilterCap cap;
-            unsigned int cap_count = 1;
-            memset(&cap, 0, sizeof(cap));
+    print_boolean("identical", diff_stats.changes == 0);
+    print_integer("nb_changes", diff_stats.changes);
+    print_integer("compared_subtrees", diff_stats.compared);
+    print_integer("skipped_subtrees", diff_stats.skipped);
+    end_object();
+}
 
-            vas = vaQueryVideoProcFilterCaps(display, context, filter,
-                                             &cap, &cap_count);
-            CHECK_VAS("Failed to query filter caps");
+// Dumps to compare against: one for every dump being compared, in the
+// same order, or a single one used for all of them.
+static struct {
+    const char   *path;
+    struct node **roots;
+    int           nb_roots;
+    int           next;
+} baseline;
 
-            if (cap_count > 0) {
-                print_double("min_value",     cap.range.min_value);
-                print_double("max_value",     cap.range.max_value);
-                print_double("default_value", cap.range.default_value);
-                print_double("step",          cap.range.step);
-            }
-        }
+static void load_baseline(const char *path)
+{
+    size_t size;
+    char *data = read_file(path, &size);
+    if (!data)
+        die("Failed to read %s: %m.\n", path);
+
+    const char *p = data, *end = data + size;
+    struct node *root;
+    while ((root = load_next(path, &p, end))) {
+        baseline.roots = realloc(baseline.roots, (baseline.nb_roots + 1) *
+                                 sizeof(*baseline.roots));
+        baseline.roots[baseline.nb_roots++] = root;
     }
+    free(data);
+
+    if (!baseline.nb_roots)
+        die("%s does not contain any dumps.\n", path);
+    baseline.path = path;
 }
 
-static void dump_pipeline_caps(VADisplay display, VAContextID context,
-                               VABufferID *filter_buffers,
-                               int nb_filter_buffers)
+static const struct node *next_baseline(void)
 {
-    VAStatus vas;
-    int i;
+    if (baseline.nb_roots == 1)
+        return baseline.roots[0];
+    if (baseline.next >= baseline.nb_roots)
+        die("%s has fewer dumps than are being compared.\n", baseline.path);
+    return baseline.roots[baseline.next++];
+}
 
-    VAProcPipelineCaps pipeline;
-    memset(&pipeline, 0, sizeof(pipeline));
+/*
+ * Fleet index.
+ *
+ * Many stored dumps, one per node, are merged into one file listing, for
+ * each capability ("term"), the nodes which have it.  A term is a path of
+ * up to four names:
+ *   HEVCMain10                          profile
+ *   HEVCMain10/EncSliceLP               entrypoint
+ *   HEVCMain10/EncSliceLP/YUV420_10     surface rt_format
+ *   HEVCMain10/EncSliceLP/YUV420_10/P010  pixel format of that rt_format
+ *   HEVCMain10/EncSliceLP/rate_control_modes/CBR  attribute value
+ *   filter/Deinterlacing, image_format/NV12, subpicture_format/BGRA
+ * Names are interned, so a term is a tuple of name IDs, and the node list
+ * of each term is stored roaring-style: one container per 65536 node IDs,
+ * holding either a sorted array of the low 16 bits or, once that would be
+ * larger, a bitmap.  Everything is at fixed offsets in native byte order,
+ * so queries work directly on the file mapped into memory.
+ */
 
-    vas = vaQueryVideoProcPipelineCaps(display, context,
-                                       filter_buffers, nb_filter_buffers,
-                                       &pipeline);
-    CHECK_VAS("Failed to query pipeline caps");
+#define INDEX_MAGIC          "VACAPIDX"
+#define INDEX_VERSION        1
+#define INDEX_DEPTH          4
+#define INDEX_ARRAY_MAX      4096
+#define INDEX_BITMAP_WORDS   (65536 / 64)
 
-    start_object("pipeline");
+enum {
+    INDEX_CONTAINER_ARRAY,
+    INDEX_CONTAINER_BITMAP,
+};
 
-    start_array("pipeline_flags");
-    for (i = 0; i < ARRAY_LENGTH(proc_pipeline_flags); i++) {
-        if (pipeline.pipeline_flags & proc_pipeline_flags[i].flag)
-            print_string(NULL, proc_pipeline_flags[i].name);
-    }
-    end_array();
-    start_array("filter_flags");
-    for (i = 0; i < ARRAY_LENGTH(proc_filter_flags); i++) {
-        if (pipeline.filter_flags & proc_filter_flags[i].flag)
-            print_string(NULL, proc_filter_flags[i].name);
-    }
-    end_array();
+struct index_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t nb_nodes;
+    uint32_t nb_names;
+    uint32_t nb_terms;
+    // Offsets from the start of the file.
+    uint64_t strings;    // NUL-terminated names.
+    uint64_t names;      // uint32_t string offsets, sorted by string.
+    uint64_t nodes;      // uint32_t string offsets, by node ID.
+    uint64_t terms;      // struct index_term, sorted by names.
+    uint64_t size;
+};
 
-    print_integer("num_forward_references",  pipeline.num_forward_references);
-    print_integer("num_backward_references", pipeline.num_backward_references);
+struct index_term {
+    // Name IDs plus one, zero after the end of the path.
+    uint32_t names[INDEX_DEPTH];
+    uint32_t nb_nodes;
+    uint32_t nb_containers;
+    uint64_t containers; // struct index_container[nb_containers].
+};
 
-    start_array("input_colour_standards");
-    dump_colour_standards(pipeline.input_color_standards,
-                          pipeline.num_input_color_standards);
-    end_array();
+struct index_container {
+    uint16_t key;        // Node ID >> 16.
+    uint16_t kind;
+    uint32_t count;
+    uint64_t data;       // uint16_t[count] or uint64_t[1024].
+};
 
-    start_array("output_colour_standards");
-    dump_colour_standards(pipeline.output_color_standards,
-                          pipeline.num_output_color_standards);
-    end_array();
+struct index_build_container {
+    uint16_t  key;
+    uint32_t  count;
+    uint16_t *array;
+    uint64_t *bitmap;
+};
 
-#if LIBVA(2, 1, 0)
-    start_array("rotation_flags");
-    for (i = 0; i < ARRAY_LENGTH(rotation_types); i++) {
-        if (pipeline.rotation_flags & 1 << rotation_types[i].type)
-            print_string(NULL, rotation_types[i].name);
-    }
-    end_array();
+struct index_build_term {
+    uint32_t names[INDEX_DEPTH];
+    uint32_t nb_nodes;
+    uint32_t last_node;
+    int nb_containers;
+    struct index_build_container *containers;
+};
 
-    start_array("blend_flags");
-    for (i = 0; i < ARRAY_LENGTH(blend_types); i++) {
-        if (pipeline.blend_flags & 1 << blend_types[i].type)
-            print_string(NULL, blend_types[i].name);
+static struct {
+    // Interned names: strings and an open-addressed table of IDs + 1.
+    char   **names;
+    uint32_t nb_names;
+    uint32_t *name_slots;
+    uint32_t name_mask;
+
+    struct index_build_term *terms;
+    uint32_t nb_terms;
+    uint32_t *term_slots;
+    uint32_t term_mask;
+
+    char   **nodes;
+    uint32_t nb_nodes;
+} index_build;
+
+static uint32_t index_intern(const char *name)
+{
+    uint32_t i, id;
+
+    if (2 * (index_build.nb_names + 1) > index_build.name_mask) {
+        uint32_t size = index_build.name_mask ?
+                        2 * (index_build.name_mask + 1) : 1024;
+        free(index_build.name_slots);
+        index_build.name_slots = calloc(size, sizeof(uint32_t));
+        index_build.name_mask  = size - 1;
+        for (id = 0; id < index_build.nb_names; id++) {
+            const char *str = index_build.names[id];
+            i = hash_bytes(str, strlen(str)) & index_build.name_mask;
+            while (index_build.name_slots[i])
+                i = (i + 1) & index_build.name_mask;
+            index_build.name_slots[i] = id + 1;
+        }
     }
-    end_array();
 
-    start_array("mirror_flags");
-    for (i = 0; i < ARRAY_LENGTH(mirror_types); i++) {
-        if (pipeline.mirror_flags & 1 << mirror_types[i].type)
-            print_string(NULL, mirror_types[i].name);
+    i = hash_bytes(name, strlen(name)) & index_build.name_mask;
+    while ((id = index_build.name_slots[i])) {
+        if (!strcmp(index_build.names[id - 1], name))
+            return id;
+        i = (i + 1) & index_build.name_mask;
     }
-    end_array();
 
-    print_integer("num_additional_outputs", pipeline.num_additional_outputs);
+    index_build.names = realloc(index_build.names,
+                                (index_build.nb_names + 1) * sizeof(char*));
+    index_build.names[index_build.nb_names] = strdup(name);
+    index_build.name_slots[i] = ++index_build.nb_names;
+    return index_build.nb_names;
+}
 
-    start_array("input_pixel_formats");
-    for (i = 0; i < pipeline.num_input_pixel_formats; i++)
-        print_string(NULL, "%.4s", pipeline.input_pixel_format[i]);
-    end_array();
+static uint32_t index_term_hash(const uint32_t names[INDEX_DEPTH])
+{
+    return hash_bytes((const char*)names, INDEX_DEPTH * sizeof(uint32_t));
+}
 
-    start_array("output_pixel_formats");
-    for (i = 0; i < pipeline.num_output_pixel_formats; i++)
-        print_string(NULL, "%.4s", pipeline.output_pixel_format[i]);
-    end_array();
+static struct index_build_term *index_term(const uint32_t names[INDEX_DEPTH])
+{
+    uint32_t i, t;
+
+    if (2 * (index_build.nb_terms + 1) > index_build.term_mask) {
+        uint32_t size = index_build.term_mask ?
+                        2 * (index_build.term_mask + 1) : 1024;
+        free(index_build.term_slots);
+        index_build.term_slots = calloc(size, sizeof(uint32_t));
+        index_build.term_mask  = size - 1;
+        for (t = 0; t < index_build.nb_terms; t++) {
+            i = index_term_hash(index_build.terms[t].names) &
+                index_build.term_mask;
+            while (index_build.term_slots[i])
+                i = (i + 1) & index_build.term_mask;
+            index_build.term_slots[i] = t + 1;
+        }
+    }
 
-#define ATTR(name) do { print_integer(#name, pipeline.name); } while (0)
-    ATTR(max_input_width);
-    ATTR(max_input_height);
-    ATTR(min_input_width);
-    ATTR(min_input_height);
+    i = index_term_hash(names) & index_build.term_mask;
+    while ((t = index_build.term_slots[i])) {
+        if (!memcmp(index_build.terms[t - 1].names, names,
+                    sizeof(index_build.terms[t - 1].names)))
+            return &index_build.terms[t - 1];
+        i = (i + 1) & index_build.term_mask;
+    }
 
-    ATTR(max_output_width);
-    ATTR(max_output_height);
-    ATTR(min_output_width);
-    ATTR(min_output_height);
-#undef ATTR
-#endif
+    index_build.terms = realloc(index_build.terms, (index_build.nb_terms + 1) *
+                                sizeof(*index_build.terms));
+    index_build.term_slots[i] = index_build.nb_terms + 1;
+    struct index_build_term *term = &index_build.terms[index_build.nb_terms++];
+    *term = (struct index_build_term) { .last_node = UINT32_MAX };
+    memcpy(term->names, names, sizeof(term->names));
+    return term;
+}
 
-    end_object();
+// Nodes are added in increasing order, so only the last container of a
+// term ever changes.
+static void index_term_add(struct index_build_term *term, uint32_t node)
+{
+    struct index_build_container *c;
+    uint16_t low = node & 0xffff;
+    int i;
+
+    if (term->last_node == node)
+        return;
+    term->last_node = node;
+    ++term->nb_nodes;
+
+    c = term->nb_containers ? &term->containers[term->nb_containers - 1]
+                            : NULL;
+    if (!c || c->key != node >> 16) {
+        term->containers = realloc(term->containers,
+                                   (term->nb_containers + 1) * sizeof(*c));
+        c = &term->containers[term->nb_containers++];
+        *c = (struct index_build_container) { .key = node >> 16 };
+    }
+
+    if (c->bitmap) {
+        c->bitmap[low / 64] |= UINT64_C(1) << low % 64;
+    } else if (c->count < INDEX_ARRAY_MAX) {
+        if (!(c->count & (c->count - 1)))
+            c->array = realloc(c->array, (c->count ? 2 * c->count : 1) *
+                               sizeof(*c->array));
+        c->array[c->count] = low;
+    } else {
+        c->bitmap = calloc(INDEX_BITMAP_WORDS, sizeof(*c->bitmap));
+        for (i = 0; i < c->count; i++)
+            c->bitmap[c->array[i] / 64] |= UINT64_C(1) << c->array[i] % 64;
+        c->bitmap[low / 64] |= UINT64_C(1) << low % 64;
+        free(c->array);
+        c->array = NULL;
+    }
+    ++c->count;
 }
 
-static void dump_filter_pipelines(VADisplay display, VAContextID context,
-                                  VAProcFilterType filter)
+static void index_add(uint32_t node, const char *a, const char *b,
+                      const char *c, const char *d)
 {
-    VABufferID filter_buffer = VA_INVALID_ID;
-    VAStatus vas;
+    const char *path[INDEX_DEPTH] = { a, b, c, d };
+    uint32_t names[INDEX_DEPTH] = { 0 };
     int i;
 
-    switch (filter) {
-    case VAProcFilterNone:
-        break;
-    case VAProcFilterDeinterlacing:
-        {
-            VAProcFilterCapDeinterlacing deint[VAProcDeinterlacingCount];
-            unsigned int deint_count = ARRAY_LENGTH(deint);
-            memset(&deint, 0, sizeof(deint));
+    for (i = 0; i < INDEX_DEPTH && path[i]; i++)
+        names[i] = index_intern(path[i]);
+    index_term_add(index_term(names), node);
+}
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterDeinterlacing,
-                                             &deint, &deint_count);
-            CHECK_VAS("Failed to query deinterlacing caps");
+static const char *index_string(const struct node *node, const char *tag)
+{
+    const struct node *child = node_child(node, tag);
+    return child && child->type == NODE_STRING ? child->string : NULL;
+}
 
-            // Choose the highest value to query.
-            int deint_type = VAProcDeinterlacingNone;
-            for (i = 0; i < deint_count; i++) {
-                if (deint[i].type > deint_type)
-                    deint_type = deint[i].type;
-            }
+static void index_add_attributes(uint32_t node, const char *profile,
+                                 const char *entrypoint,
+                                 const struct node *attributes)
+{
+    int i, j;
 
-            if (deint_type != VAProcDeinterlacingNone) {
-                VAProcFilterParameterBufferDeinterlacing param = {
-                    .type      = filter,
-                    .algorithm = deint_type,
-                    .flags     = 0,
-                };
-                vas = vaCreateBuffer(display, context,
-                                     VAProcFilterParameterBufferType,
-                                     sizeof(param), 1,
-                                     &param, &filter_buffer);
-                CHECK_VAS("Failed to create deinterlacing parameter buffer");
+    for (i = 0; i < attributes->nb_children; i++) {
+        const struct node *attr = &attributes->children[i];
+        if (attr->type == NODE_STRING) {
+            index_add(node, profile, entrypoint, attr->tag, attr->string);
+        } else if (attr->type == NODE_ARRAY) {
+            for (j = 0; j < attr->nb_children; j++) {
+                if (attr->children[j].type == NODE_STRING)
+                    index_add(node, profile, entrypoint, attr->tag,
+                              attr->children[j].string);
             }
         }
-        break;
-    case VAProcFilterColorBalance:
-        {
-            VAProcFilterCapColorBalance colour[VAProcColorBalanceCount];
-            unsigned int colour_count = ARRAY_LENGTH(colour);
-            memset(&colour, 0, sizeof(colour));
-
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterColorBalance,
-                                             &colour, &colour_count);
-            CHECK_VAS("Failed to query colour balance caps");
+    }
+}
 
-            if (colour_count > 0) {
-                VAProcFilterParameterBufferColorBalance
-                    param[VAProcColorBalanceCount];
-                for (i = 0; i < colour_count; i++) {
-                    param[i] = (VAProcFilterParameterBufferColorBalance) {
-                        .type   = filter,
-                        .attrib = colour[i].type,
-                        .value  = colour[i].range.default_value,
-                    };
+static void index_add_dump(const struct node *root, const char *name)
+{
+    static const char *const format_lists[][2] = {
+        { "image_formats",      "image_format"      },
+        { "subpicture_formats", "subpicture_format" },
+    };
+    uint32_t node = index_build.nb_nodes++;
+    const struct node *list;
+    int i, j, k, l;
+
+    if (node == UINT32_MAX)
+        die("Too many dumps to index.\n");
+    index_build.nodes = realloc(index_build.nodes, index_build.nb_nodes *
+                                sizeof(*index_build.nodes));
+    index_build.nodes[node] = strdup(name);
+
+    list = node_child(root, "profiles");
+    for (i = 0; list && i < list->nb_children; i++) {
+        const struct node *p = &list->children[i];
+        const char *profile = index_string(p, "name");
+        const struct node *entrypoints = node_child(p, "entrypoints");
+        if (!profile)
+            continue;
+        index_add(node, profile, NULL, NULL, NULL);
+
+        for (j = 0; entrypoints && j < entrypoints->nb_children; j++) {
+            const struct node *e = &entrypoints->children[j];
+            const char *entrypoint = index_string(e, "name");
+            const struct node *attributes = node_child(e, "attributes");
+            const struct node *surfaces = node_child(e, "surface_formats");
+            const struct node *filters = node_child(e, "filters");
+            if (!entrypoint)
+                continue;
+            index_add(node, profile, entrypoint, NULL, NULL);
+
+            if (attributes)
+                index_add_attributes(node, profile, entrypoint, attributes);
+
+            for (k = 0; surfaces && k < surfaces->nb_children; k++) {
+                const struct node *s = &surfaces->children[k];
+                const char *rt_format = index_string(s, "rt_format");
+                const struct node *formats = node_child(s, "pixel_formats");
+                if (!rt_format)
+                    continue;
+                index_add(node, profile, entrypoint, rt_format, NULL);
+                for (l = 0; formats && l < formats->nb_children; l++) {
+                    if (formats->children[l].type == NODE_STRING)
+                        index_add(node, profile, entrypoint, rt_format,
+                                  formats->children[l].string);
                 }
-                vas = vaCreateBuffer(display, context,
-                                     VAProcFilterParameterBufferType,
-                                     colour_count * sizeof(param), 1,
-                                     &param, &filter_buffer);
-                CHECK_VAS("Failed to create colour balance parameter buffer");
+            }
+
+            for (k = 0; filters && k < filters->nb_children; k++) {
+                const char *filter = index_string(&filters->children[k],
+                                                  "name");
+                if (filter)
+                    index_add(node, "filter", filter, NULL, NULL);
             }
         }
-        break;
-#if LIBVA(2, 1, 0)
-    case VAProcFilterTotalColorCorrection:
-        {
-            VAProcFilterCapTotalColorCorrection
-                colour[VAProcTotalColorCorrectionCount];
-            unsigned int colour_count = ARRAY_LENGTH(colour);
-            memset(&colour, 0, sizeof(colour));
+    }
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterTotalColorCorrection,
-                                             &colour, &colour_count);
-            CHECK_VAS("Failed to query total colour correction caps");
+    for (i = 0; i < ARRAY_LENGTH(format_lists); i++) {
+        list = node_child(root, format_lists[i][0]);
+        for (j = 0; list && j < list->nb_children; j++) {
+            const char *format = index_string(&list->children[j],
+                                              "pixel_format");
+            if (format)
+                index_add(node, format_lists[i][1], format, NULL, NULL);
+        }
+    }
+}
 
-            if (colour_count > 0) {
-                VAProcFilterParameterBufferTotalColorCorrection
-                    param[VAProcTotalColorCorrectionCount];
-                for (i = 0; i < colour_count; i++) {
-                    param[i] = (VAProcFilterParameterBufferTotalColorCorrection) {
-                        .type   = filter,
-                        .attrib = colour[i].type,
-                        .value  = colour[i].range.default_value,
-                    };
-                }
-                vas = vaCreateBuffer(display, context,
-                                     VAProcFilterParameterBufferType,
-                                     colour_count * sizeof(param), 1,
-                                     &param, &filter_buffer);
-                CHECK_VAS("Failed to create colour correction parameter buffer");
-            }
+// Each dump in a file is a node, named after the file; dumps after the
+// first in the same file are named file#1, file#2 and so on.
+static void index_add_file(const char *path, const char *name)
+{
+    char node_name[PATH_MAX];
+    size_t size, len = strlen(name);
+    struct node *root;
+    int n;
+
+    char *data = read_file(path, &size);
+    if (!data)
+        die("Failed to read %s: %m.\n", path);
+
+    if (len > 5 && !strcmp(name + len - 5, ".json"))
+        len -= 5;
+
+    const char *p = data, *end = data + size;
+    for (n = 0; (root = load_next(path, &p, end)); n++) {
+        if (n)
+            snprintf(node_name, sizeof(node_name), "%.*s#%d",
+                     (int)len, name, n);
+        else
+            snprintf(node_name, sizeof(node_name), "%.*s", (int)len, name);
+        index_add_dump(root, node_name);
+        node_free(root);
+        free(root);
+    }
+    free(data);
+}
+
+static int index_compare_names(const void *a, const void *b)
+{
+    return strcmp(index_build.names[*(const uint32_t*)a],
+                  index_build.names[*(const uint32_t*)b]);
+}
+
+static int index_compare_terms(const void *a, const void *b)
+{
+    const struct index_build_term *ta = a, *tb = b;
+    int i;
+    for (i = 0; i < INDEX_DEPTH; i++) {
+        if (ta->names[i] != tb->names[i])
+            return ta->names[i] < tb->names[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static uint64_t index_align(uint64_t offset)
+{
+    return (offset + 7) & ~UINT64_C(7);
+}
+
+static void index_write(const void *data, size_t size, uint64_t *offset)
+{
+    static const char zero[8];
+
+    if (size && fwrite(data, 1, size, out) != size)
+        die("Failed to write index: %m.\n");
+    *offset += size;
+    if (fwrite(zero, 1, index_align(*offset) - *offset, out) !=
+        index_align(*offset) - *offset)
+        die("Failed to write index: %m.\n");
+    *offset = index_align(*offset);
+}
+
+/*
+ * Names are renumbered in sorted order so that queries can find them by
+ * binary search, then the terms are sorted by their renumbered paths for
+ * the same reason.  The layout is computed before anything is written so
+ * that the output need not be seekable.
+ */
+static void write_index(void)
+{
+    struct index_header header = { .magic = INDEX_MAGIC };
+    uint32_t *order, *renumber, *name_offsets, *node_offsets;
+    uint64_t offset, strings_size = 0, data_offset;
+    uint32_t i, j;
+
+    order    = malloc(index_build.nb_names * sizeof(*order));
+    renumber = malloc(index_build.nb_names * sizeof(*renumber));
+    for (i = 0; i < index_build.nb_names; i++)
+        order[i] = i;
+    qsort(order, index_build.nb_names, sizeof(*order), &index_compare_names);
+    for (i = 0; i < index_build.nb_names; i++)
+        renumber[order[i]] = i + 1;
+
+    for (i = 0; i < index_build.nb_terms; i++) {
+        for (j = 0; j < INDEX_DEPTH; j++) {
+            uint32_t *name = &index_build.terms[i].names[j];
+            if (*name)
+                *name = renumber[*name - 1];
         }
-        break;
-#endif
-#if LIBVA(2, 3, 0)
-    case  VAProcFilterHVSNoiseReduction:
-        {
-            VAProcFilterParameterBufferHVSNoiseReduction param = {
-                .type     = filter,
-                .qp       = 26,
-                .strength = 10,
+    }
+    qsort(index_build.terms, index_build.nb_terms,
+          sizeof(*index_build.terms), &index_compare_terms);
+
+    name_offsets = malloc(index_build.nb_names * sizeof(*name_offsets));
+    node_offsets = malloc(index_build.nb_nodes * sizeof(*node_offsets));
+    for (i = 0; i < index_build.nb_names; i++) {
+        name_offsets[i] = strings_size;
+        strings_size += strlen(index_build.names[order[i]]) + 1;
+    }
+    for (i = 0; i < index_build.nb_nodes; i++) {
+        node_offsets[i] = strings_size;
+        strings_size += strlen(index_build.nodes[i]) + 1;
+    }
+    if (strings_size > UINT32_MAX)
+        die("Too many names to index.\n");
+
+    header.version  = INDEX_VERSION;
+    header.nb_nodes = index_build.nb_nodes;
+    header.nb_names = index_build.nb_names;
+    header.nb_terms = index_build.nb_terms;
+    header.strings  = index_align(sizeof(header));
+    header.names    = index_align(header.strings + strings_size);
+    header.nodes    = index_align(header.names +
+                                  header.nb_names * sizeof(uint32_t));
+    header.terms    = index_align(header.nodes +
+                                  header.nb_nodes * sizeof(uint32_t));
+    offset = header.terms + header.nb_terms * sizeof(struct index_term);
+    for (i = 0; i < index_build.nb_terms; i++)
+        offset += index_build.terms[i].nb_containers *
+                  sizeof(struct index_container);
+    data_offset = offset;
+    for (i = 0; i < index_build.nb_terms; i++) {
+        const struct index_build_term *term = &index_build.terms[i];
+        for (j = 0; j < term->nb_containers; j++) {
+            const struct index_build_container *c = &term->containers[j];
+            offset = index_align(offset +
+                (c->bitmap ? INDEX_BITMAP_WORDS * sizeof(uint64_t)
+                           : c->count * sizeof(uint16_t)));
+        }
+    }
+    header.size = offset;
+
+    offset = 0;
+    index_write(&header, sizeof(header), &offset);
+    for (i = 0; i < index_build.nb_names; i++) {
+        const char *name = index_build.names[order[i]];
+        if (fwrite(name, 1, strlen(name) + 1, out) != strlen(name) + 1)
+            die("Failed to write index: %m.\n");
+    }
+    for (i = 0; i < index_build.nb_nodes; i++) {
+        const char *name = index_build.nodes[i];
+        if (fwrite(name, 1, strlen(name) + 1, out) != strlen(name) + 1)
+            die("Failed to write index: %m.\n");
+    }
+    offset = header.strings + strings_size;
+    index_write(NULL, 0, &offset);
+    index_write(name_offsets, header.nb_names * sizeof(uint32_t), &offset);
+    index_write(node_offsets, header.nb_nodes * sizeof(uint32_t), &offset);
+
+    uint64_t containers = header.terms +
+                          header.nb_terms * sizeof(struct index_term);
+    for (i = 0; i < index_build.nb_terms; i++) {
+        const struct index_build_term *term = &index_build.terms[i];
+        struct index_term ft = {
+            .nb_nodes      = term->nb_nodes,
+            .nb_containers = term->nb_containers,
+            .containers    = containers,
+        };
+        memcpy(ft.names, term->names, sizeof(ft.names));
+        index_write(&ft, sizeof(ft), &offset);
+        containers += term->nb_containers * sizeof(struct index_container);
+    }
+    for (i = 0; i < index_build.nb_terms; i++) {
+        const struct index_build_term *term = &index_build.terms[i];
+        for (j = 0; j < term->nb_containers; j++) {
+            const struct index_build_container *c = &term->containers[j];
+            struct index_container fc = {
+                .key   = c->key,
+                .kind  = c->bitmap ? INDEX_CONTAINER_BITMAP
+                                   : INDEX_CONTAINER_ARRAY,
+                .count = c->count,
+                .data  = data_offset,
             };
-            vas = vaCreateBuffer(display, context,
-                                 VAProcFilterParameterBufferType,
-                                 sizeof(param), 1,
-                                 &param, &filter_buffer);
-            CHECK_VAS("Failed to create HVS NR parameter buffer");
+            index_write(&fc, sizeof(fc), &offset);
+            data_offset = index_align(data_offset +
+                (c->bitmap ? INDEX_BITMAP_WORDS * sizeof(uint64_t)
+                           : c->count * sizeof(uint16_t)));
         }
-        break;
-#endif
-#if LIBVA(2, 4, 0)
-    case VAProcFilterHighDynamicRangeToneMapping:
-        {
-            VAProcFilterCapHighDynamicRange
-                hdr[VAProcHighDynamicRangeMetadataTypeCount];
-            unsigned int hdr_count = ARRAY_LENGTH(hdr);
-            memset(&hdr, 0, sizeof(hdr));
+    }
+    for (i = 0; i < index_build.nb_terms; i++) {
+        const struct index_build_term *term = &index_build.terms[i];
+        for (j = 0; j < term->nb_containers; j++) {
+            const struct index_build_container *c = &term->containers[j];
+            if (c->bitmap)
+                index_write(c->bitmap, INDEX_BITMAP_WORDS * sizeof(uint64_t),
+                            &offset);
+            else
+                index_write(c->array, c->count * sizeof(uint16_t), &offset);
+        }
+    }
+    if (offset != header.size)
+        die("Index layout error.\n");
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilterHighDynamicRangeToneMapping,
-                                             &hdr, &hdr_count);
-            CHECK_VAS("Failed to query HDR tone mapping caps");
+    free(order);
+    free(renumber);
+    free(name_offsets);
+    free(node_offsets);
+}
 
-            if (hdr_count > 0 &&
-                hdr[0].metadata_type == VAProcHighDynamicRangeMetadataHDR10) {
-                VAHdrMetaDataHDR10 hdr10 = {
-                    .display_primaries_x = { 13245,  7500, 34000 },
-                    .display_primaries_y = { 34500,  3000, 16000 },
-                    .white_point_x = 15635,
-                    .white_point_y = 15635,
-                    .max_display_mastering_luminance = 10000000,
-                    .min_display_mastering_luminance = 10,
-                };
-                VAProcFilterParameterBufferHDRToneMapping param = {
-                    .type = filter,
-                    .data = {
-                        .metadata_type = VAProcHighDynamicRangeMetadataHDR10,
-                        .metadata      = &hdr10,
-                        .metadata_size = sizeof(hdr10),
-                    },
-                };
-                vas = vaCreateBuffer(display, context,
-                                     VAProcFilterParameterBufferType,
-                                     sizeof(param), 1,
-                                     &param, &filter_buffer);
-                CHECK_VAS("Failed to create HDR tone mapping parameter buffer");
-            }
+static int index_compare_entries(const void *a, const void *b)
+{
+    return strcmp(*(const char *const*)a, *(const char *const*)b);
+}
+
+static void run_index_build(const char *path)
+{
+    struct timespec start, end;
+    uint64_t containers[2] = { 0 };
+    uint32_t i;
+    int j;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        char **files = NULL;
+        int nb_files = 0;
+
+        // Sorted, so that node IDs do not depend on directory order.
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.')
+                continue;
+            files = realloc(files, (nb_files + 1) * sizeof(*files));
+            files[nb_files++] = strdup(entry->d_name);
         }
-        break;
-#endif
-#if LIBVA(2, 12, 0)
-    case VAProcFilter3DLUT:
-        {
-            VAProcFilterCap3DLUT lut[16];
-            unsigned int lut_count = ARRAY_LENGTH(lut);
-            memset(&lut, 0, sizeof(lut));
+        closedir(dir);
+        qsort(files, nb_files, sizeof(*files), &index_compare_entries);
+
+        for (j = 0; j < nb_files; j++) {
+            char file[PATH_MAX];
+            snprintf(file, sizeof(file), "%s/%s", path, files[j]);
+            index_add_file(file, files[j]);
+            free(files[j]);
+        }
+        free(files);
+    } else if (errno == ENOTDIR) {
+        const char *name = strrchr(path, '/');
+        index_add_file(path, name ? name + 1 : path);
+    } else {
+        die("Failed to open %s: %m.\n", path);
+    }
 
-            vas = vaQueryVideoProcFilterCaps(display, context,
-                                             VAProcFilter3DLUT,
-                                             &lut, &lut_count);
-            CHECK_VAS("Failed to query 3D LUT caps");
+    write_index();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < index_build.nb_terms; i++) {
+        struct index_build_term *term = &index_build.terms[i];
+        for (j = 0; j < term->nb_containers; j++) {
+            ++containers[!!term->containers[j].bitmap];
+            free(term->containers[j].array);
+            free(term->containers[j].bitmap);
+        }
+        free(term->containers);
+    }
+    fprintf(stderr, "Indexed %"PRIu32" dumps: %"PRIu32" names, %"PRIu32
+            " terms, %"PRIu64" array and %"PRIu64" bitmap containers "
+            "in %.3fs.\n", index_build.nb_nodes, index_build.nb_names,
+            index_build.nb_terms, containers[0], containers[1],
+            (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    for (i = 0; i < index_build.nb_names; i++)
+        free(index_build.names[i]);
+    for (i = 0; i < index_build.nb_nodes; i++)
+        free(index_build.nodes[i]);
+    free(index_build.names);
+    free(index_build.name_slots);
+    free(index_build.terms);
+    free(index_build.term_slots);
+    free(index_build.nodes);
+}
+
+/*
+ * Queries are boolean expressions over terms, with ! binding tightest,
+ * then &, then |, and parentheses for grouping:
+ *   AV1Profile0/EncSliceLP/YUV420_10 & !image_format/P016
+ * Each term is expanded from its containers into a plain bitmap over all
+ * nodes and combined with the others a word at a time.
+ */
+
+static struct {
+    const uint8_t *base;
+    const struct index_header *header;
+    const uint32_t *names;
+    const uint32_t *nodes;
+    const struct index_term *terms;
+    int words;
+
+    const char *query;
+    const char *p;
+} index_query;
+
+// The strings section ends with a NUL, so any offset inside it gives a
+// terminated string.
+static const char *index_name(uint32_t offset)
+{
+    const struct index_header *header = index_query.header;
+    if (offset >= header->names - header->strings)
+        die("Index is corrupt.\n");
+    return (const char*)index_query.base + header->strings + offset;
+}
+
+static void index_open(const char *path)
+{
+    const struct index_header *header;
+    struct stat st;
+    void *base;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        die("Failed to open %s: %m.\n", path);
+    if (fstat(fd, &st) < 0)
+        die("Failed to stat %s: %m.\n", path);
+    if (st.st_size < sizeof(*header))
+        die("%s is not a vadumpcaps index.\n", path);
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        die("Failed to map %s: %m.\n", path);
+    close(fd);
+
+    header = base;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)))
+        die("%s is not a vadumpcaps index.\n", path);
+    if (header->version != INDEX_VERSION)
+        die("%s has unsupported index version %"PRIu32".\n",
+            path, header->version);
+    if (header->size != st.st_size ||
+        header->strings < sizeof(*header) ||
+        header->names <= header->strings || header->names > st.st_size ||
+        ((const char*)base)[header->names - 1] ||
+        header->nodes > st.st_size || header->terms > st.st_size ||
+        header->names + header->nb_names * sizeof(uint32_t) > st.st_size ||
+        header->nodes + header->nb_nodes * sizeof(uint32_t) > st.st_size ||
+        header->terms + header->nb_terms * sizeof(struct index_term) >
+        st.st_size)
+        die("%s is truncated or corrupt.\n", path);
+
+    index_query.base   = base;
+    index_query.header = header;
+    index_query.names  = (const uint32_t*)((const uint8_t*)base +
+                                           header->names);
+    index_query.nodes  = (const uint32_t*)((const uint8_t*)base +
+                                           header->nodes);
+    index_query.terms  = (const struct index_term*)((const uint8_t*)base +
+                                                    header->terms);
+    index_query.words  = (header->nb_nodes + 63) / 64;
+}
+
+// Name ID plus one, or zero if no dump has the name.
+static uint32_t index_find_name(const char *name, size_t len)
+{
+    uint32_t lo = 0, hi = index_query.header->nb_names;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const char *str = index_name(index_query.names[mid]);
+        int cmp = strncmp(str, name, len);
+        if (!cmp)
+            cmp = str[len] ? 1 : 0;
+        if (!cmp)
+            return mid + 1;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+static const struct index_term *index_find_term(const uint32_t *names)
+{
+    uint32_t lo = 0, hi = index_query.header->nb_terms;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int i, cmp = 0;
+        for (i = 0; i < INDEX_DEPTH && !cmp; i++) {
+            if (index_query.terms[mid].names[i] != names[i])
+                cmp = index_query.terms[mid].names[i] < names[i] ? -1 : 1;
+        }
+        if (!cmp)
+            return &index_query.terms[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
 
-            if (lut_count > 0) {
-                VAProcFilterParameterBuffer3DLUT param = {
-                    .type = filter,
-                    .lut_surface     = VA_INVALID_ID,
-                    .lut_size        = lut[0].lut_size,
-                    .lut_stride[0]   = lut[0].lut_stride[0],
-                    .lut_stride[1]   = lut[0].lut_stride[1],
-                    .lut_stride[2]   = lut[0].lut_stride[2],
-                    .bit_depth       = lut[0].bit_depth,
-                    .num_channel     = lut[0].num_channel,
-                    .channel_mapping = 1 << (ffs(lut[0].channel_mapping) - 1),
-                };
-                vas = vaCreateBuffer(display, context,
-                                     VAProcFilterParameterBufferType,
-                                     sizeof(param), 1,
-                                     &param, &filter_buffer);
-                CHECK_VAS("Failed to create 3D LUT parameter buffer");
+static void index_expand_term(const struct index_term *term, uint64_t *bits)
+{
+    const struct index_header *header = index_query.header;
+    const struct index_container *containers;
+    uint32_t i, j;
+
+    if (term->containers > header->size ||
+        term->containers + term->nb_containers *
+        sizeof(struct index_container) > header->size)
+        die("Index is corrupt.\n");
+    containers = (const struct index_container*)(index_query.base +
+                                                 term->containers);
+
+    for (i = 0; i < term->nb_containers; i++) {
+        const struct index_container *c = &containers[i];
+        uint32_t base = (uint32_t)c->key << 16;
+
+        if (c->kind == INDEX_CONTAINER_BITMAP) {
+            const uint64_t *bitmap;
+            uint32_t first = base / 64, count = INDEX_BITMAP_WORDS;
+            if (c->data > header->size ||
+                c->data + INDEX_BITMAP_WORDS * sizeof(uint64_t) >
+                header->size)
+                die("Index is corrupt.\n");
+            bitmap = (const uint64_t*)(index_query.base + c->data);
+            if (first >= index_query.words)
+                continue;
+            if (first + count > index_query.words)
+                count = index_query.words - first;
+            memcpy(bits + first, bitmap, count * sizeof(uint64_t));
+        } else {
+            const uint16_t *array;
+            if (c->data > header->size ||
+                c->data + c->count * sizeof(uint16_t) > header->size)
+                die("Index is corrupt.\n");
+            array = (const uint16_t*)(index_query.base + c->data);
+            for (j = 0; j < c->count; j++) {
+                uint32_t node = base + array[j];
+                if (node < header->nb_nodes)
+                    bits[node / 64] |= UINT64_C(1) << node % 64;
             }
         }
-        break;
-#endif
-    default:
-        {
-            VAProcFilterCap cap;
-            unsigned int cap_count = 1;
-            memset(&cap, 0, sizeof(cap));
+    }
+}
 
-            vas = vaQueryVideoProcFilterCaps(display, context, filter,
-                                             &cap, &cap_count);
-            CHECK_VAS("Failed to query filter caps");
+static void index_skip_space(void)
+{
+    while (*index_query.p == ' ' || *index_query.p == '\t')
+        ++index_query.p;
+}
 
-            if (cap_count > 0) {
-                VAProcFilterParameterBuffer param = {
-                    .type  = filter,
-                    .value = cap.range.default_value,
-                };
-                vas = vaCreateBuffer(display, context,
-                                     VAProcFilterParameterBufferType,
-                                     sizeof(param), 1,
-                                     &param, &filter_buffer);
-                CHECK_VAS("Failed to create filter parameter buffer");
-            }
-        }
+static uint64_t *index_parse_or(void);
+
+static uint64_t *index_parse_unary(void)
+{
+    uint64_t *bits;
+    int i;
+
+    index_skip_space();
+    if (*index_query.p == '!') {
+        ++index_query.p;
+        bits = index_parse_unary();
+        for (i = 0; i < index_query.words; i++)
+            bits[i] = ~bits[i];
+        if (index_query.header->nb_nodes % 64)
+            bits[index_query.words - 1] &=
+                (UINT64_C(1) << index_query.header->nb_nodes % 64) - 1;
+        return bits;
+    }
+    if (*index_query.p == '(') {
+        ++index_query.p;
+        bits = index_parse_or();
+        index_skip_space();
+        if (*index_query.p != ')')
+            die("Query \"%s\": expected ')' at offset %d.\n",
+                index_query.query, (int)(index_query.p - index_query.query));
+        ++index_query.p;
+        return bits;
     }
 
-    if (filter_buffer == VA_INVALID_ID) {
-        if (filter == VAProcFilterNone) {
-            dump_pipeline_caps(display, context, NULL, 0);
-        } else {
-            // Broken filter caps.
+    // A term, as names separated by '/'.
+    uint32_t names[INDEX_DEPTH] = { 0 };
+    const char *start = index_query.p;
+    bool known = true;
+    int depth = 0;
+
+    bits = calloc(index_query.words ? index_query.words : 1,
+                  sizeof(*bits));
+    while (1) {
+        size_t len = strcspn(index_query.p, "/&|!() \t");
+        if (!len)
+            die("Query \"%s\": expected a name at offset %d.\n",
+                index_query.query, (int)(index_query.p - index_query.query));
+        if (depth >= INDEX_DEPTH)
+            die("Query \"%s\": term has more than %d names.\n",
+                index_query.query, INDEX_DEPTH);
+        names[depth] = index_find_name(index_query.p, len);
+        known = known && names[depth];
+        ++depth;
+        index_query.p += len;
+        if (*index_query.p != '/')
+            break;
+        ++index_query.p;
+    }
+
+    const struct index_term *term = known ? index_find_term(names) : NULL;
+    if (term)
+        index_expand_term(term, bits);
+    else
+        fprintf(stderr, "Query \"%s\": no dump has %.*s.\n",
+                index_query.query, (int)(index_query.p - start), start);
+    return bits;
+}
+
+static uint64_t *index_parse_and(void)
+{
+    uint64_t *bits = index_parse_unary(), *rhs;
+    int i;
+
+    while (index_skip_space(), *index_query.p == '&') {
+        ++index_query.p;
+        rhs = index_parse_unary();
+        for (i = 0; i < index_query.words; i++)
+            bits[i] &= rhs[i];
+        free(rhs);
+    }
+    return bits;
+}
+
+static uint64_t *index_parse_or(void)
+{
+    uint64_t *bits = index_parse_and(), *rhs;
+    int i;
+
+    while (index_skip_space(), *index_query.p == '|') {
+        ++index_query.p;
+        rhs = index_parse_and();
+        for (i = 0; i < index_query.words; i++)
+            bits[i] |= rhs[i];
+        free(rhs);
+    }
+    return bits;
+}
+
+static void run_index_query(const char *query)
+{
+    struct timespec start, end;
+    uint64_t *bits;
+    int64_t matched = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    index_query.query = index_query.p = query;
+    bits = index_parse_or();
+    index_skip_space();
+    if (*index_query.p)
+        die("Query \"%s\": unexpected '%c' at offset %d.\n", query,
+            *index_query.p, (int)(index_query.p - query));
+    for (i = 0; i < index_query.words; i++)
+        matched += __builtin_popcountll(bits[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    start_object(NULL);
+    print_string("query", "%s", query);
+    print_integer("matched", matched);
+    print_double("query_us", (end.tv_sec - start.tv_sec) * 1e6 +
+                             (end.tv_nsec - start.tv_nsec) / 1e3);
+    start_array("nodes");
+    for (i = 0; i < index_query.words; i++) {
+        uint64_t word = bits[i];
+        while (word) {
+            uint32_t node = 64 * i + __builtin_ctzll(word);
+            print_string(NULL, "%s", index_name(index_query.nodes[node]));
+            word &= word - 1;
         }
-    } else {
-        dump_pipeline_caps(display, context, &filter_buffer, 1);
-        vaDestroyBuffer(display, filter_buffer);
     }
+    end_array();
+    end_object();
+
+    free(bits);
 }
 
-static void dump_filters(VADisplay display, unsigned int rt_format)
+/*
+ * Opens and initialises a device, returning NULL (having said why) if that
+ * fails.  The DRM fd must be closed after vaTerminate().
+ */
+static VADisplay open_device(const char *path, const char *driver,
+                             int *drm_fd, int *major, int *minor)
 {
+    VADisplay display;
     VAStatus vas;
-    int i, j;
 
-    VAConfigAttrib attr_rt_format = {
-        .type  = VAConfigAttribRTFormat,
-        .value = rt_format,
+    probe_stats_reset();
+
+    // A replayed device is never opened (and closing -1 does no harm).
+    *drm_fd = tape.mode == TAPE_REPLAY ? -1 : open(path, O_RDWR);
+    if (*drm_fd < 0 && tape.mode != TAPE_REPLAY) {
+        fprintf(stderr, "Failed to open %s: %m.\n", path);
+        return NULL;
+    }
+
+    display = vaGetDisplayDRM(*drm_fd);
+    if (!display) {
+        fprintf(stderr, "Failed to open VA display from DRM device.\n");
+        close(*drm_fd);
+        return NULL;
+    }
+
+    if (driver) {
+#if LIBVA(1, 6, 0)
+        vas = vaSetDriverName(display, (char*)driver);
+        if (vas != VA_STATUS_SUCCESS) {
+            error_vas(vas, "Failed to set driver name");
+            goto fail;
+        }
+#else
+        fprintf(stderr, "Driver name setting not supported.\n");
+        goto fail;
+#endif
+    }
+
+    *major = *minor = 0;
+    probe_phase(PHASE_INITIALISE);
+    vas = vaInitialize(display, major, minor);
+    probe_phase(PHASE_OTHER);
+    if (vas != VA_STATUS_SUCCESS) {
+        error_vas(vas, "Failed to initialise");
+        goto fail;
+    }
+    return display;
+
+fail:
+    vaTerminate(display);
+    close(*drm_fd);
+    return NULL;
+}
+
+static struct node *capture_device(VADisplay display, int major, int minor)
+{
+    const struct output_format *saved_output = output;
+
+    output = &tree_format;
+    dump_device(display, major, minor);
+    output = saved_output;
+
+    struct node *root = tree.root;
+    tree.root = NULL;
+    return root;
+}
+
+/*
+ * Writes one probe of the device repeatedly in each output format to
+ * compare the encoded size and encode time.
+ */
+static void bench_formats(const struct node *root)
+{
+    static const struct {
+        const char *name;
+        int format;
+        bool pretty;
+        bool json;
+    } modes[] = {
+        { "json",      0, true,  true  },
+        { "json_ugly", 0, false, true  },
+        { "cbor",      1, false, false },
+        { "msgpack",   2, false, false },
+        { "ndjson",    3, false, true  },
     };
+    const struct output_format *saved_output = output;
+    FILE *saved_out = out;
+    bool saved_pretty = pretty_print;
+    struct {
+        size_t bytes;
+        long iterations;
+        double seconds;
+        bool valid;
+        long parse_iterations;
+        double parse_seconds;
+    } results[ARRAY_LENGTH(modes)];
+    char *buffer = NULL;
+    size_t buffer_size = 0;
+    int i;
 
-    VAConfigID config;
-    vas = vaCreateConfig(display, VAProfileNone,
-                         VAEntrypointVideoProc,
-                         &attr_rt_format, 1, &config);
-    CHECK_VAS("Unable to create config to test filters");
+    out = open_memstream(&buffer, &buffer_size);
+    if (!out)
+        die("Failed to open memory stream: %m.\n");
 
-    VAContextID context;
-    vas = vaCreateContext(display, config, 1280, 720, 0,
-                          NULL, 0, &context);
-    CHECK_VAS("Unable to create context to test filters");
+    for (i = 0; i < ARRAY_LENGTH(modes); i++) {
+        struct timespec start, now;
+        double elapsed;
+        long iterations = 0;
 
-    VAProcFilterType filter_list[VAProcFilterCount];
-    unsigned int filter_count = VAProcFilterCount;
-    vas = vaQueryVideoProcFilters(display, context,
-                                  filter_list, &filter_count);
-    CHECK_VAS("Failed to query filters");
+        output       = &output_formats[modes[i].format];
+        pretty_print = modes[i].pretty;
 
-    start_array("filters");
+        // Run for at least a quarter of a second to get a stable figure.
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            rewind(out);
+            emit_node(root);
+            fflush(out);
+            ++iterations;
 
-    for (i = -1; i < (int)filter_count; i++) {
-        VAProcFilterType filter;
-        if (i == -1)
-            filter = VAProcFilterNone;
-        else
-            filter = filter_list[i];
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) +
+                      (now.tv_nsec - start.tv_nsec) / 1e9;
+        } while (elapsed < 0.25);
+
+        results[i].bytes      = ftell(out);
+        results[i].iterations = iterations;
+        results[i].seconds    = elapsed;
+
+        if (!modes[i].json)
+            continue;
 
-        for (j = 0; j < ARRAY_LENGTH(filters); j++) {
-            if (filters[j].filter == filter)
+        // Check that the text output is accepted by a strict parser, and
+        // measure how fast that parser can read it back.
+        char error[160];
+        iterations = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            results[i].valid = validate_json(buffer, results[i].bytes,
+                                             error, sizeof(error)) > 0;
+            if (!results[i].valid) {
+                fprintf(stderr, "Invalid %s output: %s.\n",
+                        modes[i].name, error);
                 break;
-        }
+            }
+            ++iterations;
 
-        start_object(NULL);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (now.tv_sec - start.tv_sec) +
+                      (now.tv_nsec - start.tv_nsec) / 1e9;
+        } while (elapsed < 0.25);
 
-        print_integer("filter", filter);
-        if (j < ARRAY_LENGTH(filters))
-            print_string("name", filters[j].name);
+        results[i].parse_iterations = iterations;
+        results[i].parse_seconds    = elapsed;
+    }
 
-        if (DUMP(FILTER_CAPS) && filter != VAProcFilterNone)
-            dump_filter_caps(display, context, filter);
+    fclose(out);
+    free(buffer);
 
-        if (DUMP(PIPELINE_CAPS))
-            dump_filter_pipelines(display, context, filter);
+    output       = saved_output;
+    out          = saved_out;
+    pretty_print = saved_pretty;
 
+    start_object(NULL);
+    start_array("formats");
+    for (i = 0; i < ARRAY_LENGTH(modes); i++) {
+        start_object(NULL);
+        print_string("format", "%s", modes[i].name);
+        print_integer("bytes", results[i].bytes);
+        print_double("size_ratio",
+                     (double)results[i].bytes / results[0].bytes);
+        print_integer("iterations", results[i].iterations);
+        print_double("encode_us",
+                     1e6 * results[i].seconds / results[i].iterations);
+        print_double("encode_mb_per_second",
+                     results[i].bytes * results[i].iterations /
+                     results[i].seconds / 1e6);
+        if (modes[i].json) {
+            print_boolean("valid", results[i].valid);
+            if (results[i].valid) {
+                print_double("parse_us", 1e6 * results[i].parse_seconds /
+                             results[i].parse_iterations);
+                print_double("parse_mb_per_second",
+                             results[i].bytes *
+                             results[i].parse_iterations /
+                             results[i].parse_seconds / 1e6);
+            }
+        }
         end_object();
     }
-
     end_array();
+    end_object();
+}
 
-    vaDestroyContext(display, context);
-    vaDestroyConfig(display, config);
+/*
+ * Output to a named file is written to a temporary file beside it and
+ * renamed into place when complete, so that readers (such as the
+ * node_exporter textfile collector) never see a partial file.
+ */
+static struct {
+    const char *path;
+    char temp[PATH_MAX];
+} output_file;
+
+static void output_file_discard(void)
+{
+    if (output_file.temp[0])
+        unlink(output_file.temp);
 }
 
-static void dump_entrypoints(VADisplay display, VAProfile profile)
+static void output_file_open(const char *path)
 {
-    int entrypoint_count = vaMaxNumEntrypoints(display);
-    VAEntrypoint *entrypoint_list = calloc(entrypoint_count,
-                                           sizeof(*entrypoint_list));
+    snprintf(output_file.temp, sizeof(output_file.temp),
+             "%s.tmp.%d", path, (int)getpid());
+    out = fopen(output_file.temp, "w");
+    if (!out)
+        die("Failed to open %s: %m.\n", output_file.temp);
+    output_file.path = path;
+    atexit(&output_file_discard);
+}
 
-    VAStatus vas = vaQueryConfigEntrypoints(display, profile,
-                                            entrypoint_list, &entrypoint_count);
-    CHECK_VAS("Unable to query entrypoints");
+static void finish_output(void)
+{
+    if (output->finish)
+        output->finish();
 
-    int i, j;
-    for (i = 0; i < entrypoint_count; i++) {
-        for (j = 0; j < ARRAY_LENGTH(entrypoints); j++) {
-            if (entrypoints[j].entrypoint == entrypoint_list[i])
-                break;
-        }
+    if (!output_file.path)
+        return;
+    if (fflush(out) || fsync(fileno(out)) || fclose(out))
+        die("Failed to write %s: %m.\n", output_file.temp);
+    if (rename(output_file.temp, output_file.path))
+        die("Failed to rename %s to %s: %m.\n",
+            output_file.temp, output_file.path);
+    output_file.temp[0] = 0;
+}
 
-        start_object(NULL);
+static void usage(const char *argv0)
+{
+    printf("vadumpcaps - dump VAAPI capabilities for a device\n"
+           "  Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>\n"
+           "Usage: %s [options]\n"
+           "Options:\n"
+           "  -h, --help                Show this information\n"
+           "  -i, --indent <number>     Set JSON indent size in spaces\n"
+           "  -u, --ugly                Do not pretty print JSON\n"
+           "  -d, --device <path>       Use specified device, may be repeated\n"
+           "                              Uses /dev/dri/renderD128 if not given\n"
+           "  -r, --driver <name>       Set driver name\n"
+           "                              Uses libva default if not given\n"
+           "  -o, --output <file>       Write output to a file, replacing it only\n"
+           "                              once complete\n"
+           "      --format <name>       Set output format: json (default), cbor,\n"
+           "                              msgpack, ndjson or openmetrics\n"
+           "      --bench-format        Compare size and encode time of each\n"
+           "                              output format for this device\n"
+           "      --bench-lookup        Measure the cost of capability lookups\n"
+           "                              through libvacaps\n"
+           "      --bench-match         Measure the rate of matching jobs against\n"
+           "                              fleets of devices like these\n"
+           "      --bench-encode        Measure the speed and quality of each\n"
+           "                              encoder at each quality level\n"
+           "      --bench-size <WxH>    Set the encode benchmark frame size\n"
+           "                              (default 1920x1080)\n"
+           "      --bench-frames <n>    Set the encode benchmark length in frames\n"
+           "                              (default 60)\n"
+           "      --bench-psnr-floor <dB> Also pick the fastest quality level of\n"
+           "                              each encoder with at least this PSNR\n"
+           "      --bench-transcode[=<decode>:<encode>] Measure decode, scaling\n"
+           "                              and encode chained together between\n"
+           "                              two H.264 profiles (default\n"
+           "                              H264Main:H264Main)\n"
+           "      --bench-interference[=<decode>:<encode>] Measure how much\n"
+           "                              decode, encode and VPP slow each\n"
+           "                              other down when run side by side\n"
+           "      --bench-ladder <WxH,...> Set the sizes the transcode benchmark\n"
+           "                              scales and encodes to (default\n"
+           "                              1280x720,640x360)\n"
+           "      --bench-depth <n>     Set the frames in flight in the transcode\n"
+           "                              benchmark (default 4)\n"
+           "      --fdinfo[=<hz>]       Add GPU engine and memory use from DRM\n"
+           "                              fdinfo to each benchmark result,\n"
+           "                              sampled at <hz> (default 50)\n"
+           "      --cpu-stats           Add the host CPU time, cycles and\n"
+           "                              context switches of each libva call\n"
+           "                              and of each benchmark frame\n"
+           "      --validate <file>     Check that a file contains only strictly\n"
+           "                              valid JSON texts (- for stdin)\n"
+           "      --dedup               Write each distinct attribute and surface\n"
+           "                              format block once, with references to it\n"
+           "      --expand <file>       Write a --dedup dump with the references\n"
+           "                              replaced by what they refer to\n"
+           "      --load <file>         Use dumps stored in a file instead of\n"
+           "                              probing a device\n"
+           "      --fingerprint         Write hashes of the canonical form of the\n"
+           "                              capabilities and their main subtrees\n"
+           "      --diff <file>         Write the changes in capabilities since\n"
+           "                              the dumps stored in a file\n"
+           "      --watch               Probe again whenever drivers or devices\n"
+           "                              change, writing an event for each change\n"
+           "      --index-build <path>  Write an index of the dumps in a directory\n"
+           "                              (or file) to the -o file\n"
+           "      --index-query <file>  Write the nodes in an index matching each\n"
+           "                              query argument (or line of stdin)\n"
+           "      --record <file>       Write every libva call made, with its\n"
+           "                              results and timing, to a tape file\n"
+           "      --replay <file>       Answer libva calls from a tape file instead\n"
+           "                              of the device\n"
+           "      --replay-timing       Take as long over each replayed call as the\n"
+           "                              recording did\n"
+           "Output selection options:\n"
+           "  -a, --all                 Dump all capabilities\n"
+           "  -p, --profiles            Dump profiles\n"
+           "  -e, --entrypoints         Dump entrypoints\n"
+           "  -t, --attributes          Dump attributes\n"
+           "  -s, --surface-formats     Dump surface formats\n"
+           "  -f, --filters             Dump filters\n"
+           "  -c, --filter-caps         Dump filter capabilities\n"
+           "  -l, --pipeline-caps       Dump pipeline capabilities\n"
+           "      --filter-chains[=<n>] Also dump pipeline capabilities for chains\n"
+           "                              of several filters, probing with n\n"
+           "                              contexts at once (default up to 8)\n"
+           "      --context-sizes[=<WxH,...>] Also probe filters with contexts of\n"
+           "                              these sizes, writing what differs from\n"
+           "                              1280x720 (default 640x480 to 7680x4320)\n"
+           "      --filters-by-format[=<n>] Also dump filters for each rt_format\n"
+           "                              alone, probing n at once (default one\n"
+           "                              per CPU), with formats giving the same\n"
+           "                              results grouped together\n"
+           "      --cost-model[=<WxH,...>] Also time decode, encode and VPP at\n"
+           "                              these sizes for each rt_format, and fit\n"
+           "                              a cost per pixel and per frame (default\n"
+           "                              640x360,1280x720,1920x1080)\n"
+           "  -m, --image-formats       Dump image formats\n"
+           "  -b, --subpicture-formats  Dump subpicture formats\n"
+           "Some selections depend on others - entrypoint information can only be shown\n"
+           "if profiles are.  Driver information will always be shown.  If nothing is\n"
+           "selected, will show everything like --all.\n"
+           "Batch checking options:\n"
+           "      --check               Read job specs from stdin, one JSON object\n"
+           "                              per line, and write a verdict line for each\n"
+           "                              (listing the devices which match if there\n"
+           "                              are several)\n"
+           "      --check-generate <n>  Write n random job specs to stdout (for\n"
+           "                              benchmarking --check)\n",
+           argv0);
+    exit(0);
+}
 
-        unsigned int flags = EP_ATTRIBUTES;
+enum {
+    MODE_DUMP,
+    MODE_CHECK,
+    MODE_BENCH_FORMAT,
+    MODE_BENCH_LOOKUP,
+    MODE_BENCH_MATCH,
+    MODE_BENCH_ENCODE,
+    MODE_BENCH_TRANSCODE,
+    MODE_BENCH_INTERFERENCE,
+    MODE_FINGERPRINT,
+    MODE_DIFF,
+};
 
-        print_integer("entrypoint", entrypoint_list[i]);
-        if (j < ARRAY_LENGTH(entrypoints)) {
-            print_string("name", "%s", entrypoints[j].name);
-            print_string("description", "%s", entrypoints[j].description);
-            flags = entrypoints[j].flags;
-        }
+// Everything other than a plain dump works on the whole tree.
+static void handle_tree(struct node *root, int mode)
+{
+    switch (mode) {
+    case MODE_BENCH_FORMAT:
+        bench_formats(root);
+        break;
+    case MODE_FINGERPRINT:
+        fingerprint_tree(root);
+        break;
+    case MODE_DIFF:
+        diff_tree(NULL, next_baseline(), root);
+        break;
+    default:
+        emit_node(root);
+        break;
+    }
+    node_free(root);
+    free(root);
+}
 
-        unsigned int rt_formats = 0;
+/*
+ * Watch mode.
+ *
+ * Each device is probed once, then again only when something which can
+ * change its capabilities happens: a driver it may load is installed or
+ * replaced, its render node appears or goes away, or the kernel reports a
+ * change on it (a GPU reset, for example).  Events arriving together, as
+ * when a package touches many files, are coalesced before probing, and
+ * only the devices they affect are probed again.
+ */
 
-        if (DUMP(ATTRIBUTES) && (flags & EP_ATTRIBUTES)) {
-            start_object("attributes");
-            dump_config_attributes(display, profile, entrypoint_list[i],
-                                   &rt_formats);
-            end_object();
-        }
+#ifndef VA_DRIVERS_PATH
+#define VA_DRIVERS_PATH ""
+#endif
 
-        if (DUMP(SURFACE_FORMATS) && (flags & EP_SURFACES)) {
-            start_array("surface_formats");
-            dump_surface_attributes(display, profile, entrypoint_list[i],
-                                    rt_formats);
-            end_array();
+// Where libva usually looks if the build did not say.
+static const char *const watch_default_driver_paths[] = {
+    "/usr/lib/dri",
+    "/usr/lib64/dri",
+    "/usr/lib/x86_64-linux-gnu/dri",
+    "/usr/lib/aarch64-linux-gnu/dri",
+    "/usr/local/lib/dri",
+};
+
+// The VA drivers libva may pick for each kernel driver.
+static const struct {
+    const char *kernel;
+    const char *va[3];
+} watch_kernel_drivers[] = {
+    { "i915",       { "iHD", "i965" } },
+    { "xe",         { "iHD" } },
+    { "amdgpu",     { "radeonsi" } },
+    { "radeon",     { "r600", "radeonsi" } },
+    { "nouveau",    { "nouveau" } },
+    { "nvidia-drm", { "nvidia" } },
+    { "virtio_gpu", { "virtio_gpu" } },
+    { "vmwgfx",     { "vmwgfx" } },
+};
+
+#define WATCH_DEBOUNCE_MS 250
+// Holds "driver " and the longest file name watch_driver_event() takes.
+#define WATCH_REASON_SIZE 96
+
+struct watch_device {
+    char path[64];
+    // Real path of the sysfs device behind the node, to match uevents
+    // for the card node of the same device.
+    char sysfs[PATH_MAX];
+    // VA drivers which can affect this device; any if the first is NULL.
+    const char *drivers[3];
+    struct node *tree;
+    bool dirty;
+    int  nb_reasons;
+    char reasons[8][WATCH_REASON_SIZE];
+};
+
+static struct {
+    const char *driver;
+    bool all_devices;
+    int  nb_devices;
+    struct watch_device devices[64];
+    int  inotify_fd;
+    int  dri_wd;
+    int  uevent_fd;
+} watch;
+
+static void watch_device_init(struct watch_device *dev, const char *path)
+{
+    const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    char link[PATH_MAX], target[PATH_MAX];
+    ssize_t len;
+    int i;
+
+    memset(dev, 0, sizeof(*dev));
+    snprintf(dev->path, sizeof(dev->path), "%s", path);
+
+    snprintf(link, sizeof(link), "/sys/class/drm/%s/device", name);
+    if (!realpath(link, dev->sysfs))
+        dev->sysfs[0] = 0;
+
+    if (watch.driver) {
+        dev->drivers[0] = watch.driver;
+        return;
+    }
+
+    snprintf(link, sizeof(link), "/sys/class/drm/%s/device/driver", name);
+    len = readlink(link, target, sizeof(target) - 1);
+    if (len < 0)
+        return;
+    target[len] = 0;
+    name = strrchr(target, '/') ? strrchr(target, '/') + 1 : target;
+
+    for (i = 0; i < ARRAY_LENGTH(watch_kernel_drivers); i++) {
+        if (!strcmp(name, watch_kernel_drivers[i].kernel)) {
+            memcpy(dev->drivers, watch_kernel_drivers[i].va,
+                   sizeof(dev->drivers));
+            break;
         }
+    }
+}
 
-        if (DUMP(FILTERS) && (flags & EP_FILTERS))
-            dump_filters(display, rt_formats);
+static struct watch_device *watch_find(const char *path, bool add)
+{
+    int i;
 
-        end_object();
+    for (i = 0; i < watch.nb_devices; i++) {
+        if (!strcmp(watch.devices[i].path, path))
+            return &watch.devices[i];
     }
+    if (!add || watch.nb_devices >= ARRAY_LENGTH(watch.devices))
+        return NULL;
 
-    free(entrypoint_list);
+    watch_device_init(&watch.devices[watch.nb_devices], path);
+    return &watch.devices[watch.nb_devices++];
 }
 
-static void dump_profiles(VADisplay display)
+static void watch_mark(struct watch_device *dev, const char *reason)
 {
-    int profile_count = vaMaxNumProfiles(display);
-    VAProfile *profile_list = calloc(profile_count, sizeof(*profile_list));
+    int i;
 
-    VAStatus vas = vaQueryConfigProfiles(display,
-                                         profile_list, &profile_count);
-    CHECK_VAS("Unable to query profiles");
+    dev->dirty = true;
+    for (i = 0; i < dev->nb_reasons; i++) {
+        if (!strcmp(dev->reasons[i], reason))
+            return;
+    }
+    if (dev->nb_reasons < ARRAY_LENGTH(dev->reasons))
+        snprintf(dev->reasons[dev->nb_reasons++],
+                 sizeof(dev->reasons[0]), "%s", reason);
+}
 
-    int i, j;
-    for (i = 0; i < profile_count; i++) {
-        for (j = 0; j < ARRAY_LENGTH(profiles); j++) {
-            if (profiles[j].profile == profile_list[i])
-                break;
-        }
+static void watch_event_start(const struct watch_device *dev,
+                              const char *event)
+{
+    struct timespec now;
+    int i;
 
-        start_object(NULL);
+    clock_gettime(CLOCK_REALTIME, &now);
 
-        print_integer("profile", profile_list[i]);
-        if (j < ARRAY_LENGTH(profiles)) {
-            print_string("name", "%s", profiles[j].name);
-            print_string("description", "%s", profiles[j].description);
-        }
+    start_object(NULL);
+    print_string("event", "%s", event);
+    print_string("device", "%s", dev->path);
+    print_integer("time_ms", (int64_t)now.tv_sec * 1000 +
+                             now.tv_nsec / 1000000);
+    if (dev->nb_reasons) {
+        start_array("reasons");
+        for (i = 0; i < dev->nb_reasons; i++)
+            print_string(NULL, "%s", dev->reasons[i]);
+        end_array();
+    }
+}
 
-        if (DUMP(ENTRYPOINTS)) {
-            start_array("entrypoints");
-            dump_entrypoints(display, profile_list[i]);
-            end_array();
+static void watch_event_end(void)
+{
+    end_object();
+    fflush(out);
+}
+
+static void watch_probe(struct watch_device *dev)
+{
+    struct node *tree = NULL;
+    int drm_fd, major, minor;
+    uint8_t hash[32];
+
+    if (access(dev->path, F_OK)) {
+        if (dev->tree) {
+            watch_event_start(dev, "removed");
+            watch_event_end();
+            node_free(dev->tree);
+            free(dev->tree);
+            dev->tree = NULL;
         }
+        goto done;
+    }
 
-        end_object();
+    VADisplay display = open_device(dev->path, watch.driver,
+                                    &drm_fd, &major, &minor);
+    if (display) {
+        tree = capture_device(display, major, minor);
+        vaTerminate(display);
+        close(drm_fd);
     }
 
-    free(profile_list);
+    if (!tree) {
+        watch_event_start(dev, "failed");
+        watch_event_end();
+    } else if (!dev->tree) {
+        watch_event_start(dev, "added");
+        node_hash(tree, hash);
+        print_hash("fingerprint", hash);
+        watch_event_end();
+    } else if (!node_hash_equal(dev->tree, tree)) {
+        watch_event_start(dev, "changed");
+        diff_tree("diff", dev->tree, tree);
+        watch_event_end();
+    }
+
+    if (dev->tree) {
+        node_free(dev->tree);
+        free(dev->tree);
+    }
+    dev->tree = tree;
+
+done:
+    dev->dirty = false;
+    dev->nb_reasons = 0;
 }
 
-static void dump_image_formats(VADisplay display)
+static void watch_driver_event(const char *file)
 {
-    int format_count = vaMaxNumImageFormats(display);
-    VAImageFormat *format_list = calloc(format_count, sizeof(*format_list));
+    static const char suffix[] = "_drv_video.so";
+    char name[64], reason[WATCH_REASON_SIZE];
+    size_t len = strlen(file);
+    int i, j;
 
-    VAStatus vas = vaQueryImageFormats(display, format_list, &format_count);
-    CHECK_VAS("Unable to query image formats");
+    if (len <= strlen(suffix) || len - strlen(suffix) >= sizeof(name) ||
+        strcmp(file + len - strlen(suffix), suffix))
+        return;
+    memcpy(name, file, len - strlen(suffix));
+    name[len - strlen(suffix)] = 0;
+    snprintf(reason, sizeof(reason), "driver %s%s", name, suffix);
+
+    for (i = 0; i < watch.nb_devices; i++) {
+        struct watch_device *dev = &watch.devices[i];
+        bool affected = !dev->drivers[0];
+        for (j = 0; j < ARRAY_LENGTH(dev->drivers) && dev->drivers[j]; j++)
+            affected |= !strcmp(dev->drivers[j], name);
+        if (affected)
+            watch_mark(dev, reason);
+    }
+}
 
-    int i;
-    for (i = 0; i < format_count; i++) {
-        start_object(NULL);
+static void watch_node_event(const char *name, uint32_t mask)
+{
+    struct watch_device *dev;
+    char path[64];
 
-        print_string("pixel_format", "%.4s", &format_list[i].fourcc);
+    if (strncmp(name, "renderD", 7))
+        return;
+    snprintf(path, sizeof(path), "/dev/dri/%s", name);
 
-        print_string("byte_order",
-                     format_list[i].byte_order == VA_LSB_FIRST ? "LE" :
-                     format_list[i].byte_order == VA_MSB_FIRST ? "BE" :
-                     "unknown");
+    dev = watch_find(path, watch.all_devices && !(mask & IN_DELETE));
+    if (dev)
+        watch_mark(dev, mask & IN_DELETE ? "node removed" :
+                        mask & IN_CREATE ? "node created" : "node changed");
+}
 
-        print_integer("bits_per_pixel", format_list[i].bits_per_pixel);
+static void watch_read_inotify(void)
+{
+    char buffer[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *p;
+    int i;
 
-        if (format_list[i].depth) {
-            print_integer("depth", format_list[i].depth);
+    while ((len = read(watch.inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (p = buffer; p < buffer + len;
+             p += sizeof(*event) + event->len) {
+            event = (const struct inotify_event*)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (i = 0; i < watch.nb_devices; i++)
+                    watch_mark(&watch.devices[i], "events lost");
+            } else if (event->len == 0) {
+                continue;
+            } else if (event->wd == watch.dri_wd) {
+                watch_node_event(event->name, event->mask);
+            } else {
+                watch_driver_event(event->name);
+            }
+        }
+    }
+}
 
-            print_integer("red_mask",   format_list[i].red_mask);
-            print_integer("green_mask", format_list[i].green_mask);
-            print_integer("blue_mask",  format_list[i].blue_mask);
-            print_integer("alpha_mask", format_list[i].alpha_mask);
+// Kernel uevents are "action@devpath" followed by KEY=value strings.
+static void watch_read_uevents(void)
+{
+    char buffer[8192], sysfs[PATH_MAX], reason[WATCH_REASON_SIZE];
+    const char *action = NULL, *subsystem = NULL, *devname = NULL;
+    const char *devpath = NULL, *p;
+    ssize_t len;
+    int i;
+
+    while ((len = recv(watch.uevent_fd, buffer,
+                       sizeof(buffer) - 1, 0)) > 0) {
+        buffer[len] = 0;
+        action = subsystem = devname = devpath = NULL;
+        for (p = buffer; p < buffer + len; p += strlen(p) + 1) {
+            if (!strncmp(p, "ACTION=", 7))
+                action = p + 7;
+            else if (!strncmp(p, "SUBSYSTEM=", 10))
+                subsystem = p + 10;
+            else if (!strncmp(p, "DEVNAME=", 8))
+                devname = p + 8;
+            else if (!strncmp(p, "DEVPATH=", 8))
+                devpath = p + 8;
         }
+        if (!action || !subsystem || strcmp(subsystem, "drm"))
+            continue;
 
-        end_object();
-    }
+        sysfs[0] = 0;
+        if (devpath) {
+            char link[PATH_MAX];
+            snprintf(link, sizeof(link), "/sys%s/device", devpath);
+            if (!realpath(link, sysfs))
+                sysfs[0] = 0;
+        }
+        snprintf(reason, sizeof(reason), "uevent %s", action);
 
-    free(format_list);
+        for (i = 0; i < watch.nb_devices; i++) {
+            struct watch_device *dev = &watch.devices[i];
+            if ((devname && !strcmp(devname, dev->path + strlen("/dev/"))) ||
+                (sysfs[0] && !strcmp(sysfs, dev->sysfs)))
+                watch_mark(dev, reason);
+        }
+    }
 }
 
-static void dump_subpicture_formats(VADisplay display)
+static void watch_add_driver_path(const char *dir, size_t len)
 {
-    unsigned int format_count = vaMaxNumSubpictureFormats(display);
-    VAImageFormat *format_list = calloc(format_count, sizeof(*format_list));
-    unsigned int *flags_list = calloc(format_count, sizeof(*flags_list));
+    char path[PATH_MAX];
 
-    VAStatus vas = vaQuerySubpictureFormats(display, format_list,
-                                            flags_list, &format_count);
-    CHECK_VAS("Unable to query subpicture formats");
+    snprintf(path, sizeof(path), "%.*s", (int)len, dir);
+    if (inotify_add_watch(watch.inotify_fd, path,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                          IN_CREATE | IN_DELETE | IN_ATTRIB) >= 0)
+        fprintf(stderr, "Watching drivers in %s.\n", path);
+}
 
+static void run_watch(const char *const *devices, int nb_devices,
+                      const char *driver)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = 1,
+    };
+    const char *paths, *end;
     int i;
-    for (i = 0; i < format_count; i++) {
-        start_object(NULL);
 
-        print_string("pixel_format", "%.4s", &format_list[i].fourcc);
+    watch.driver = driver;
+    watch.all_devices = nb_devices == 0;
+
+    watch.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.inotify_fd < 0)
+        die("Failed to create inotify instance: %m.\n");
+
+    paths = getenv("LIBVA_DRIVERS_PATH");
+    if (!paths || !*paths)
+        paths = VA_DRIVERS_PATH;
+    if (*paths) {
+        for (; *paths; paths = *end ? end + 1 : end) {
+            end = strchr(paths, ':');
+            if (!end)
+                end = paths + strlen(paths);
+            if (end > paths)
+                watch_add_driver_path(paths, end - paths);
+        }
+    } else {
+        for (i = 0; i < ARRAY_LENGTH(watch_default_driver_paths); i++)
+            watch_add_driver_path(watch_default_driver_paths[i],
+                                  strlen(watch_default_driver_paths[i]));
+    }
 
-        print_string("byte_order",
-                     format_list[i].byte_order == VA_LSB_FIRST ? "LE" :
-                     format_list[i].byte_order == VA_MSB_FIRST ? "BE" :
-                     "unknown");
+    watch.dri_wd = inotify_add_watch(watch.inotify_fd, "/dev/dri",
+                                     IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (watch.dri_wd < 0)
+        fprintf(stderr, "Failed to watch /dev/dri: %m.\n");
+
+    watch.uevent_fd = socket(AF_NETLINK,
+                             SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                             NETLINK_KOBJECT_UEVENT);
+    if (watch.uevent_fd >= 0 &&
+        bind(watch.uevent_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(watch.uevent_fd);
+        watch.uevent_fd = -1;
+    }
+    if (watch.uevent_fd < 0)
+        fprintf(stderr, "Failed to listen for uevents: %m.\n");
+
+    if (watch.all_devices) {
+        DIR *dir = opendir("/dev/dri");
+        struct dirent *entry;
+        char path[64];
+        while (dir && (entry = readdir(dir))) {
+            if (strncmp(entry->d_name, "renderD", 7))
+                continue;
+            snprintf(path, sizeof(path), "/dev/dri/%.50s", entry->d_name);
+            watch_find(path, true);
+        }
+        if (dir)
+            closedir(dir);
+    } else {
+        for (i = 0; i < nb_devices; i++)
+            watch_find(devices[i], true);
+    }
 
-        print_integer("bits_per_pixel", format_list[i].bits_per_pixel);
+    for (i = 0; i < watch.nb_devices; i++)
+        watch_probe(&watch.devices[i]);
 
-        if (format_list[i].depth) {
-            print_integer("depth", format_list[i].depth);
+    for (;;) {
+        struct pollfd fds[2] = {
+            { .fd = watch.inotify_fd, .events = POLLIN },
+            { .fd = watch.uevent_fd,  .events = POLLIN },
+        };
+        bool dirty = false;
+        int ret;
 
-            print_integer("red_mask",   format_list[i].red_mask);
-            print_integer("green_mask", format_list[i].green_mask);
-            print_integer("blue_mask",  format_list[i].blue_mask);
-            print_integer("alpha_mask", format_list[i].alpha_mask);
+        for (i = 0; i < watch.nb_devices; i++)
+            dirty |= watch.devices[i].dirty;
+
+        ret = poll(fds, ARRAY_LENGTH(fds), dirty ? WATCH_DEBOUNCE_MS : -1);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            die("Failed to wait for events: %m.\n");
         }
 
-        start_array("flags");
-#define SF(type, bit) do { \
-            if (flags_list[i] & VA_ ## type ## _ ## bit) \
-                print_string(NULL, #bit); \
-        } while (0)
-        SF(SUBPICTURE, CHROMA_KEYING);
-        SF(SUBPICTURE, GLOBAL_ALPHA);
-        SF(SUBPICTURE, DESTINATION_IS_SCREEN_COORD);
-#undef SF
-        end_array();
+        if (ret == 0) {
+            for (i = 0; i < watch.nb_devices; i++) {
+                if (watch.devices[i].dirty)
+                    watch_probe(&watch.devices[i]);
+            }
+            continue;
+        }
 
-        end_object();
+        if (fds[0].revents & POLLIN)
+            watch_read_inotify();
+        if (fds[1].revents & POLLIN)
+            watch_read_uevents();
     }
-
-    free(format_list);
-    free(flags_list);
 }
 
-static void die(const char *format, ...)
-{
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    exit(1);
-}
-
-static void usage(const char *argv0)
-{
-    printf("vadumpcaps - dump VAAPI capabilities for a device\n"
-           "  Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>\n"
-           "Usage: %s [options]\n"
-           "Options:\n"
-           "  -h, --help                Show this information\n"
-           "  -i, --indent <number>     Set JSON indent size in spaces\n"
-           "  -u, --ugly                Do not pretty print JSON\n"
-           "  -d, --device <path>       Use specified device\n"
-           "                              Uses /dev/dri/renderD128 if not given\n"
-           "  -r, --driver <name>       Set driver name\n"
-           "                              Uses libva default if not given\n"
-           "Output selection options:\n"
-           "  -a, --all                 Dump all capabilities\n"
-           "  -p, --profiles            Dump profiles\n"
-           "  -e, --entrypoints         Dump entrypoints\n"
-           "  -t, --attributes          Dump attributes\n"
-           "  -s, --surface-formats     Dump surface formats\n"
-           "  -f, --filters             Dump filters\n"
-           "  -c, --filter-caps         Dump filter capabilities\n"
-           "  -l, --pipeline-caps       Dump pipeline capabilities\n"
-           "  -m, --image-formats       Dump image formats\n"
-           "  -b, --subpicture-formats  Dump subpicture formats\n"
-           "Some selections depend on others - entrypoint information can only be shown\n"
-           "if profiles are.  Driver information will always be shown.  If nothing is\n"
-           "selected, will show everything like --all.\n",
-           argv0);
-    exit(0);
-}
+enum {
+    OPT_CHECK = 256,
+    OPT_CHECK_GENERATE,
+    OPT_FORMAT,
+    OPT_BENCH_FORMAT,
+    OPT_VALIDATE,
+    OPT_DEDUP,
+    OPT_EXPAND,
+    OPT_FINGERPRINT,
+    OPT_LOAD,
+    OPT_DIFF,
+    OPT_WATCH,
+    OPT_BENCH_LOOKUP,
+    OPT_BENCH_MATCH,
+    OPT_INDEX_BUILD,
+    OPT_INDEX_QUERY,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_REPLAY_TIMING,
+    OPT_FILTER_CHAINS,
+    OPT_CONTEXT_SIZES,
+    OPT_FILTERS_BY_FORMAT,
+    OPT_COST_MODEL,
+    OPT_BENCH_ENCODE,
+    OPT_BENCH_SIZE,
+    OPT_BENCH_FRAMES,
+    OPT_BENCH_PSNR_FLOOR,
+    OPT_BENCH_TRANSCODE,
+    OPT_BENCH_INTERFERENCE,
+    OPT_BENCH_LADDER,
+    OPT_BENCH_DEPTH,
+    OPT_FDINFO,
+    OPT_CPU_STATS,
+};
 
 int main(int argc, char **argv)
 {
@@ -2009,7 +11774,35 @@ int main(int argc, char **argv)
         { "ugly",    no_argument,       0, 'u' },
         { "device",  required_argument, 0, 'd' },
         { "driver",  required_argument, 0, 'r' },
+        { "output",  required_argument, 0, 'o' },
         { "all",     no_argument,       0, 'a' },
+        { "format",  required_argument, 0, OPT_FORMAT },
+        { "bench-format", no_argument,  0, OPT_BENCH_FORMAT },
+        { "bench-lookup", no_argument,  0, OPT_BENCH_LOOKUP },
+        { "bench-match",  no_argument,  0, OPT_BENCH_MATCH },
+        { "bench-encode", no_argument,  0, OPT_BENCH_ENCODE },
+        { "bench-size",   required_argument, 0, OPT_BENCH_SIZE },
+        { "bench-frames", required_argument, 0, OPT_BENCH_FRAMES },
+        { "bench-psnr-floor", required_argument, 0, OPT_BENCH_PSNR_FLOOR },
+        { "bench-transcode", optional_argument, 0, OPT_BENCH_TRANSCODE },
+        { "bench-interference", optional_argument, 0,
+          OPT_BENCH_INTERFERENCE },
+        { "bench-ladder", required_argument, 0, OPT_BENCH_LADDER },
+        { "bench-depth",  required_argument, 0, OPT_BENCH_DEPTH },
+        { "fdinfo",       optional_argument, 0, OPT_FDINFO },
+        { "cpu-stats",    no_argument,       0, OPT_CPU_STATS },
+        { "validate", required_argument, 0, OPT_VALIDATE },
+        { "dedup",    no_argument,       0, OPT_DEDUP },
+        { "expand",   required_argument, 0, OPT_EXPAND },
+        { "fingerprint", no_argument,    0, OPT_FINGERPRINT },
+        { "load",     required_argument, 0, OPT_LOAD },
+        { "diff",     required_argument, 0, OPT_DIFF },
+        { "watch",    no_argument,       0, OPT_WATCH },
+        { "index-build", required_argument, 0, OPT_INDEX_BUILD },
+        { "index-query", required_argument, 0, OPT_INDEX_QUERY },
+        { "record",   required_argument, 0, OPT_RECORD },
+        { "replay",   required_argument, 0, OPT_REPLAY },
+        { "replay-timing", no_argument,  0, OPT_REPLAY_TIMING },
 
         { "profiles",           no_argument, 0, 'p' },
         { "entrypoints",        no_argument, 0, 'e' },
@@ -2018,13 +11811,36 @@ int main(int argc, char **argv)
         { "filters",            no_argument, 0, 'f' },
         { "filter-caps",        no_argument, 0, 'c' },
         { "pipeline-caps",      no_argument, 0, 'l' },
+        { "filter-chains",      optional_argument, 0, OPT_FILTER_CHAINS },
+        { "context-sizes",      optional_argument, 0, OPT_CONTEXT_SIZES },
+        { "filters-by-format",  optional_argument, 0, OPT_FILTERS_BY_FORMAT },
+        { "cost-model",         optional_argument, 0, OPT_COST_MODEL },
         { "image-formats",      no_argument, 0, 'm' },
         { "subpicture-formats", no_argument, 0, 'b' },
+
+        { "check",              no_argument,       0, OPT_CHECK },
+        { "check-generate",     required_argument, 0, OPT_CHECK_GENERATE },
+        { 0 },
     };
-    static const char *short_options = "hi:ud:r:apetsfclmb";
+    static const char *short_options = "hi:ud:r:o:apetsfclmb";
 
-    const char *drm_device = NULL;
+    const char *drm_devices[64];
+    int nb_drm_devices = 0;
     const char *driver_name = NULL;
+    int mode = MODE_DUMP;
+    const char *expand_path = NULL;
+    const char *load_path = NULL;
+    const char *baseline_path = NULL;
+    const char *index_build_path = NULL;
+    const char *index_query_path = NULL;
+    bool watch_mode = false;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    bool replay_timing = false;
+    const char *output_path = NULL;
+
+    output = &output_formats[0];
+    out    = stdout;
 
     dump_mask = 0;
     while (1) {
@@ -2044,11 +11860,16 @@ int main(int argc, char **argv)
             pretty_print = false;
             break;
         case 'd':
-            drm_device = optarg;
+            if (nb_drm_devices >= ARRAY_LENGTH(drm_devices))
+                die("Too many devices.\n");
+            drm_devices[nb_drm_devices++] = optarg;
             break;
         case 'r':
             driver_name = optarg;
             break;
+        case 'o':
+            output_path = optarg;
+            break;
         case 'a':
             dump_mask = (1 << DUMP_MAX) - 1;
             break;
@@ -2063,6 +11884,154 @@ int main(int argc, char **argv)
         DUMP_ARG('m', IMAGE_FORMATS);
         DUMP_ARG('b', SUBPICTURE_FORMATS);
 #undef DUMP_ARG
+        case OPT_FORMAT:
+            {
+                int i;
+                for (i = 0; i < ARRAY_LENGTH(output_formats); i++) {
+                    if (!strcmp(optarg, output_formats[i].name))
+                        break;
+                }
+                if (i >= ARRAY_LENGTH(output_formats))
+                    die("Unknown output format %s.\n", optarg);
+                output = &output_formats[i];
+            }
+            break;
+        case OPT_BENCH_FORMAT:
+            mode = MODE_BENCH_FORMAT;
+            break;
+        case OPT_BENCH_LOOKUP:
+            mode = MODE_BENCH_LOOKUP;
+            break;
+        case OPT_BENCH_MATCH:
+            mode = MODE_BENCH_MATCH;
+            break;
+        case OPT_BENCH_ENCODE:
+            mode = MODE_BENCH_ENCODE;
+            break;
+        case OPT_BENCH_SIZE:
+            parse_bench_size(optarg);
+            break;
+        case OPT_BENCH_FRAMES:
+            bench_frames = strtol(optarg, NULL, 0);
+            if (bench_frames < 1 || bench_frames > 10000)
+                die("Invalid number of benchmark frames %s.\n", optarg);
+            break;
+        case OPT_BENCH_PSNR_FLOOR:
+            bench_psnr_floor = strtod(optarg, NULL);
+            if (!(bench_psnr_floor > 0))
+                die("Invalid PSNR floor %s.\n", optarg);
+            break;
+        case OPT_BENCH_TRANSCODE:
+            mode = MODE_BENCH_TRANSCODE;
+            if (optarg)
+                parse_transcode_profiles(optarg);
+            if (!nb_bench_ladder)
+                parse_bench_ladder(default_bench_ladder);
+            break;
+        case OPT_BENCH_INTERFERENCE:
+            // VPP scales to the first size of the ladder.
+            mode = MODE_BENCH_INTERFERENCE;
+            if (optarg)
+                parse_transcode_profiles(optarg);
+            if (!nb_bench_ladder)
+                parse_bench_ladder(default_bench_ladder);
+            break;
+        case OPT_BENCH_LADDER:
+            parse_bench_ladder(optarg);
+            break;
+        case OPT_BENCH_DEPTH:
+            bench_depth = strtol(optarg, NULL, 0);
+            if (bench_depth < 1 || bench_depth > BENCH_MAX_DEPTH)
+                die("Invalid pipeline depth %s.\n", optarg);
+            break;
+        case OPT_FDINFO:
+            if (optarg) {
+                char *end;
+                fdinfo_rate = strtol(optarg, &end, 0);
+                if (end == optarg || *end)
+                    die("Invalid sampling rate %s.\n", optarg);
+            } else
+                fdinfo_rate = FDINFO_DEFAULT_RATE;
+            if (fdinfo_rate < 1 || fdinfo_rate > 1000)
+                die("Invalid sampling rate %s.\n", optarg);
+            break;
+        case OPT_CPU_STATS:
+            if (!cpu_stats.enabled)
+                cpu_stats_init();
+            break;
+        case OPT_VALIDATE:
+            run_validate(optarg);
+            return 0;
+        case OPT_DEDUP:
+            dedup = true;
+            break;
+        case OPT_EXPAND:
+            expand_path = optarg;
+            break;
+        case OPT_FINGERPRINT:
+            mode = MODE_FINGERPRINT;
+            break;
+        case OPT_LOAD:
+            load_path = optarg;
+            break;
+        case OPT_WATCH:
+            watch_mode = true;
+            break;
+        case OPT_INDEX_BUILD:
+            index_build_path = optarg;
+            break;
+        case OPT_INDEX_QUERY:
+            index_query_path = optarg;
+            break;
+        case OPT_DIFF:
+            mode = MODE_DIFF;
+            baseline_path = optarg;
+            break;
+        case OPT_RECORD:
+            record_path = optarg;
+            break;
+        case OPT_REPLAY:
+            replay_path = optarg;
+            break;
+        case OPT_REPLAY_TIMING:
+            replay_timing = true;
+            break;
+        case OPT_FILTER_CHAINS:
+            if (optarg) {
+                filter_chain_workers = strtol(optarg, NULL, 0);
+                if (filter_chain_workers < 1)
+                    die("Invalid number of filter chain workers %s.\n",
+                        optarg);
+            } else {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                filter_chain_workers = cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+            }
+            break;
+        case OPT_CONTEXT_SIZES:
+            parse_context_sizes(optarg ? optarg : default_context_sizes);
+            break;
+        case OPT_FILTERS_BY_FORMAT:
+            if (optarg) {
+                char *end;
+                filters_by_format = strtol(optarg, &end, 0);
+                if (end == optarg || *end || filters_by_format < 1 ||
+                    filters_by_format > 32)
+                    die("Invalid number of filter probe threads %s.\n",
+                        optarg);
+            } else {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                filters_by_format = cpus < 1 ? 1 : cpus > 32 ? 32 : cpus;
+            }
+            break;
+        case OPT_COST_MODEL:
+            parse_cost_model_sizes(optarg ? optarg : default_cost_model_sizes);
+            break;
+        case OPT_CHECK:
+            mode = MODE_CHECK;
+            break;
+        case OPT_CHECK_GENERATE:
+            generate_job_specs(strtol(optarg, NULL, 0));
+            return 0;
         default:
             die("Unknown option.\n");
         }
@@ -2070,74 +12039,175 @@ int main(int argc, char **argv)
     if (dump_mask == 0)
         dump_mask = (1 << DUMP_MAX) - 1;
 
-    if (!drm_device)
-        drm_device = "/dev/dri/renderD128";
-
-    int drm_fd = open(drm_device, O_RDWR);
-    if (drm_fd < 0)
-        die("Failed to open %s: %m.\n", drm_device);
+    // Metrics, fingerprints, diffs and the format benchmark are taken from
+    // the full tree, so references would be lost.
+    if (output->finish == &openmetrics_finish || watch_mode ||
+        mode == MODE_FINGERPRINT || mode == MODE_DIFF ||
+        mode == MODE_BENCH_FORMAT)
+        dedup = false;
+    // Records are written as they end, before the shared table exists.
+    if (dedup && output->start_array == &ndjson_start_array)
+        die("--dedup cannot be used with --format=ndjson.\n");
+
+    if (output_path) {
+        if (watch_mode)
+            die("--output cannot be used with --watch.\n");
+        output_file_open(output_path);
+    }
 
-    VADisplay display = vaGetDisplayDRM(drm_fd);
-    if (!display)
-        die("Failed to open VA display from DRM device.\n");
+    // Expanding only needs the output options, not a device.
+    if (expand_path) {
+        run_expand(expand_path);
+        finish_output();
+        return 0;
+    }
 
-    VAStatus vas;
-    if (driver_name) {
-#if LIBVA(1, 6, 0)
-        vas = vaSetDriverName(display, (char*)driver_name);
-        if (vas != VA_STATUS_SUCCESS)
-            die("Failed to set driver name: %d (%s).\n",
-                vas, vaErrorStr(vas));
-#else
-        die("Driver name setting not supported.\n");
-#endif
+    if (index_build_path) {
+        run_index_build(index_build_path);
+        finish_output();
+        return 0;
     }
 
-    int major = 0, minor = 0;
-    vas = vaInitialize(display, &major, &minor);
-    if (vas != VA_STATUS_SUCCESS)
-        die("Failed to initialise: %d (%s).\n", vas, vaErrorStr(vas));
+    // Queries are the remaining arguments, or lines of stdin if none.
+    if (index_query_path) {
+        index_open(index_query_path);
+        if (optind < argc) {
+            for (; optind < argc; optind++)
+                run_index_query(argv[optind]);
+        } else {
+            char *line = NULL;
+            size_t line_size = 0;
+            ssize_t len;
+            while ((len = getline(&line, &line_size, stdin)) >= 0) {
+                if (len > 0 && line[len - 1] == '\n')
+                    line[len - 1] = 0;
+                if (*skip_space(line))
+                    run_index_query(line);
+            }
+            free(line);
+        }
+        finish_output();
+        return 0;
+    }
 
-    start_object(NULL);
+    if (mode == MODE_DIFF)
+        load_baseline(baseline_path);
+
+    // bench_match only runs once the devices are closed.
+    if (fdinfo_rate && mode != MODE_BENCH_LOOKUP &&
+        mode != MODE_BENCH_ENCODE && mode != MODE_BENCH_TRANSCODE &&
+        mode != MODE_BENCH_INTERFERENCE)
+        die("--fdinfo can only be used with the device benchmarks.\n");
+
+    // libvacaps calls libva directly, so its probes can't go on a tape.
+    if (record_path || replay_path) {
+        if (record_path && replay_path)
+            die("--record and --replay cannot be used together.\n");
+        if (load_path || watch_mode)
+            die("--record and --replay need a device to probe.\n");
+        if (nb_cost_model_sizes)
+            die("--cost-model cannot be recorded.\n");
+        if (replay_path && cpu_stats.enabled)
+            die("--cpu-stats cannot be used with --replay.\n");
+        if (mode == MODE_CHECK || mode == MODE_BENCH_LOOKUP ||
+            mode == MODE_BENCH_MATCH || mode == MODE_BENCH_ENCODE ||
+            mode == MODE_BENCH_TRANSCODE || mode == MODE_BENCH_INTERFERENCE)
+            die("--check and the benchmarks cannot be recorded.\n");
+        if (record_path)
+            tape_start_record(record_path);
+        else
+            tape_start_replay(replay_path, replay_timing);
+    }
 
-    start_object("build_version");
-    print_integer("major", VA_MAJOR_VERSION);
-    print_integer("minor", VA_MINOR_VERSION);
-    print_integer("micro", VA_MICRO_VERSION);
-    end_object();
+    if (load_path) {
+        if (mode == MODE_CHECK || mode == MODE_BENCH_LOOKUP ||
+            mode == MODE_BENCH_MATCH || mode == MODE_BENCH_ENCODE ||
+            mode == MODE_BENCH_TRANSCODE || mode == MODE_BENCH_INTERFERENCE)
+            die("--check and the benchmarks need a device to probe.\n");
+
+        size_t size;
+        char *data = read_file(load_path, &size);
+        if (!data)
+            die("Failed to read %s: %m.\n", load_path);
+
+        const char *p = data, *end = data + size;
+        struct node *root;
+        while ((root = load_next(load_path, &p, end)))
+            handle_tree(root, mode);
+
+        free(data);
+        finish_output();
+        return 0;
+    }
 
-    start_object("driver_version");
-    print_integer("major", major);
-    print_integer("minor", minor);
-    end_object();
+    if (watch_mode) {
+        if (mode != MODE_DUMP || load_path)
+            die("--watch can only be used to dump capabilities.\n");
+        run_watch(drm_devices, nb_drm_devices, driver_name);
+        return 0;
+    }
 
-    const char *vendor_string = vaQueryVendorString(display);
-    if (vendor_string)
-        print_string("driver_vendor", "%s", vendor_string);
-    else
-        print_string("driver_vendor", "unknown");
+    if (nb_drm_devices == 0)
+        drm_devices[nb_drm_devices++] = "/dev/dri/renderD128";
 
-    if (DUMP(PROFILES)) {
-        start_array("profiles");
-        dump_profiles(display);
-        end_array();
-    }
+    // Checking and matching work on all of the devices at once.
+    VACapsDevice *caps[ARRAY_LENGTH(drm_devices)];
+    int i;
+    for (i = 0; i < nb_drm_devices; i++) {
+        device_path = drm_devices[i];
+
+        int drm_fd, major, minor;
+        VADisplay display = open_device(device_path, driver_name,
+                                        &drm_fd, &major, &minor);
+        if (!display)
+            return 1;
+
+        bool sampled = mode == MODE_BENCH_LOOKUP ||
+                       mode == MODE_BENCH_ENCODE ||
+                       mode == MODE_BENCH_TRANSCODE ||
+                       mode == MODE_BENCH_INTERFERENCE;
+        if (sampled)
+            fdinfo_start(drm_fd);
+
+        if (mode == MODE_CHECK || mode == MODE_BENCH_MATCH) {
+            caps[i] = vacaps_device_create(display);
+            if (!caps[i])
+                die("Failed to probe capabilities.\n");
+            if (vacaps_nb_dropped_fourccs(caps[i]))
+                fprintf(stderr, "Warning: %s has more than %d pixel "
+                        "formats; %d surface formats are left out of "
+                        "the checks.\n", device_path,
+                        vacaps_nb_fourccs(caps[i]),
+                        vacaps_nb_dropped_fourccs(caps[i]));
+        } else if (mode == MODE_BENCH_LOOKUP)
+            bench_lookup(display);
+        else if (mode == MODE_BENCH_ENCODE)
+            bench_encode(display);
+        else if (mode == MODE_BENCH_TRANSCODE)
+            bench_transcode(display);
+        else if (mode == MODE_BENCH_INTERFERENCE)
+            bench_interference(display);
+        else if (mode == MODE_DUMP)
+            dump_device(display, major, minor);
+        else
+            handle_tree(capture_device(display, major, minor), mode);
+        if (sampled)
+            fdinfo_stop();
 
-    if (DUMP(IMAGE_FORMATS)) {
-        start_array("image_formats");
-        dump_image_formats(display);
-        end_array();
+        vaTerminate(display);
+        close(drm_fd);
     }
 
-    if (DUMP(SUBPICTURE_FORMATS)) {
-        start_array("subpicture_formats");
-        dump_subpicture_formats(display);
-        end_array();
+    if (mode == MODE_CHECK)
+        run_check(caps, drm_devices, nb_drm_devices);
+    else if (mode == MODE_BENCH_MATCH)
+        bench_match(caps, nb_drm_devices);
+    if (mode == MODE_CHECK || mode == MODE_BENCH_MATCH) {
+        for (i = 0; i < nb_drm_devices; i++)
+            vacaps_device_destroy(caps[i]);
     }
 
-    end_object();
-
-    vaTerminate(display);
-
+    tape_finish();
+    finish_output();
     return 0;
 }
@@ -0,0 +1,555 @@
+/*
+ * vadumpcaps_bench - end-to-end benchmark of vadumpcaps
+ * Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs vadumpcaps against the stub driver, serving synthetic capability
+ * sets of increasing size, in each output mode.  Every run is a separate
+ * process, so the figures include startup and driver loading as a user
+ * would see them.  Results are written as JSON with one result per line,
+ * and can be compared with an earlier file to catch regressions.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <va/va.h>
+#include <va/va_vpp.h>
+
+#define ARRAY_LENGTH(a) (sizeof(a)/sizeof((a)[0]))
+
+#define MAX_REPEATS 100
+
+static void die(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    exit(1);
+}
+
+/*
+ * Synthetic capability sets.  Each profile has decode and two encode
+ * entrypoints, with the given number of rt_formats and pixel formats for
+ * each; profile none has video processing with a fixed set of filters.
+ */
+static const struct scale {
+    const char *name;
+    int profiles;
+    int rt_formats;
+    int pixel_formats;
+    int image_formats;
+} scales[] = {
+    { "small",   4, 1,  2,  4 },
+    { "medium", 16, 2,  4, 16 },
+    { "large",  32, 4,  8, 32 },
+    { "huge",   62, 8, 16, 64 },
+};
+
+static const char *const rt_format_names[] = {
+    "YUV420", "YUV422", "YUV444", "YUV411",
+    "YUV400", "RGB16",  "RGB32",  "RGBP",
+};
+
+static const char *const fourccs[] = {
+    "NV12", "P010", "YUY2", "Y210", "AYUV", "Y410", "P016", "Y216",
+    "Y416", "RGBA", "BGRA", "RGBX", "BGRX", "ARGB", "I420", "YV12",
+};
+
+static void write_surfaces(FILE *f, const struct scale *s)
+{
+    int i, j;
+    fprintf(f, "\"surface_formats\":[");
+    for (i = 0; i < s->rt_formats; i++) {
+        fprintf(f, "%s{\"rt_format\":\"%s\",\"min_width\":16,"
+                "\"max_width\":8192,\"min_height\":16,\"max_height\":8192,"
+                "\"memory_types\":[\"VA\",\"DRM_PRIME\"],\"pixel_formats\":[",
+                i ? "," : "", rt_format_names[i]);
+        for (j = 0; j < s->pixel_formats; j++)
+            fprintf(f, "%s\"%s\"", j ? "," : "", fourccs[j]);
+        fprintf(f, "]}");
+    }
+    fprintf(f, "]");
+}
+
+static void write_rt_formats(FILE *f, const struct scale *s)
+{
+    int i;
+    fprintf(f, "\"rt_formats\":[");
+    for (i = 0; i < s->rt_formats; i++)
+        fprintf(f, "%s\"%s\"", i ? "," : "", rt_format_names[i]);
+    fprintf(f, "]");
+}
+
+static void write_manifest(const char *path, const struct scale *s)
+{
+    static const struct {
+        VAEntrypoint entrypoint;
+        bool encode;
+    } entrypoints[] = {
+        { VAEntrypointVLD,        false },
+        { VAEntrypointEncSlice,   true  },
+        { VAEntrypointEncSliceLP, true  },
+    };
+    static const char *const filters[] = {
+        "\"filter\":0",
+        "\"filter\":1,\"min_value\":0,\"max_value\":64,"
+        "\"default_value\":0,\"step\":1",
+        "\"filter\":2,\"types\":[{\"type\":1},{\"type\":2}]",
+        "\"filter\":3,\"min_value\":0,\"max_value\":64,"
+        "\"default_value\":44,\"step\":1",
+        "\"filter\":4,\"types\":["
+        "{\"type\":1,\"min_value\":-180,\"max_value\":180,"
+        "\"default_value\":0,\"step\":0.1},"
+        "{\"type\":2,\"min_value\":0,\"max_value\":10,"
+        "\"default_value\":1,\"step\":0.1}]",
+    };
+    FILE *f;
+    int i, j;
+
+    f = fopen(path, "w");
+    if (!f)
+        die("Failed to open %s: %m.\n", path);
+
+    fprintf(f, "{\"driver_vendor\":\"vadumpcaps_bench %s\",\"profiles\":[",
+            s->name);
+    for (i = 0; i < s->profiles; i++) {
+        fprintf(f, "%s{\"profile\":%d,\"entrypoints\":[", i ? "," : "", i);
+        for (j = 0; j < ARRAY_LENGTH(entrypoints); j++) {
+            fprintf(f, "%s{\"entrypoint\":%d,\"attributes\":{",
+                    j ? "," : "", entrypoints[j].entrypoint);
+            write_rt_formats(f, s);
+            if (entrypoints[j].encode)
+                fprintf(f, ",\"rate_control_modes\":[\"CBR\",\"VBR\","
+                        "\"CQP\"],\"packed_headers\":[\"SEQUENCE\","
+                        "\"PICTURE\",\"SLICE\"],\"max_ref_frames\":"
+                        "{\"list0\":4,\"list1\":1},\"max_slices\":32,"
+                        "\"quality_range\":7");
+            else
+                fprintf(f, ",\"decode_slice_modes\":[\"NORMAL\"]");
+            fprintf(f, "},");
+            write_surfaces(f, s);
+            fprintf(f, "}");
+        }
+        fprintf(f, "]}");
+    }
+
+    fprintf(f, ",{\"profile\":-1,\"entrypoints\":[{\"entrypoint\":%d,"
+            "\"attributes\":{", VAEntrypointVideoProc);
+    write_rt_formats(f, s);
+    fprintf(f, "},");
+    write_surfaces(f, s);
+    fprintf(f, ",\"filters\":[");
+    for (i = 0; i < ARRAY_LENGTH(filters); i++) {
+        fprintf(f, "%s{%s,\"pipeline\":{\"pipeline_flags\":[],"
+                "\"filter_flags\":[],\"num_forward_references\":%d,"
+                "\"num_backward_references\":0,"
+                "\"input_colour_standards\":[{\"type\":%d},{\"type\":%d}],"
+                "\"output_colour_standards\":[{\"type\":%d},{\"type\":%d}],"
+                "\"input_pixel_formats\":[", i ? "," : "", filters[i],
+                i == VAProcFilterDeinterlacing,
+                VAProcColorStandardBT601, VAProcColorStandardBT709,
+                VAProcColorStandardBT601, VAProcColorStandardBT709);
+        for (j = 0; j < s->pixel_formats; j++)
+            fprintf(f, "%s\"%s\"", j ? "," : "", fourccs[j]);
+        fprintf(f, "],\"output_pixel_formats\":[");
+        for (j = 0; j < s->pixel_formats; j++)
+            fprintf(f, "%s\"%s\"", j ? "," : "", fourccs[j]);
+        fprintf(f, "]}}");
+    }
+    fprintf(f, "]}]}],");
+
+    fprintf(f, "\"image_formats\":[");
+    for (i = 0; i < s->image_formats; i++)
+        fprintf(f, "%s{\"pixel_format\":\"%s\",\"byte_order\":\"LE\","
+                "\"bits_per_pixel\":12}", i ? "," : "",
+                fourccs[i % ARRAY_LENGTH(fourccs)]);
+    fprintf(f, "],\"subpicture_formats\":[{\"pixel_format\":\"BGRA\","
+            "\"byte_order\":\"LE\",\"bits_per_pixel\":32,\"depth\":32,"
+            "\"red_mask\":16711680,\"green_mask\":65280,\"blue_mask\":255,"
+            "\"alpha_mask\":4278190080,\"flags\":[\"GLOBAL_ALPHA\"]}]}\n");
+
+    if (fclose(f))
+        die("Failed to write %s: %m.\n", path);
+}
+
+/*
+ * Output modes: the two forms of JSON with everything, then each group of
+ * selection options in the order their sections depend on each other.
+ */
+static const struct mode {
+    const char *name;
+    const char *args;
+} modes[] = {
+    { "pretty",             NULL    },
+    { "ugly",               "-u"    },
+    { "profiles",           "-p"    },
+    { "entrypoints",        "-pe"   },
+    { "attributes",         "-pet"  },
+    { "surface_formats",    "-pes"  },
+    { "filters",            "-pef"  },
+    { "filter_caps",        "-pefc" },
+    { "pipeline_caps",      "-pefl" },
+    { "image_formats",      "-m"    },
+    { "subpicture_formats", "-b"    },
+};
+
+struct run {
+    double wall_ms;
+    double cpu_ms;
+    long max_rss_kb;
+    long output_bytes;
+    unsigned long calls;
+    // Room for every stub call with a 20-digit count.
+    char call_counts[4096];
+};
+
+static const char *vadumpcaps_path = "./vadumpcaps";
+static const char *driver_path     = ".";
+static const char *device_path     = "/dev/dri/renderD128";
+
+static double timespec_ms(const struct timespec *t)
+{
+    return t->tv_sec * 1e3 + t->tv_nsec / 1e6;
+}
+
+static void run_once(const char *manifest, const char *calls_path,
+                     const struct mode *mode, struct run *run)
+{
+    struct timespec start, end;
+    struct rusage usage;
+    struct stat st;
+    FILE *output, *calls;
+    int status;
+    pid_t pid;
+
+    output = tmpfile();
+    if (!output)
+        die("Failed to create output file: %m.\n");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0)
+        die("Failed to fork: %m.\n");
+    if (pid == 0) {
+        const char *argv[] = {
+            vadumpcaps_path, "-d", device_path, "-r", "vadumpcaps_stub",
+            mode->args, NULL,
+        };
+        setenv("LIBVA_DRIVERS_PATH", driver_path, 1);
+        setenv("VADUMPCAPS_STUB_MANIFEST", manifest, 1);
+        setenv("VADUMPCAPS_STUB_CALLS", calls_path, 1);
+        unsetenv("VADUMPCAPS_STUB_LATENCY");
+        dup2(fileno(output), STDOUT_FILENO);
+        execv(vadumpcaps_path, (char**)argv);
+        fprintf(stderr, "Failed to run %s: %m.\n", vadumpcaps_path);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &usage) < 0)
+        die("Failed to wait for %s: %m.\n", vadumpcaps_path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        die("%s %s failed with status %d.\n", vadumpcaps_path,
+            mode->args ? mode->args : "", status);
+
+    if (fstat(fileno(output), &st) < 0)
+        die("Failed to stat output file: %m.\n");
+    fclose(output);
+
+    run->wall_ms      = timespec_ms(&end) - timespec_ms(&start);
+    run->cpu_ms       = usage.ru_utime.tv_sec * 1e3 +
+                        usage.ru_utime.tv_usec / 1e3 +
+                        usage.ru_stime.tv_sec * 1e3 +
+                        usage.ru_stime.tv_usec / 1e3;
+    run->max_rss_kb   = usage.ru_maxrss;
+    run->output_bytes = st.st_size;
+
+    // The driver counts the calls which reach it, not those which libva
+    // answers itself.
+    run->calls = 0;
+    run->call_counts[0] = 0;
+    calls = fopen(calls_path, "r");
+    if (calls) {
+        if (fgets(run->call_counts, sizeof(run->call_counts), calls)) {
+            const char *p = run->call_counts;
+            if (!strchr(run->call_counts, '\n') && !feof(calls))
+                die("Call counts in %s are too long.\n", calls_path);
+            run->call_counts[strcspn(run->call_counts, "\n")] = 0;
+            while ((p = strchr(p, ':')))
+                run->calls += strtoul(p + 1, (char**)&p, 10);
+        }
+        fclose(calls);
+        unlink(calls_path);
+    }
+    if (!run->call_counts[0])
+        strcpy(run->call_counts, "{}");
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *values, int count)
+{
+    qsort(values, count, sizeof(*values), compare_double);
+    return count % 2 ? values[count / 2]
+                     : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/*
+ * Comparison with a baseline written by an earlier run.  Each result is
+ * on a line of its own, so the baseline is read line by line rather than
+ * needing a JSON parser.
+ */
+static char *baseline;
+
+static bool baseline_value(const char *name, const char *key, double *value)
+{
+    char pattern[128];
+    const char *line, *end, *p;
+
+    snprintf(pattern, sizeof(pattern), "{\"name\":\"%s\",", name);
+    line = baseline ? strstr(baseline, pattern) : NULL;
+    if (!line)
+        return false;
+    end = strchr(line, '\n');
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(line, pattern);
+    if (!p || (end && p > end))
+        return false;
+    *value = strtod(p + strlen(pattern), NULL);
+    return true;
+}
+
+static void read_baseline(const char *path)
+{
+    size_t size = 0, got;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        die("Failed to open %s: %m.\n", path);
+    do {
+        baseline = realloc(baseline, size + 65536 + 1);
+        if (!baseline)
+            die("Failed to allocate baseline.\n");
+        got = fread(baseline + size, 1, 65536, f);
+        size += got;
+    } while (got > 0);
+    baseline[size] = 0;
+    fclose(f);
+}
+
+static void usage(const char *argv0)
+{
+    printf("vadumpcaps_bench - end-to-end benchmark of vadumpcaps\n"
+           "  Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>\n"
+           "Usage: %s [options]\n"
+           "Options:\n"
+           "  -h, --help                Show this information\n"
+           "  -d, --device <path>       Device for libva to open\n"
+           "                              (default /dev/dri/renderD128)\n"
+           "  -x, --vadumpcaps <path>   vadumpcaps to run (default ./vadumpcaps)\n"
+           "  -D, --drivers <dir>       Directory containing\n"
+           "                              vadumpcaps_stub_drv_video.so (default .)\n"
+           "  -n, --repeats <n>         Runs of each case (default 5)\n"
+           "  -o, --output <file>       Write results to a file\n"
+           "  -b, --baseline <file>     Compare with earlier results, failing\n"
+           "                              if any case got slower or made more calls\n"
+           "  -t, --threshold <pct>     Slowdown allowed before failing\n"
+           "                              (default 10)\n",
+           argv0);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "help",       no_argument,       0, 'h' },
+        { "device",     required_argument, 0, 'd' },
+        { "vadumpcaps", required_argument, 0, 'x' },
+        { "drivers",    required_argument, 0, 'D' },
+        { "repeats",    required_argument, 0, 'n' },
+        { "output",     required_argument, 0, 'o' },
+        { "baseline",   required_argument, 0, 'b' },
+        { "threshold",  required_argument, 0, 't' },
+        { 0 },
+    };
+    char dir[] = "/tmp/vadumpcaps_bench.XXXXXX";
+    char manifests[ARRAY_LENGTH(scales)][sizeof(dir) + 32];
+    char calls_path[sizeof(dir) + 32];
+    const char *output_path = NULL;
+    double threshold = 10;
+    int repeats = 5, regressions = 0;
+    FILE *out = stdout;
+    int i, j, k;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "hd:x:D:n:o:b:t:",
+                            long_options, NULL);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'h':
+            usage(argv[0]);
+            break;
+        case 'd':
+            device_path = optarg;
+            break;
+        case 'x':
+            vadumpcaps_path = optarg;
+            break;
+        case 'D':
+            driver_path = optarg;
+            break;
+        case 'n':
+            repeats = atoi(optarg);
+            if (repeats < 1 || repeats > MAX_REPEATS)
+                die("Repeats must be between 1 and %d.\n", MAX_REPEATS);
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'b':
+            read_baseline(optarg);
+            break;
+        case 't':
+            threshold = strtod(optarg, NULL);
+            break;
+        default:
+            die("Unknown option.\n");
+        }
+    }
+
+    if (access(vadumpcaps_path, X_OK))
+        die("Cannot run %s: %m.\n", vadumpcaps_path);
+
+    if (!mkdtemp(dir))
+        die("Failed to create temporary directory: %m.\n");
+    snprintf(calls_path, sizeof(calls_path), "%s/calls.json", dir);
+    for (i = 0; i < ARRAY_LENGTH(scales); i++) {
+        snprintf(manifests[i], sizeof(manifests[i]), "%s/%s.json",
+                 dir, scales[i].name);
+        write_manifest(manifests[i], &scales[i]);
+    }
+
+    if (output_path) {
+        out = fopen(output_path, "w");
+        if (!out)
+            die("Failed to open %s: %m.\n", output_path);
+    }
+
+    fprintf(out, "{\"device\":\"%s\",\"repeats\":%d,\"scales\":[",
+            device_path, repeats);
+    for (i = 0; i < ARRAY_LENGTH(scales); i++) {
+        struct stat st;
+        stat(manifests[i], &st);
+        fprintf(out, "%s{\"scale\":\"%s\",\"profiles\":%d,"
+                "\"rt_formats\":%d,\"pixel_formats\":%d,"
+                "\"image_formats\":%d,\"manifest_bytes\":%lld}",
+                i ? "," : "", scales[i].name, scales[i].profiles,
+                scales[i].rt_formats, scales[i].pixel_formats,
+                scales[i].image_formats, (long long)st.st_size);
+    }
+    fprintf(out, "],\"results\":[\n");
+
+    for (i = 0; i < ARRAY_LENGTH(scales); i++) {
+        for (j = 0; j < ARRAY_LENGTH(modes); j++) {
+            struct run runs[MAX_REPEATS];
+            double wall[MAX_REPEATS], cpu[MAX_REPEATS];
+            double wall_min, wall_median, cpu_median, previous;
+            long max_rss_kb = 0;
+            char name[64];
+
+            // One unmeasured run first, to warm the page cache.
+            run_once(manifests[i], calls_path, &modes[j], &runs[0]);
+            for (k = 0; k < repeats; k++) {
+                run_once(manifests[i], calls_path, &modes[j], &runs[k]);
+                wall[k] = runs[k].wall_ms;
+                cpu[k]  = runs[k].cpu_ms;
+                if (runs[k].max_rss_kb > max_rss_kb)
+                    max_rss_kb = runs[k].max_rss_kb;
+            }
+            wall_median = median(wall, repeats);
+            wall_min    = wall[0];
+            cpu_median  = median(cpu, repeats);
+
+            snprintf(name, sizeof(name), "%s/%s",
+                     scales[i].name, modes[j].name);
+            fprintf(out, "%s{\"name\":\"%s\",\"scale\":\"%s\","
+                    "\"mode\":\"%s\",\"args\":\"%s\",\"wall_ms\":%.3f,"
+                    "\"wall_ms_min\":%.3f,\"cpu_ms\":%.3f,"
+                    "\"max_rss_kb\":%ld,\"output_bytes\":%ld,"
+                    "\"driver_calls\":%lu,\"calls\":%s}",
+                    i || j ? ",\n" : "", name, scales[i].name,
+                    modes[j].name, modes[j].args ? modes[j].args : "",
+                    wall_median, wall_min, cpu_median, max_rss_kb,
+                    runs[0].output_bytes, runs[0].calls,
+                    runs[0].call_counts);
+            fflush(out);
+
+            if (baseline_value(name, "wall_ms", &previous) &&
+                wall_median > previous * (1 + threshold / 100)) {
+                fprintf(stderr, "%s: wall time %.3f ms, was %.3f ms.\n",
+                        name, wall_median, previous);
+                ++regressions;
+            }
+            if (baseline_value(name, "cpu_ms", &previous) &&
+                cpu_median > previous * (1 + threshold / 100)) {
+                fprintf(stderr, "%s: CPU time %.3f ms, was %.3f ms.\n",
+                        name, cpu_median, previous);
+                ++regressions;
+            }
+            if (baseline_value(name, "driver_calls", &previous) &&
+                runs[0].calls > previous) {
+                fprintf(stderr, "%s: %lu driver calls, was %.0f.\n",
+                        name, runs[0].calls, previous);
+                ++regressions;
+            }
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if (out != stdout && fclose(out))
+        die("Failed to write %s: %m.\n", output_path);
+
+    for (i = 0; i < ARRAY_LENGTH(scales); i++)
+        unlink(manifests[i]);
+    rmdir(dir);
+
+    if (baseline) {
+        if (regressions)
+            die("%d regressions against the baseline.\n", regressions);
+        fprintf(stderr, "No regressions against the baseline.\n");
+    }
+    return 0;
+}
@@ -0,0 +1,2369 @@
+/*
+ * vadumpcaps_stub - VAAPI driver answering from a capability manifest
+ * Copyright (C) 2016-2021 Mark Thompson <sw@jkqxz.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A driver with no hardware behind it, for measuring and testing
+ * vadumpcaps on machines without a GPU.  Its capabilities are read from a
+ * manifest, which is a plain (not --dedup) vadumpcaps JSON dump named by
+ * VADUMPCAPS_STUB_MANIFEST, so that dumping through this driver gives the
+ * manifest back.  Every call can be made to take a fixed time, set by
+ * VADUMPCAPS_STUB_LATENCY as "name=microseconds" pairs separated by
+ * commas, with "*" for every call not named:
+ *   VADUMPCAPS_STUB_LATENCY='*=20,vaCreateContext=2000'
+ * If VADUMPCAPS_STUB_CALLS names a file, the number of times each call
+ * was made is written to it as a JSON object when the driver terminates.
+ *
+ * Attributes which vadumpcaps writes as objects of bit fields (other than
+ * max_ref_frames and unknown) are not read back, so appear unsupported.
+ * Surfaces, contexts, buffers and images can be created and pictures
+ * "rendered", but nothing is ever processed.  H.264 encodes do write the
+ * headers their parameters describe to the coded buffer, followed by
+ * filler in place of the slice data, so that the stream can be parsed.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <va/va.h>
+#include <va/va_backend.h>
+#include <va/va_backend_vpp.h>
+#include <va/va_vpp.h>
+#include <va/va_enc_h264.h>
+
+#if !VA_CHECK_VERSION(1, 0, 0)
+#error "The stub driver needs libva 2.0 or later."
+#endif
+
+#define LIBVA_2_1_0  VA_CHECK_VERSION(1,  1, 0)
+#define LIBVA_2_2_0  VA_CHECK_VERSION(1,  2, 0)
+#define LIBVA_2_3_0  VA_CHECK_VERSION(1,  3, 0)
+#define LIBVA_2_4_0  VA_CHECK_VERSION(1,  4, 0)
+#define LIBVA_2_5_0  VA_CHECK_VERSION(1,  5, 0)
+#define LIBVA_2_6_0  VA_CHECK_VERSION(1,  6, 0)
+#define LIBVA_2_8_0  VA_CHECK_VERSION(1,  8, 0)
+#define LIBVA_2_9_0  VA_CHECK_VERSION(1,  9, 0)
+#define LIBVA_2_10_0 VA_CHECK_VERSION(1, 10, 0)
+#define LIBVA_2_11_0 VA_CHECK_VERSION(1, 11, 0)
+#define LIBVA_2_12_0 VA_CHECK_VERSION(1, 12, 0)
+#define LIBVA(major, minor, micro) \
+       (LIBVA_ ## major ## _ ## minor ## _ ## micro)
+
+#define ARRAY_LENGTH(x) (sizeof(x) / sizeof(x[0]))
+
+#define STUB_MAX_PROFILES    64
+#define STUB_MAX_ENTRYPOINTS 32
+#define STUB_MAX_FILTERS     32
+#define STUB_MAX_CAPS        32
+
+
+/*
+ * Manifest parsing.  Only what a vadumpcaps dump contains is needed, so
+ * this is a small tree-building JSON parser without the strictness of the
+ * one in vadumpcaps.
+ */
+
+enum {
+    JSON_NULL,
+    JSON_BOOLEAN,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT,
+};
+
+struct json {
+    int    type;
+    char  *key;
+    double number;
+    char  *string;
+    int    nb_children;
+    struct json *children;
+};
+
+static void json_free(struct json *value)
+{
+    int i;
+    for (i = 0; i < value->nb_children; i++)
+        json_free(&value->children[i]);
+    free(value->children);
+    free(value->key);
+    free(value->string);
+}
+
+static void json_skip(const char **p)
+{
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+        ++*p;
+}
+
+static char *json_parse_string(const char **p)
+{
+    const char *s = *p + 1;
+    size_t len = 0;
+    char *str;
+
+    // Escapes only shrink the string, so its length in the file is enough.
+    while (s[len] && s[len] != '"')
+        len += s[len] == '\\' && s[len + 1] ? 2 : 1;
+    str = malloc(len + 1);
+    if (!str)
+        return NULL;
+    len = 0;
+    while (*s && *s != '"') {
+        if (*s == '\\') {
+            ++s;
+            switch (*s) {
+            case 'n': str[len++] = '\n'; break;
+            case 't': str[len++] = '\t'; break;
+            case 'r': str[len++] = '\r'; break;
+            case 'b': str[len++] = '\b'; break;
+            case 'f': str[len++] = '\f'; break;
+            case 'u':
+                {
+                    // Names are ASCII; anything else becomes '?'.
+                    unsigned int cp = 0;
+                    if (sscanf(s + 1, "%4x", &cp) != 1)
+                        goto fail;
+                    str[len++] = cp < 0x80 ? cp : '?';
+                    s += 4;
+                }
+                break;
+            case 0:
+                goto fail;
+            default:
+                str[len++] = *s;
+            }
+            ++s;
+        } else {
+            str[len++] = *s++;
+        }
+    }
+    if (*s != '"')
+        goto fail;
+    str[len] = 0;
+    *p = s + 1;
+    return str;
+fail:
+    free(str);
+    return NULL;
+}
+
+static bool json_parse_value(const char **p, struct json *value)
+{
+    json_skip(p);
+    memset(value, 0, sizeof(*value));
+
+    if (**p == '{' || **p == '[') {
+        char close = **p == '{' ? '}' : ']';
+        value->type = close == '}' ? JSON_OBJECT : JSON_ARRAY;
+        ++*p;
+        json_skip(p);
+        if (**p == close) {
+            ++*p;
+            return true;
+        }
+        while (1) {
+            struct json *child;
+            char *key = NULL;
+            if (value->type == JSON_OBJECT) {
+                json_skip(p);
+                if (**p != '"' || !(key = json_parse_string(p)))
+                    return false;
+                json_skip(p);
+                if (*(*p)++ != ':') {
+                    free(key);
+                    return false;
+                }
+            }
+            child = realloc(value->children, (value->nb_children + 1) *
+                            sizeof(*child));
+            if (!child) {
+                free(key);
+                return false;
+            }
+            value->children = child;
+            child = &value->children[value->nb_children++];
+            if (!json_parse_value(p, child)) {
+                child->key = key;
+                return false;
+            }
+            child->key = key;
+            json_skip(p);
+            if (**p == close) {
+                ++*p;
+                return true;
+            }
+            if (*(*p)++ != ',')
+                return false;
+        }
+    } else if (**p == '"') {
+        value->type = JSON_STRING;
+        value->string = json_parse_string(p);
+        return value->string;
+    } else if (!strncmp(*p, "true", 4) || !strncmp(*p, "false", 5)) {
+        value->type   = JSON_BOOLEAN;
+        value->number = **p == 't';
+        *p += **p == 't' ? 4 : 5;
+        return true;
+    } else if (!strncmp(*p, "null", 4)) {
+        value->type = JSON_NULL;
+        *p += 4;
+        return true;
+    } else {
+        char *end;
+        value->type   = JSON_NUMBER;
+        value->number = strtod(*p, &end);
+        if (end == *p)
+            return false;
+        *p = end;
+        return true;
+    }
+}
+
+static const struct json *json_get(const struct json *object, const char *key)
+{
+    int i;
+    if (!object || object->type != JSON_OBJECT)
+        return NULL;
+    for (i = 0; i < object->nb_children; i++) {
+        if (!strcmp(object->children[i].key, key))
+            return &object->children[i];
+    }
+    return NULL;
+}
+
+static double json_number(const struct json *object, const char *key,
+                          double fallback)
+{
+    const struct json *value = json_get(object, key);
+    return value && (value->type == JSON_NUMBER ||
+                     value->type == JSON_BOOLEAN) ? value->number : fallback;
+}
+
+static const char *json_string(const struct json *object, const char *key)
+{
+    const struct json *value = json_get(object, key);
+    return value && value->type == JSON_STRING ? value->string : NULL;
+}
+
+static int json_length(const struct json *array)
+{
+    return array && array->type == JSON_ARRAY ? array->nb_children : 0;
+}
+
+
+/*
+ * Names written by vadumpcaps, mapped back to values.
+ */
+
+struct stub_name {
+    const char *name;
+    uint32_t value;
+};
+
+static const struct stub_name rt_format_names[] = {
+#define R(name) { #name, VA_RT_FORMAT_ ## name }
+    R(YUV420),
+    R(YUV422),
+    R(YUV444),
+    R(YUV411),
+    R(YUV400),
+#if LIBVA(2, 2, 0)
+    R(YUV420_10),
+    R(YUV422_10),
+    R(YUV444_10),
+    R(YUV420_12),
+    R(YUV422_12),
+    R(YUV444_12),
+#else
+    R(YUV420_10BPP),
+#endif
+    R(RGB16),
+    R(RGB32),
+    R(RGBP),
+#if LIBVA(2, 2, 0)
+    R(RGB32_10),
+#elif LIBVA(2, 1, 0)
+    R(RGB32_10BPP),
+#endif
+#undef R
+};
+
+#define N(prefix, name) { #name, VA_ ## prefix ## _ ## name }
+
+static const struct stub_name rate_control_names[] = {
+    N(RC, NONE), N(RC, CBR), N(RC, VBR), N(RC, VCM), N(RC, CQP),
+    N(RC, VBR_CONSTRAINED), N(RC, MB),
+#if LIBVA(2, 1, 0)
+    N(RC, ICQ), N(RC, CFS), N(RC, PARALLEL),
+#endif
+#if LIBVA(2, 3, 0)
+    N(RC, QVBR), N(RC, AVBR),
+#endif
+#if LIBVA(2, 10, 0)
+    N(RC, TCBRC),
+#endif
+};
+
+static const struct stub_name decode_slice_mode_names[] = {
+    N(DEC_SLICE_MODE, NORMAL), N(DEC_SLICE_MODE, BASE),
+};
+
+static const struct stub_name packed_header_names[] = {
+    N(ENC_PACKED_HEADER, SEQUENCE), N(ENC_PACKED_HEADER, PICTURE),
+    N(ENC_PACKED_HEADER, SLICE), N(ENC_PACKED_HEADER, MISC),
+    N(ENC_PACKED_HEADER, RAW_DATA),
+};
+
+static const struct stub_name interlace_mode_names[] = {
+    N(ENC_INTERLACED, FRAME), N(ENC_INTERLACED, FIELD),
+    N(ENC_INTERLACED, MBAFF), N(ENC_INTERLACED, PAFF),
+};
+
+static const struct stub_name slice_structure_names[] = {
+    N(ENC_SLICE_STRUCTURE, ARBITRARY_ROWS),
+    N(ENC_SLICE_STRUCTURE, POWER_OF_TWO_ROWS),
+    N(ENC_SLICE_STRUCTURE, ARBITRARY_MACROBLOCKS),
+    N(ENC_SLICE_STRUCTURE, EQUAL_ROWS),
+    N(ENC_SLICE_STRUCTURE, MAX_SLICE_SIZE),
+#if LIBVA(2, 8, 0)
+    N(ENC_SLICE_STRUCTURE, EQUAL_MULTI_ROWS),
+#endif
+};
+
+static const struct stub_name fei_function_names[] = {
+    N(FEI_FUNCTION, ENC), N(FEI_FUNCTION, PAK), N(FEI_FUNCTION, ENC_PAK),
+};
+
+#if LIBVA(2, 1, 0)
+static const struct stub_name quantization_names[] = {
+    N(ENC_QUANTIZATION, TRELLIS_SUPPORTED),
+};
+
+static const struct stub_name intra_refresh_names[] = {
+    N(ENC_INTRA_REFRESH, ROLLING_COLUMN), N(ENC_INTRA_REFRESH, ROLLING_ROW),
+    N(ENC_INTRA_REFRESH, ADAPTIVE), N(ENC_INTRA_REFRESH, CYCLIC),
+    N(ENC_INTRA_REFRESH, P_FRAME), N(ENC_INTRA_REFRESH, B_FRAME),
+    N(ENC_INTRA_REFRESH, MULTI_REF),
+};
+
+static const struct stub_name processing_rate_names[] = {
+    N(PROCESSING_RATE, ENCODE), N(PROCESSING_RATE, DECODE),
+};
+#endif
+
+#if LIBVA(2, 6, 0)
+static const struct stub_name prediction_direction_names[] = {
+    N(PREDICTION_DIRECTION, PREVIOUS), N(PREDICTION_DIRECTION, FUTURE),
+#if LIBVA(2, 8, 0)
+    N(PREDICTION_DIRECTION, BI_NOT_EMPTY),
+#endif
+};
+#endif
+
+static const struct stub_name memory_type_names[] = {
+    N(SURFACE_ATTRIB_MEM_TYPE, VA), N(SURFACE_ATTRIB_MEM_TYPE, V4L2),
+    N(SURFACE_ATTRIB_MEM_TYPE, USER_PTR),
+    N(SURFACE_ATTRIB_MEM_TYPE, KERNEL_DRM),
+    N(SURFACE_ATTRIB_MEM_TYPE, DRM_PRIME),
+#if LIBVA(2, 1, 0)
+    N(SURFACE_ATTRIB_MEM_TYPE, DRM_PRIME_2),
+#endif
+};
+
+static const struct stub_name usage_hint_names[] = {
+    N(SURFACE_ATTRIB_USAGE_HINT, DECODER),
+    N(SURFACE_ATTRIB_USAGE_HINT, ENCODER),
+    N(SURFACE_ATTRIB_USAGE_HINT, VPP_READ),
+    N(SURFACE_ATTRIB_USAGE_HINT, VPP_WRITE),
+    N(SURFACE_ATTRIB_USAGE_HINT, DISPLAY),
+};
+
+static const struct stub_name subpicture_flag_names[] = {
+    N(SUBPICTURE, CHROMA_KEYING), N(SUBPICTURE, GLOBAL_ALPHA),
+    N(SUBPICTURE, DESTINATION_IS_SCREEN_COORD),
+};
+
+static const struct stub_name pipeline_flag_names[] = {
+    N(PROC_PIPELINE, SUBPICTURES), N(PROC_PIPELINE, FAST),
+};
+
+static const struct stub_name filter_flag_names[] = {
+    { "PROC_FILTER_MANDATORY",        VA_PROC_FILTER_MANDATORY        },
+    { "FRAME_PICTURE",                VA_FRAME_PICTURE                },
+    { "TOP_FIELD",                    VA_TOP_FIELD                    },
+    { "BOTTOM_FIELD",                 VA_BOTTOM_FIELD                 },
+    { "SRC_BT601",                    VA_SRC_BT601                    },
+    { "SRC_BT709",                    VA_SRC_BT709                    },
+    { "SRC_SMPTE_240",                VA_SRC_SMPTE_240                },
+    { "FILTER_SCALING_DEFAULT",       VA_FILTER_SCALING_DEFAULT       },
+    { "FILTER_SCALING_FAST",          VA_FILTER_SCALING_FAST          },
+    { "FILTER_SCALING_HQ",            VA_FILTER_SCALING_HQ            },
+    { "FILTER_SCALING_NL_ANAMORPHIC", VA_FILTER_SCALING_NL_ANAMORPHIC },
+#if LIBVA(2, 9, 0)
+    { "FILTER_INTERPOLATION_NEAREST_NEIGHBOR",
+      VA_FILTER_INTERPOLATION_NEAREST_NEIGHBOR },
+    { "FILTER_INTERPOLATION_BILINEAR",
+      VA_FILTER_INTERPOLATION_BILINEAR },
+    { "FILTER_INTERPOLATION_ADVANCED",
+      VA_FILTER_INTERPOLATION_ADVANCED },
+#endif
+};
+
+#if LIBVA(2, 1, 0)
+// These are written as names of bit positions.
+static const struct stub_name rotation_names[] = {
+    N(ROTATION, NONE), N(ROTATION, 90), N(ROTATION, 180), N(ROTATION, 270),
+};
+
+static const struct stub_name blend_names[] = {
+    N(BLEND, GLOBAL_ALPHA), N(BLEND, PREMULTIPLIED_ALPHA), N(BLEND, LUMA_KEY),
+};
+
+static const struct stub_name mirror_names[] = {
+    N(MIRROR, NONE), N(MIRROR, HORIZONTAL), N(MIRROR, VERTICAL),
+};
+#endif
+
+#if LIBVA(2, 4, 0)
+static const struct stub_name tone_mapping_names[] = {
+    N(TONE_MAPPING, HDR_TO_HDR), N(TONE_MAPPING, HDR_TO_SDR),
+    N(TONE_MAPPING, HDR_TO_EDR), N(TONE_MAPPING, SDR_TO_HDR),
+};
+#endif
+
+#if LIBVA(2, 12, 0)
+static const struct stub_name tdlut_channel_names[] = {
+    N(3DLUT_CHANNEL, RGB_RGB), N(3DLUT_CHANNEL, YUV_RGB),
+    N(3DLUT_CHANNEL, VUY_RGB),
+};
+#endif
+
+#undef N
+
+// Attributes written as a list of flag names, or as one number.
+static const struct {
+    const char *name;
+    VAConfigAttribType type;
+    const struct stub_name *flags;
+    int nb_flags;
+} attribute_names[] = {
+#define F(name, type, table) { name, VAConfigAttrib ## type, \
+                               table, ARRAY_LENGTH(table) }
+#define I(name, type) { name, VAConfigAttrib ## type, NULL, 0 }
+    F("rate_control_modes",    RateControl,       rate_control_names),
+    F("decode_slice_modes",    DecSliceMode,      decode_slice_mode_names),
+    F("packed_headers",        EncPackedHeaders,  packed_header_names),
+    F("interlace_modes",       EncInterlaced,     interlace_mode_names),
+    I("max_slices",            EncMaxSlices),
+    F("slice_structure_modes", EncSliceStructure, slice_structure_names),
+    I("macroblock_info",       EncMacroblockInfo),
+    I("quality_range",         EncQualityRange),
+    I("skip_frame",            EncSkipFrame),
+    F("fei_function_type",     FEIFunctionType,   fei_function_names),
+    I("fei_mv_predictors",     FEIMVPredictors),
+#if LIBVA(2, 1, 0)
+    I("max_picture_width",     MaxPictureWidth),
+    I("max_picture_height",    MaxPictureHeight),
+    F("quantization",          EncQuantization,   quantization_names),
+    F("intra_refresh",         EncIntraRefresh,   intra_refresh_names),
+    F("processing_rate",       ProcessingRate,    processing_rate_names),
+    I("encode_dirty_rectangle", EncDirtyRect),
+    I("encode_parallel_rate_control_layers", EncParallelRateControl),
+    I("encode_dynamic_scaling", EncDynamicScaling),
+    I("encode_frame_size_tolerance", FrameSizeToleranceSupport),
+    I("encode_tile_support",   EncTileSupport),
+    I("custom_rounding_control", CustomRoundingControl),
+    I("qp_block_size",         QPBlockSize),
+#endif
+#if LIBVA(2, 6, 0)
+    F("prediction_direction",  PredictionDirection, prediction_direction_names),
+#endif
+#if LIBVA(2, 11, 0)
+    I("tee_type",              TEEType),
+    I("tee_type_client",       TEETypeClient),
+    I("protected_content_cipher_algorithm",
+      ProtectedContentCipherAlgorithm),
+    I("protected_content_cipher_block_size",
+      ProtectedContentCipherBlockSize),
+    I("protected_content_cipher_mode", ProtectedContentCipherMode),
+    I("protected_content_cipher_sample_type",
+      ProtectedContentCipherSampleType),
+    I("protected_content_usage", ProtectedContentUsage),
+#endif
+#undef F
+#undef I
+};
+
+static bool stub_lookup(const struct stub_name *names, int nb_names,
+                        const char *name, uint32_t *value)
+{
+    int i;
+    for (i = 0; name && i < nb_names; i++) {
+        if (!strcmp(names[i].name, name)) {
+            *value = names[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ORs together the values of the names in an array.
+static uint32_t stub_flags(const struct json *array,
+                           const struct stub_name *names, int nb_names,
+                           bool positions)
+{
+    uint32_t flags = 0, value;
+    int i;
+    for (i = 0; i < json_length(array); i++) {
+        if (stub_lookup(names, nb_names, array->children[i].string, &value))
+            flags |= positions ? 1u << value : value;
+    }
+    return flags;
+}
+
+static uint32_t stub_fourcc(const char *name)
+{
+    char fourcc[4] = { ' ', ' ', ' ', ' ' };
+    memcpy(fourcc, name, strnlen(name, 4));
+    return VA_FOURCC(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+}
+
+
+/*
+ * The capabilities, as read from the manifest.
+ */
+
+struct stub_surface {
+    unsigned int rt_format;
+    VASurfaceAttrib attribs[64];
+    int nb_attribs;
+};
+
+struct stub_filter {
+    VAProcFilterType type;
+    int nb_caps;
+    size_t cap_size;
+    union {
+        VAProcFilterCap              range;
+        VAProcFilterCapDeinterlacing deinterlacing[STUB_MAX_CAPS];
+        VAProcFilterCapColorBalance  colour_balance[STUB_MAX_CAPS];
+#if LIBVA(2, 1, 0)
+        VAProcFilterCapTotalColorCorrection colour_correction[STUB_MAX_CAPS];
+#endif
+#if LIBVA(2, 4, 0)
+        VAProcFilterCapHighDynamicRange hdr[STUB_MAX_CAPS];
+#endif
+#if LIBVA(2, 12, 0)
+        VAProcFilterCap3DLUT         lut[STUB_MAX_CAPS];
+#endif
+    } caps;
+
+    bool has_pipeline;
+    VAProcPipelineCaps pipeline;
+    VAProcColorStandardType input_colour_standards[32];
+    VAProcColorStandardType output_colour_standards[32];
+    uint32_t input_pixel_formats[64];
+    uint32_t output_pixel_formats[64];
+};
+
+struct stub_entrypoint {
+    VAEntrypoint entrypoint;
+    VAConfigAttrib attribs[VAConfigAttribTypeMax];
+    int nb_attribs;
+    struct stub_surface *surfaces;
+    int nb_surfaces;
+    struct stub_filter *filters;
+    int nb_filters;
+};
+
+struct stub_profile {
+    VAProfile profile;
+    struct stub_entrypoint entrypoints[STUB_MAX_ENTRYPOINTS];
+    int nb_entrypoints;
+};
+
+struct stub_config {
+    VAProfile    profile;
+    VAEntrypoint entrypoint;
+    unsigned int rt_format;
+};
+
+struct stub_buffer {
+    VABufferType type;
+    size_t size;
+    void *data;
+    // Bytes written to a coded buffer, if any.
+    size_t used;
+    VACodedBufferSegment segment;
+};
+
+// The last H.264 encode parameters rendered to a context.
+struct stub_context {
+    VAConfigID config;
+    bool have_sequence;
+    bool have_picture;
+    VAEncSequenceParameterBufferH264 sequence;
+    VAEncPictureParameterBufferH264  picture;
+    VAEncSliceParameterBufferH264    slice;
+};
+
+struct stub_image {
+    VAImage image;
+};
+
+struct stub_driver {
+    char vendor[256];
+
+    struct stub_profile profiles[STUB_MAX_PROFILES];
+    int nb_profiles;
+
+    VAImageFormat *image_formats;
+    int nb_image_formats;
+    VAImageFormat *subpicture_formats;
+    unsigned int *subpicture_flags;
+    int nb_subpicture_formats;
+
+    // Objects are numbered from one, with zero marking a free slot.
+    struct stub_config *configs;
+    int nb_configs;
+    struct stub_context *contexts;
+    int nb_contexts;
+    struct stub_buffer *buffers;
+    int nb_buffers;
+    struct stub_image *images;
+    int nb_images;
+    VASurfaceID next_surface;
+
+    pthread_mutex_t lock;
+};
+
+#define STUB(ctx) ((struct stub_driver*)(ctx)->pDriverData)
+
+static void stub_read_attributes(struct stub_entrypoint *ep,
+                                 const struct json *attributes)
+{
+    uint32_t value;
+    int i, j;
+
+    for (i = 0; attributes && i < attributes->nb_children; i++) {
+        const struct json *attr = &attributes->children[i];
+        VAConfigAttrib *out = &ep->attribs[ep->nb_attribs];
+
+        if (ep->nb_attribs >= ARRAY_LENGTH(ep->attribs))
+            break;
+
+        if (!strcmp(attr->key, "rt_formats")) {
+            *out = (VAConfigAttrib) {
+                .type  = VAConfigAttribRTFormat,
+                .value = stub_flags(attr, rt_format_names,
+                                    ARRAY_LENGTH(rt_format_names), false),
+            };
+        } else if (!strcmp(attr->key, "max_ref_frames")) {
+            *out = (VAConfigAttrib) {
+                .type  = VAConfigAttribEncMaxRefFrames,
+                .value = (uint32_t)json_number(attr, "list0", 0) |
+                         (uint32_t)json_number(attr, "list1", 0) << 16,
+            };
+#if LIBVA(2, 1, 0)
+        } else if (!strcmp(attr->key, "decode_processing")) {
+            if (!attr->number)
+                continue;
+            *out = (VAConfigAttrib) {
+                .type  = VAConfigAttribDecProcessing,
+                .value = VA_DEC_PROCESSING,
+            };
+#endif
+        } else if (!strcmp(attr->key, "unknown")) {
+            *out = (VAConfigAttrib) {
+                .type  = json_number(attr, "type", VAConfigAttribTypeMax),
+                .value = json_number(attr, "value", 0),
+            };
+            if (out->type >= VAConfigAttribTypeMax)
+                continue;
+        } else {
+            for (j = 0; j < ARRAY_LENGTH(attribute_names); j++) {
+                if (!strcmp(attribute_names[j].name, attr->key))
+                    break;
+            }
+            if (j >= ARRAY_LENGTH(attribute_names))
+                continue;
+            if (attribute_names[j].flags)
+                value = stub_flags(attr, attribute_names[j].flags,
+                                   attribute_names[j].nb_flags, false);
+            else
+                value = attr->number;
+            *out = (VAConfigAttrib) {
+                .type  = attribute_names[j].type,
+                .value = value,
+            };
+        }
+        ++ep->nb_attribs;
+    }
+}
+
+static void stub_add_surface_attrib(struct stub_surface *s,
+                                    VASurfaceAttribType type, int32_t value)
+{
+    if (s->nb_attribs >= ARRAY_LENGTH(s->attribs))
+        return;
+    s->attribs[s->nb_attribs++] = (VASurfaceAttrib) {
+        .type  = type,
+        .flags = VA_SURFACE_ATTRIB_GETTABLE,
+        .value = {
+            .type    = VAGenericValueTypeInteger,
+            .value.i = value,
+        },
+    };
+}
+
+static void stub_read_surfaces(struct stub_entrypoint *ep,
+                               const struct json *surfaces)
+{
+    static const struct {
+        const char *key;
+        VASurfaceAttribType type;
+    } sizes[] = {
+        { "min_width",  VASurfaceAttribMinWidth  },
+        { "max_width",  VASurfaceAttribMaxWidth  },
+        { "min_height", VASurfaceAttribMinHeight },
+        { "max_height", VASurfaceAttribMaxHeight },
+    };
+    int i, j;
+
+    ep->surfaces = calloc(json_length(surfaces), sizeof(*ep->surfaces));
+    if (!ep->surfaces)
+        return;
+
+    for (i = 0; i < json_length(surfaces); i++) {
+        const struct json *sf = &surfaces->children[i];
+        const struct json *list;
+        struct stub_surface *s = &ep->surfaces[ep->nb_surfaces];
+
+        if (!stub_lookup(rt_format_names, ARRAY_LENGTH(rt_format_names),
+                         json_string(sf, "rt_format"), &s->rt_format))
+            continue;
+        ++ep->nb_surfaces;
+
+        // In the order vadumpcaps would see them from a real driver.
+        list = json_get(sf, "pixel_formats");
+        for (j = 0; j < json_length(list); j++) {
+            if (list->children[j].type == JSON_STRING)
+                stub_add_surface_attrib(s, VASurfaceAttribPixelFormat,
+                    stub_fourcc(list->children[j].string));
+        }
+        for (j = 0; j < ARRAY_LENGTH(sizes); j++) {
+            if (json_get(sf, sizes[j].key))
+                stub_add_surface_attrib(s, sizes[j].type,
+                                        json_number(sf, sizes[j].key, 0));
+        }
+        if ((list = json_get(sf, "memory_types")))
+            stub_add_surface_attrib(s, VASurfaceAttribMemoryType,
+                stub_flags(list, memory_type_names,
+                           ARRAY_LENGTH(memory_type_names), false));
+        if ((list = json_get(sf, "usage_hints")))
+            stub_add_surface_attrib(s, VASurfaceAttribUsageHint,
+                stub_flags(list, usage_hint_names,
+                           ARRAY_LENGTH(usage_hint_names), false));
+        for (j = 0; j < sf->nb_children; j++) {
+            list = &sf->children[j];
+            if (!strcmp(list->key, "unknown"))
+                stub_add_surface_attrib(s, json_number(list, "type", 0),
+                                        json_number(list, "value", 0));
+        }
+    }
+}
+
+static VAProcFilterValueRange stub_range(const struct json *object)
+{
+    return (VAProcFilterValueRange) {
+        .min_value     = json_number(object, "min_value",     0),
+        .max_value     = json_number(object, "max_value",     0),
+        .default_value = json_number(object, "default_value", 0),
+        .step          = json_number(object, "step",          0),
+    };
+}
+
+static void stub_read_pipeline(struct stub_filter *f,
+                               const struct json *pipeline)
+{
+    VAProcPipelineCaps *caps = &f->pipeline;
+    const struct json *list;
+    int i;
+
+    if (!pipeline)
+        return;
+    f->has_pipeline = true;
+
+    caps->pipeline_flags = stub_flags(json_get(pipeline, "pipeline_flags"),
+                                      pipeline_flag_names,
+                                      ARRAY_LENGTH(pipeline_flag_names),
+                                      false);
+    caps->filter_flags = stub_flags(json_get(pipeline, "filter_flags"),
+                                    filter_flag_names,
+                                    ARRAY_LENGTH(filter_flag_names), false);
+    caps->num_forward_references =
+        json_number(pipeline, "num_forward_references", 0);
+    caps->num_backward_references =
+        json_number(pipeline, "num_backward_references", 0);
+
+    list = json_get(pipeline, "input_colour_standards");
+    for (i = 0; i < json_length(list) &&
+                i < ARRAY_LENGTH(f->input_colour_standards); i++)
+        f->input_colour_standards[i] =
+            json_number(&list->children[i], "type", 0);
+    caps->input_color_standards     = f->input_colour_standards;
+    caps->num_input_color_standards = i;
+
+    list = json_get(pipeline, "output_colour_standards");
+    for (i = 0; i < json_length(list) &&
+                i < ARRAY_LENGTH(f->output_colour_standards); i++)
+        f->output_colour_standards[i] =
+            json_number(&list->children[i], "type", 0);
+    caps->output_color_standards     = f->output_colour_standards;
+    caps->num_output_color_standards = i;
+
+#if LIBVA(2, 1, 0)
+    caps->rotation_flags = stub_flags(json_get(pipeline, "rotation_flags"),
+                                      rotation_names,
+                                      ARRAY_LENGTH(rotation_names), true);
+    caps->blend_flags = stub_flags(json_get(pipeline, "blend_flags"),
+                                   blend_names, ARRAY_LENGTH(blend_names),
+                                   true);
+    caps->mirror_flags = stub_flags(json_get(pipeline, "mirror_flags"),
+                                    mirror_names, ARRAY_LENGTH(mirror_names),
+                                    true);
+    caps->num_additional_outputs =
+        json_number(pipeline, "num_additional_outputs", 0);
+
+    list = json_get(pipeline, "input_pixel_formats");
+    for (i = 0; i < json_length(list) &&
+                i < ARRAY_LENGTH(f->input_pixel_formats); i++)
+        f->input_pixel_formats[i] = stub_fourcc(list->children[i].string ?
+                                                list->children[i].string : "");
+    caps->input_pixel_format      = f->input_pixel_formats;
+    caps->num_input_pixel_formats = i;
+
+    list = json_get(pipeline, "output_pixel_formats");
+    for (i = 0; i < json_length(list) &&
+                i < ARRAY_LENGTH(f->output_pixel_formats); i++)
+        f->output_pixel_formats[i] = stub_fourcc(list->children[i].string ?
+                                                 list->children[i].string : "");
+    caps->output_pixel_format      = f->output_pixel_formats;
+    caps->num_output_pixel_formats = i;
+
+#define SIZE(name) caps->name = json_number(pipeline, #name, 0)
+    SIZE(max_input_width);
+    SIZE(max_input_height);
+    SIZE(min_input_width);
+    SIZE(min_input_height);
+    SIZE(max_output_width);
+    SIZE(max_output_height);
+    SIZE(min_output_width);
+    SIZE(min_output_height);
+#undef SIZE
+#endif
+}
+
+static void stub_read_filters(struct stub_entrypoint *ep,
+                              const struct json *filters)
+{
+    int i, j;
+
+    ep->filters = calloc(json_length(filters), sizeof(*ep->filters));
+    if (!ep->filters)
+        return;
+
+    for (i = 0; i < json_length(filters); i++) {
+        const struct json *fj = &filters->children[i];
+        const struct json *types = json_get(fj, "types");
+        struct stub_filter *f = &ep->filters[ep->nb_filters++];
+        int nb_types = json_length(types);
+
+        if (nb_types > STUB_MAX_CAPS)
+            nb_types = STUB_MAX_CAPS;
+        f->type = json_number(fj, "filter", VAProcFilterNone);
+
+        switch (f->type) {
+        case VAProcFilterNone:
+            break;
+        case VAProcFilterDeinterlacing:
+            f->cap_size = sizeof(f->caps.deinterlacing[0]);
+            for (j = 0; j < nb_types; j++)
+                f->caps.deinterlacing[j].type =
+                    json_number(&types->children[j], "type", 0);
+            f->nb_caps = nb_types;
+            break;
+        case VAProcFilterColorBalance:
+            f->cap_size = sizeof(f->caps.colour_balance[0]);
+            for (j = 0; j < nb_types; j++) {
+                f->caps.colour_balance[j].type =
+                    json_number(&types->children[j], "type", 0);
+                f->caps.colour_balance[j].range =
+                    stub_range(&types->children[j]);
+            }
+            f->nb_caps = nb_types;
+            break;
+#if LIBVA(2, 1, 0)
+        case VAProcFilterTotalColorCorrection:
+            f->cap_size = sizeof(f->caps.colour_correction[0]);
+            for (j = 0; j < nb_types; j++) {
+                f->caps.colour_correction[j].type =
+                    json_number(&types->children[j], "type", 0);
+                f->caps.colour_correction[j].range =
+                    stub_range(&types->children[j]);
+            }
+            f->nb_caps = nb_types;
+            break;
+#endif
+#if LIBVA(2, 3, 0)
+        case VAProcFilterHVSNoiseReduction:
+            break;
+#endif
+#if LIBVA(2, 4, 0)
+        case VAProcFilterHighDynamicRangeToneMapping:
+            f->cap_size = sizeof(f->caps.hdr[0]);
+            for (j = 0; j < nb_types; j++) {
+                f->caps.hdr[j].metadata_type =
+                    json_number(&types->children[j], "type", 0);
+                f->caps.hdr[j].caps_flag =
+                    stub_flags(json_get(&types->children[j], "tone_mapping"),
+                               tone_mapping_names,
+                               ARRAY_LENGTH(tone_mapping_names), false);
+            }
+            f->nb_caps = nb_types;
+            break;
+#endif
+#if LIBVA(2, 12, 0)
+        case VAProcFilter3DLUT:
+            f->cap_size = sizeof(f->caps.lut[0]);
+            for (j = 0; j < nb_types; j++) {
+                const struct json *t = &types->children[j];
+                const struct json *stride = json_get(t, "lut_stride");
+                int k;
+                f->caps.lut[j].lut_size = json_number(t, "lut_size", 0);
+                for (k = 0; k < 3 && k < json_length(stride); k++)
+                    f->caps.lut[j].lut_stride[k] = stride->children[k].number;
+                f->caps.lut[j].bit_depth   = json_number(t, "bit_depth", 0);
+                f->caps.lut[j].num_channel = json_number(t, "num_channel", 0);
+                f->caps.lut[j].channel_mapping =
+                    stub_flags(json_get(t, "channel_mapping"),
+                               tdlut_channel_names,
+                               ARRAY_LENGTH(tdlut_channel_names), false);
+            }
+            f->nb_caps = nb_types;
+            break;
+#endif
+        default:
+            f->cap_size = sizeof(f->caps.range);
+            if (json_get(fj, "min_value")) {
+                f->caps.range.range = stub_range(fj);
+                f->nb_caps = 1;
+            }
+            break;
+        }
+
+        stub_read_pipeline(f, json_get(fj, "pipeline"));
+    }
+}
+
+static void stub_read_formats(const struct json *list, VAImageFormat **formats,
+                              unsigned int **flags, int *nb_formats)
+{
+    int i;
+
+    *formats = calloc(json_length(list) + 1, sizeof(**formats));
+    if (flags)
+        *flags = calloc(json_length(list) + 1, sizeof(**flags));
+    if (!*formats || (flags && !*flags))
+        return;
+
+    for (i = 0; i < json_length(list); i++) {
+        const struct json *f = &list->children[i];
+        const char *order = json_string(f, "byte_order");
+        const char *name = json_string(f, "pixel_format");
+        if (!name)
+            continue;
+        (*formats)[*nb_formats] = (VAImageFormat) {
+            .fourcc         = stub_fourcc(name),
+            .byte_order     = order && !strcmp(order, "BE") ? VA_MSB_FIRST
+                                                            : VA_LSB_FIRST,
+            .bits_per_pixel = json_number(f, "bits_per_pixel", 0),
+            .depth          = json_number(f, "depth",          0),
+            .red_mask       = json_number(f, "red_mask",       0),
+            .green_mask     = json_number(f, "green_mask",     0),
+            .blue_mask      = json_number(f, "blue_mask",      0),
+            .alpha_mask     = json_number(f, "alpha_mask",     0),
+        };
+        if (flags)
+            (*flags)[*nb_formats] =
+                stub_flags(json_get(f, "flags"), subpicture_flag_names,
+                           ARRAY_LENGTH(subpicture_flag_names), false);
+        ++*nb_formats;
+    }
+}
+
+static VAStatus stub_read_manifest(struct stub_driver *stub, const char *path)
+{
+    const struct json *profiles, *vendor;
+    struct json root;
+    char *data = NULL;
+    size_t size = 0, got;
+    const char *p;
+    FILE *file;
+    int i, j;
+
+    file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "vadumpcaps_stub: failed to open manifest %s: %s.\n",
+                path, strerror(errno));
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    do {
+        char *tmp = realloc(data, size + 65536 + 1);
+        if (!tmp) {
+            fclose(file);
+            free(data);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
+        data = tmp;
+        got = fread(data + size, 1, 65536, file);
+        size += got;
+    } while (got > 0);
+    fclose(file);
+    data[size] = 0;
+
+    // A file of several dumps describes the first.
+    p = data;
+    if (!json_parse_value(&p, &root) || root.type != JSON_OBJECT) {
+        fprintf(stderr, "vadumpcaps_stub: manifest %s is not a vadumpcaps "
+                "dump.\n", path);
+        json_free(&root);
+        free(data);
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+    free(data);
+
+    vendor = json_get(&root, "driver_vendor");
+    snprintf(stub->vendor, sizeof(stub->vendor), "%s",
+             vendor && vendor->type == JSON_STRING ? vendor->string
+                                                   : "vadumpcaps stub");
+
+    profiles = json_get(&root, "profiles");
+    for (i = 0; i < json_length(profiles) &&
+                stub->nb_profiles < STUB_MAX_PROFILES; i++) {
+        const struct json *pj = &profiles->children[i];
+        const struct json *entrypoints = json_get(pj, "entrypoints");
+        struct stub_profile *profile = &stub->profiles[stub->nb_profiles++];
+
+        profile->profile = json_number(pj, "profile", VAProfileNone);
+        for (j = 0; j < json_length(entrypoints) &&
+                    profile->nb_entrypoints < STUB_MAX_ENTRYPOINTS; j++) {
+            const struct json *ej = &entrypoints->children[j];
+            struct stub_entrypoint *ep =
+                &profile->entrypoints[profile->nb_entrypoints++];
+
+            ep->entrypoint = json_number(ej, "entrypoint", 0);
+            stub_read_attributes(ep, json_get(ej, "attributes"));
+            stub_read_surfaces(ep, json_get(ej, "surface_formats"));
+            stub_read_filters(ep, json_get(ej, "filters"));
+        }
+    }
+
+    stub_read_formats(json_get(&root, "image_formats"),
+                      &stub->image_formats, NULL, &stub->nb_image_formats);
+    stub_read_formats(json_get(&root, "subpicture_formats"),
+                      &stub->subpicture_formats, &stub->subpicture_flags,
+                      &stub->nb_subpicture_formats);
+
+    json_free(&root);
+    return VA_STATUS_SUCCESS;
+}
+
+
+/*
+ * Latency injection and call counting.
+ */
+
+#define STUB_CALLS(X) \
+    X(vaQueryConfigProfiles) \
+    X(vaQueryConfigEntrypoints) \
+    X(vaGetConfigAttributes) \
+    X(vaCreateConfig) \
+    X(vaDestroyConfig) \
+    X(vaQueryConfigAttributes) \
+    X(vaQuerySurfaceAttributes) \
+    X(vaCreateSurfaces) \
+    X(vaDestroySurfaces) \
+    X(vaCreateContext) \
+    X(vaDestroyContext) \
+    X(vaCreateBuffer) \
+    X(vaMapBuffer) \
+    X(vaUnmapBuffer) \
+    X(vaDestroyBuffer) \
+    X(vaBeginPicture) \
+    X(vaRenderPicture) \
+    X(vaEndPicture) \
+    X(vaSyncSurface) \
+    X(vaQueryImageFormats) \
+    X(vaCreateImage) \
+    X(vaDestroyImage) \
+    X(vaGetImage) \
+    X(vaPutImage) \
+    X(vaQuerySubpictureFormats) \
+    X(vaQueryVideoProcFilters) \
+    X(vaQueryVideoProcFilterCaps) \
+    X(vaQueryVideoProcPipelineCaps)
+
+enum {
+#define X(name) STUB_CALL_ ## name,
+    STUB_CALLS(X)
+#undef X
+    STUB_CALL_COUNT,
+};
+
+static const char *const stub_call_names[] = {
+#define X(name) #name,
+    STUB_CALLS(X)
+#undef X
+};
+
+// Shared by every display: libva gives no better place for them before
+// the first call.
+static long stub_latency_us[STUB_CALL_COUNT];
+static unsigned long stub_calls[STUB_CALL_COUNT];
+
+static void stub_read_latency(const char *spec)
+{
+    bool named[STUB_CALL_COUNT] = { false };
+    char name[64];
+    long us;
+    int i, len;
+
+    memset(stub_latency_us, 0, sizeof(stub_latency_us));
+    while (spec && *spec) {
+        if (sscanf(spec, " %63[^=, ] = %ld%n", name, &us, &len) != 2) {
+            fprintf(stderr, "vadumpcaps_stub: invalid latency at \"%s\".\n",
+                    spec);
+            return;
+        }
+        for (i = 0; i < STUB_CALL_COUNT; i++) {
+            if (!strcmp(name, stub_call_names[i])) {
+                stub_latency_us[i] = us;
+                named[i] = true;
+            } else if (!strcmp(name, "*") && !named[i]) {
+                stub_latency_us[i] = us;
+            }
+        }
+        spec += len;
+        while (*spec == ',' || *spec == ' ')
+            ++spec;
+    }
+}
+
+// Entry points called by other entry points (images are made of
+// buffers), so only the outermost call of each thread is counted and
+// delayed.
+static __thread int stub_depth;
+
+// Calls may come from several threads, so each holds the driver lock
+// until it returns.  The lock is taken after the delay, so that delays in
+// different threads still overlap.
+static pthread_mutex_t *stub_enter(VADriverContextP ctx, int call)
+{
+    struct timespec ts;
+    long us = stub_depth ? 0 : stub_latency_us[call];
+    if (!stub_depth++)
+        __atomic_add_fetch(&stub_calls[call], 1, __ATOMIC_RELAXED);
+    if (us > 0) {
+        ts.tv_sec  = us / 1000000;
+        ts.tv_nsec = us % 1000000 * 1000;
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+    }
+    pthread_mutex_lock(&STUB(ctx)->lock);
+    return &STUB(ctx)->lock;
+}
+
+static void stub_leave(pthread_mutex_t **lock)
+{
+    pthread_mutex_unlock(*lock);
+    --stub_depth;
+}
+
+#define STUB_ENTER(ctx, call) \
+    pthread_mutex_t *stub_lock __attribute__((cleanup(stub_leave))) = \
+        stub_enter(ctx, STUB_CALL_ ## call)
+
+static void stub_write_calls(const char *path)
+{
+    const char *sep = "";
+    FILE *file;
+    int i;
+
+    if (!path)
+        return;
+    file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "vadumpcaps_stub: failed to open %s: %s.\n",
+                path, strerror(errno));
+        return;
+    }
+    fputc('{', file);
+    for (i = 0; i < STUB_CALL_COUNT; i++) {
+        if (!stub_calls[i])
+            continue;
+        fprintf(file, "%s\"%s\":%lu", sep, stub_call_names[i], stub_calls[i]);
+        sep = ",";
+    }
+    fputs("}\n", file);
+    fclose(file);
+}
+
+
+/*
+ * Driver entry points.
+ */
+
+static const struct stub_entrypoint *stub_find(const struct stub_driver *stub,
+                                               VAProfile profile,
+                                               VAEntrypoint entrypoint,
+                                               VAStatus *status)
+{
+    int i, j;
+    for (i = 0; i < stub->nb_profiles; i++) {
+        const struct stub_profile *p = &stub->profiles[i];
+        if (p->profile != profile)
+            continue;
+        for (j = 0; j < p->nb_entrypoints; j++) {
+            if (p->entrypoints[j].entrypoint == entrypoint)
+                return &p->entrypoints[j];
+        }
+        *status = VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
+        return NULL;
+    }
+    *status = VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+    return NULL;
+}
+
+static const struct stub_config *stub_config(const struct stub_driver *stub,
+                                             VAConfigID config)
+{
+    if (config < 1 || config > stub->nb_configs ||
+        !stub->configs[config - 1].rt_format)
+        return NULL;
+    return &stub->configs[config - 1];
+}
+
+static const struct stub_config *stub_context(const struct stub_driver *stub,
+                                              VAContextID context)
+{
+    if (context < 1 || context > stub->nb_contexts)
+        return NULL;
+    return stub_config(stub, stub->contexts[context - 1].config);
+}
+
+static struct stub_buffer *stub_buffer(struct stub_driver *stub,
+                                       VABufferID buffer)
+{
+    if (buffer < 1 || buffer > stub->nb_buffers ||
+        !stub->buffers[buffer - 1].data)
+        return NULL;
+    return &stub->buffers[buffer - 1];
+}
+
+static uint32_t stub_attrib_value(const struct stub_entrypoint *ep,
+                                  VAConfigAttribType type)
+{
+    int i;
+    for (i = 0; i < ep->nb_attribs; i++) {
+        if (ep->attribs[i].type == type)
+            return ep->attribs[i].value;
+    }
+    return VA_ATTRIB_NOT_SUPPORTED;
+}
+
+static VAStatus stub_QueryConfigProfiles(VADriverContextP ctx,
+                                         VAProfile *profile_list,
+                                         int *num_profiles)
+{
+    const struct stub_driver *stub = STUB(ctx);
+    int i;
+    STUB_ENTER(ctx, vaQueryConfigProfiles);
+    for (i = 0; i < stub->nb_profiles; i++)
+        profile_list[i] = stub->profiles[i].profile;
+    *num_profiles = stub->nb_profiles;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_QueryConfigEntrypoints(VADriverContextP ctx,
+                                            VAProfile profile,
+                                            VAEntrypoint *entrypoint_list,
+                                            int *num_entrypoints)
+{
+    const struct stub_driver *stub = STUB(ctx);
+    int i, j;
+    STUB_ENTER(ctx, vaQueryConfigEntrypoints);
+    for (i = 0; i < stub->nb_profiles; i++) {
+        const struct stub_profile *p = &stub->profiles[i];
+        if (p->profile != profile)
+            continue;
+        for (j = 0; j < p->nb_entrypoints; j++)
+            entrypoint_list[j] = p->entrypoints[j].entrypoint;
+        *num_entrypoints = p->nb_entrypoints;
+        return VA_STATUS_SUCCESS;
+    }
+    return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
+}
+
+static VAStatus stub_GetConfigAttributes(VADriverContextP ctx,
+                                         VAProfile profile,
+                                         VAEntrypoint entrypoint,
+                                         VAConfigAttrib *attrib_list,
+                                         int num_attribs)
+{
+    const struct stub_entrypoint *ep;
+    VAStatus status;
+    int i;
+
+    STUB_ENTER(ctx, vaGetConfigAttributes);
+    ep = stub_find(STUB(ctx), profile, entrypoint, &status);
+    if (!ep)
+        return status;
+    for (i = 0; i < num_attribs; i++)
+        attrib_list[i].value = stub_attrib_value(ep, attrib_list[i].type);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_CreateConfig(VADriverContextP ctx, VAProfile profile,
+                                  VAEntrypoint entrypoint,
+                                  VAConfigAttrib *attrib_list,
+                                  int num_attribs, VAConfigID *config_id)
+{
+    struct stub_driver *stub = STUB(ctx);
+    const struct stub_entrypoint *ep;
+    struct stub_config *configs;
+    unsigned int rt_formats, rt_format;
+    VAStatus status;
+    int i;
+
+    STUB_ENTER(ctx, vaCreateConfig);
+    ep = stub_find(stub, profile, entrypoint, &status);
+    if (!ep)
+        return status;
+
+    rt_formats = stub_attrib_value(ep, VAConfigAttribRTFormat);
+    if (rt_formats == VA_ATTRIB_NOT_SUPPORTED)
+        rt_formats = VA_RT_FORMAT_YUV420;
+    rt_format = rt_formats & -rt_formats;
+    for (i = 0; i < num_attribs; i++) {
+        if (attrib_list[i].type != VAConfigAttribRTFormat)
+            continue;
+        if (!(attrib_list[i].value & rt_formats))
+            return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
+        rt_format = attrib_list[i].value & rt_formats;
+    }
+
+    configs = realloc(stub->configs, (stub->nb_configs + 1) *
+                      sizeof(*configs));
+    if (!configs)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    stub->configs = configs;
+    configs[stub->nb_configs++] = (struct stub_config) {
+        .profile    = profile,
+        .entrypoint = entrypoint,
+        .rt_format  = rt_format,
+    };
+    *config_id = stub->nb_configs;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_DestroyConfig(VADriverContextP ctx, VAConfigID config_id)
+{
+    struct stub_driver *stub = STUB(ctx);
+    STUB_ENTER(ctx, vaDestroyConfig);
+    if (!stub_config(stub, config_id))
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    stub->configs[config_id - 1].rt_format = 0;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_QueryConfigAttributes(VADriverContextP ctx,
+                                           VAConfigID config_id,
+                                           VAProfile *profile,
+                                           VAEntrypoint *entrypoint,
+                                           VAConfigAttrib *attrib_list,
+                                           int *num_attribs)
+{
+    STUB_ENTER(ctx, vaQueryConfigAttributes);
+    const struct stub_config *config = stub_config(STUB(ctx), config_id);
+    if (!config)
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    *profile    = config->profile;
+    *entrypoint = config->entrypoint;
+    attrib_list[0] = (VAConfigAttrib) {
+        .type  = VAConfigAttribRTFormat,
+        .value = config->rt_format,
+    };
+    *num_attribs = 1;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_QuerySurfaceAttributes(VADriverContextP ctx,
+                                            VAConfigID config_id,
+                                            VASurfaceAttrib *attrib_list,
+                                            unsigned int *num_attribs)
+{
+    const struct stub_driver *stub = STUB(ctx);
+    const struct stub_config *config = stub_config(stub, config_id);
+    const struct stub_entrypoint *ep;
+    const struct stub_surface *s = NULL;
+    VAStatus status;
+    int i;
+
+    STUB_ENTER(ctx, vaQuerySurfaceAttributes);
+    if (!config)
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    ep = stub_find(stub, config->profile, config->entrypoint, &status);
+    if (!ep)
+        return status;
+    for (i = 0; i < ep->nb_surfaces; i++) {
+        if (ep->surfaces[i].rt_format == config->rt_format)
+            s = &ep->surfaces[i];
+    }
+
+    if (!attrib_list) {
+        *num_attribs = s ? s->nb_attribs : 0;
+        return VA_STATUS_SUCCESS;
+    }
+    if (s && *num_attribs < s->nb_attribs) {
+        *num_attribs = s->nb_attribs;
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+    }
+    if (s)
+        memcpy(attrib_list, s->attribs, s->nb_attribs * sizeof(*s->attribs));
+    *num_attribs = s ? s->nb_attribs : 0;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_CreateSurfaces2(VADriverContextP ctx, unsigned int format,
+                                     unsigned int width, unsigned int height,
+                                     VASurfaceID *surfaces,
+                                     unsigned int num_surfaces,
+                                     VASurfaceAttrib *attrib_list,
+                                     unsigned int num_attribs)
+{
+    struct stub_driver *stub = STUB(ctx);
+    unsigned int i;
+    STUB_ENTER(ctx, vaCreateSurfaces);
+    for (i = 0; i < num_surfaces; i++)
+        surfaces[i] = ++stub->next_surface;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_CreateSurfaces(VADriverContextP ctx, int width,
+                                    int height, int format, int num_surfaces,
+                                    VASurfaceID *surfaces)
+{
+    return stub_CreateSurfaces2(ctx, format, width, height, surfaces,
+                                num_surfaces, NULL, 0);
+}
+
+static VAStatus stub_DestroySurfaces(VADriverContextP ctx,
+                                     VASurfaceID *surface_list,
+                                     int num_surfaces)
+{
+    STUB_ENTER(ctx, vaDestroySurfaces);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_CreateContext(VADriverContextP ctx, VAConfigID config_id,
+                                   int picture_width, int picture_height,
+                                   int flag, VASurfaceID *render_targets,
+                                   int num_render_targets,
+                                   VAContextID *context)
+{
+    struct stub_driver *stub = STUB(ctx);
+    struct stub_context *contexts;
+
+    STUB_ENTER(ctx, vaCreateContext);
+    if (!stub_config(stub, config_id))
+        return VA_STATUS_ERROR_INVALID_CONFIG;
+    contexts = realloc(stub->contexts, (stub->nb_contexts + 1) *
+                       sizeof(*contexts));
+    if (!contexts)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    stub->contexts = contexts;
+    contexts[stub->nb_contexts++] = (struct stub_context) {
+        .config = config_id,
+    };
+    *context = stub->nb_contexts;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_DestroyContext(VADriverContextP ctx, VAContextID context)
+{
+    struct stub_driver *stub = STUB(ctx);
+    STUB_ENTER(ctx, vaDestroyContext);
+    if (!stub_context(stub, context))
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    stub->contexts[context - 1].config = 0;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_CreateBuffer(VADriverContextP ctx, VAContextID context,
+                                  VABufferType type, unsigned int size,
+                                  unsigned int num_elements, void *data,
+                                  VABufferID *buf_id)
+{
+    struct stub_driver *stub = STUB(ctx);
+    struct stub_buffer *buffers, *buffer;
+    size_t total = (size_t)size * num_elements;
+
+    STUB_ENTER(ctx, vaCreateBuffer);
+    buffers = realloc(stub->buffers, (stub->nb_buffers + 1) *
+                      sizeof(*buffers));
+    if (!buffers)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    stub->buffers = buffers;
+    buffer = &buffers[stub->nb_buffers];
+    *buffer = (struct stub_buffer) {
+        .type = type,
+        .size = total,
+        .data = calloc(1, total ? total : 1),
+    };
+    if (!buffer->data)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    if (data)
+        memcpy(buffer->data, data, total);
+    *buf_id = ++stub->nb_buffers;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_BufferSetNumElements(VADriverContextP ctx,
+                                          VABufferID buf_id,
+                                          unsigned int num_elements)
+{
+    return stub_buffer(STUB(ctx), buf_id) ? VA_STATUS_SUCCESS
+                                          : VA_STATUS_ERROR_INVALID_BUFFER;
+}
+
+// Coded buffers map to a segment claiming an eighth of the buffer, as
+// though everything were compressed at the same rate, unless an H.264
+// encode wrote to them.
+static VAStatus stub_MapBuffer(VADriverContextP ctx, VABufferID buf_id,
+                               void **pbuf)
+{
+    STUB_ENTER(ctx, vaMapBuffer);
+    struct stub_buffer *buffer = stub_buffer(STUB(ctx), buf_id);
+    if (!buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    if (buffer->type == VAEncCodedBufferType) {
+        buffer->segment = (VACodedBufferSegment) {
+            .size = buffer->used ? buffer->used : buffer->size / 8,
+            .buf  = buffer->data,
+        };
+        *pbuf = &buffer->segment;
+    } else {
+        *pbuf = buffer->data;
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_UnmapBuffer(VADriverContextP ctx, VABufferID buf_id)
+{
+    STUB_ENTER(ctx, vaUnmapBuffer);
+    return stub_buffer(STUB(ctx), buf_id) ? VA_STATUS_SUCCESS
+                                          : VA_STATUS_ERROR_INVALID_BUFFER;
+}
+
+static VAStatus stub_DestroyBuffer(VADriverContextP ctx, VABufferID buf_id)
+{
+    STUB_ENTER(ctx, vaDestroyBuffer);
+    struct stub_buffer *buffer = stub_buffer(STUB(ctx), buf_id);
+    if (!buffer)
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    free(buffer->data);
+    buffer->data = NULL;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_BeginPicture(VADriverContextP ctx, VAContextID context,
+                                  VASurfaceID render_target)
+{
+    STUB_ENTER(ctx, vaBeginPicture);
+    return stub_context(STUB(ctx), context) ? VA_STATUS_SUCCESS
+                                            : VA_STATUS_ERROR_INVALID_CONTEXT;
+}
+
+static VAStatus stub_RenderPicture(VADriverContextP ctx, VAContextID context,
+                                   VABufferID *buffers, int num_buffers)
+{
+    struct stub_driver *stub = STUB(ctx);
+    struct stub_context *c;
+    int i;
+
+    STUB_ENTER(ctx, vaRenderPicture);
+    if (!stub_context(stub, context))
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    c = &stub->contexts[context - 1];
+
+    for (i = 0; i < num_buffers; i++) {
+        struct stub_buffer *buffer = stub_buffer(stub, buffers[i]);
+        if (!buffer)
+            return VA_STATUS_ERROR_INVALID_BUFFER;
+        if (buffer->type == VAEncSequenceParameterBufferType &&
+            buffer->size == sizeof(c->sequence)) {
+            memcpy(&c->sequence, buffer->data, sizeof(c->sequence));
+            c->have_sequence = true;
+        } else if (buffer->type == VAEncPictureParameterBufferType &&
+                   buffer->size == sizeof(c->picture)) {
+            memcpy(&c->picture, buffer->data, sizeof(c->picture));
+            c->have_picture = true;
+        } else if (buffer->type == VAEncSliceParameterBufferType &&
+                   buffer->size == sizeof(c->slice)) {
+            memcpy(&c->slice, buffer->data, sizeof(c->slice));
+        }
+    }
+    return VA_STATUS_SUCCESS;
+}
+
+struct stub_bits {
+    uint8_t data[256];
+    size_t pos;
+};
+
+static void stub_put(struct stub_bits *b, uint32_t value, int bits)
+{
+    for (bits--; bits >= 0; bits--, b->pos++) {
+        if (b->pos < 8 * sizeof(b->data) && value >> bits & 1)
+            b->data[b->pos / 8] |= 0x80 >> b->pos % 8;
+    }
+}
+
+static void stub_put_ue(struct stub_bits *b, uint32_t value)
+{
+    int bits = 32 - __builtin_clz(value + 1);
+    stub_put(b, 0, bits - 1);
+    stub_put(b, value + 1, bits);
+}
+
+static void stub_put_se(struct stub_bits *b, int32_t value)
+{
+    stub_put_ue(b, value > 0 ? 2 * value - 1 : -2 * value);
+}
+
+static void stub_put_trailing(struct stub_bits *b)
+{
+    stub_put(b, 1, 1);
+    while (b->pos % 8)
+        stub_put(b, 0, 1);
+}
+
+// Writes the bits as a NAL unit with a start code and emulation
+// prevention, returning its size or zero if there is not room.
+static size_t stub_put_nal(uint8_t *dst, size_t space,
+                           const struct stub_bits *b)
+{
+    size_t i, n = 0, size = (b->pos + 7) / 8;
+    int zeros = 0;
+
+    if (space < 4 + 3 * size / 2 + 1)
+        return 0;
+    memcpy(dst, "\0\0\0\1", 4);
+    n = 4;
+    for (i = 0; i < size; i++) {
+        if (zeros == 2 && b->data[i] <= 3) {
+            dst[n++] = 3;
+            zeros = 0;
+        }
+        dst[n++] = b->data[i];
+        zeros = b->data[i] ? 0 : zeros + 1;
+    }
+    return n;
+}
+
+// Writes the SPS and PPS (on IDR frames) and slice header for the
+// picture, then fills the rest of an eighth of the coded buffer.
+static void stub_write_h264(struct stub_driver *stub, struct stub_context *c,
+                            VAProfile profile)
+{
+    const VAEncSequenceParameterBufferH264 *seq = &c->sequence;
+    const VAEncPictureParameterBufferH264  *pic = &c->picture;
+    const VAEncSliceParameterBufferH264    *slice = &c->slice;
+    struct stub_buffer *coded = stub_buffer(stub, pic->coded_buf);
+    int frame_num_bits = seq->seq_fields.bits.log2_max_frame_num_minus4 + 4;
+    int poc_bits = seq->seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4 + 4;
+    bool cabac = pic->pic_fields.bits.entropy_coding_mode_flag;
+    bool idr = pic->pic_fields.bits.idr_pic_flag;
+    int ref_idc = pic->pic_fields.bits.reference_pic_flag || idr ? 3 : 0;
+    uint8_t *data;
+    size_t pos = 0, target;
+    struct stub_bits b;
+
+    if (!coded || coded->type != VAEncCodedBufferType || !c->have_sequence)
+        return;
+    data = coded->data;
+
+    if (idr) {
+        memset(&b, 0, sizeof(b));
+        stub_put(&b, 0x67, 8);
+        stub_put(&b, profile == VAProfileH264High ? 100 :
+                     profile == VAProfileH264Main ? 77 : 66, 8);
+        stub_put(&b, profile == VAProfileH264ConstrainedBaseline ? 0x40 : 0,
+                 8);
+        stub_put(&b, seq->level_idc, 8);
+        stub_put_ue(&b, 0);
+        if (profile == VAProfileH264High) {
+            stub_put_ue(&b, 1);
+            stub_put_ue(&b, 0);
+            stub_put_ue(&b, 0);
+            stub_put(&b, 0, 2);
+        }
+        stub_put_ue(&b, seq->seq_fields.bits.log2_max_frame_num_minus4);
+        stub_put_ue(&b, 0);
+        stub_put_ue(&b, seq->seq_fields.bits.log2_max_pic_order_cnt_lsb_minus4);
+        stub_put_ue(&b, seq->max_num_ref_frames);
+        stub_put(&b, 0, 1);
+        stub_put_ue(&b, seq->picture_width_in_mbs - 1);
+        stub_put_ue(&b, seq->picture_height_in_mbs - 1);
+        stub_put(&b, 1, 1);
+        stub_put(&b, seq->seq_fields.bits.direct_8x8_inference_flag, 1);
+        stub_put(&b, seq->frame_cropping_flag, 1);
+        if (seq->frame_cropping_flag) {
+            stub_put_ue(&b, seq->frame_crop_left_offset);
+            stub_put_ue(&b, seq->frame_crop_right_offset);
+            stub_put_ue(&b, seq->frame_crop_top_offset);
+            stub_put_ue(&b, seq->frame_crop_bottom_offset);
+        }
+        stub_put(&b, 0, 1);
+        stub_put_trailing(&b);
+        pos += stub_put_nal(data + pos, coded->size - pos, &b);
+
+        memset(&b, 0, sizeof(b));
+        stub_put(&b, 0x68, 8);
+        stub_put_ue(&b, 0);
+        stub_put_ue(&b, 0);
+        stub_put(&b, cabac, 1);
+        stub_put(&b, 0, 1);
+        stub_put_ue(&b, 0);
+        stub_put_ue(&b, pic->num_ref_idx_l0_active_minus1);
+        stub_put_ue(&b, pic->num_ref_idx_l1_active_minus1);
+        stub_put(&b, 0, 3);
+        stub_put_se(&b, pic->pic_init_qp - 26);
+        stub_put_se(&b, 0);
+        stub_put_se(&b, pic->chroma_qp_index_offset);
+        stub_put(&b, pic->pic_fields.bits.deblocking_filter_control_present_flag,
+                 1);
+        stub_put(&b, 0, 2);
+        if (pic->pic_fields.bits.transform_8x8_mode_flag) {
+            stub_put(&b, 1, 1);
+            stub_put(&b, 0, 1);
+            stub_put_se(&b, pic->second_chroma_qp_index_offset);
+        }
+        stub_put_trailing(&b);
+        pos += stub_put_nal(data + pos, coded->size - pos, &b);
+    }
+
+    memset(&b, 0, sizeof(b));
+    stub_put(&b, 0, 1);
+    stub_put(&b, ref_idc, 2);
+    stub_put(&b, idr ? 5 : 1, 5);
+    stub_put_ue(&b, slice->macroblock_address);
+    stub_put_ue(&b, slice->slice_type);
+    stub_put_ue(&b, 0);
+    stub_put(&b, pic->frame_num, frame_num_bits);
+    if (idr)
+        stub_put_ue(&b, slice->idr_pic_id);
+    stub_put(&b, slice->pic_order_cnt_lsb, poc_bits);
+    if (slice->slice_type == 0)
+        stub_put(&b, 0, 2);
+    if (ref_idc)
+        stub_put(&b, 0, idr ? 2 : 1);
+    if (cabac && slice->slice_type != 2)
+        stub_put_ue(&b, slice->cabac_init_idc);
+    stub_put_se(&b, slice->slice_qp_delta);
+    if (pic->pic_fields.bits.deblocking_filter_control_present_flag) {
+        stub_put_ue(&b, slice->disable_deblocking_filter_idc);
+        if (slice->disable_deblocking_filter_idc != 1) {
+            stub_put_se(&b, slice->slice_alpha_c0_offset_div2);
+            stub_put_se(&b, slice->slice_beta_offset_div2);
+        }
+    }
+    while (b.pos % 8)
+        stub_put(&b, 1, 1);
+    pos += stub_put_nal(data + pos, coded->size - pos, &b);
+
+    target = coded->size / 8;
+    if (pos < target && pos < coded->size) {
+        memset(data + pos, 0xaa, target - pos - 1);
+        data[target - 1] = 0x80;
+        pos = target;
+    }
+    coded->used = pos;
+}
+
+static VAStatus stub_EndPicture(VADriverContextP ctx, VAContextID context)
+{
+    struct stub_driver *stub = STUB(ctx);
+    const struct stub_config *config;
+    struct stub_context *c;
+
+    STUB_ENTER(ctx, vaEndPicture);
+    config = stub_context(stub, context);
+    if (!config)
+        return VA_STATUS_ERROR_INVALID_CONTEXT;
+    c = &stub->contexts[context - 1];
+
+    if (c->have_picture &&
+        (config->profile == VAProfileH264ConstrainedBaseline ||
+         config->profile == VAProfileH264Main ||
+         config->profile == VAProfileH264High))
+        stub_write_h264(stub, c, config->profile);
+    c->have_picture = false;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_SyncSurface(VADriverContextP ctx,
+                                 VASurfaceID render_target)
+{
+    STUB_ENTER(ctx, vaSyncSurface);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_QuerySurfaceStatus(VADriverContextP ctx,
+                                        VASurfaceID render_target,
+                                        VASurfaceStatus *status)
+{
+    *status = VASurfaceReady;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_PutSurface(VADriverContextP ctx, VASurfaceID surface,
+                                void *draw, short srcx, short srcy,
+                                unsigned short srcw, unsigned short srch,
+                                short destx, short desty,
+                                unsigned short destw, unsigned short desth,
+                                VARectangle *cliprects,
+                                unsigned int number_cliprects,
+                                unsigned int flags)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_QueryImageFormats(VADriverContextP ctx,
+                                       VAImageFormat *format_list,
+                                       int *num_formats)
+{
+    const struct stub_driver *stub = STUB(ctx);
+    STUB_ENTER(ctx, vaQueryImageFormats);
+    memcpy(format_list, stub->image_formats,
+           stub->nb_image_formats * sizeof(*format_list));
+    *num_formats = stub->nb_image_formats;
+    return VA_STATUS_SUCCESS;
+}
+
+// Images are single allocations with planes laid out as for 4:2:0 if the
+// format has fewer than 16 bits per pixel, and packed otherwise.
+static VAStatus stub_CreateImage(VADriverContextP ctx, VAImageFormat *format,
+                                 int width, int height, VAImage *image)
+{
+    struct stub_driver *stub = STUB(ctx);
+    struct stub_image *images;
+    unsigned int bytes, pitch;
+    VAStatus status;
+
+    STUB_ENTER(ctx, vaCreateImage);
+    if (width <= 0 || height <= 0 || !format->bits_per_pixel)
+        return VA_STATUS_ERROR_INVALID_PARAMETER;
+
+    *image = (VAImage) {
+        .format = *format,
+        .width  = width,
+        .height = height,
+    };
+    if (format->bits_per_pixel < 16) {
+        bytes = format->bits_per_pixel > 12 ? 2 : 1;
+        pitch = bytes * width;
+        image->num_planes = 2;
+        image->pitches[0] = image->pitches[1] = pitch;
+        image->offsets[1] = pitch * height;
+        image->data_size  = pitch * height + pitch * ((height + 1) / 2);
+    } else {
+        pitch = (format->bits_per_pixel + 7) / 8 * width;
+        image->num_planes = 1;
+        image->pitches[0] = pitch;
+        image->data_size  = pitch * height;
+    }
+
+    status = stub_CreateBuffer(ctx, 0, VAImageBufferType, image->data_size,
+                               1, NULL, &image->buf);
+    if (status != VA_STATUS_SUCCESS)
+        return status;
+
+    images = realloc(stub->images, (stub->nb_images + 1) * sizeof(*images));
+    if (!images)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    stub->images = images;
+    image->image_id = ++stub->nb_images;
+    images[image->image_id - 1].image = *image;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_DeriveImage(VADriverContextP ctx, VASurfaceID surface,
+                                 VAImage *image)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_DestroyImage(VADriverContextP ctx, VAImageID image)
+{
+    struct stub_driver *stub = STUB(ctx);
+    STUB_ENTER(ctx, vaDestroyImage);
+    if (image < 1 || image > stub->nb_images ||
+        !stub->images[image - 1].image.image_id)
+        return VA_STATUS_ERROR_INVALID_IMAGE;
+    stub->images[image - 1].image.image_id = 0;
+    return stub_DestroyBuffer(ctx, stub->images[image - 1].image.buf);
+}
+
+static VAStatus stub_SetImagePalette(VADriverContextP ctx, VAImageID image,
+                                     unsigned char *palette)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_GetImage(VADriverContextP ctx, VASurfaceID surface,
+                              int x, int y, unsigned int width,
+                              unsigned int height, VAImageID image)
+{
+    STUB_ENTER(ctx, vaGetImage);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_PutImage(VADriverContextP ctx, VASurfaceID surface,
+                              VAImageID image, int src_x, int src_y,
+                              unsigned int src_width, unsigned int src_height,
+                              int dest_x, int dest_y, unsigned int dest_width,
+                              unsigned int dest_height)
+{
+    STUB_ENTER(ctx, vaPutImage);
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_QuerySubpictureFormats(VADriverContextP ctx,
+                                            VAImageFormat *format_list,
+                                            unsigned int *flags,
+                                            unsigned int *num_formats)
+{
+    const struct stub_driver *stub = STUB(ctx);
+    STUB_ENTER(ctx, vaQuerySubpictureFormats);
+    memcpy(format_list, stub->subpicture_formats,
+           stub->nb_subpicture_formats * sizeof(*format_list));
+    if (flags)
+        memcpy(flags, stub->subpicture_flags,
+               stub->nb_subpicture_formats * sizeof(*flags));
+    *num_formats = stub->nb_subpicture_formats;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_CreateSubpicture(VADriverContextP ctx, VAImageID image,
+                                      VASubpictureID *subpicture)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_DestroySubpicture(VADriverContextP ctx,
+                                       VASubpictureID subpicture)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_SetSubpictureImage(VADriverContextP ctx,
+                                        VASubpictureID subpicture,
+                                        VAImageID image)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_SetSubpictureChromakey(VADriverContextP ctx,
+                                            VASubpictureID subpicture,
+                                            unsigned int chromakey_min,
+                                            unsigned int chromakey_max,
+                                            unsigned int chromakey_mask)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_SetSubpictureGlobalAlpha(VADriverContextP ctx,
+                                              VASubpictureID subpicture,
+                                              float global_alpha)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_AssociateSubpicture(VADriverContextP ctx,
+                                         VASubpictureID subpicture,
+                                         VASurfaceID *target_surfaces,
+                                         int num_surfaces,
+                                         short src_x, short src_y,
+                                         unsigned short src_width,
+                                         unsigned short src_height,
+                                         short dest_x, short dest_y,
+                                         unsigned short dest_width,
+                                         unsigned short dest_height,
+                                         unsigned int flags)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_DeassociateSubpicture(VADriverContextP ctx,
+                                           VASubpictureID subpicture,
+                                           VASurfaceID *target_surfaces,
+                                           int num_surfaces)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_QueryDisplayAttributes(VADriverContextP ctx,
+                                            VADisplayAttribute *attr_list,
+                                            int *num_attributes)
+{
+    *num_attributes = 0;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_GetDisplayAttributes(VADriverContextP ctx,
+                                          VADisplayAttribute *attr_list,
+                                          int num_attributes)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static VAStatus stub_SetDisplayAttributes(VADriverContextP ctx,
+                                          VADisplayAttribute *attr_list,
+                                          int num_attributes)
+{
+    return VA_STATUS_ERROR_UNIMPLEMENTED;
+}
+
+static const struct stub_entrypoint *stub_vpp(VADriverContextP ctx,
+                                              VAContextID context,
+                                              VAStatus *status)
+{
+    const struct stub_driver *stub = STUB(ctx);
+    const struct stub_config *config = stub_context(stub, context);
+    if (!config) {
+        *status = VA_STATUS_ERROR_INVALID_CONTEXT;
+        return NULL;
+    }
+    return stub_find(stub, config->profile, config->entrypoint, status);
+}
+
+static const struct stub_filter *stub_filter(const struct stub_entrypoint *ep,
+                                             VAProcFilterType type)
+{
+    int i;
+    for (i = 0; i < ep->nb_filters; i++) {
+        if (ep->filters[i].type == type)
+            return &ep->filters[i];
+    }
+    return NULL;
+}
+
+static VAStatus stub_QueryVideoProcFilters(VADriverContextP ctx,
+                                           VAContextID context,
+                                           VAProcFilterType *filters,
+                                           unsigned int *num_filters)
+{
+    const struct stub_entrypoint *ep;
+    unsigned int i, count = 0;
+    VAStatus status;
+
+    STUB_ENTER(ctx, vaQueryVideoProcFilters);
+    if (!(ep = stub_vpp(ctx, context, &status)))
+        return status;
+    // vadumpcaps writes the pipeline without filters as filter None.
+    for (i = 0; i < ep->nb_filters; i++) {
+        if (ep->filters[i].type == VAProcFilterNone)
+            continue;
+        if (count >= *num_filters)
+            return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+        filters[count++] = ep->filters[i].type;
+    }
+    *num_filters = count;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_QueryVideoProcFilterCaps(VADriverContextP ctx,
+                                              VAContextID context,
+                                              VAProcFilterType type,
+                                              void *filter_caps,
+                                              unsigned int *num_filter_caps)
+{
+    const struct stub_entrypoint *ep;
+    const struct stub_filter *f;
+    VAStatus status;
+
+    STUB_ENTER(ctx, vaQueryVideoProcFilterCaps);
+    if (!(ep = stub_vpp(ctx, context, &status)))
+        return status;
+    if (!(f = stub_filter(ep, type)))
+        return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+    if (*num_filter_caps < f->nb_caps) {
+        *num_filter_caps = f->nb_caps;
+        return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+    }
+    memcpy(filter_caps, &f->caps, f->nb_caps * f->cap_size);
+    *num_filter_caps = f->nb_caps;
+    return VA_STATUS_SUCCESS;
+}
+
+// Arrays in the pipeline caps are copied if the caller supplied space for
+// them, and otherwise point at the driver's own copy.
+static void stub_copy_list(void *dst_list, uint32_t *dst_count,
+                           const void *src_list, uint32_t src_count,
+                           size_t element_size)
+{
+    void **dst = dst_list;
+    if (*dst) {
+        if (src_count > *dst_count)
+            src_count = *dst_count;
+        memcpy(*dst, src_list, src_count * element_size);
+    } else {
+        *dst = (void*)src_list;
+    }
+    *dst_count = src_count;
+}
+
+static VAStatus stub_QueryVideoProcPipelineCaps(VADriverContextP ctx,
+                                                VAContextID context,
+                                                VABufferID *filters,
+                                                unsigned int num_filters,
+                                                VAProcPipelineCaps *caps)
+{
+    const struct stub_entrypoint *ep;
+    const struct stub_filter *f = NULL, *other;
+    VAProcFilterType type;
+    VAProcPipelineCaps out;
+    VAStatus status;
+    unsigned int i;
+
+    STUB_ENTER(ctx, vaQueryVideoProcPipelineCaps);
+    if (!(ep = stub_vpp(ctx, context, &status)))
+        return status;
+
+    // A chain works only if every filter in it does.  The caps are those
+    // of the first filter, needing as many references as any of them.
+    for (i = 0; i < (num_filters ? num_filters : 1); i++) {
+        type = VAProcFilterNone;
+        if (num_filters > 0) {
+            const struct stub_buffer *buffer = stub_buffer(STUB(ctx),
+                                                           filters[i]);
+            if (!buffer || buffer->size < sizeof(VAProcFilterType))
+                return VA_STATUS_ERROR_INVALID_BUFFER;
+            type = *(const VAProcFilterType*)buffer->data;
+        }
+        if (!(other = stub_filter(ep, type)) || !other->has_pipeline)
+            return VA_STATUS_ERROR_UNSUPPORTED_FILTER;
+        if (!f) {
+            f   = other;
+            out = f->pipeline;
+        }
+        if (other->pipeline.num_forward_references >
+            out.num_forward_references)
+            out.num_forward_references =
+                other->pipeline.num_forward_references;
+        if (other->pipeline.num_backward_references >
+            out.num_backward_references)
+            out.num_backward_references =
+                other->pipeline.num_backward_references;
+    }
+
+    out.input_color_standards      = caps->input_color_standards;
+    out.num_input_color_standards  = caps->num_input_color_standards;
+    out.output_color_standards     = caps->output_color_standards;
+    out.num_output_color_standards = caps->num_output_color_standards;
+    stub_copy_list(&out.input_color_standards, &out.num_input_color_standards,
+                   f->pipeline.input_color_standards,
+                   f->pipeline.num_input_color_standards,
+                   sizeof(VAProcColorStandardType));
+    stub_copy_list(&out.output_color_standards,
+                   &out.num_output_color_standards,
+                   f->pipeline.output_color_standards,
+                   f->pipeline.num_output_color_standards,
+                   sizeof(VAProcColorStandardType));
+#if LIBVA(2, 1, 0)
+    out.input_pixel_format       = caps->input_pixel_format;
+    out.num_input_pixel_formats  = caps->num_input_pixel_formats;
+    out.output_pixel_format      = caps->output_pixel_format;
+    out.num_output_pixel_formats = caps->num_output_pixel_formats;
+    stub_copy_list(&out.input_pixel_format, &out.num_input_pixel_formats,
+                   f->pipeline.input_pixel_format,
+                   f->pipeline.num_input_pixel_formats, sizeof(uint32_t));
+    stub_copy_list(&out.output_pixel_format, &out.num_output_pixel_formats,
+                   f->pipeline.output_pixel_format,
+                   f->pipeline.num_output_pixel_formats, sizeof(uint32_t));
+#endif
+    *caps = out;
+    return VA_STATUS_SUCCESS;
+}
+
+static VAStatus stub_Terminate(VADriverContextP ctx)
+{
+    struct stub_driver *stub = STUB(ctx);
+    int i, j;
+
+    stub_write_calls(getenv("VADUMPCAPS_STUB_CALLS"));
+
+    for (i = 0; i < stub->nb_profiles; i++) {
+        for (j = 0; j < stub->profiles[i].nb_entrypoints; j++) {
+            free(stub->profiles[i].entrypoints[j].surfaces);
+            free(stub->profiles[i].entrypoints[j].filters);
+        }
+    }
+    for (i = 0; i < stub->nb_buffers; i++)
+        free(stub->buffers[i].data);
+    free(stub->image_formats);
+    free(stub->subpicture_formats);
+    free(stub->subpicture_flags);
+    free(stub->configs);
+    free(stub->contexts);
+    free(stub->buffers);
+    free(stub->images);
+    pthread_mutex_destroy(&stub->lock);
+    free(stub);
+    ctx->pDriverData = NULL;
+    return VA_STATUS_SUCCESS;
+}
+
+#define STUB_INIT_NAME(major, minor) STUB_INIT_NAME_(major, minor)
+#define STUB_INIT_NAME_(major, minor) __vaDriverInit_ ## major ## _ ## minor
+
+__attribute__((visibility("default")))
+VAStatus STUB_INIT_NAME(VA_MAJOR_VERSION, VA_MINOR_VERSION)(VADriverContextP ctx);
+
+VAStatus STUB_INIT_NAME(VA_MAJOR_VERSION, VA_MINOR_VERSION)(VADriverContextP ctx)
+{
+    struct VADriverVTable *const vtable = ctx->vtable;
+    struct VADriverVTableVPP *const vtable_vpp = ctx->vtable_vpp;
+    const char *manifest = getenv("VADUMPCAPS_STUB_MANIFEST");
+    struct stub_driver *stub;
+    VAStatus status;
+    int i, max_entrypoints = 1;
+
+    if (!manifest) {
+        fprintf(stderr, "vadumpcaps_stub: VADUMPCAPS_STUB_MANIFEST must "
+                "name a vadumpcaps dump.\n");
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    stub = calloc(1, sizeof(*stub));
+    if (!stub)
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    ctx->pDriverData = stub;
+
+    // Images are made of buffers, so calls can be nested.
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&stub->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    status = stub_read_manifest(stub, manifest);
+    if (status != VA_STATUS_SUCCESS) {
+        stub_Terminate(ctx);
+        return status;
+    }
+    stub_read_latency(getenv("VADUMPCAPS_STUB_LATENCY"));
+
+    for (i = 0; i < stub->nb_profiles; i++) {
+        if (stub->profiles[i].nb_entrypoints > max_entrypoints)
+            max_entrypoints = stub->profiles[i].nb_entrypoints;
+    }
+
+    ctx->version_major          = VA_MAJOR_VERSION;
+    ctx->version_minor          = VA_MINOR_VERSION;
+    ctx->max_profiles           = stub->nb_profiles ? stub->nb_profiles : 1;
+    ctx->max_entrypoints        = max_entrypoints;
+    ctx->max_attributes         = VAConfigAttribTypeMax;
+    ctx->max_image_formats      = stub->nb_image_formats ?
+                                  stub->nb_image_formats : 1;
+    ctx->max_subpic_formats     = stub->nb_subpicture_formats ?
+                                  stub->nb_subpicture_formats : 1;
+    ctx->max_display_attributes = 1;
+    ctx->str_vendor             = stub->vendor;
+
+#define V(name) vtable->va ## name = &stub_ ## name
+    V(Terminate);
+    V(QueryConfigProfiles);
+    V(QueryConfigEntrypoints);
+    V(GetConfigAttributes);
+    V(CreateConfig);
+    V(DestroyConfig);
+    V(QueryConfigAttributes);
+    V(CreateSurfaces);
+    V(CreateSurfaces2);
+    V(DestroySurfaces);
+    V(QuerySurfaceAttributes);
+    V(CreateContext);
+    V(DestroyContext);
+    V(CreateBuffer);
+    V(BufferSetNumElements);
+    V(MapBuffer);
+    V(UnmapBuffer);
+    V(DestroyBuffer);
+    V(BeginPicture);
+    V(RenderPicture);
+    V(EndPicture);
+    V(SyncSurface);
+    V(QuerySurfaceStatus);
+    V(PutSurface);
+    V(QueryImageFormats);
+    V(CreateImage);
+    V(DeriveImage);
+    V(DestroyImage);
+    V(SetImagePalette);
+    V(GetImage);
+    V(PutImage);
+    V(QuerySubpictureFormats);
+    V(CreateSubpicture);
+    V(DestroySubpicture);
+    V(SetSubpictureImage);
+    V(SetSubpictureChromakey);
+    V(SetSubpictureGlobalAlpha);
+    V(AssociateSubpicture);
+    V(DeassociateSubpicture);
+    V(QueryDisplayAttributes);
+    V(GetDisplayAttributes);
+    V(SetDisplayAttributes);
+#undef V
+
+    vtable_vpp->version = VA_DRIVER_VTABLE_VPP_VERSION;
+    vtable_vpp->vaQueryVideoProcFilters      = &stub_QueryVideoProcFilters;
+    vtable_vpp->vaQueryVideoProcFilterCaps   = &stub_QueryVideoProcFilterCaps;
+    vtable_vpp->vaQueryVideoProcPipelineCaps = &stub_QueryVideoProcPipelineCaps;
+
+    return VA_STATUS_SUCCESS;
+}